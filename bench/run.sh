@@ -0,0 +1,151 @@
+#!/bin/sh
+#
+# End to end benchmark of search-tag-file: generates a tagged tree with
+# bench/tree-gen, then times every query shape in every search mode and
+# prints the results as a JSON object on the standard output.
+#
+# The tree is generated under $BENCH_DIR, so that the file system is
+# chosen by mounting a tmpfs, ext4 or xfs there beforehand. The other
+# variables set the shape of the tree, see bench/tree-gen -h:
+#
+#   BENCH_DIR          where the tree is generated (a new directory of $TMPDIR)
+#   BENCH_RUNS         runs per query, the fastest one is kept (5)
+#   BENCH_THREADS      threads of the parallel modes (nproc)
+#   BENCH_COLD         drop the page cache before every run, as root (0)
+#   BENCH_FANOUT, BENCH_DEPTH, BENCH_FILES, BENCH_TAGS, BENCH_DENSITY,
+#   BENCH_TAGS_PER_FILE, BENCH_SKEW, BENCH_SHAPE, BENCH_BRANCHING,
+#   BENCH_NOISE, BENCH_SEED   the parameters of bench/tree-gen
+#
+# The system calls per file are the ones reported by --stats.
+
+set -eu
+
+BIN=${BIN:-$(dirname "$0")/../bin}
+GEN=${GEN:-$(dirname "$0")/tree-gen}
+
+RUNS=${BENCH_RUNS:-5}
+THREADS=${BENCH_THREADS:-$(nproc)}
+COLD=${BENCH_COLD:-0}
+FANOUT=${BENCH_FANOUT:-8}
+DEPTH=${BENCH_DEPTH:-3}
+FILES=${BENCH_FILES:-150}
+TAGS=${BENCH_TAGS:-50}
+DENSITY=${BENCH_DENSITY:-0.1}
+TAGS_PER_FILE=${BENCH_TAGS_PER_FILE:-2}
+SKEW=${BENCH_SKEW:-1.0}
+SHAPE=${BENCH_SHAPE:-balanced}
+BRANCHING=${BENCH_BRANCHING:-3}
+NOISE=${BENCH_NOISE:-2}
+SEED=${BENCH_SEED:-1}
+
+if [ -n "${BENCH_DIR:-}" ]; then
+    WORK=$(mktemp -d "$BENCH_DIR/tagsys6-bench.XXXXXX")
+else
+    WORK=$(mktemp -d "${TMPDIR:-/tmp}/tagsys6-bench.XXXXXX")
+fi
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+# The searches read the config, index and summaries of this home, and
+# never ask a running tagsysd.
+export HOME="$WORK/home"
+export TAGSYS6_NO_DAEMON=1
+mkdir "$HOME"
+TREE="$WORK/tree"
+
+echo "Generating the tree under $WORK" >&2
+TREE_STATS=$("$GEN" --fanout "$FANOUT" --depth "$DEPTH" --files "$FILES" \
+    --tags "$TAGS" --density "$DENSITY" --tags-per-file "$TAGS_PER_FILE" \
+    --skew "$SKEW" --shape "$SHAPE" --branching "$BRANCHING" \
+    --noise "$NOISE" --seed "$SEED" "$TREE" "$HOME/.tagsys6.json")
+NB_FILES=$(echo "$TREE_STATS" | sed 's/.*"files": \([0-9]*\).*/\1/')
+
+"$BIN/search-tag-file" --build-index "$TREE" >/dev/null
+"$BIN/search-tag-file" --build-summary "$TREE" >/dev/null
+
+now() {
+    date +%s%N
+}
+
+drop_caches() {
+    if [ "$COLD" = 1 ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+# Prints the system calls made by search-tag-file with the arguments
+# "$@", as reported by --stats.
+count_syscalls() {
+    "$BIN/search-tag-file" --stats "$@" 2>&1 >/dev/null \
+        | sed -n 's/^System calls: \([0-9]*\).*/\1/p'
+}
+
+FIRST=1
+
+# Times the query $2 in the mode $1, whose options are the remaining
+# arguments, and prints its result.
+run_query() {
+    mode=$1
+    query=$2
+    shift 2
+    best=
+    # A counter rather than $(seq), which the IFS of the loop over the
+    # queries would not split.
+    run=0
+    while [ "$run" -lt "$RUNS" ]; do
+        run=$((run + 1))
+        drop_caches
+        start=$(now)
+        matches=$("$BIN/search-tag-file" "$@" "$TREE" $query | wc -l)
+        end=$(now)
+        elapsed=$((end - start))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+    done
+    syscalls=$(count_syscalls "$@" "$TREE" $query)
+    [ "$FIRST" = 1 ] || printf ',\n'
+    FIRST=0
+    awk -v mode="$mode" -v query="$query" -v ns="$best" -v files="$NB_FILES" \
+        -v matches="$matches" -v syscalls="$syscalls" 'BEGIN {
+        seconds = ns / 1e9
+        printf "    {\"mode\": \"%s\", \"query\": \"%s\", \"seconds\": %.6f, ",
+            mode, query, seconds
+        printf "\"files_per_sec\": %.0f, \"matches\": %d, ", files / seconds,
+            matches
+        printf "\"syscalls_per_file\": %.3f}", syscalls / files
+    }'
+}
+
+# The shapes of the queries, separated by commas: every tagged file, a
+# tag and its descendants, a common leaf tag, a rare leaf tag, a
+# conjunction, a disjunction and a negation.
+LAST=$((TAGS - 1))
+QUERIES=",t0,t$((TAGS / 2)),t$LAST,t1 t2,t1 | t2,t1 !t4"
+
+printf '{\n  "tree": {"fs": "%s", "seed": %s, "fanout": %s, "depth": %s, ' \
+    "$(stat -f -c %T "$WORK")" "$SEED" "$FANOUT" "$DEPTH"
+printf '"files_per_dir": %s, "tags": %s, "density": %s, ' \
+    "$FILES" "$TAGS" "$DENSITY"
+printf '"tags_per_file": %s, "skew": %s, "shape": "%s", "noise": %s, ' \
+    "$TAGS_PER_FILE" "$SKEW" "$SHAPE" "$NOISE"
+printf '"cold": %s, "runs": %s,\n    "generated": %s},\n' \
+    "$([ "$COLD" = 1 ] && echo true || echo false)" "$RUNS" "$TREE_STATS"
+printf '  "results": [\n'
+
+IFS=','
+for query in $QUERIES; do
+    IFS=' '
+    echo "Query '$query'" >&2
+    run_query sequential "$query"
+    run_query parallel "$query" -j "$THREADS"
+    run_query sort-inode "$query" --sort-inode
+    run_query uring "$query" -j "$THREADS" --uring
+    run_query summary "$query" -j "$THREADS" --summary
+    run_query index "$query" --index
+    run_query index-verify "$query" --index --verify
+    IFS=','
+done
+IFS=' '
+
+printf '\n  ]\n}\n'
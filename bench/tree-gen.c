@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+/*
+ * The attributes of the files are named like the ones of the tag
+ * system, see xattr_namespace(), and the foreign ones start with these
+ * prefixes: the tags of another user, then the attributes of another
+ * program.
+ */
+#define TAG_PREFIX "user.tagsys6"
+#define NOISE_TAG_UID 65534
+#define NOISE_PREFIX "user.bench.noise"
+
+#define MAX_NAME_LEN 64
+
+typedef enum {
+    SHAPE_FLAT = 0,
+    SHAPE_BALANCED = 1,
+    SHAPE_CHAIN = 2
+} HierarchyShape;
+
+/**
+ * The parameters of a generated tree: [depth] levels of [fanout]
+ * subdirectories under the root, each directory holding
+ * [files_per_dir] files. A file is tagged with probability [density],
+ * with [tags_per_file] of the [nb_tags] tags, the tag [i] being drawn
+ * with a weight of 1 / (i + 1)^[skew]. The tags form a hierarchy of
+ * shape [shape], each tag having [branching] children when it is
+ * balanced, and every file gets [noise] foreign attributes. The
+ * pseudo random numbers start from [seed], so that the same
+ * parameters give the same tree.
+ */
+typedef struct {
+    const char *root;
+    const char *config;
+    int fanout;
+    int depth;
+    int files_per_dir;
+    int nb_tags;
+    double density;
+    int tags_per_file;
+    double skew;
+    HierarchyShape shape;
+    int branching;
+    int noise;
+    uint64_t seed;
+} TreeParams;
+
+/**
+ * The state of the generation: the pseudo random generator [state],
+ * the cumulated weights [weights] of the tags, and the counts of
+ * directories, files and tags set so far.
+ */
+typedef struct {
+    const TreeParams *params;
+    uint64_t state;
+    double *weights;
+    uid_t uid;
+    long nb_dirs;
+    long nb_files;
+    long nb_tagged;
+    long nb_tags_set;
+} Generator;
+
+/**
+ * Returns the next number of the splitmix64 sequence of [gen].
+ */
+static uint64_t next_random(Generator *gen)
+{
+    uint64_t z = (gen->state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+/**
+ * Returns a pseudo random number in [0, 1).
+ */
+static double next_double(Generator *gen)
+{
+    return (next_random(gen) >> 11) * 0x1.0p-53;
+}
+
+/**
+ * Draws a tag according to the weights of [gen].
+ */
+static int draw_tag(Generator *gen)
+{
+    int nb_tags = gen->params->nb_tags;
+    double target = next_double(gen) * gen->weights[nb_tags - 1];
+    int low = 0;
+    int high = nb_tags - 1;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (gen->weights[mid] <= target)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * Returns the parent of the tag [tag] in the hierarchy of [params], or
+ * -1 for a top level tag.
+ */
+static int parent_tag(const TreeParams *params, int tag)
+{
+    switch (params->shape) {
+        case SHAPE_BALANCED:
+            return tag == 0 ? -1 : (tag - 1) / params->branching;
+        case SHAPE_CHAIN:
+            return tag - 1;
+        case SHAPE_FLAT:
+            break;
+    }
+    return -1;
+}
+
+/**
+ * Writes the tag [tag] and its descendants to [out] as the objects of
+ * the config file.
+ */
+static void write_tag(const TreeParams *params, int tag, FILE *out)
+{
+    fprintf(out, "{\"name\":\"t%d\",\"assignable\":true,\"children\":[", tag);
+    bool first = true;
+    int child = params->shape == SHAPE_BALANCED
+        ? tag * params->branching + 1 : tag + 1;
+    for (; child < params->nb_tags && parent_tag(params, child) == tag;
+            child++) {
+        if (!first)
+            fputc(',', out);
+        write_tag(params, child, out);
+        first = false;
+    }
+    fputs("]}", out);
+}
+
+/**
+ * Writes the config file of the tag hierarchy of [params].
+ * Returns [false] and prints an error message on failure.
+ */
+static bool write_config(const TreeParams *params)
+{
+    FILE *out = fopen(params->config, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not create '%s': %s\n",
+                params->config, strerror(errno));
+        return false;
+    }
+    fputc('[', out);
+    bool first = true;
+    for (int tag = 0; tag < params->nb_tags; tag++) {
+        if (parent_tag(params, tag) != -1)
+            continue;
+        if (!first)
+            fputc(',', out);
+        write_tag(params, tag, out);
+        first = false;
+    }
+    fputs("]\n", out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Could not write '%s': %s\n",
+                params->config, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Sets the attributes of the new file [path]: its tags, drawn by
+ * [gen], and its foreign attributes.
+ * Returns [false] and prints an error message on failure.
+ */
+static bool tag_file(Generator *gen, const char *path)
+{
+    const TreeParams *params = gen->params;
+    char attr[MAX_NAME_LEN];
+    for (int i = 0; i < params->noise; i++) {
+        if (i % 2 == 0)
+            snprintf(attr, sizeof(attr), "%s.%d.t%d", TAG_PREFIX,
+                    NOISE_TAG_UID, i / 2);
+        else
+            snprintf(attr, sizeof(attr), "%s%d", NOISE_PREFIX, i / 2);
+        if (setxattr(path, attr, "", 0, 0) == -1)
+            goto ERROR;
+    }
+    if (params->nb_tags == 0 || next_double(gen) >= params->density)
+        return true;
+
+    gen->nb_tagged++;
+    for (int i = 0; i < params->tags_per_file; i++) {
+        snprintf(attr, sizeof(attr), "%s.%d.t%d", TAG_PREFIX,
+                (int) gen->uid, draw_tag(gen));
+        /* The same tag may be drawn twice.  */
+        if (setxattr(path, attr, "", 0, XATTR_CREATE) == 0)
+            gen->nb_tags_set++;
+        else if (errno != EEXIST)
+            goto ERROR;
+    }
+    return true;
+
+ERROR:
+    fprintf(stderr, "Could not set '%s' on '%s': %s\n",
+            attr, path, strerror(errno));
+    return false;
+}
+
+/**
+ * Creates the files of the directory [path], of [len] chars, and its
+ * subdirectories down to the level [level].
+ * Returns [false] and prints an error message on failure.
+ */
+static bool fill_dir(Generator *gen, char *path, size_t len, int level)
+{
+    const TreeParams *params = gen->params;
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Could not create '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    gen->nb_dirs++;
+    for (int i = 0; i < params->files_per_dir; i++) {
+        snprintf(path + len, PATH_MAX - len, "/f%d", i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Could not create '%s': %s\n",
+                    path, strerror(errno));
+            return false;
+        }
+        close(fd);
+        gen->nb_files++;
+        if (!tag_file(gen, path))
+            return false;
+    }
+    if (level < params->depth) {
+        for (int i = 0; i < params->fanout; i++) {
+            int sublen = snprintf(path + len, PATH_MAX - len, "/d%d", i);
+            if (sublen < 0 || len + sublen >= PATH_MAX - MAX_NAME_LEN) {
+                fprintf(stderr, "The tree is too deep\n");
+                return false;
+            }
+            if (!fill_dir(gen, path, len + sublen, level + 1))
+                return false;
+        }
+    }
+    path[len] = '\0';
+    return true;
+}
+
+static void print_help(const char *prog_name)
+{
+    fprintf(stderr,
+            "Usage: %s [OPTION]... <root> <config>\n\n"
+            "Create a reproducible tree of tagged files under <root>, and\n"
+            "the config file <config> of its tags, named t0, t1, ...\n"
+            "Prints the counts of the tree as a JSON object.\n\n"
+            "Options:\n"
+            "\t--fanout <n>\t\tSubdirectories per directory (4)\n"
+            "\t--depth <n>\t\tLevels of subdirectories (3)\n"
+            "\t--files <n>\t\tFiles per directory (100)\n"
+            "\t--tags <n>\t\tTags of the hierarchy (50)\n"
+            "\t--density <p>\t\tProbability that a file is tagged (0.1)\n"
+            "\t--tags-per-file <n>\tTags drawn per tagged file (2)\n"
+            "\t--skew <s>\t\tTag i drawn with weight 1/(i+1)^s (1.0)\n"
+            "\t--shape <shape>\t\tHierarchy of the tags: flat, balanced\n"
+            "\t\t\t\t or chain (balanced)\n"
+            "\t--branching <n>\t\tChildren per tag when balanced (3)\n"
+            "\t--noise <n>\t\tForeign attributes per file (0)\n"
+            "\t--seed <n>\t\tSeed of the pseudo random numbers (1)\n"
+            "\t-h\t\t\tPrint this help message\n\n",
+            prog_name);
+}
+
+/**
+ * Parses the options at the beginning of [argv] into [params].
+ * Returns the index of the first non option argument, or -1 if an
+ * option is invalid.
+ */
+static int parse_options(int argc, char *argv[], TreeParams *params)
+{
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        const char *opt = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Option '%s' requires an argument\n", opt);
+            return -1;
+        }
+        const char *arg = argv[++i];
+        char *end = NULL;
+        errno = 0;
+        if (strcmp(opt, "--density") == 0 || strcmp(opt, "--skew") == 0) {
+            double value = strtod(arg, &end);
+            if (*arg == '\0' || *end != '\0' || errno != 0 || value < 0
+                    || (strcmp(opt, "--density") == 0 && value > 1)) {
+                fprintf(stderr, "Invalid value '%s' for '%s'\n", arg, opt);
+                return -1;
+            }
+            if (strcmp(opt, "--density") == 0)
+                params->density = value;
+            else
+                params->skew = value;
+            continue;
+        } else if (strcmp(opt, "--shape") == 0) {
+            if (strcmp(arg, "flat") == 0) {
+                params->shape = SHAPE_FLAT;
+            } else if (strcmp(arg, "balanced") == 0) {
+                params->shape = SHAPE_BALANCED;
+            } else if (strcmp(arg, "chain") == 0) {
+                params->shape = SHAPE_CHAIN;
+            } else {
+                fprintf(stderr, "Invalid shape '%s'\n", arg);
+                return -1;
+            }
+            continue;
+        }
+
+        long long value = strtoll(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || errno != 0 || value < 0
+                || value > 1000000000) {
+            fprintf(stderr, "Invalid value '%s' for '%s'\n", arg, opt);
+            return -1;
+        }
+        if (strcmp(opt, "--fanout") == 0) {
+            params->fanout = value;
+        } else if (strcmp(opt, "--depth") == 0) {
+            params->depth = value;
+        } else if (strcmp(opt, "--files") == 0) {
+            params->files_per_dir = value;
+        } else if (strcmp(opt, "--tags") == 0) {
+            params->nb_tags = value;
+        } else if (strcmp(opt, "--tags-per-file") == 0) {
+            params->tags_per_file = value;
+        } else if (strcmp(opt, "--branching") == 0 && value > 0) {
+            params->branching = value;
+        } else if (strcmp(opt, "--noise") == 0) {
+            params->noise = value;
+        } else if (strcmp(opt, "--seed") == 0) {
+            params->seed = value;
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", opt);
+            return -1;
+        }
+    }
+    return i;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "-h") == 0) {
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+    }
+    TreeParams params = {
+        .fanout = 4, .depth = 3, .files_per_dir = 100, .nb_tags = 50,
+        .density = 0.1, .tags_per_file = 2, .skew = 1.0,
+        .shape = SHAPE_BALANCED, .branching = 3, .noise = 0, .seed = 1
+    };
+    int first_arg = parse_options(argc, argv, &params);
+    if (first_arg < 0 || first_arg + 2 != argc) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+    params.root = argv[first_arg];
+    params.config = argv[first_arg + 1];
+    if (!write_config(&params))
+        return EXIT_FAILURE;
+
+    Generator gen = {
+        .params = &params, .state = params.seed, .uid = getuid()
+    };
+    gen.weights = malloc((params.nb_tags + 1) * sizeof(double));
+    if (gen.weights == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    double total = 0;
+    for (int i = 0; i < params.nb_tags; i++) {
+        total += 1 / pow(i + 1, params.skew);
+        gen.weights[i] = total;
+    }
+
+    char path[PATH_MAX];
+    size_t len = strlen(params.root);
+    if (len >= PATH_MAX - MAX_NAME_LEN) {
+        fprintf(stderr, "The path '%s' is too long\n", params.root);
+        return EXIT_FAILURE;
+    }
+    memcpy(path, params.root, len + 1);
+    bool success = fill_dir(&gen, path, len, 0);
+    free(gen.weights);
+    if (!success)
+        return EXIT_FAILURE;
+    printf("{\"dirs\": %ld, \"files\": %ld, \"tagged_files\": %ld, "
+            "\"tags_set\": %ld}\n", gen.nb_dirs, gen.nb_files, gen.nb_tagged,
+            gen.nb_tags_set);
+    return EXIT_SUCCESS;
+}
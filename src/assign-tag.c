@@ -1,5 +1,9 @@
 #include "../lib/cJSON.h"
 #include "tag.h"
+#include "journal.h"
+#include "summary.h"
+#include "commands.h"
+#include "tagsysd.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -11,6 +15,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <unistd.h>
 
 /**
  *  Take a file descriptor [fd], and a tag name
@@ -37,7 +42,7 @@ static bool set_tag(int fd, const char* tag)
  * in our [tag_tree], if it exists returns true
  * else returns false
  */
-static bool check_is_assignable(const char* tag, TagsTree* tag_tree)
+static bool check_is_assignable(const char* tag, const TagsTree* tag_tree)
 {
     TagsTree res_tag;
     TagError tag_error;
@@ -70,7 +75,7 @@ static void print_help(const char *prog_name)
 /**
  * ./assign-tag tag filename
  */
-int main(int argc, char const *argv[])
+int assign_tag_command(int argc, const char *argv[])
 {
     if(argc < 2) {
         print_help(argv[0]);
@@ -95,25 +100,48 @@ int main(int argc, char const *argv[])
     }
     load_config();
 
-    TagsTree tree;
-    TagError rc = parse_config_file(JSON_CONFIG_FILE, &tree);
+    Journal journal = {0};
+    /* The tags of argv[first_tag_pos .. first_tag_pos + nb_set[ are set.  */
+    int first_tag_pos = 2;
+    int nb_set = 0;
+    const TagsTree *tree;
+    TagError rc = get_config_tree(&tree, NULL);
     if (rc != NO_ERROR) {
         print_tag_error(rc);
         goto FREE_RESOURCES_ON_ERROR;
     }
 
-    int first_tag_pos = 2;
     const char *tag = NULL;
     for (int i = first_tag_pos; i < argc; i++) {
         tag = argv[i];
-        if (!check_is_assignable(tag, &tree) || !set_tag(fd, tag))
+        if (!check_is_assignable(tag, tree) || !set_tag(fd, tag))
             goto FREE_RESOURCES_ON_ERROR;
+        nb_set++;
+        if (!journal_add_file_change(&journal, JOURNAL_ADD_TAG, fd,
+                    filename, tag))
+            fprintf(stderr, "Could not journal the tagging of '%s': %s\n",
+                    filename, strerror(errno));
     }
 
-    free_tags_tree(&tree);
-    return EXIT_SUCCESS;
+    close(fd);
+    bool success = summary_add_tags(filename, argv + first_tag_pos, nb_set);
+    return journal_close(&journal) && success ? EXIT_SUCCESS : EXIT_FAILURE;
 
 FREE_RESOURCES_ON_ERROR:
-    free_tags_tree(&tree);
+    /* Some tags may have been set before the error.  */
+    journal_close(&journal);
+    close(fd);
+    if (nb_set > 0)
+        summary_add_tags(filename, argv + first_tag_pos, nb_set);
     return EXIT_FAILURE;
 }
+
+#ifndef TAGSYSD
+int main(int argc, char const *argv[])
+{
+    int status;
+    if (forward_to_daemon("assign-tag", argc, argv, &status))
+        return status;
+    return assign_tag_command(argc, argv);
+}
+#endif
@@ -0,0 +1,654 @@
+#include "bitmap.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BIT(value) ((uint64_t) 1 << ((value) & 63))
+
+/*
+ * The serialized form of a bitmap: a BitmapHeader, a BitmapRecord
+ * per container, and then the data of each container, padded to a
+ * multiple of 8 bytes.
+ */
+struct BitmapHeader {
+    uint32_t nb_containers;
+    uint32_t reserved;
+};
+
+struct BitmapRecord {
+    uint16_t key;
+    uint16_t kind;
+    uint32_t cardinality;
+};
+
+static void *checked_malloc(size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr == NULL && size > 0) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static uint64_t *alloc_words()
+{
+    uint64_t *words = calloc(BITMAP_NB_WORDS, sizeof(uint64_t));
+    if (words == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return words;
+}
+
+static size_t padded_size(size_t size)
+{
+    return (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+static size_t container_data_size(const BitmapContainer *container)
+{
+    if (container->kind == BITMAP_WORDS)
+        return BITMAP_NB_WORDS * sizeof(uint64_t);
+    return container->cardinality * sizeof(uint16_t);
+}
+
+static uint32_t count_words(const uint64_t *words)
+{
+    uint32_t count = 0;
+    for (size_t i = 0; i < BITMAP_NB_WORDS; i++)
+        count += __builtin_popcountll(words[i]);
+    return count;
+}
+
+/**
+ * Writes the positions of the bits set in [words] to [values] and
+ * returns their number.
+ */
+static size_t words_to_array(const uint64_t *words, uint16_t *values)
+{
+    size_t nb_values = 0;
+    for (size_t i = 0; i < BITMAP_NB_WORDS; i++) {
+        for (uint64_t word = words[i]; word != 0; word &= word - 1)
+            values[nb_values++] = i * 64 + __builtin_ctzll(word);
+    }
+    return nb_values;
+}
+
+/**
+ * Converts the array container [container] to words.
+ */
+static void array_to_words(BitmapContainer *container)
+{
+    uint64_t *words = alloc_words();
+    const uint16_t *values = container->data;
+    for (size_t i = 0; i < container->cardinality; i++)
+        words[values[i] >> 6] |= BIT(values[i]);
+    free(container->data);
+    container->kind = BITMAP_WORDS;
+    container->data = words;
+}
+
+/**
+ * Replaces the values of the array container [container] by the
+ * [nb_values] sorted values [values] it takes the ownership of,
+ * converting it to words if they are too many.
+ */
+static void set_array(
+        BitmapContainer *container,
+        uint16_t *values,
+        size_t nb_values)
+{
+    free(container->data);
+    container->kind = BITMAP_ARRAY;
+    container->cardinality = nb_values;
+    container->data = values;
+    if (nb_values > BITMAP_MAX_ARRAY_SIZE)
+        array_to_words(container);
+}
+
+/**
+ * Converts the words container [container] to an array if it holds
+ * few enough values.
+ */
+static void shrink_container(BitmapContainer *container)
+{
+    if (container->kind != BITMAP_WORDS
+            || container->cardinality > BITMAP_MAX_ARRAY_SIZE)
+        return;
+    uint16_t *values =
+        checked_malloc(container->cardinality * sizeof(uint16_t));
+    words_to_array(container->data, values);
+    free(container->data);
+    container->kind = BITMAP_ARRAY;
+    container->data = values;
+}
+
+static BitmapContainer copy_container(const BitmapContainer *container)
+{
+    BitmapContainer copy = *container;
+    size_t size = container_data_size(container);
+    copy.data = checked_malloc(size);
+    memcpy(copy.data, container->data, size);
+    return copy;
+}
+
+/**
+ * Returns a new container at the end of [bitmap].
+ */
+static BitmapContainer *add_container(Bitmap *bitmap, uint16_t key)
+{
+    if (bitmap->nb_containers == bitmap->capacity) {
+        size_t new_capacity = (bitmap->capacity + 1) * 2;
+        void *rc = realloc(bitmap->containers,
+                new_capacity * sizeof(BitmapContainer));
+        if (rc == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        bitmap->containers = rc;
+        bitmap->capacity = new_capacity;
+    }
+    BitmapContainer *container = &bitmap->containers[bitmap->nb_containers++];
+    *container = (BitmapContainer) { .key = key, .kind = BITMAP_ARRAY };
+    return container;
+}
+
+/**
+ * Frees the containers of [bitmap] from the [first] one.
+ */
+static void free_containers(Bitmap *bitmap, size_t first)
+{
+    for (size_t i = first; !bitmap->borrowed && i < bitmap->nb_containers; i++)
+        free(bitmap->containers[i].data);
+    bitmap->nb_containers = first;
+}
+
+void bitmap_free(Bitmap *bitmap)
+{
+    if (bitmap == NULL)
+        return;
+    free_containers(bitmap, 0);
+    free(bitmap->containers);
+    memset(bitmap, 0, sizeof(*bitmap));
+}
+
+void bitmap_append(Bitmap *bitmap, uint32_t value)
+{
+    assert(bitmap != NULL);
+    assert(!bitmap->borrowed);
+
+    uint16_t key = value >> 16;
+    uint16_t low = value & 0xffff;
+    BitmapContainer *container = NULL;
+    if (bitmap->nb_containers > 0)
+        container = &bitmap->containers[bitmap->nb_containers - 1];
+    if (container == NULL || container->key != key) {
+        assert(container == NULL || container->key < key);
+        container = add_container(bitmap, key);
+    }
+
+    uint32_t cardinality = container->cardinality;
+    if (container->kind == BITMAP_ARRAY
+            && cardinality == BITMAP_MAX_ARRAY_SIZE)
+        array_to_words(container);
+    if (container->kind == BITMAP_WORDS) {
+        uint64_t *words = container->data;
+        words[low >> 6] |= BIT(low);
+        container->cardinality++;
+        return;
+    }
+    /* Arrays grow by powers of two.  */
+    if (cardinality == 0 || (cardinality >= 4
+                && (cardinality & (cardinality - 1)) == 0)) {
+        size_t new_size = cardinality == 0 ? 4 : cardinality * 2;
+        void *rc = realloc(container->data, new_size * sizeof(uint16_t));
+        if (rc == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        container->data = rc;
+    }
+    uint16_t *values = container->data;
+    assert(cardinality == 0 || values[cardinality - 1] < low);
+    values[container->cardinality++] = low;
+}
+
+void bitmap_set_range(Bitmap *bitmap, uint32_t first, uint32_t end)
+{
+    assert(bitmap != NULL);
+    assert(!bitmap->borrowed);
+
+    free_containers(bitmap, 0);
+    if (first >= end)
+        return;
+    for (uint32_t key = first >> 16; key <= (end - 1) >> 16; key++) {
+        uint32_t low = key == first >> 16 ? first & 0xffff : 0;
+        uint32_t high = key == (end - 1) >> 16 ? (end - 1) & 0xffff : 0xffff;
+        BitmapContainer *container = add_container(bitmap, key);
+        container->cardinality = high - low + 1;
+        if (container->cardinality <= BITMAP_MAX_ARRAY_SIZE) {
+            uint16_t *values =
+                checked_malloc(container->cardinality * sizeof(uint16_t));
+            for (uint32_t value = low; value <= high; value++)
+                values[value - low] = value;
+            container->data = values;
+            continue;
+        }
+        uint64_t *words = alloc_words();
+        for (uint32_t value = low; value <= high;) {
+            if ((value & 63) == 0 && value + 63 <= high) {
+                words[value >> 6] = ~(uint64_t) 0;
+                value += 64;
+            } else {
+                words[value >> 6] |= BIT(value);
+                value++;
+            }
+        }
+        container->kind = BITMAP_WORDS;
+        container->data = words;
+    }
+}
+
+void bitmap_keep_range(Bitmap *bitmap, uint32_t first, uint32_t end)
+{
+    assert(bitmap != NULL);
+    assert(!bitmap->borrowed);
+
+    if (first >= end) {
+        free_containers(bitmap, 0);
+        return;
+    }
+    uint32_t first_key = first >> 16;
+    uint32_t last_key = (end - 1) >> 16;
+    size_t kept = 0;
+    for (size_t i = 0; i < bitmap->nb_containers; i++) {
+        BitmapContainer *container = &bitmap->containers[i];
+        if (container->key < first_key || container->key > last_key) {
+            free(container->data);
+            continue;
+        }
+        uint32_t low = container->key == first_key ? first & 0xffff : 0;
+        uint32_t high = container->key == last_key
+            ? (end - 1) & 0xffff : 0xffff;
+        if (container->kind == BITMAP_ARRAY) {
+            uint16_t *values = container->data;
+            size_t nb_values = 0;
+            for (size_t j = 0; j < container->cardinality; j++)
+                if (values[j] >= low && values[j] <= high)
+                    values[nb_values++] = values[j];
+            container->cardinality = nb_values;
+        } else if (low > 0 || high < 0xffff) {
+            uint64_t *words = container->data;
+            for (uint32_t value = 0; value < low; value++)
+                words[value >> 6] &= ~BIT(value);
+            for (uint32_t value = high + 1; value <= 0xffff; value++)
+                words[value >> 6] &= ~BIT(value);
+            container->cardinality = count_words(words);
+            shrink_container(container);
+        }
+        if (container->cardinality == 0)
+            free(container->data);
+        else
+            bitmap->containers[kept++] = *container;
+    }
+    bitmap->nb_containers = kept;
+}
+
+/**
+ * Replaces [container] by its union with [other], of the same key.
+ */
+static void or_container(
+        BitmapContainer *container,
+        const BitmapContainer *other)
+{
+    if (container->kind == BITMAP_ARRAY && other->kind == BITMAP_ARRAY) {
+        const uint16_t *a = container->data;
+        const uint16_t *b = other->data;
+        size_t nb_a = container->cardinality;
+        size_t nb_b = other->cardinality;
+        uint16_t *values = checked_malloc((nb_a + nb_b) * sizeof(uint16_t));
+        size_t i = 0, j = 0, k = 0;
+        while (i < nb_a && j < nb_b) {
+            if (a[i] < b[j])
+                values[k++] = a[i++];
+            else if (b[j] < a[i])
+                values[k++] = b[j++];
+            else {
+                values[k++] = a[i++];
+                j++;
+            }
+        }
+        while (i < nb_a)
+            values[k++] = a[i++];
+        while (j < nb_b)
+            values[k++] = b[j++];
+        set_array(container, values, k);
+        return;
+    }
+
+    if (container->kind == BITMAP_ARRAY) {
+        /* Add the values of the array to a copy of the words.  */
+        BitmapContainer array = *container;
+        *container = copy_container(other);
+        const uint16_t *values = array.data;
+        uint64_t *words = container->data;
+        for (size_t i = 0; i < array.cardinality; i++) {
+            if (!(words[values[i] >> 6] & BIT(values[i]))) {
+                words[values[i] >> 6] |= BIT(values[i]);
+                container->cardinality++;
+            }
+        }
+        free(array.data);
+        return;
+    }
+
+    uint64_t *words = container->data;
+    if (other->kind == BITMAP_ARRAY) {
+        const uint16_t *values = other->data;
+        for (size_t i = 0; i < other->cardinality; i++) {
+            if (!(words[values[i] >> 6] & BIT(values[i]))) {
+                words[values[i] >> 6] |= BIT(values[i]);
+                container->cardinality++;
+            }
+        }
+        return;
+    }
+    const uint64_t *other_words = other->data;
+    for (size_t i = 0; i < BITMAP_NB_WORDS; i++)
+        words[i] |= other_words[i];
+    container->cardinality = count_words(words);
+}
+
+/**
+ * Replaces [container] by its intersection with [other], of the
+ * same key.
+ */
+static void and_container(
+        BitmapContainer *container,
+        const BitmapContainer *other)
+{
+    if (container->kind == BITMAP_ARRAY) {
+        uint16_t *values = container->data;
+        size_t nb_values = 0;
+        if (other->kind == BITMAP_WORDS) {
+            const uint64_t *words = other->data;
+            for (size_t i = 0; i < container->cardinality; i++)
+                if (words[values[i] >> 6] & BIT(values[i]))
+                    values[nb_values++] = values[i];
+        } else {
+            const uint16_t *b = other->data;
+            size_t j = 0;
+            for (size_t i = 0; i < container->cardinality; i++) {
+                while (j < other->cardinality && b[j] < values[i])
+                    j++;
+                if (j < other->cardinality && b[j] == values[i])
+                    values[nb_values++] = values[i];
+            }
+        }
+        container->cardinality = nb_values;
+        return;
+    }
+
+    uint64_t *words = container->data;
+    if (other->kind == BITMAP_ARRAY) {
+        const uint16_t *b = other->data;
+        uint16_t *values = checked_malloc(other->cardinality * sizeof(uint16_t));
+        size_t nb_values = 0;
+        for (size_t i = 0; i < other->cardinality; i++)
+            if (words[b[i] >> 6] & BIT(b[i]))
+                values[nb_values++] = b[i];
+        set_array(container, values, nb_values);
+        return;
+    }
+    const uint64_t *other_words = other->data;
+    for (size_t i = 0; i < BITMAP_NB_WORDS; i++)
+        words[i] &= other_words[i];
+    container->cardinality = count_words(words);
+    shrink_container(container);
+}
+
+/**
+ * Removes from [container] the values of [other], of the same key.
+ */
+static void andnot_container(
+        BitmapContainer *container,
+        const BitmapContainer *other)
+{
+    if (container->kind == BITMAP_ARRAY) {
+        uint16_t *values = container->data;
+        size_t nb_values = 0;
+        if (other->kind == BITMAP_WORDS) {
+            const uint64_t *words = other->data;
+            for (size_t i = 0; i < container->cardinality; i++)
+                if (!(words[values[i] >> 6] & BIT(values[i])))
+                    values[nb_values++] = values[i];
+        } else {
+            const uint16_t *b = other->data;
+            size_t j = 0;
+            for (size_t i = 0; i < container->cardinality; i++) {
+                while (j < other->cardinality && b[j] < values[i])
+                    j++;
+                if (j == other->cardinality || b[j] != values[i])
+                    values[nb_values++] = values[i];
+            }
+        }
+        container->cardinality = nb_values;
+        return;
+    }
+
+    uint64_t *words = container->data;
+    if (other->kind == BITMAP_ARRAY) {
+        const uint16_t *b = other->data;
+        for (size_t i = 0; i < other->cardinality; i++) {
+            if (words[b[i] >> 6] & BIT(b[i])) {
+                words[b[i] >> 6] &= ~BIT(b[i]);
+                container->cardinality--;
+            }
+        }
+    } else {
+        const uint64_t *other_words = other->data;
+        for (size_t i = 0; i < BITMAP_NB_WORDS; i++)
+            words[i] &= ~other_words[i];
+        container->cardinality = count_words(words);
+    }
+    shrink_container(container);
+}
+
+void bitmap_or(Bitmap *dst, const Bitmap *src)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+    assert(!dst->borrowed);
+
+    size_t capacity = dst->nb_containers + src->nb_containers;
+    BitmapContainer *merged =
+        checked_malloc(capacity * sizeof(BitmapContainer));
+    const BitmapContainer *a = dst->containers;
+    const BitmapContainer *b = src->containers;
+    size_t i = 0, j = 0, k = 0;
+    while (i < dst->nb_containers || j < src->nb_containers) {
+        if (j == src->nb_containers
+                || (i < dst->nb_containers && a[i].key < b[j].key)) {
+            merged[k++] = a[i++];
+        } else if (i == dst->nb_containers || b[j].key < a[i].key) {
+            merged[k++] = copy_container(&b[j++]);
+        } else {
+            merged[k] = a[i++];
+            or_container(&merged[k++], &b[j++]);
+        }
+    }
+    free(dst->containers);
+    dst->containers = merged;
+    dst->nb_containers = k;
+    dst->capacity = capacity;
+}
+
+void bitmap_and(Bitmap *dst, const Bitmap *src)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+    assert(!dst->borrowed);
+
+    BitmapContainer *a = dst->containers;
+    const BitmapContainer *b = src->containers;
+    size_t i = 0, j = 0, k = 0;
+    while (i < dst->nb_containers && j < src->nb_containers) {
+        if (a[i].key < b[j].key) {
+            free(a[i++].data);
+        } else if (b[j].key < a[i].key) {
+            j++;
+        } else {
+            and_container(&a[i], &b[j++]);
+            if (a[i].cardinality == 0)
+                free(a[i++].data);
+            else
+                a[k++] = a[i++];
+        }
+    }
+    for (; i < dst->nb_containers; i++)
+        free(a[i].data);
+    dst->nb_containers = k;
+}
+
+void bitmap_andnot(Bitmap *dst, const Bitmap *src)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+    assert(!dst->borrowed);
+
+    BitmapContainer *a = dst->containers;
+    const BitmapContainer *b = src->containers;
+    size_t j = 0, k = 0;
+    for (size_t i = 0; i < dst->nb_containers; i++) {
+        while (j < src->nb_containers && b[j].key < a[i].key)
+            j++;
+        if (j < src->nb_containers && b[j].key == a[i].key)
+            andnot_container(&a[i], &b[j]);
+        if (a[i].cardinality == 0)
+            free(a[i].data);
+        else
+            a[k++] = a[i];
+    }
+    dst->nb_containers = k;
+}
+
+uint64_t bitmap_cardinality(const Bitmap *bitmap)
+{
+    assert(bitmap != NULL);
+
+    uint64_t cardinality = 0;
+    for (size_t i = 0; i < bitmap->nb_containers; i++)
+        cardinality += bitmap->containers[i].cardinality;
+    return cardinality;
+}
+
+size_t bitmap_to_array(const Bitmap *bitmap, uint32_t *values)
+{
+    assert(bitmap != NULL);
+
+    size_t nb_values = 0;
+    for (size_t i = 0; i < bitmap->nb_containers; i++) {
+        const BitmapContainer *container = &bitmap->containers[i];
+        uint32_t high = (uint32_t) container->key << 16;
+        if (container->kind == BITMAP_ARRAY) {
+            const uint16_t *low = container->data;
+            for (size_t j = 0; j < container->cardinality; j++)
+                values[nb_values++] = high | low[j];
+            continue;
+        }
+        const uint64_t *words = container->data;
+        for (size_t j = 0; j < BITMAP_NB_WORDS; j++) {
+            for (uint64_t word = words[j]; word != 0; word &= word - 1)
+                values[nb_values++] = high | (j * 64 + __builtin_ctzll(word));
+        }
+    }
+    return nb_values;
+}
+
+size_t bitmap_serialized_size(const Bitmap *bitmap)
+{
+    assert(bitmap != NULL);
+
+    size_t size = sizeof(struct BitmapHeader)
+        + bitmap->nb_containers * sizeof(struct BitmapRecord);
+    for (size_t i = 0; i < bitmap->nb_containers; i++)
+        size += padded_size(container_data_size(&bitmap->containers[i]));
+    return size;
+}
+
+void bitmap_serialize(const Bitmap *bitmap, void *buf)
+{
+    assert(bitmap != NULL);
+    assert(buf != NULL);
+
+    char *pos = buf;
+    struct BitmapHeader header = { .nb_containers = bitmap->nb_containers };
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
+    for (size_t i = 0; i < bitmap->nb_containers; i++) {
+        const BitmapContainer *container = &bitmap->containers[i];
+        struct BitmapRecord record = {
+            .key = container->key,
+            .kind = container->kind,
+            .cardinality = container->cardinality
+        };
+        memcpy(pos, &record, sizeof(record));
+        pos += sizeof(record);
+    }
+    for (size_t i = 0; i < bitmap->nb_containers; i++) {
+        const BitmapContainer *container = &bitmap->containers[i];
+        size_t size = container_data_size(container);
+        memcpy(pos, container->data, size);
+        memset(pos + size, 0, padded_size(size) - size);
+        pos += padded_size(size);
+    }
+}
+
+bool bitmap_view(const void *data, size_t size, Bitmap *view)
+{
+    assert(data != NULL);
+    assert(view != NULL);
+
+    memset(view, 0, sizeof(*view));
+    const struct BitmapHeader *header = data;
+    if (size < sizeof(*header)
+            || (size - sizeof(*header)) / sizeof(struct BitmapRecord)
+                < header->nb_containers)
+        return false;
+    const struct BitmapRecord *records = (const void *) (header + 1);
+    const char *pos = (const char *) (records + header->nb_containers);
+    const char *end = (const char *) data + size;
+
+    view->borrowed = true;
+    view->containers =
+        checked_malloc(header->nb_containers * sizeof(BitmapContainer));
+    view->capacity = header->nb_containers;
+    for (size_t i = 0; i < header->nb_containers; i++) {
+        BitmapContainer *container = &view->containers[i];
+        *container = (BitmapContainer) {
+            .key = records[i].key,
+            .kind = records[i].kind,
+            .cardinality = records[i].cardinality,
+            .data = (void *) pos
+        };
+        size_t data_size = container_data_size(container);
+        if ((container->kind != BITMAP_ARRAY
+                    && container->kind != BITMAP_WORDS)
+                || (container->kind == BITMAP_ARRAY
+                    && (container->cardinality == 0
+                        || container->cardinality > BITMAP_MAX_ARRAY_SIZE))
+                || (i > 0 && container->key <= records[i - 1].key)
+                || end - pos < padded_size(data_size)) {
+            bitmap_free(view);
+            return false;
+        }
+        /* The operations rely on the number of bits set.  */
+        if (container->kind == BITMAP_WORDS)
+            container->cardinality = count_words(container->data);
+        pos += padded_size(data_size);
+        view->nb_containers++;
+    }
+    return true;
+}
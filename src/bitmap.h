@@ -0,0 +1,109 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A compressed set of 32 bits integers, such as the identifiers of
+ * the files of the index having a tag. The values are grouped by
+ * their 16 high bits in containers, sorted by key, which store their
+ * 16 low bits either as a sorted array, when they are at most
+ * BITMAP_MAX_ARRAY_SIZE, or as a bitmap of BITMAP_NB_WORDS words.
+ * The operations between bitmaps containers therefore handle 64
+ * values per instruction.
+ */
+
+#define BITMAP_ARRAY 1
+#define BITMAP_WORDS 2
+
+#define BITMAP_MAX_ARRAY_SIZE 4096
+#define BITMAP_NB_WORDS (65536 / 64)
+
+/**
+ * The values of a Bitmap whose 16 high bits are [key]: the
+ * [cardinality] sorted low bits [data] of kind BITMAP_ARRAY, or the
+ * BITMAP_NB_WORDS words [data] of kind BITMAP_WORDS.
+ */
+typedef struct {
+    uint16_t key;
+    uint16_t kind;
+    uint32_t cardinality;
+    void *data;
+} BitmapContainer;
+
+/**
+ * A set of 32 bits integers. A [borrowed] bitmap, returned by
+ * bitmap_view(), reads the data of its containers from memory it
+ * does not own, and cannot be modified.
+ */
+typedef struct {
+    BitmapContainer *containers;
+    size_t nb_containers;
+    size_t capacity;
+    bool borrowed;
+} Bitmap;
+
+void bitmap_free(Bitmap *bitmap);
+
+/**
+ * Adds [value] to [bitmap], whose values must all be lower.
+ */
+void bitmap_append(Bitmap *bitmap, uint32_t value);
+
+/**
+ * Replaces the values of [bitmap] by those in [first, end).
+ */
+void bitmap_set_range(Bitmap *bitmap, uint32_t first, uint32_t end);
+
+/**
+ * Removes from [bitmap] the values outside of [first, end).
+ */
+void bitmap_keep_range(Bitmap *bitmap, uint32_t first, uint32_t end);
+
+/**
+ * Replaces [dst] by its union with [src].
+ */
+void bitmap_or(Bitmap *dst, const Bitmap *src);
+
+/**
+ * Replaces [dst] by its intersection with [src].
+ */
+void bitmap_and(Bitmap *dst, const Bitmap *src);
+
+/**
+ * Removes from [dst] the values of [src].
+ */
+void bitmap_andnot(Bitmap *dst, const Bitmap *src);
+
+/**
+ * Returns the number of values of [bitmap].
+ */
+uint64_t bitmap_cardinality(const Bitmap *bitmap);
+
+/**
+ * Writes the sorted values of [bitmap] to [values], which must hold
+ * bitmap_cardinality() values. Returns their number.
+ */
+size_t bitmap_to_array(const Bitmap *bitmap, uint32_t *values);
+
+/**
+ * Returns the size of [bitmap] once serialized, a multiple of 8.
+ */
+size_t bitmap_serialized_size(const Bitmap *bitmap);
+
+/**
+ * Writes [bitmap] to [buf], which must hold bitmap_serialized_size()
+ * bytes.
+ */
+void bitmap_serialize(const Bitmap *bitmap, void *buf);
+
+/**
+ * Writes to [view] a borrowed bitmap reading the [size] bytes [data]
+ * written by bitmap_serialize(), which must be aligned on 8 bytes.
+ * Returns [false] if they are not a valid bitmap.
+ */
+bool bitmap_view(const void *data, size_t size, Bitmap *view);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+/*
+ * The commands served by tagsysd. Each of them is the body of the
+ * main() function of the program of the same name and returns its
+ * exit status. They must release everything they acquire, since the
+ * daemon runs them again and again in the same process.
+ */
+
+int assign_tag_command(int argc, const char *argv[]);
+
+int display_file_tag_command(int argc, const char *argv[]);
+
+int rm_tag_command(int argc, const char *argv[]);
+
+int search_tag_file_command(int argc, const char *argv[]);
+
+/**
+ * Numbers the tags of the config for search_tag_file_command(), or
+ * numbers them again if the config changed, so that the requests do
+ * not have to.
+ */
+void search_tag_file_refresh(void);
+
+#endif
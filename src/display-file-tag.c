@@ -1,4 +1,6 @@
 #include "tag.h"
+#include "commands.h"
+#include "tagsysd.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -9,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <unistd.h>
 
 /**
  * Displays the tags of the domain XATTR_PROG_DOMAIN
@@ -36,31 +39,18 @@ static bool display_tags(int fd, char const *name, bool is_quiet)
         return false;
     }
 
-    /*
-     * Loop over the list of zero terminated strings with the
-     * attribute keys. Use the remaining buffer length to determine
-     * the end of the list.
-     */
-    char *key = buf;
-    char *tagname;
-    size_t keylen;
+    /* Loop over the tags of the user in the list of attribute keys.  */
+    XattrTagScanner scanner;
+    const char *tagname;
+    size_t tagname_len;
     bool has_tag_printed = false;
-    while (buflen > 0) {
-        keylen = strlen(key) + 1; // +1 for the null byte
-
-        if (keylen - 1 > XATTR_PROG_DOMAIN_LEN
-                && strncmp(key, XATTR_PROG_DOMAIN, XATTR_PROG_DOMAIN_LEN) == 0) {
-            if (!has_tag_printed && !is_quiet) {
-                printf("# file '%s' has tags:\n", name);
-                has_tag_printed = true;
-            }
-            tagname = key + XATTR_PROG_DOMAIN_LEN;
-            printf("%s\n", tagname);
+    scan_xattr_tags(&scanner, buf, buflen);
+    while (next_xattr_tag(&scanner, &tagname, &tagname_len)) {
+        if (!has_tag_printed && !is_quiet) {
+            printf("# file '%s' has tags:\n", name);
+            has_tag_printed = true;
         }
-
-        /* Forward to next attribute key.  */
-        buflen -= keylen;
-        key += keylen;
+        printf("%s\n", tagname);
     }
     free(buf);
     return true;
@@ -78,7 +68,7 @@ static void print_help(const char *prog_name)
             prog_name, prog_name, prog_name);
 }
 
-int main(int argc, char const *argv[])
+int display_file_tag_command(int argc, const char *argv[])
 {
     bool is_quiet = false;
     if (argc != 2 && argc != 3) {
@@ -104,8 +94,20 @@ int main(int argc, char const *argv[])
     load_config();
     if (!display_tags(fd, argv[argc-1],is_quiet)) {
         fprintf(stderr, "Could not list tags: %s\n", strerror(errno));
+        close(fd);
         return EXIT_FAILURE;
     }
 
+    close(fd);
     return EXIT_SUCCESS;
 }
+
+#ifndef TAGSYSD
+int main(int argc, char const *argv[])
+{
+    int status;
+    if (forward_to_daemon("display-file-tag", argc, argv, &status))
+        return status;
+    return display_file_tag_command(argc, argv);
+}
+#endif
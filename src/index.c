@@ -0,0 +1,879 @@
+#define _GNU_SOURCE
+#include "index.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "TAGSYS6I"
+#define INDEX_VERSION 3
+
+/*
+ * Layout of an index file, in the byte order of the machine:
+ * an IndexHeader, the IndexFileRecord of each file sorted by path,
+ * the IndexTagRecord of each tag sorted by name, a pool of NUL
+ * terminated strings holding the paths and the tag names, and the
+ * posting lists: for each tag, the identifiers of its files as a
+ * serialized Bitmap aligned on 8 bytes.
+ */
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_files;
+    uint32_t nb_tags;
+    uint32_t reserved;
+    uint64_t files_offset;
+    uint64_t tags_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t postings_offset;
+    uint64_t postings_size;
+    uint64_t journal_generation;
+    uint64_t journal_offset;
+};
+
+struct IndexFileRecord {
+    uint64_t path;
+    uint64_t dev;
+    uint64_t ino;
+};
+
+struct IndexTagRecord {
+    uint64_t name;
+    uint64_t postings;
+    uint64_t postings_size;
+    uint32_t nb_files;
+    uint32_t reserved;
+};
+
+/* The index file mapped by get_index_reader() and its identity.  */
+static IndexReader cached_reader = {0};
+static struct stat cached_reader_stat;
+
+static void *checked_malloc(size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr == NULL && size > 0) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static char *checked_strdup(const char *str)
+{
+    char *copy = strdup(str);
+    if (copy == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+TagError open_index(const char *filename, IndexReader *reader)
+{
+    assert(filename != NULL);
+    assert(reader != NULL);
+
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return LOAD_INDEX_ERROR;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return LOAD_INDEX_ERROR;
+    }
+    if (st.st_size < sizeof(struct IndexHeader)) {
+        close(fd);
+        return INVALID_INDEX_FILE;
+    }
+    reader->size = st.st_size;
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        return LOAD_INDEX_ERROR;
+    }
+
+    const struct IndexHeader *header = reader->map;
+    const char *base = reader->map;
+    uint64_t size = reader->size;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+            || header->version != INDEX_VERSION
+            || header->files_offset > size
+            || (size - header->files_offset) / sizeof(struct IndexFileRecord)
+                < header->nb_files
+            || header->tags_offset > size
+            || (size - header->tags_offset) / sizeof(struct IndexTagRecord)
+                < header->nb_tags
+            || header->strings_offset > size
+            || size - header->strings_offset < header->strings_size
+            || (header->strings_size > 0
+                && base[header->strings_offset + header->strings_size - 1])
+            || header->postings_offset > size
+            || size - header->postings_offset < header->postings_size
+            || header->postings_offset % sizeof(uint64_t) != 0) {
+        close_index(reader);
+        return INVALID_INDEX_FILE;
+    }
+    reader->header = header;
+    reader->files = (const void *) (base + header->files_offset);
+    reader->tags = (const void *) (base + header->tags_offset);
+    reader->strings = base + header->strings_offset;
+    reader->postings = base + header->postings_offset;
+    return NO_ERROR;
+}
+
+void close_index(IndexReader *reader)
+{
+    if (reader != NULL && reader->map != NULL)
+        munmap(reader->map, reader->size);
+    if (reader != NULL)
+        memset(reader, 0, sizeof(*reader));
+}
+
+TagError get_index_reader(const IndexReader **reader)
+{
+    assert(reader != NULL);
+
+    struct stat st;
+    if (stat(INDEX_FILE, &st) == -1) {
+        close_index(&cached_reader);
+        return LOAD_INDEX_ERROR;
+    }
+    /* The index file is replaced, never modified in place.  */
+    if (cached_reader.map == NULL
+            || st.st_dev != cached_reader_stat.st_dev
+            || st.st_ino != cached_reader_stat.st_ino
+            || st.st_size != cached_reader_stat.st_size
+            || st.st_mtim.tv_sec != cached_reader_stat.st_mtim.tv_sec
+            || st.st_mtim.tv_nsec != cached_reader_stat.st_mtim.tv_nsec) {
+        close_index(&cached_reader);
+        TagError error = open_index(INDEX_FILE, &cached_reader);
+        if (error != NO_ERROR)
+            return error;
+        cached_reader_stat = st;
+    }
+    *reader = &cached_reader;
+    return NO_ERROR;
+}
+
+uint32_t index_nb_files(const IndexReader *reader)
+{
+    assert(reader != NULL);
+    return reader->header->nb_files;
+}
+
+/**
+ * Returns the string at offset [offset] of the string pool of
+ * [reader], or an empty string if the offset is out of bounds.
+ */
+static const char *index_string(const IndexReader *reader, uint64_t offset)
+{
+    if (offset >= reader->header->strings_size)
+        return "";
+    return reader->strings + offset;
+}
+
+/**
+ * Returns the record of the tag [tag] in [reader], or NULL if no file
+ * has this tag.
+ */
+static const struct IndexTagRecord *find_tag(
+        const IndexReader *reader,
+        const char *tag)
+{
+    size_t low = 0;
+    size_t high = reader->header->nb_tags;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const struct IndexTagRecord *record = &reader->tags[middle];
+        int cmp = strcmp(tag, index_string(reader, record->name));
+        if (cmp == 0)
+            return record;
+        else if (cmp < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return NULL;
+}
+
+bool index_tag_files(
+        const IndexReader *reader,
+        const char *tag,
+        Bitmap *files)
+{
+    assert(reader != NULL);
+    assert(tag != NULL);
+    assert(files != NULL);
+
+    const struct IndexTagRecord *record = find_tag(reader, tag);
+    if (record == NULL
+            || record->postings > reader->header->postings_size
+            || reader->header->postings_size - record->postings
+                < record->postings_size
+            || record->postings % sizeof(uint64_t) != 0)
+        return false;
+    return bitmap_view(reader->postings + record->postings,
+            record->postings_size, files);
+}
+
+uint32_t index_tag_nb_files(const IndexReader *reader, const char *tag)
+{
+    assert(reader != NULL);
+    assert(tag != NULL);
+
+    const struct IndexTagRecord *record = find_tag(reader, tag);
+    return record != NULL ? record->nb_files : 0;
+}
+
+const char *index_file_path(const IndexReader *reader, uint32_t id)
+{
+    assert(reader != NULL);
+    assert(id < reader->header->nb_files);
+    return index_string(reader, reader->files[id].path);
+}
+
+/**
+ * Returns the identifier of the first file whose path is not lower
+ * than the [len] chars of [path] in [reader].
+ */
+static uint32_t index_lower_bound(
+        const IndexReader *reader,
+        const char *path,
+        size_t len)
+{
+    uint32_t low = 0;
+    uint32_t high = reader->header->nb_files;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const char *other = index_file_path(reader, middle);
+        if (strncmp(other, path, len) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void index_dir_range(
+        const IndexReader *reader,
+        const char *dir,
+        uint32_t *first,
+        uint32_t *end)
+{
+    assert(reader != NULL);
+    assert(dir != NULL);
+
+    /* The paths under "dir/" lie between "dir/" and "dir0".  */
+    size_t len = strlen(dir);
+    while (len > 0 && dir[len - 1] == '/')
+        len--;
+    char prefix[len + 2];
+    memcpy(prefix, dir, len);
+    prefix[len] = '/';
+    prefix[len + 1] = '\0';
+    *first = index_lower_bound(reader, prefix, len + 1);
+    prefix[len] = '/' + 1;
+    *end = index_lower_bound(reader, prefix, len + 1);
+}
+
+TagError load_index(const char *filename, TagIndex *index)
+{
+    assert(filename != NULL);
+    assert(index != NULL);
+
+    memset(index, 0, sizeof(*index));
+    IndexReader reader;
+    TagError error = open_index(filename, &reader);
+    if (error != NO_ERROR)
+        return error;
+
+    size_t nb_files = reader.header->nb_files;
+    index->files = calloc(nb_files, sizeof(IndexedFile));
+    if (index->files == NULL && nb_files > 0) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    index->nb_files = index->capacity = nb_files;
+    index->cursor.generation = reader.header->journal_generation;
+    index->cursor.offset = reader.header->journal_offset;
+    for (size_t i = 0; i < nb_files; i++) {
+        index->files[i].path =
+            checked_strdup(index_string(&reader, reader.files[i].path));
+        index->files[i].dev = reader.files[i].dev;
+        index->files[i].ino = reader.files[i].ino;
+    }
+
+    /* Invert the posting lists: count the tags of each file first.  */
+    uint32_t *ids = checked_malloc(nb_files * sizeof(uint32_t));
+    Bitmap files;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < reader.header->nb_tags; i++) {
+            const char *tag = index_string(&reader, reader.tags[i].name);
+            if (!index_tag_files(&reader, tag, &files))
+                continue;
+            size_t nb_ids = 0;
+            if (bitmap_cardinality(&files) <= nb_files)
+                nb_ids = bitmap_to_array(&files, ids);
+            bitmap_free(&files);
+            for (size_t j = 0; j < nb_ids; j++) {
+                if (ids[j] >= nb_files) {
+                    free(ids);
+                    close_index(&reader);
+                    free_index(index);
+                    return INVALID_INDEX_FILE;
+                }
+                IndexedFile *file = &index->files[ids[j]];
+                if (pass == 0)
+                    file->nb_tags++;
+                else
+                    file->tags[file->nb_tags++] = checked_strdup(tag);
+            }
+        }
+        for (size_t i = 0; pass == 0 && i < nb_files; i++) {
+            index->files[i].tags =
+                checked_malloc(index->files[i].nb_tags * sizeof(char *));
+            index->files[i].nb_tags = 0;
+        }
+    }
+    free(ids);
+    close_index(&reader);
+    return NO_ERROR;
+}
+
+/**
+ * Frees the tags of [file].
+ */
+static void free_file_tags(IndexedFile *file)
+{
+    for (size_t i = 0; i < file->nb_tags; i++)
+        free(file->tags[i]);
+    free(file->tags);
+    file->tags = NULL;
+    file->nb_tags = 0;
+}
+
+void free_index(TagIndex *index)
+{
+    if (index == NULL)
+        return;
+    for (size_t i = 0; i < index->nb_files; i++) {
+        free(index->files[i].path);
+        free_file_tags(&index->files[i]);
+    }
+    free(index->files);
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * Returns the position of the first file of [index] whose path is
+ * not lower than [path].
+ */
+static size_t file_lower_bound(const TagIndex *index, const char *path)
+{
+    size_t low = 0;
+    size_t high = index->nb_files;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(index->files[middle].path, path) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * Makes room for one more file in [index].
+ */
+static void reserve_file(TagIndex *index)
+{
+    if (index->nb_files == index->capacity) {
+        size_t new_capacity = (index->capacity + 1) * 2;
+        void *rc = realloc(index->files, new_capacity * sizeof(IndexedFile));
+        if (rc == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        index->files = rc;
+        index->capacity = new_capacity;
+    }
+}
+
+IndexedFile *index_add_file(TagIndex *index, const char *path)
+{
+    assert(index != NULL);
+    assert(path != NULL);
+
+    reserve_file(index);
+    IndexedFile *file = &index->files[index->nb_files++];
+    memset(file, 0, sizeof(*file));
+    file->path = checked_strdup(path);
+    return file;
+}
+
+/**
+ * A file of an index with its position, to sort files stably.
+ */
+typedef struct {
+    IndexedFile file;
+    size_t position;
+} PositionedFile;
+
+static int compare_positioned_files(const void *a, const void *b)
+{
+    const PositionedFile *file_a = a;
+    const PositionedFile *file_b = b;
+    int cmp = strcmp(file_a->file.path, file_b->file.path);
+    if (cmp != 0)
+        return cmp;
+    return (file_a->position > file_b->position)
+        - (file_a->position < file_b->position);
+}
+
+void index_sort(TagIndex *index)
+{
+    assert(index != NULL);
+
+    PositionedFile *files =
+        checked_malloc(index->nb_files * sizeof(PositionedFile));
+    for (size_t i = 0; i < index->nb_files; i++)
+        files[i] = (PositionedFile) { .file = index->files[i], .position = i };
+    qsort(files, index->nb_files, sizeof(PositionedFile),
+            compare_positioned_files);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < index->nb_files; i++) {
+        if (kept > 0
+                && strcmp(index->files[kept - 1].path,
+                    files[i].file.path) == 0) {
+            free(index->files[kept - 1].path);
+            free_file_tags(&index->files[kept - 1]);
+            kept--;
+        }
+        index->files[kept++] = files[i].file;
+    }
+    index->nb_files = kept;
+    free(files);
+}
+
+IndexedFile *index_get_file(TagIndex *index, const char *path, bool create)
+{
+    assert(index != NULL);
+    assert(path != NULL);
+
+    size_t pos = file_lower_bound(index, path);
+    if (pos < index->nb_files && strcmp(index->files[pos].path, path) == 0)
+        return &index->files[pos];
+    if (!create)
+        return NULL;
+
+    reserve_file(index);
+    memmove(&index->files[pos + 1], &index->files[pos],
+            (index->nb_files - pos) * sizeof(IndexedFile));
+    index->nb_files++;
+    IndexedFile *file = &index->files[pos];
+    memset(file, 0, sizeof(*file));
+    file->path = checked_strdup(path);
+    return file;
+}
+
+void index_set_tags(IndexedFile *file, const char **tags, size_t nb_tags)
+{
+    assert(file != NULL);
+    assert(tags != NULL || nb_tags == 0);
+
+    free_file_tags(file);
+    file->tags = checked_malloc(nb_tags * sizeof(char *));
+    for (size_t i = 0; i < nb_tags; i++)
+        file->tags[i] = checked_strdup(tags[i]);
+    file->nb_tags = nb_tags;
+}
+
+/**
+ * Returns [true] if [path] is located under the directory [dir].
+ */
+static bool is_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    while (len > 0 && dir[len - 1] == '/')
+        len--;
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+void index_remove_files_under(TagIndex *index, const char *dir)
+{
+    assert(index != NULL);
+    assert(dir != NULL);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < index->nb_files; i++) {
+        IndexedFile *file = &index->files[i];
+        if (is_under(file->path, dir)) {
+            free(file->path);
+            free_file_tags(file);
+        } else {
+            index->files[kept++] = *file;
+        }
+    }
+    index->nb_files = kept;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Writes the [size] bytes of [data] to [f], returning [false] on error.
+ */
+static bool write_all(FILE *f, const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+TagError write_index(const char *filename, const TagIndex *index)
+{
+    assert(filename != NULL);
+    assert(index != NULL);
+
+    /* Only tagged files are indexed, and they get consecutive ids.  */
+    size_t nb_files = 0;
+    size_t nb_postings = 0;
+    for (size_t i = 0; i < index->nb_files; i++) {
+        if (index->files[i].nb_tags > 0) {
+            nb_files++;
+            nb_postings += index->files[i].nb_tags;
+        }
+    }
+
+    char **tags = checked_malloc(nb_postings * sizeof(char *));
+    size_t nb_tags = 0;
+    for (size_t i = 0; i < index->nb_files; i++)
+        for (size_t j = 0; j < index->files[i].nb_tags; j++)
+            tags[nb_tags++] = index->files[i].tags[j];
+    qsort(tags, nb_tags, sizeof(char *), compare_strings);
+    size_t nb_unique = 0;
+    for (size_t i = 0; i < nb_tags; i++)
+        if (nb_unique == 0 || strcmp(tags[nb_unique - 1], tags[i]) != 0)
+            tags[nb_unique++] = tags[i];
+    nb_tags = nb_unique;
+
+    struct IndexFileRecord *file_records =
+        checked_malloc(nb_files * sizeof(*file_records));
+    struct IndexTagRecord *tag_records =
+        calloc(nb_tags, sizeof(*tag_records));
+    Bitmap *tag_files = calloc(nb_tags, sizeof(Bitmap));
+    if ((tag_records == NULL || tag_files == NULL) && nb_tags > 0) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The files are visited by increasing id.  */
+    PascalBuffer strings = {0};
+    uint32_t id = 0;
+    for (size_t i = 0; i < index->nb_files; i++) {
+        const IndexedFile *file = &index->files[i];
+        if (file->nb_tags == 0)
+            continue;
+        for (size_t j = 0; j < file->nb_tags; j++) {
+            char **tag = bsearch(&file->tags[j], tags, nb_tags,
+                    sizeof(char *), compare_strings);
+            assert(tag != NULL);
+            tag_records[tag - tags].nb_files++;
+            bitmap_append(&tag_files[tag - tags], id);
+        }
+        file_records[id] = (struct IndexFileRecord) {
+            .path = strings.str_length,
+            .dev = file->dev,
+            .ino = file->ino
+        };
+        append_str_to_buffer(&strings, file->path, strlen(file->path) + 1);
+        id++;
+    }
+    size_t postings_size = 0;
+    for (size_t i = 0; i < nb_tags; i++) {
+        tag_records[i].postings = postings_size;
+        tag_records[i].postings_size = bitmap_serialized_size(&tag_files[i]);
+        postings_size += tag_records[i].postings_size;
+    }
+    char *postings = checked_malloc(postings_size);
+    for (size_t i = 0; i < nb_tags; i++) {
+        bitmap_serialize(&tag_files[i], postings + tag_records[i].postings);
+        bitmap_free(&tag_files[i]);
+    }
+    free(tag_files);
+    for (size_t i = 0; i < nb_tags; i++) {
+        tag_records[i].name = strings.str_length;
+        append_str_to_buffer(&strings, tags[i], strlen(tags[i]) + 1);
+    }
+
+    struct IndexHeader header = {
+        .magic = INDEX_MAGIC,
+        .version = INDEX_VERSION,
+        .nb_files = nb_files,
+        .nb_tags = nb_tags,
+        .strings_size = strings.str_length,
+        .postings_size = postings_size,
+        .journal_generation = index->cursor.generation,
+        .journal_offset = index->cursor.offset
+    };
+    header.files_offset = sizeof(header);
+    header.tags_offset =
+        header.files_offset + nb_files * sizeof(*file_records);
+    header.strings_offset =
+        header.tags_offset + nb_tags * sizeof(*tag_records);
+    /* Keep the posting lists aligned for the readers.  */
+    header.postings_offset = (header.strings_offset + strings.str_length
+            + sizeof(uint64_t) - 1) & ~(uint64_t) (sizeof(uint64_t) - 1);
+    static const char padding[sizeof(uint64_t)] = {0};
+
+    TagError error = NO_ERROR;
+    size_t tmp_len = strlen(filename) + 32;
+    char tmp_filename[tmp_len];
+    snprintf(tmp_filename, tmp_len, "%s.tmp.%d", filename, (int) getpid());
+    FILE *f = fopen(tmp_filename, "w");
+    if (f == NULL) {
+        error = WRITE_INDEX_ERROR;
+        goto FREE_RESOURCES;
+    }
+    if (!write_all(f, &header, sizeof(header))
+            || !write_all(f, file_records, nb_files * sizeof(*file_records))
+            || !write_all(f, tag_records, nb_tags * sizeof(*tag_records))
+            || !write_all(f, strings.str, strings.str_length)
+            || !write_all(f, padding, header.postings_offset
+                - header.strings_offset - strings.str_length)
+            || !write_all(f, postings, postings_size)
+            || fflush(f) == EOF
+            || fsync(fileno(f)) == -1) {
+        int errno_save = errno;
+        fclose(f);
+        unlink(tmp_filename);
+        errno = errno_save;
+        error = WRITE_INDEX_ERROR;
+        goto FREE_RESOURCES;
+    }
+    if (fclose(f) == EOF || rename(tmp_filename, filename) == -1) {
+        int errno_save = errno;
+        unlink(tmp_filename);
+        errno = errno_save;
+        error = WRITE_INDEX_ERROR;
+    }
+
+FREE_RESOURCES:
+    free(strings.str);
+    free(postings);
+    free(tag_records);
+    free(file_records);
+    free(tags);
+    return error;
+}
+
+int lock_index()
+{
+    return lock_file(INDEX_FILE);
+}
+
+void unlock_index(int lock_fd)
+{
+    if (lock_fd != -1)
+        close(lock_fd);
+}
+
+/**
+ * Applies the change [record] of the journal to [index].
+ */
+static void replay_record(TagIndex *index, const JournalRecord *record)
+{
+    if (record->op != JOURNAL_ADD_TAG && record->op != JOURNAL_REMOVE_TAG)
+        return;
+    IndexedFile *file = index_get_file(index, record->path,
+            record->op == JOURNAL_ADD_TAG);
+    if (file == NULL)
+        return;
+    file->dev = record->dev;
+    file->ino = record->ino;
+
+    size_t pos = 0;
+    while (pos < file->nb_tags && strcmp(file->tags[pos], record->tag) != 0)
+        pos++;
+    if (record->op == JOURNAL_ADD_TAG && pos == file->nb_tags) {
+        void *rc = realloc(file->tags, (file->nb_tags + 1) * sizeof(char *));
+        if (rc == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        file->tags = rc;
+        file->tags[file->nb_tags++] = checked_strdup(record->tag);
+    } else if (record->op == JOURNAL_REMOVE_TAG && pos < file->nb_tags) {
+        free(file->tags[pos]);
+        file->tags[pos] = file->tags[--file->nb_tags];
+    }
+}
+
+TagError index_replay_journal(
+        TagIndex *index,
+        const JournalCursor *from,
+        const char *dir)
+{
+    assert(index != NULL);
+    assert(from != NULL);
+
+    JournalReader reader;
+    TagError error = open_journal_reader(&reader, from);
+    if (error != NO_ERROR)
+        return error;
+    JournalRecord record;
+    bool found;
+    while ((error = journal_next(&reader, &record, &found)) == NO_ERROR
+            && found) {
+        if (dir == NULL || is_under(record.path, dir))
+            replay_record(index, &record);
+    }
+    if (error == NO_ERROR)
+        index->cursor = reader.cursor;
+    close_journal_reader(&reader);
+    return error;
+}
+
+TagError update_index()
+{
+    const IndexReader *reader;
+    TagError error = get_index_reader(&reader);
+    if (error == LOAD_INDEX_ERROR && errno == ENOENT)
+        return NO_ERROR;
+    else if (error != NO_ERROR)
+        return error;
+    JournalCursor cursor = {
+        .generation = reader->header->journal_generation,
+        .offset = reader->header->journal_offset
+    };
+    JournalCursor end;
+    if ((error = journal_end(&end)) != NO_ERROR)
+        return error;
+    if (cursor.generation == end.generation && cursor.offset == end.offset)
+        return NO_ERROR;
+
+    int lock_fd = lock_index();
+    if (lock_fd == -1)
+        return WRITE_INDEX_ERROR;
+    TagIndex index;
+    if ((error = load_index(INDEX_FILE, &index)) == NO_ERROR) {
+        error = index_replay_journal(&index, &index.cursor, NULL);
+        if (error == NO_ERROR)
+            error = write_index(INDEX_FILE, &index);
+        free_index(&index);
+    }
+    int errno_save = errno;
+    unlock_index(lock_fd);
+    errno = errno_save;
+    return error;
+}
+
+bool index_read_tags(IndexedFile *file)
+{
+    assert(file != NULL);
+
+    struct stat st;
+    if (stat(file->path, &st) == -1)
+        return false;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+
+    PascalBuffer list = {0};
+    ssize_t buflen = read_xattr_list(AT_FDCWD, file->path, &list, NULL);
+    if (buflen == -1) {
+        int errno_save = errno;
+        free(list.str);
+        errno = errno_save;
+        return false;
+    }
+    char *buf = list.str;
+
+    const char **tags = checked_malloc((buflen / 2 + 1) * sizeof(char *));
+    size_t nb_tags = 0;
+    XattrTagScanner scanner;
+    const char *tag;
+    size_t tag_len;
+    scan_xattr_tags(&scanner, buf, buflen);
+    while (next_xattr_tag(&scanner, &tag, &tag_len))
+        tags[nb_tags++] = tag;
+    index_set_tags(file, tags, nb_tags);
+    free(tags);
+    free(buf);
+    return true;
+}
+
+TagError index_merge(
+        const TagIndex *files,
+        const char **dirs,
+        size_t nb_dirs,
+        const JournalCursor *since)
+{
+    assert(files != NULL);
+    assert(dirs != NULL || nb_dirs == 0);
+
+    int lock_fd = lock_index();
+    if (lock_fd == -1)
+        return WRITE_INDEX_ERROR;
+
+    TagIndex index;
+    bool lost = false;
+    TagError error = load_index(INDEX_FILE, &index);
+    if (error == LOAD_INDEX_ERROR && errno == ENOENT) {
+        error = journal_end(&index.cursor);
+    } else if (error == INVALID_INDEX_FILE) {
+        /* Such as an index of a previous version: start a new one.  */
+        lost = true;
+        error = journal_end(&index.cursor);
+    } else if (error == NO_ERROR) {
+        error = index_replay_journal(&index, &index.cursor, NULL);
+        if (error == JOURNAL_CURSOR_LOST) {
+            lost = true;
+            error = journal_end(&index.cursor);
+        }
+    }
+    if (error != NO_ERROR)
+        goto UNLOCK;
+
+    for (size_t i = 0; i < nb_dirs; i++)
+        index_remove_files_under(&index, dirs[i]);
+    for (size_t i = 0; i < files->nb_files; i++) {
+        const IndexedFile *changed = &files->files[i];
+        IndexedFile *file = index_add_file(&index, changed->path);
+        file->dev = changed->dev;
+        file->ino = changed->ino;
+        index_set_tags(file, (const char **) changed->tags, changed->nb_tags);
+    }
+    index_sort(&index);
+
+    JournalCursor end = index.cursor;
+    for (size_t i = 0; since != NULL && i < nb_dirs; i++) {
+        error = index_replay_journal(&index, since, dirs[i]);
+        if (error == JOURNAL_CURSOR_LOST)
+            lost = true;
+        else if (error != NO_ERROR)
+            goto FREE_INDEX;
+    }
+    index.cursor = end;
+    error = write_index(INDEX_FILE, &index);
+
+FREE_INDEX:
+    free_index(&index);
+UNLOCK:;
+    int errno_save = errno;
+    unlock_index(lock_fd);
+    errno = errno_save;
+    if (error == NO_ERROR && lost)
+        return JOURNAL_CURSOR_LOST;
+    return error;
+}
@@ -0,0 +1,192 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "bitmap.h"
+#include "journal.h"
+#include "tag.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A tagged file as stored in the index: its absolute path, its
+ * device and inode numbers and the names of its [nb_tags] tags.
+ */
+typedef struct {
+    char *path;
+    uint64_t dev;
+    uint64_t ino;
+    char **tags;
+    size_t nb_tags;
+} IndexedFile;
+
+/**
+ * The content of an index loaded in memory to be modified.
+ * [files] is sorted by path, except after index_add_file().
+ * [cursor] is the position of the first change of the journal that
+ * is not reflected in [files].
+ */
+typedef struct {
+    IndexedFile *files;
+    size_t nb_files;
+    size_t capacity;
+    JournalCursor cursor;
+} TagIndex;
+
+/**
+ * A read-only view of an index file mapped in memory. The files are
+ * identified by their position in the index, the files of a given
+ * directory having consecutive identifiers since they are sorted by
+ * path.
+ */
+typedef struct {
+    void *map;
+    size_t size;
+    const struct IndexHeader *header;
+    const struct IndexFileRecord *files;
+    const struct IndexTagRecord *tags;
+    const char *strings;
+    const char *postings;
+} IndexReader;
+
+/**
+ * Loads the index file [filename] in [index]. A missing index file
+ * is reported as LOAD_INDEX_ERROR with errno set to ENOENT.
+ */
+TagError load_index(const char *filename, TagIndex *index);
+
+/**
+ * Writes [index] to [filename], atomically replacing it.
+ */
+TagError write_index(const char *filename, const TagIndex *index);
+
+void free_index(TagIndex *index);
+
+/**
+ * Returns the file of path [path] in [index], creating it without
+ * tags if [create] is [true]. Returns NULL if it does not exist.
+ */
+IndexedFile *index_get_file(TagIndex *index, const char *path, bool create);
+
+/**
+ * Appends a file of path [path] without tags to [index], which is no
+ * longer sorted until index_sort() is called. Returns the new file.
+ */
+IndexedFile *index_add_file(TagIndex *index, const char *path);
+
+/**
+ * Sorts the files of [index] by path. When several files have the
+ * same path, the last one added is kept.
+ */
+void index_sort(TagIndex *index);
+
+/**
+ * Replaces the tags of [file] by the [nb_tags] names [tags].
+ */
+void index_set_tags(IndexedFile *file, const char **tags, size_t nb_tags);
+
+/**
+ * Removes from [index] the files located under the directory [dir].
+ */
+void index_remove_files_under(TagIndex *index, const char *dir);
+
+/**
+ * Takes the lock serializing the modifications of the index files.
+ * Returns the descriptor to give to unlock_index(), or -1 on error.
+ */
+int lock_index();
+
+void unlock_index(int lock_fd);
+
+/**
+ * Applies to [index] the changes of the journal following [from],
+ * ignoring the files not located under the directory [dir] if it is
+ * not NULL, and moves the cursor of [index] after them.
+ * [index] must be sorted.
+ */
+TagError index_replay_journal(
+        TagIndex *index,
+        const JournalCursor *from,
+        const char *dir);
+
+/**
+ * Applies to the index file the changes of the journal it does not
+ * reflect yet. Does nothing if the user has no index.
+ */
+TagError update_index();
+
+/**
+ * Sets the tags, device and inode of [file] to those the file of path
+ * [file->path] currently has. Returns [false] and sets errno if they
+ * could not be read.
+ */
+bool index_read_tags(IndexedFile *file);
+
+/**
+ * Updates the index file, creating it if needed: applies the changes
+ * of the journal it does not reflect yet, removes the files located
+ * under the [nb_dirs] directories [dirs], and then replaces the entries
+ * of the files of [files] by them, the files without tags being
+ * removed. If [since] is not NULL, the changes of the journal
+ * following it are applied again to the files under [dirs], as they
+ * may be missing from [files] if they were made while it was read.
+ * Returns JOURNAL_CURSOR_LOST, once the index file is written, if
+ * changes of the journal were lost or if the previous index file
+ * could not be read and was replaced.
+ */
+TagError index_merge(
+        const TagIndex *files,
+        const char **dirs,
+        size_t nb_dirs,
+        const JournalCursor *since);
+
+/**
+ * Maps the index file [filename] in memory.
+ */
+TagError open_index(const char *filename, IndexReader *reader);
+
+void close_index(IndexReader *reader);
+
+/**
+ * Writes to [*reader] a view of the index file of the user, mapped on
+ * the first call and mapped again only when the file has been
+ * replaced since. The view must not be closed, and is only valid
+ * until the next call.
+ */
+TagError get_index_reader(const IndexReader **reader);
+
+/**
+ * Returns the number of files in the index of [reader].
+ */
+uint32_t index_nb_files(const IndexReader *reader);
+
+/**
+ * Writes to [files] a borrowed Bitmap of the identifiers of the files
+ * tagged with [tag], to be freed with bitmap_free(). Returns [false]
+ * if no file has this tag.
+ */
+bool index_tag_files(
+        const IndexReader *reader,
+        const char *tag,
+        Bitmap *files);
+
+/**
+ * Returns the number of files tagged with [tag] in [reader].
+ */
+uint32_t index_tag_nb_files(const IndexReader *reader, const char *tag);
+
+/**
+ * Returns the path of the file of identifier [id].
+ */
+const char *index_file_path(const IndexReader *reader, uint32_t id);
+
+/**
+ * Writes to [*first] and [*end] the range of identifiers of the files
+ * located under the absolute directory [dir].
+ */
+void index_dir_range(
+        const IndexReader *reader,
+        const char *dir,
+        uint32_t *first,
+        uint32_t *end);
+
+#endif
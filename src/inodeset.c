@@ -0,0 +1,101 @@
+#include "inodeset.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SHARD_CAPACITY 64
+
+void inode_set_init(InodeSet *set)
+{
+    assert(set != NULL);
+
+    memset(set, 0, sizeof(*set));
+    for (int i = 0; i < INODE_SET_SHARDS; i++)
+        pthread_mutex_init(&set->shards[i].lock, NULL);
+}
+
+void inode_set_free(InodeSet *set)
+{
+    assert(set != NULL);
+
+    for (int i = 0; i < INODE_SET_SHARDS; i++) {
+        pthread_mutex_destroy(&set->shards[i].lock);
+        free(set->shards[i].slots);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+/**
+ * Returns the hash of the file of device [dev] and inode [ino]: its
+ * high bits pick the shard, its low bits the slot.
+ */
+static uint64_t hash_inode(uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = ino ^ (dev * UINT64_C(0x9e3779b97f4a7c15));
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Returns the slot of [shard] holding [key], or the free slot where it
+ * goes if [shard] does not hold it.
+ */
+static InodeKey *find_slot(const InodeShard *shard, const InodeKey *key,
+        uint64_t hash)
+{
+    size_t mask = shard->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        InodeKey *slot = &shard->slots[i];
+        if (slot->ino == 0
+                || (slot->ino == key->ino && slot->dev == key->dev))
+            return slot;
+    }
+}
+
+/**
+ * Doubles the capacity of [shard], or allocates its first slots.
+ */
+static void grow_shard(InodeShard *shard)
+{
+    InodeKey *old_slots = shard->slots;
+    size_t old_capacity = shard->capacity;
+    shard->capacity = old_capacity > 0
+        ? old_capacity * 2 : INITIAL_SHARD_CAPACITY;
+    shard->slots = calloc(shard->capacity, sizeof(InodeKey));
+    if (shard->slots == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        const InodeKey *key = &old_slots[i];
+        if (key->ino != 0)
+            *find_slot(shard, key, hash_inode(key->dev, key->ino)) = *key;
+    }
+    free(old_slots);
+}
+
+bool inode_set_add(InodeSet *set, dev_t dev, ino_t ino)
+{
+    assert(set != NULL);
+
+    InodeKey key = { .dev = dev, .ino = ino };
+    uint64_t hash = hash_inode(key.dev, key.ino);
+    InodeShard *shard = &set->shards[hash >> (64 - INODE_SET_SHARD_BITS)];
+    pthread_mutex_lock(&shard->lock);
+    /* The shards are kept at most half full.  */
+    if (2 * (shard->size + 1) > shard->capacity)
+        grow_shard(shard);
+    InodeKey *slot = find_slot(shard, &key, hash);
+    bool added = slot->ino == 0;
+    if (added) {
+        *slot = key;
+        shard->size++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return added;
+}
@@ -0,0 +1,56 @@
+#ifndef INODESET_H
+#define INODESET_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The inodes of an InodeSet are spread over this number of shards,
+ * each one having its own lock, so that the workers of a walk rarely
+ * wait for each other.
+ */
+#define INODE_SET_SHARD_BITS 6
+#define INODE_SET_SHARDS (1 << INODE_SET_SHARD_BITS)
+
+/**
+ * The device and inode numbers of a file. No file has the inode 0, so
+ * that the slots of a shard holding it are free.
+ */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} InodeKey;
+
+/**
+ * A shard of an InodeSet: an open addressing hash table of [capacity]
+ * slots [slots], a power of 2, holding [size] inodes.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    InodeKey *slots;
+    size_t capacity;
+    size_t size;
+} InodeShard;
+
+/**
+ * A set of files given by their device and inode numbers, which may be
+ * used by several threads at once.
+ */
+typedef struct {
+    InodeShard shards[INODE_SET_SHARDS];
+} InodeSet;
+
+void inode_set_init(InodeSet *set);
+
+void inode_set_free(InodeSet *set);
+
+/**
+ * Adds the file of device [dev] and inode [ino] to [set].
+ * Returns [false] if it was already there, [true] otherwise.
+ */
+bool inode_set_add(InodeSet *set, dev_t dev, ino_t ino);
+
+#endif
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "TAGSYS6J"
+#define JOURNAL_VERSION 1
+#define JOURNAL_OLD_SUFFIX ".old"
+
+/* A segment is rotated once it would grow beyond this size.  */
+#ifndef JOURNAL_MAX_SIZE
+#define JOURNAL_MAX_SIZE (1 << 20)
+#endif
+
+/* The records are padded to keep their headers aligned.  */
+#define JOURNAL_ALIGNMENT 8
+
+/*
+ * Layout of a journal segment, in the byte order of the machine:
+ * a JournalHeader followed by the records, each one being a
+ * JournalRecordHeader followed by the path and the tag, both NUL
+ * terminated. Only the first [committed] bytes of the segment hold
+ * complete records: the records are written after them, flushed to
+ * the disk, and then [committed] is updated, so a crash cannot leave
+ * a partial record visible.
+ */
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t generation;
+    uint64_t committed;
+};
+
+struct JournalRecordHeader {
+    uint32_t size;
+    uint16_t op;
+    uint16_t tag_len;
+    uint32_t path_len;
+    uint32_t reserved;
+    int64_t timestamp;
+    uint64_t dev;
+    uint64_t ino;
+};
+
+#define JOURNAL_START sizeof(struct JournalHeader)
+
+void journal_add(Journal *journal, const JournalRecord *record)
+{
+    assert(journal != NULL);
+    assert(record != NULL);
+    assert(record->path != NULL);
+    assert(record->tag != NULL);
+
+    size_t path_len = strlen(record->path) + 1;
+    size_t tag_len = strlen(record->tag) + 1;
+    size_t size = sizeof(struct JournalRecordHeader) + path_len + tag_len;
+    size = (size + JOURNAL_ALIGNMENT - 1) & ~(size_t) (JOURNAL_ALIGNMENT - 1);
+
+    struct JournalRecordHeader header = {
+        .size = size,
+        .op = record->op,
+        .tag_len = tag_len,
+        .path_len = path_len,
+        .timestamp = record->timestamp,
+        .dev = record->dev,
+        .ino = record->ino
+    };
+    if (header.timestamp == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        header.timestamp = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+    static const char padding[JOURNAL_ALIGNMENT] = {0};
+    PascalBuffer *pending = &journal->pending;
+    append_str_to_buffer(pending, (const char *) &header, sizeof(header));
+    append_str_to_buffer(pending, record->path, path_len);
+    append_str_to_buffer(pending, record->tag, tag_len);
+    append_str_to_buffer(pending, padding,
+            size - sizeof(header) - path_len - tag_len);
+}
+
+bool journal_add_file_change(
+        Journal *journal,
+        JournalOp op,
+        int fd,
+        const char *filename,
+        const char *tag)
+{
+    assert(journal != NULL);
+    assert(filename != NULL);
+    assert(tag != NULL);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return false;
+    char *path = realpath(filename, NULL);
+    if (path == NULL)
+        return false;
+    JournalRecord record = {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .op = op,
+        .path = path,
+        .tag = tag
+    };
+    journal_add(journal, &record);
+    free(path);
+    return true;
+}
+
+void journal_free(Journal *journal)
+{
+    if (journal == NULL)
+        return;
+    free(journal->pending.str);
+    memset(journal, 0, sizeof(*journal));
+}
+
+bool journal_close(Journal *journal)
+{
+    assert(journal != NULL);
+
+    TagError error = journal_commit(journal);
+    if (error != NO_ERROR)
+        print_tag_error(error);
+    journal_free(journal);
+    return error == NO_ERROR;
+}
+
+/**
+ * Writes to [filename] the path of the previous segment of the journal.
+ */
+static void old_segment_path(char *filename, size_t size)
+{
+    snprintf(filename, size, "%s"JOURNAL_OLD_SUFFIX, JOURNAL_FILE);
+}
+
+/**
+ * Reads the header of the journal segment [fd] to [header].
+ */
+static TagError read_header(int fd, struct JournalHeader *header)
+{
+    ssize_t rc = pread(fd, header, sizeof(*header), 0);
+    if (rc == -1)
+        return LOAD_JOURNAL_ERROR;
+    if (rc != sizeof(*header)
+            || memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic))
+            || header->version != JOURNAL_VERSION
+            || header->committed < JOURNAL_START)
+        return INVALID_JOURNAL_FILE;
+    return NO_ERROR;
+}
+
+/**
+ * Opens the journal segment [filename] and reads its header.
+ * Returns -1 and sets [*error] on failure.
+ */
+static int open_segment(
+        const char *filename,
+        struct JournalHeader *header,
+        TagError *error)
+{
+    int fd = open(filename, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        *error = LOAD_JOURNAL_ERROR;
+        return -1;
+    }
+    if ((*error = read_header(fd, header)) != NO_ERROR) {
+        int errno_save = errno;
+        close(fd);
+        errno = errno_save;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Returns the generation of the segment to create when the journal
+ * does not exist: the one following the previous segment, if any.
+ */
+static uint64_t next_generation()
+{
+    char old_filename[strlen(JOURNAL_FILE) + sizeof(JOURNAL_OLD_SUFFIX)];
+    old_segment_path(old_filename, sizeof(old_filename));
+    struct JournalHeader header;
+    TagError error;
+    int fd = open_segment(old_filename, &header, &error);
+    if (fd == -1)
+        return 1;
+    close(fd);
+    return header.generation + 1;
+}
+
+/**
+ * Creates the empty segment [generation] of the journal, renaming the
+ * current segment to JOURNAL_FILE.old if [rotate] is [true].
+ * Returns its descriptor, or -1 on error.
+ */
+static int create_segment(uint64_t generation, bool rotate)
+{
+    size_t len = strlen(JOURNAL_FILE) + 32;
+    char tmp_filename[len];
+    snprintf(tmp_filename, len, "%s.tmp.%d", JOURNAL_FILE, (int) getpid());
+    char old_filename[len];
+    old_segment_path(old_filename, len);
+
+    int fd = open(tmp_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+    struct JournalHeader header = {
+        .magic = JOURNAL_MAGIC,
+        .version = JOURNAL_VERSION,
+        .generation = generation,
+        .committed = JOURNAL_START
+    };
+    if (write(fd, &header, sizeof(header)) != sizeof(header)
+            || fsync(fd) == -1
+            || (rotate && rename(JOURNAL_FILE, old_filename) == -1)
+            || rename(tmp_filename, JOURNAL_FILE) == -1) {
+        int errno_save = errno;
+        close(fd);
+        unlink(tmp_filename);
+        errno = errno_save;
+        return -1;
+    }
+    return fd;
+}
+
+TagError journal_commit(Journal *journal)
+{
+    assert(journal != NULL);
+
+    size_t size = journal->pending.str_length;
+    if (size == 0)
+        return NO_ERROR;
+
+    int lock_fd = lock_file(JOURNAL_FILE);
+    if (lock_fd == -1)
+        return WRITE_JOURNAL_ERROR;
+
+    TagError error = NO_ERROR;
+    struct JournalHeader header;
+    int fd = open_segment(JOURNAL_FILE, &header, &error);
+    if (fd == -1 && error == LOAD_JOURNAL_ERROR && errno == ENOENT) {
+        header.generation = next_generation();
+        header.committed = JOURNAL_START;
+        fd = create_segment(header.generation, false);
+        error = fd == -1 ? WRITE_JOURNAL_ERROR : NO_ERROR;
+    }
+    if (fd == -1)
+        goto UNLOCK;
+
+    if (header.committed > JOURNAL_START
+            && header.committed + size > JOURNAL_MAX_SIZE) {
+        close(fd);
+        header.generation++;
+        header.committed = JOURNAL_START;
+        if ((fd = create_segment(header.generation, true)) == -1) {
+            error = WRITE_JOURNAL_ERROR;
+            goto UNLOCK;
+        }
+    }
+
+    /* Flush the records before publishing them in the header.  */
+    uint64_t committed = header.committed + size;
+    if (pwrite(fd, journal->pending.str, size, header.committed) != size
+            || fdatasync(fd) == -1
+            || pwrite(fd, &committed, sizeof(committed),
+                offsetof(struct JournalHeader, committed))
+                != sizeof(committed)
+            || fdatasync(fd) == -1)
+        error = WRITE_JOURNAL_ERROR;
+    else
+        journal->pending.str_length = 0;
+    int errno_save = errno;
+    close(fd);
+    errno = errno_save;
+
+UNLOCK:
+    errno_save = errno;
+    close(lock_fd);
+    errno = errno_save;
+    return error;
+}
+
+TagError journal_end(JournalCursor *cursor)
+{
+    assert(cursor != NULL);
+
+    struct JournalHeader header;
+    TagError error;
+    int fd = open(JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        cursor->generation = next_generation();
+        cursor->offset = JOURNAL_START;
+        return NO_ERROR;
+    } else if (fd == -1) {
+        return LOAD_JOURNAL_ERROR;
+    }
+    error = read_header(fd, &header);
+    close(fd);
+    if (error != NO_ERROR)
+        return error;
+    cursor->generation = header.generation;
+    cursor->offset = header.committed;
+    return NO_ERROR;
+}
+
+/**
+ * Appends the records of the segment [fd] following [offset] to the
+ * data of [reader].
+ */
+static TagError read_records(
+        JournalReader *reader,
+        int fd,
+        const struct JournalHeader *header,
+        uint64_t offset)
+{
+    if (offset < JOURNAL_START || offset > header->committed)
+        return JOURNAL_CURSOR_LOST;
+    size_t size = header->committed - offset;
+    char *data = realloc(reader->data, reader->size + size + 1);
+    if (data == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    reader->data = data;
+    ssize_t rc = pread(fd, reader->data + reader->size, size, offset);
+    if (rc == -1)
+        return LOAD_JOURNAL_ERROR;
+    else if (rc != size)
+        return INVALID_JOURNAL_FILE;
+    reader->size += size;
+    return NO_ERROR;
+}
+
+TagError open_journal_reader(JournalReader *reader, const JournalCursor *from)
+{
+    assert(reader != NULL);
+    assert(from != NULL);
+
+    memset(reader, 0, sizeof(*reader));
+    reader->cursor = *from;
+    if (reader->cursor.generation == 0) {
+        reader->cursor.generation = 1;
+        reader->cursor.offset = JOURNAL_START;
+    }
+
+    /* Prevent a rotation between the reads of the two segments.  */
+    int lock_fd = lock_file(JOURNAL_FILE);
+    if (lock_fd == -1)
+        return LOAD_JOURNAL_ERROR;
+
+    TagError error = NO_ERROR;
+    struct JournalHeader header;
+    struct JournalHeader old_header;
+    int old_fd = -1;
+    int fd = open_segment(JOURNAL_FILE, &header, &error);
+    if (fd == -1 && error == LOAD_JOURNAL_ERROR && errno == ENOENT) {
+        /* An empty segment: the next one to be created.  */
+        header.generation = next_generation();
+        header.committed = JOURNAL_START;
+        error = NO_ERROR;
+    } else if (fd == -1) {
+        goto FREE_RESOURCES;
+    }
+
+    JournalCursor *cursor = &reader->cursor;
+    if (cursor->generation + 1 == header.generation) {
+        char old_filename[strlen(JOURNAL_FILE) + sizeof(JOURNAL_OLD_SUFFIX)];
+        old_segment_path(old_filename, sizeof(old_filename));
+        old_fd = open_segment(old_filename, &old_header, &error);
+        if (old_fd == -1 && error == LOAD_JOURNAL_ERROR && errno == ENOENT) {
+            error = JOURNAL_CURSOR_LOST;
+            goto FREE_RESOURCES;
+        } else if (old_fd == -1) {
+            goto FREE_RESOURCES;
+        } else if (old_header.generation != cursor->generation) {
+            error = JOURNAL_CURSOR_LOST;
+            goto FREE_RESOURCES;
+        }
+        if ((error = read_records(reader, old_fd, &old_header,
+                        cursor->offset)) != NO_ERROR)
+            goto FREE_RESOURCES;
+        if (reader->size > 0) {
+            reader->boundary = reader->size;
+        } else {
+            cursor->generation = header.generation;
+            cursor->offset = JOURNAL_START;
+        }
+        if (fd != -1 && (error = read_records(reader, fd, &header,
+                        JOURNAL_START)) != NO_ERROR)
+            goto FREE_RESOURCES;
+    } else if (cursor->generation == header.generation) {
+        if (fd != -1 && (error = read_records(reader, fd, &header,
+                        cursor->offset)) != NO_ERROR)
+            goto FREE_RESOURCES;
+        else if (fd == -1 && cursor->offset != JOURNAL_START)
+            error = JOURNAL_CURSOR_LOST;
+    } else {
+        error = JOURNAL_CURSOR_LOST;
+    }
+
+FREE_RESOURCES:;
+    int errno_save = errno;
+    if (old_fd != -1)
+        close(old_fd);
+    if (fd != -1)
+        close(fd);
+    close(lock_fd);
+    if (error != NO_ERROR)
+        close_journal_reader(reader);
+    errno = errno_save;
+    return error;
+}
+
+TagError journal_next(
+        JournalReader *reader,
+        JournalRecord *record,
+        bool *found)
+{
+    assert(reader != NULL);
+    assert(record != NULL);
+    assert(found != NULL);
+
+    *found = false;
+    if (reader->position == reader->size)
+        return NO_ERROR;
+
+    struct JournalRecordHeader header;
+    size_t remaining = reader->size - reader->position;
+    if (remaining < sizeof(header))
+        return INVALID_JOURNAL_FILE;
+    char *data = reader->data + reader->position;
+    memcpy(&header, data, sizeof(header));
+    if (header.size > remaining
+            || header.size < sizeof(header) + header.path_len + header.tag_len
+            || header.path_len == 0 || header.tag_len == 0
+            || data[sizeof(header) + header.path_len - 1] != '\0'
+            || data[sizeof(header) + header.path_len + header.tag_len - 1])
+        return INVALID_JOURNAL_FILE;
+
+    record->timestamp = header.timestamp;
+    record->dev = header.dev;
+    record->ino = header.ino;
+    record->op = header.op;
+    record->path = data + sizeof(header);
+    record->tag = record->path + header.path_len;
+    *found = true;
+
+    reader->position += header.size;
+    if (reader->boundary > 0 && reader->position >= reader->boundary) {
+        reader->cursor.generation++;
+        reader->cursor.offset =
+            JOURNAL_START + reader->position - reader->boundary;
+        reader->boundary = 0;
+    } else {
+        reader->cursor.offset += header.size;
+    }
+    return NO_ERROR;
+}
+
+void close_journal_reader(JournalReader *reader)
+{
+    if (reader == NULL)
+        return;
+    free(reader->data);
+    reader->data = NULL;
+    reader->size = reader->position = reader->boundary = 0;
+}
@@ -0,0 +1,122 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "tag.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The changes recorded in the journal. The file operations record the
+ * path, device and inode of the tagged file, the tag operations those
+ * of the config file.
+ */
+typedef enum {
+    JOURNAL_ADD_TAG = 1,
+    JOURNAL_REMOVE_TAG = 2,
+    JOURNAL_CREATE_TAG = 3,
+    JOURNAL_DELETE_TAG = 4
+} JournalOp;
+
+/**
+ * A position in the journal. The journal is made of segments: when
+ * the current one is full it is renamed to JOURNAL_FILE.old and the
+ * next generation starts. The generation 0 designates the beginning
+ * of the first segment.
+ */
+typedef struct {
+    uint64_t generation;
+    uint64_t offset;
+} JournalCursor;
+
+/**
+ * A change of the journal. [timestamp] is in nanoseconds since the
+ * Epoch.
+ */
+typedef struct {
+    int64_t timestamp;
+    uint64_t dev;
+    uint64_t ino;
+    JournalOp op;
+    const char *path;
+    const char *tag;
+} JournalRecord;
+
+/**
+ * The records added by a command and not yet written to the journal.
+ */
+typedef struct {
+    PascalBuffer pending;
+} Journal;
+
+/**
+ * The records of the journal following a cursor, read at once.
+ * [cursor] is the position of the next record to be returned.
+ */
+typedef struct {
+    JournalCursor cursor;
+    char *data;
+    size_t size;
+    size_t position;
+    /* The records before [boundary] belong to the previous segment.  */
+    size_t boundary;
+} JournalReader;
+
+/**
+ * Adds [record] to the records of [journal] to be written by
+ * journal_commit(). [record->timestamp] is set if it is 0.
+ */
+void journal_add(Journal *journal, const JournalRecord *record);
+
+/**
+ * Adds the change [op] of the tag [tag] of the file [filename] open
+ * as [fd] to [journal]. Returns [false] if the file could not be
+ * identified.
+ */
+bool journal_add_file_change(
+        Journal *journal,
+        JournalOp op,
+        int fd,
+        const char *filename,
+        const char *tag);
+
+/**
+ * Appends the records added to [journal] to the journal file with a
+ * single write followed by a single flush to the disk, starting a new
+ * segment when the current one is full.
+ */
+TagError journal_commit(Journal *journal);
+
+void journal_free(Journal *journal);
+
+/**
+ * Commits the records of [journal], printing an error message if
+ * they could not be written, and frees [journal].
+ */
+bool journal_close(Journal *journal);
+
+/**
+ * Writes to [cursor] the position following the last record of the
+ * journal.
+ */
+TagError journal_end(JournalCursor *cursor);
+
+/**
+ * Opens [reader] on the records following [from]. Returns
+ * JOURNAL_CURSOR_LOST if they were removed by the rotation of the
+ * journal.
+ */
+TagError open_journal_reader(JournalReader *reader, const JournalCursor *from);
+
+/**
+ * Writes the next record of [reader] to [record], sets [*found] to
+ * [false] if there is none. The strings of [record] live as long as
+ * [reader].
+ */
+TagError journal_next(
+        JournalReader *reader,
+        JournalRecord *record,
+        bool *found);
+
+void close_journal_reader(JournalReader *reader);
+
+#endif
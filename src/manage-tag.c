@@ -1,11 +1,14 @@
 #include "../lib/cJSON.h"
 #include "tag.h"
+#include "journal.h"
 #include <linux/xattr.h>
+#include <sys/stat.h>
 #include <sys/xattr.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -58,7 +61,33 @@ static cJSON * new_tag(const char *tag, bool assignable)
 }
 
 /**
- * Adds the tag named [tag_name] to the parent tag [parent_obj].
+ * Records the change [op] of the tag [tag] in the journal.
+ */
+static bool journal_tag_change(JournalOp op, const char *tag)
+{
+    struct stat st;
+    if (stat(JSON_CONFIG_FILE, &st) == -1) {
+        fprintf(stderr, "Could not journal the change of '%s': %s\n",
+                tag, strerror(errno));
+        return false;
+    }
+    Journal journal = {0};
+    JournalRecord record = {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .op = op,
+        .path = JSON_CONFIG_FILE,
+        .tag = tag
+    };
+    journal_add(&journal, &record);
+    return journal_close(&journal);
+}
+
+/**
+ * Adds the tag named [tag_name] to the parent tag [parent_obj] and
+ * writes the config file.
+ * Returns [false] and sets [*error] if the tag could not be added or
+ * the file could not be written, [true] otherwise.
  */
 bool add_to_parent(
         const char *tag_name,
@@ -82,12 +111,15 @@ bool add_to_parent(
         return false;
 
     cJSON_AddItemToArray(children.json_tree, tag_obj);
-    write_config_file(JSON_CONFIG_FILE, root);
-    return true;
+    *error = write_config_file(JSON_CONFIG_FILE, root);
+    return *error == NO_ERROR;
 }
 
 /**
- * Adds the tag named [tag] to the TagsTree [tag_tree].
+ * Adds the tag named [tag] to the TagsTree [tag_tree] and writes the
+ * config file.
+ * Returns [false] and prints an error message if the file could not be
+ * written, [true] otherwise.
  */
 bool add_tag(const char *tag, TagsTree *tag_tree, bool assignable)
 {
@@ -102,12 +134,19 @@ bool add_tag(const char *tag, TagsTree *tag_tree, bool assignable)
     cJSON *root_array = tag_tree->json_tree;
     cJSON_AddItemToArray(root_array, tag_obj);
 
-    write_config_file(JSON_CONFIG_FILE, tag_tree);
+    TagError error = write_config_file(JSON_CONFIG_FILE, tag_tree);
+    if (error != NO_ERROR) {
+        print_tag_error(error);
+        return false;
+    }
     return true;
 }
 
 /**
- * Remove the tag named [tag] from the TagsTree [root].
+ * Remove the tag named [tag] from the TagsTree [root] and writes the
+ * config file.
+ * Returns [false] and prints an error message on failure, [true]
+ * otherwise.
  */
 bool remove_tag(const char *tag, TagsTree *root)
 {
@@ -145,7 +184,10 @@ bool remove_tag(const char *tag, TagsTree *root)
     }
 
     cJSON_Delete(tag_object.json_tree);
-    write_config_file(JSON_CONFIG_FILE, root);
+    if ((error = write_config_file(JSON_CONFIG_FILE, root)) != NO_ERROR) {
+        print_tag_error(error);
+        return false;
+    }
     return true;
 }
 
@@ -290,7 +332,9 @@ int main(int argc, char const *argv[])
                 fprintf(stderr, "Cannot remove inexistent tag '%s'\n", tag);
                 goto FREE_RESOURCES_ON_ERROR;
             }
-            remove_tag(tag, &root);
+            if (!remove_tag(tag, &root)
+                    || !journal_tag_change(JOURNAL_DELETE_TAG, tag))
+                goto FREE_RESOURCES_ON_ERROR;
             break;
 
         case 'A':
@@ -305,7 +349,9 @@ int main(int argc, char const *argv[])
                 fprintf(stderr, "Tag '%s' already exists\n", tag);
                 goto FREE_RESOURCES_ON_ERROR;
             }
-            add_tag(tag, &root, assignable);
+            if (!add_tag(tag, &root, assignable)
+                    || !journal_tag_change(JOURNAL_CREATE_TAG, tag))
+                goto FREE_RESOURCES_ON_ERROR;
             break;
 
         case 'P':
@@ -329,6 +375,8 @@ int main(int argc, char const *argv[])
                 print_tag_error(error);
                 goto FREE_RESOURCES_ON_ERROR;
             }
+            if (!journal_tag_change(JOURNAL_CREATE_TAG, tag))
+                goto FREE_RESOURCES_ON_ERROR;
             break;
 
         case 'l':
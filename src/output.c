@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include "output.h"
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void output_open(ResultOutput *output, const OutputOptions *options)
+{
+    assert(output != NULL);
+    assert(options != NULL);
+    assert(options->exec_args == NULL || options->nb_exec_args > 0);
+
+    memset(output, 0, sizeof(*output));
+    pthread_mutex_init(&output->lock, NULL);
+    output->options = *options;
+    /* Like find, show the paths as they are found on a terminal.  */
+    output->interactive = isatty(STDOUT_FILENO);
+    extends_buffer(&output->buffer, options->exec_args != NULL
+            ? OUTPUT_EXEC_ARGS_SIZE : OUTPUT_BUFFER_SIZE);
+    if (options->top > 0) {
+        output->ranked = malloc(options->top * sizeof(RankedPath));
+        if (output->ranked == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Writes the buffered paths of [output] to the standard output. Once
+ * a write failed, the paths are dropped.
+ */
+static void write_buffer(ResultOutput *output)
+{
+    const char *pos = output->buffer.str;
+    size_t left = output->buffer.str_length;
+    while (left > 0 && output->write_error == 0) {
+        ssize_t written = write(STDOUT_FILENO, pos, left);
+        if (written >= 0) {
+            pos += written;
+            left -= written;
+        } else if (errno != EINTR) {
+            output->write_error = errno;
+        }
+    }
+    output->buffer.str_length = 0;
+}
+
+/**
+ * Runs the command of [output] with the buffered paths as its last
+ * arguments and waits for it to exit.
+ */
+static void run_command(ResultOutput *output)
+{
+    if (output->nb_paths == 0)
+        return;
+    const OutputOptions *options = &output->options;
+    size_t nb_args = options->nb_exec_args + output->nb_paths;
+    char **argv = malloc((nb_args + 1) * sizeof(char *));
+    if (argv == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < options->nb_exec_args; i++)
+        argv[i] = (char *) options->exec_args[i];
+    char *path = output->buffer.str;
+    for (size_t i = options->nb_exec_args; i < nb_args; i++) {
+        argv[i] = path;
+        path += strlen(path) + 1;
+    }
+    argv[nb_args] = NULL;
+
+    /* tagsysd ignores SIGPIPE, which the command would inherit.  */
+    posix_spawnattr_t attr;
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    fflush(stdout);
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (error != 0) {
+        fprintf(stderr, "Could not run '%s': %s\n", argv[0], strerror(error));
+        output->exec_failed = true;
+    } else {
+        int status;
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                status = EXIT_FAILURE << 8;
+                break;
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            output->exec_failed = true;
+    }
+    free(argv);
+    output->buffer.str_length = 0;
+    output->nb_paths = 0;
+}
+
+/**
+ * Outputs the path [path] of [len] chars through [output], whose lock
+ * is held, unless the limit is reached.
+ */
+static void emit_path(ResultOutput *output, const char *path, size_t len)
+{
+    const OutputOptions *options = &output->options;
+    PascalBuffer *buffer = &output->buffer;
+    if (options->limit > 0 && output->nb_output >= options->limit)
+        return;
+    output->nb_output++;
+    if (options->exec_args != NULL) {
+        if (buffer->str_length + len + 1 > OUTPUT_EXEC_ARGS_SIZE)
+            run_command(output);
+        /* The null byte ending the path separates the arguments.  */
+        append_str_to_buffer(buffer, path, len);
+        buffer->str_length++;
+        output->nb_paths++;
+    } else {
+        append_str_to_buffer(buffer, path, len);
+        buffer->str[buffer->str_length++] = options->separator;
+        if (output->interactive || buffer->str_length >= OUTPUT_BUFFER_SIZE)
+            write_buffer(output);
+    }
+}
+
+/**
+ * Compares two RankedPath by decreasing key, then by path so that the
+ * paths kept do not depend on the order in which they are found.
+ */
+static int compare_ranked(const void *a, const void *b)
+{
+    const RankedPath *ranked_a = a;
+    const RankedPath *ranked_b = b;
+    if (ranked_a->key != ranked_b->key)
+        return (ranked_a->key < ranked_b->key)
+            - (ranked_a->key > ranked_b->key);
+    return strcmp(ranked_a->path, ranked_b->path);
+}
+
+/**
+ * Restores the order of the heap of [output] from the position [i],
+ * whose path may rank higher than its children.
+ */
+static void sift_down(ResultOutput *output, size_t i)
+{
+    RankedPath *heap = output->ranked;
+    for (;;) {
+        size_t lowest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < output->nb_ranked
+                && compare_ranked(&heap[left], &heap[lowest]) > 0)
+            lowest = left;
+        if (right < output->nb_ranked
+                && compare_ranked(&heap[right], &heap[lowest]) > 0)
+            lowest = right;
+        if (lowest == i)
+            return;
+        RankedPath tmp = heap[i];
+        heap[i] = heap[lowest];
+        heap[lowest] = tmp;
+        i = lowest;
+    }
+}
+
+/**
+ * Keeps the path [path] of key [key] in the heap of [output], whose
+ * lock is held, if it ranks among the top ones. The heap never holds
+ * more than [top] paths.
+ */
+static void rank_path(ResultOutput *output, const char *path, int64_t key)
+{
+    RankedPath *heap = output->ranked;
+    RankedPath candidate = { .key = key, .path = (char *) path };
+    if (output->nb_ranked == output->options.top) {
+        if (compare_ranked(&candidate, &heap[0]) >= 0)
+            return;
+        free(heap[0].path);
+        heap[0] = candidate;
+        heap[0].path = strdup(path);
+        if (heap[0].path == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        sift_down(output, 0);
+        return;
+    }
+
+    size_t i = output->nb_ranked++;
+    candidate.path = strdup(path);
+    if (candidate.path == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    while (i > 0 && compare_ranked(&candidate, &heap[(i - 1) / 2]) > 0) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = candidate;
+}
+
+bool output_path(ResultOutput *output, const char *path, int64_t key)
+{
+    assert(output != NULL);
+    assert(path != NULL);
+
+    pthread_mutex_lock(&output->lock);
+    if (output->options.top > 0)
+        rank_path(output, path, key);
+    else
+        emit_path(output, path, strlen(path));
+    bool success = output->write_error == 0;
+    pthread_mutex_unlock(&output->lock);
+    return success;
+}
+
+bool output_done(ResultOutput *output)
+{
+    assert(output != NULL);
+
+    pthread_mutex_lock(&output->lock);
+    bool done = output->write_error != 0 || (output->options.limit > 0
+            && output->nb_output >= output->options.limit);
+    pthread_mutex_unlock(&output->lock);
+    return done;
+}
+
+bool output_close(ResultOutput *output)
+{
+    assert(output != NULL);
+
+    qsort(output->ranked, output->nb_ranked, sizeof(RankedPath),
+            compare_ranked);
+    for (size_t i = 0; i < output->nb_ranked; i++) {
+        emit_path(output, output->ranked[i].path,
+                strlen(output->ranked[i].path));
+        free(output->ranked[i].path);
+    }
+    free(output->ranked);
+    if (output->options.exec_args != NULL)
+        run_command(output);
+    else
+        write_buffer(output);
+    /* Like a process killed by SIGPIPE, say nothing to a closed pipe.  */
+    if (output->write_error != 0 && output->write_error != EPIPE)
+        fprintf(stderr, "Could not write the results: %s\n",
+                strerror(output->write_error));
+    bool success = output->write_error == 0 && !output->exec_failed;
+    pthread_mutex_destroy(&output->lock);
+    free(output->buffer.str);
+    memset(output, 0, sizeof(*output));
+    return success;
+}
@@ -0,0 +1,106 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "tag.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The paths are written to the standard output by blocks of this
+ * size, rather than one write(2) per path.
+ */
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+/*
+ * The total size of the paths given to one run of the command of
+ * --exec, as xargs(1) does by default, well below the limit of
+ * execve(2) for the arguments and the environment.
+ */
+#define OUTPUT_EXEC_ARGS_SIZE (128 * 1024)
+
+/**
+ * How the paths found by a search are output: each one followed by
+ * [separator] or, if [exec_args] is not NULL, given to the command
+ * made of the [nb_exec_args] arguments [exec_args]. Only the first
+ * [limit] paths are output, unless [limit] is 0. If [top] is not 0,
+ * only the [top] paths of highest key are kept, and output by
+ * decreasing key once all the paths are known.
+ */
+typedef struct {
+    char separator;
+    const char **exec_args;
+    int nb_exec_args;
+    size_t limit;
+    size_t top;
+} OutputOptions;
+
+/**
+ * A path kept by a ResultOutput with its key [key].
+ */
+typedef struct {
+    int64_t key;
+    char *path;
+} RankedPath;
+
+/**
+ * Where the paths found by a search go, shared by all the workers of
+ * a walk, according to [options]. The paths are written to the
+ * standard output through the buffer [buffer], which is flushed after
+ * each path when [interactive] is set because the standard output is
+ * a terminal, or, with exec_args, collected in [buffer], [nb_paths] at
+ * a time, to be the last arguments of the command, like
+ * "find -exec {} +". [nb_output]
+ * counts the paths output so far. With top, [ranked] is a heap of the
+ * [nb_ranked] paths of highest key, the lowest one first.
+ * [write_error] is the errno value of the first failed write, 0 if
+ * none failed, and [exec_failed] is set once a run of the command
+ * failed.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    OutputOptions options;
+    PascalBuffer buffer;
+    size_t nb_paths;
+    size_t nb_output;
+    RankedPath *ranked;
+    size_t nb_ranked;
+    int write_error;
+    bool exec_failed;
+    bool interactive;
+} ResultOutput;
+
+/**
+ * Prepares [output] to output paths according to [options].
+ */
+void output_open(ResultOutput *output, const OutputOptions *options);
+
+/**
+ * Adds the path [path] to [output], writing the buffered paths or
+ * running the command when the buffer is full. With the top option,
+ * the path is only kept if its key [key] is among the highest ones,
+ * [key] being ignored otherwise. May be called by several threads at
+ * once.
+ * Returns [false] if the output failed, now or before, [true]
+ * otherwise.
+ */
+bool output_path(ResultOutput *output, const char *path, int64_t key);
+
+/**
+ * Returns [true] if [output] takes no more paths, because the limit
+ * is reached or a write failed, so that the search can stop.
+ */
+bool output_done(ResultOutput *output);
+
+/**
+ * Outputs the paths kept for the top option, writes the remaining
+ * paths of [output] or runs the command with them, and frees
+ * [output]. An error message is printed if a write failed, except
+ * when the reader of the output went away.
+ * Returns [false] if a write or a run of the command failed, [true]
+ * otherwise.
+ */
+bool output_close(ResultOutput *output);
+
+#endif
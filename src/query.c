@@ -0,0 +1,1112 @@
+#define _GNU_SOURCE
+#include "query.h"
+#include <assert.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The maximum nesting of parentheses and negations in an expression,
+ * which are parsed recursively.
+ */
+#define QUERY_MAX_DEPTH 256
+
+/*
+ * The number of seeds tried for a bucket of the perfect hash table
+ * before the table is made larger.
+ */
+#define MAX_BUCKET_SEEDS 4096
+
+/* The characters which are tokens on their own.  */
+#define QUERY_OPERATORS "()|&!"
+
+typedef enum {
+    TOKEN_END = 0,
+    TOKEN_WORD = 1,
+    TOKEN_OPEN = 2,
+    TOKEN_CLOSE = 3,
+    TOKEN_OR = 4,
+    TOKEN_AND = 5,
+    TOKEN_NOT = 6,
+    TOKEN_PLUS = 7
+} TokenKind;
+
+/**
+ * The state of the parser: the [nb_args] arguments [args] being read,
+ * the position [pos] in the argument [arg], the current token of kind
+ * [kind], which is the word [word] of [word_len] bytes for TOKEN_WORD,
+ * whether it is a '+' or '_' glued to the next token [after_sign],
+ * and the nesting [depth] of the expression being parsed.
+ */
+typedef struct {
+    const char **args;
+    int nb_args;
+    int arg;
+    const char *pos;
+    TokenKind kind;
+    const char *word;
+    size_t word_len;
+    bool after_sign;
+    int depth;
+    TagQuery *query;
+    size_t groups_capacity;
+} QueryParser;
+
+static void *checked_realloc(void *ptr, size_t size)
+{
+    void *rc = realloc(ptr, size);
+    if (rc == NULL && size > 0) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return rc;
+}
+
+void free_tag_query(TagQuery *query)
+{
+    assert(query != NULL);
+    for (size_t i = 0; i < query->nb_extra_tags; i++)
+        free(query->extra_tags[i]);
+    free(query->extra_tags);
+    free(query->groups);
+    free(query->spans);
+    free(query->nodes);
+    free(query->steps);
+    memset(query, 0, sizeof(*query));
+}
+
+/**
+ * Reads the next token of [parser]. A leading '+' or '_' is a token
+ * of its own, so that "+tag" and "_tag" stand for the tag and its
+ * negation, and the word glued to it is a name even if it starts with
+ * '+' or '_'.
+ */
+static void next_token(QueryParser *parser)
+{
+    for (;;) {
+        if (parser->pos == NULL) {
+            if (parser->arg >= parser->nb_args) {
+                parser->kind = TOKEN_END;
+                return;
+            }
+            parser->pos = parser->args[parser->arg++];
+        }
+        while (*parser->pos == ' ' || *parser->pos == '\t'
+                || *parser->pos == '\n')
+            parser->pos++;
+        if (*parser->pos != '\0')
+            break;
+        parser->pos = NULL;
+    }
+
+    const char *pos = parser->pos;
+    bool after_sign = parser->after_sign;
+    parser->after_sign = false;
+    switch (*pos) {
+        case '(': parser->kind = TOKEN_OPEN; break;
+        case ')': parser->kind = TOKEN_CLOSE; break;
+        case '|': parser->kind = TOKEN_OR; break;
+        case '&': parser->kind = TOKEN_AND; break;
+        case '!': parser->kind = TOKEN_NOT; break;
+        case '_': parser->kind = TOKEN_NOT; break;
+        case '+': parser->kind = TOKEN_PLUS; break;
+        default: parser->kind = TOKEN_WORD; break;
+    }
+    /* As with the legacy syntax, the name following a sign may start
+     * with one: "+__tag" is the tag "__tag".  */
+    if (after_sign && (*pos == '_' || *pos == '+'))
+        parser->kind = TOKEN_WORD;
+    if (parser->kind != TOKEN_WORD) {
+        parser->after_sign = (*pos == '_' || *pos == '+')
+            && pos[1] != '\0' && strchr(" \t\n", pos[1]) == NULL;
+        parser->pos++;
+        return;
+    }
+    parser->word = pos;
+    parser->word_len = strcspn(pos, " \t\n" QUERY_OPERATORS);
+    parser->pos += parser->word_len;
+}
+
+/**
+ * Returns the text of the current token of [parser] for the error
+ * messages.
+ */
+static const char *token_name(const QueryParser *parser)
+{
+    switch (parser->kind) {
+        case TOKEN_END: return "end of expression";
+        case TOKEN_OPEN: return "'('";
+        case TOKEN_CLOSE: return "')'";
+        case TOKEN_OR: return "'|'";
+        case TOKEN_AND: return "'&'";
+        case TOKEN_NOT: return "'!'";
+        case TOKEN_PLUS: return "'+'";
+        default: return "tag";
+    }
+}
+
+/**
+ * Adds a node to the syntax tree of [query]. Returns its index.
+ */
+static size_t add_node(
+        TagQuery *query,
+        QueryOp op,
+        size_t group,
+        size_t left,
+        size_t right)
+{
+    query->nodes = checked_realloc(query->nodes,
+            (query->nb_nodes + 1) * sizeof(*query->nodes));
+    query->nodes[query->nb_nodes] = (QueryNode) {
+        .op = op, .group = group, .left = left, .right = right
+    };
+    return query->nb_nodes++;
+}
+
+/**
+ * Returns the group of the tag named by the current token of [parser],
+ * creating it if the expression did not already use the tag. The group
+ * holds the numbers of the tag and of its descendants, or only the one
+ * of the tag if it is missing from the config.
+ */
+static size_t tag_group(QueryParser *parser)
+{
+    TagQuery *query = parser->query;
+    const TagHierarchy *hierarchy = query->hierarchy;
+    char *name = strndup(parser->word, parser->word_len);
+    if (name == NULL) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    int number = tag_hierarchy_find(hierarchy, name);
+    if (number >= 0) {
+        free(name);
+    } else {
+        /* Files keep the tags removed from the config.  */
+        size_t i = 0;
+        while (i < query->nb_extra_tags
+                && strcmp(query->extra_tags[i], name) != 0)
+            i++;
+        if (i == query->nb_extra_tags) {
+            query->extra_tags = checked_realloc(query->extra_tags,
+                    (i + 1) * sizeof(char *));
+            query->extra_tags[query->nb_extra_tags++] = name;
+        } else {
+            free(name);
+        }
+        number = hierarchy->nb_tags + i;
+    }
+
+    for (size_t i = 0; i < query->nb_groups; i++) {
+        if (query->groups[i].first == (uint32_t) number)
+            return i;
+    }
+    if (query->nb_groups == parser->groups_capacity) {
+        parser->groups_capacity = 2 * parser->groups_capacity + 4;
+        query->groups = checked_realloc(query->groups,
+                parser->groups_capacity * sizeof(QueryGroup));
+    }
+    query->groups[query->nb_groups] = (QueryGroup) {
+        .first = number,
+        .end = (size_t) number < hierarchy->nb_tags
+            ? hierarchy->ends[number] : (uint32_t) number + 1
+    };
+    return query->nb_groups++;
+}
+
+static bool parse_or(QueryParser *parser, size_t *node);
+
+/**
+ * Parses a tag, a negation or an expression between parentheses and
+ * writes its node to [*node].
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool parse_unary(QueryParser *parser, size_t *node)
+{
+    if (parser->depth >= QUERY_MAX_DEPTH) {
+        fprintf(stderr, "Invalid search expression: nested too deeply\n");
+        return false;
+    }
+    size_t child, group;
+    bool success = true;
+    parser->depth++;
+    switch (parser->kind) {
+        case TOKEN_WORD:
+            group = tag_group(parser);
+            *node = add_node(parser->query, QUERY_TAG, group, 0, 0);
+            next_token(parser);
+            break;
+        case TOKEN_PLUS:
+            next_token(parser);
+            success = parse_unary(parser, node);
+            break;
+        case TOKEN_NOT:
+            next_token(parser);
+            if ((success = parse_unary(parser, &child)))
+                *node = add_node(parser->query, QUERY_NOT, 0, child, 0);
+            break;
+        case TOKEN_OPEN:
+            next_token(parser);
+            if (!(success = parse_or(parser, node)))
+                break;
+            if (parser->kind != TOKEN_CLOSE) {
+                fprintf(stderr, "Invalid search expression: expected ')' "
+                        "instead of %s\n", token_name(parser));
+                success = false;
+                break;
+            }
+            next_token(parser);
+            break;
+        default:
+            fprintf(stderr, "Invalid search expression: expected a tag "
+                    "instead of %s\n", token_name(parser));
+            success = false;
+    }
+    parser->depth--;
+    return success;
+}
+
+/**
+ * Parses a conjunction, whose operands may be separated by '&' or
+ * simply follow each other, and writes its node to [*node].
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool parse_and(QueryParser *parser, size_t *node)
+{
+    if (!parse_unary(parser, node))
+        return false;
+    for (;;) {
+        if (parser->kind == TOKEN_AND)
+            next_token(parser);
+        else if (parser->kind != TOKEN_WORD && parser->kind != TOKEN_NOT
+                && parser->kind != TOKEN_PLUS && parser->kind != TOKEN_OPEN)
+            return true;
+        size_t right;
+        if (!parse_unary(parser, &right))
+            return false;
+        *node = add_node(parser->query, QUERY_AND, 0, *node, right);
+    }
+}
+
+/**
+ * Parses a disjunction of conjunctions and writes its node to [*node].
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool parse_or(QueryParser *parser, size_t *node)
+{
+    if (!parse_and(parser, node))
+        return false;
+    while (parser->kind == TOKEN_OR) {
+        next_token(parser);
+        size_t right;
+        if (!parse_and(parser, &right))
+            return false;
+        *node = add_node(parser->query, QUERY_OR, 0, *node, right);
+    }
+    return true;
+}
+
+/**
+ * Adds a step to the plan of [query]. Returns its index.
+ */
+static int add_step(TagQuery *query, size_t group, int on_match,
+        int on_mismatch)
+{
+    /* Each tag of the syntax tree makes one step.  */
+    assert(query->nb_steps < query->nb_nodes);
+    /* tag_query_may_match() relies on the steps leading backwards.  */
+    assert(on_match < (int) query->nb_steps);
+    assert(on_mismatch < (int) query->nb_steps);
+    query->steps[query->nb_steps] = (QueryStep) {
+        .group = group, .on_match = on_match, .on_mismatch = on_mismatch
+    };
+    return query->nb_steps++;
+}
+
+/**
+ * Compiles the node [node] of [query] into steps leading to the step
+ * [on_true] if it holds, to [on_false] otherwise. Returns the first
+ * step. The left operands are compiled iteratively, so that the long
+ * chains built by the parser do not nest calls.
+ */
+static int compile_node(TagQuery *query, size_t node, int on_true,
+        int on_false)
+{
+    for (;;) {
+        const QueryNode *current = &query->nodes[node];
+        int tmp;
+        switch (current->op) {
+            case QUERY_TAG:
+                return add_step(query, current->group, on_true, on_false);
+            case QUERY_NOT:
+                tmp = on_true;
+                on_true = on_false;
+                on_false = tmp;
+                break;
+            case QUERY_AND:
+                on_true = compile_node(query, current->right,
+                        on_true, on_false);
+                break;
+            case QUERY_OR:
+                on_false = compile_node(query, current->right,
+                        on_true, on_false);
+                break;
+        }
+        node = current->left;
+    }
+}
+
+static int compare_groups(const void *a, const void *b, void *arg)
+{
+    const QueryGroup *groups = arg;
+    uint32_t first_a = groups[*(const size_t *) a].first;
+    uint32_t first_b = groups[*(const size_t *) b].first;
+    return (first_a > first_b) - (first_a < first_b);
+}
+
+/**
+ * Gives an identifier to each distinct tag of the groups of [query].
+ * Two ranges of a depth-first numbering are either nested or disjoint,
+ * so the groups sorted by their first number make spans, each one
+ * starting with a group which is not nested in the previous span and
+ * holding the groups nested in it. The tags of a span get consecutive
+ * identifiers, and so do the tags of each of its groups.
+ */
+static void number_query_tags(TagQuery *query)
+{
+    size_t nb_groups = query->nb_groups;
+    size_t *order = checked_realloc(NULL, nb_groups * sizeof(size_t));
+    for (size_t i = 0; i < nb_groups; i++)
+        order[i] = i;
+    qsort_r(order, nb_groups, sizeof(size_t), compare_groups, query->groups);
+
+    query->spans = checked_realloc(NULL, nb_groups * sizeof(QuerySpan));
+    for (size_t i = 0; i < nb_groups; i++) {
+        QueryGroup *group = &query->groups[order[i]];
+        QuerySpan *span = query->nb_spans > 0
+            ? &query->spans[query->nb_spans - 1] : NULL;
+        if (span == NULL || group->first >= span->end) {
+            span = &query->spans[query->nb_spans++];
+            *span = (QuerySpan) {
+                .first = group->first, .end = group->end, .id = query->nb_tags
+            };
+            query->nb_tags += group->end - group->first;
+        }
+        group->id = span->id + (group->first - span->first);
+    }
+    query->nb_words = (nb_groups + 63) / 64;
+    free(order);
+}
+
+/**
+ * Returns the FNV-1a hash of [name] for the seed [seed], whose bits
+ * are mixed so that its low bits can index a table.
+ */
+static uint64_t hash_name(const char *name, uint64_t seed)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325)
+        ^ (seed * UINT64_C(0x9e3779b97f4a7c15));
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Tries to place the [nb_ids] tags [ids] of a bucket in the free slots
+ * of the hash table of [hierarchy] given by the seed [seed]. Returns
+ * [false], leaving the table unchanged, if two of them collide.
+ */
+static bool place_bucket(
+        TagHierarchy *hierarchy,
+        const uint32_t *ids,
+        size_t nb_ids,
+        uint32_t seed)
+{
+    for (size_t i = 0; i < nb_ids; i++) {
+        size_t slot = hash_name(hierarchy->names[ids[i]], seed + 1)
+            & hierarchy->slot_mask;
+        if (hierarchy->slots[slot] != -1) {
+            while (i-- > 0)
+                hierarchy->slots[hash_name(hierarchy->names[ids[i]],
+                        seed + 1) & hierarchy->slot_mask] = -1;
+            return false;
+        }
+        hierarchy->slots[slot] = ids[i];
+    }
+    return true;
+}
+
+/**
+ * The bucket [buckets[i]] of each tag [i] while the hash table is
+ * built, and the size of each bucket.
+ */
+typedef struct {
+    const size_t *buckets;
+    const size_t *bucket_sizes;
+} BucketOrder;
+
+/**
+ * Compares two tags of a BucketOrder given as [arg], the tags of the
+ * largest buckets coming first, grouped by bucket.
+ */
+static int compare_buckets(const void *a, const void *b, void *arg)
+{
+    const BucketOrder *order = arg;
+    size_t bucket_a = order->buckets[*(const uint32_t *) a];
+    size_t bucket_b = order->buckets[*(const uint32_t *) b];
+    size_t size_a = order->bucket_sizes[bucket_a];
+    size_t size_b = order->bucket_sizes[bucket_b];
+    if (size_a != size_b)
+        return (size_a < size_b) - (size_a > size_b);
+    return (bucket_a > bucket_b) - (bucket_a < bucket_b);
+}
+
+/**
+ * Builds the perfect hash table of the [nb_tags] tags [ids] of
+ * [hierarchy]: the tags are spread in buckets by a first hash, and
+ * each bucket gets the seed of a second hash placing its tags in
+ * distinct slots of a table at most half full. The largest buckets
+ * are placed first, while most slots are still free.
+ */
+static void build_tag_table(
+        TagHierarchy *hierarchy,
+        uint32_t *ids,
+        size_t nb_tags)
+{
+    size_t nb_slots = 1;
+    while (nb_slots < 2 * nb_tags)
+        nb_slots *= 2;
+    hierarchy->nb_buckets = nb_tags / 4 + 1;
+    hierarchy->seeds = calloc(hierarchy->nb_buckets, sizeof(uint32_t));
+    size_t *buckets = calloc(hierarchy->nb_tags + 1, sizeof(size_t));
+    size_t *bucket_sizes = calloc(hierarchy->nb_buckets, sizeof(size_t));
+    if (hierarchy->seeds == NULL || buckets == NULL || bucket_sizes == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nb_tags; i++) {
+        buckets[ids[i]] = hash_name(hierarchy->names[ids[i]], 0)
+            % hierarchy->nb_buckets;
+        bucket_sizes[buckets[ids[i]]]++;
+    }
+    BucketOrder order = { .buckets = buckets, .bucket_sizes = bucket_sizes };
+    qsort_r(ids, nb_tags, sizeof(uint32_t), compare_buckets, &order);
+
+    bool built = false;
+    while (!built) {
+        hierarchy->slot_mask = nb_slots - 1;
+        hierarchy->slots = checked_realloc(hierarchy->slots,
+                nb_slots * sizeof(int32_t));
+        memset(hierarchy->slots, -1, nb_slots * sizeof(int32_t));
+        built = true;
+        for (size_t i = 0; i < nb_tags && built;) {
+            size_t bucket = buckets[ids[i]];
+            size_t size = bucket_sizes[bucket];
+            uint32_t seed = 0;
+            while (seed < MAX_BUCKET_SEEDS
+                    && !place_bucket(hierarchy, &ids[i], size, seed))
+                seed++;
+            hierarchy->seeds[bucket] = seed;
+            built = seed < MAX_BUCKET_SEEDS;
+            i += size;
+        }
+        nb_slots *= 2;
+    }
+    free(bucket_sizes);
+    free(buckets);
+}
+
+/**
+ * The state of build_tag_hierarchy(): the names of the tags numbered so
+ * far are at the offsets [offsets] of [strings], which has room for
+ * [capacity] tags.
+ */
+typedef struct {
+    TagHierarchy *hierarchy;
+    PascalBuffer strings;
+    size_t *offsets;
+    size_t capacity;
+} HierarchyBuilder;
+
+/**
+ * Numbers the tags of the array [tags] of the config and their
+ * descendants, each tag being followed by its descendants.
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool number_tags(HierarchyBuilder *builder, const TagsTree *tags)
+{
+    TagHierarchy *hierarchy = builder->hierarchy;
+    bool success = true;
+    TagError error;
+    cJSON *child = NULL;
+    cJSON_ArrayForEach(child, tags->json_tree) {
+        TagsTree tag = { .json_tree = child };
+        TagsTree children;
+        const char *name;
+        if ((error = get_name(&tag, &name)) != NO_ERROR
+                || (error = get_children_array(&tag, &children))
+                != NO_ERROR) {
+            print_tag_error(error);
+            success = false;
+            continue;
+        }
+        if (hierarchy->nb_tags == builder->capacity) {
+            builder->capacity = 2 * builder->capacity + 16;
+            builder->offsets = checked_realloc(builder->offsets,
+                    builder->capacity * sizeof(size_t));
+            hierarchy->ends = checked_realloc(hierarchy->ends,
+                    builder->capacity * sizeof(uint32_t));
+        }
+        size_t number = hierarchy->nb_tags++;
+        builder->offsets[number] = builder->strings.str_length;
+        append_str_to_buffer(&builder->strings, name, strlen(name) + 1);
+        success = number_tags(builder, &children) && success;
+        hierarchy->ends[number] = hierarchy->nb_tags;
+    }
+    return success;
+}
+
+static int compare_names(const void *a, const void *b, void *arg)
+{
+    const char **names = arg;
+    uint32_t id_a = *(const uint32_t *) a;
+    uint32_t id_b = *(const uint32_t *) b;
+    int cmp = strcmp(names[id_a], names[id_b]);
+    if (cmp != 0)
+        return cmp;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+bool build_tag_hierarchy(const TagsTree *root, TagHierarchy *hierarchy)
+{
+    assert(root != NULL);
+    assert(hierarchy != NULL);
+
+    memset(hierarchy, 0, sizeof(*hierarchy));
+    HierarchyBuilder builder = { .hierarchy = hierarchy };
+    bool success = number_tags(&builder, root);
+    size_t nb_tags = hierarchy->nb_tags;
+    hierarchy->strings = builder.strings.str;
+    hierarchy->names = checked_realloc(NULL, nb_tags * sizeof(char *));
+    for (size_t i = 0; i < nb_tags; i++)
+        hierarchy->names[i] = hierarchy->strings + builder.offsets[i];
+    free(builder.offsets);
+
+    /* Only the first place of a name given twice goes to the table.  */
+    uint32_t *ids = checked_realloc(NULL, nb_tags * sizeof(uint32_t));
+    for (size_t i = 0; i < nb_tags; i++)
+        ids[i] = i;
+    qsort_r(ids, nb_tags, sizeof(uint32_t), compare_names, hierarchy->names);
+    size_t nb_distinct = 0;
+    for (size_t i = 0; i < nb_tags; i++) {
+        if (nb_distinct == 0 || strcmp(hierarchy->names[ids[i]],
+                    hierarchy->names[ids[nb_distinct - 1]]) != 0)
+            ids[nb_distinct++] = ids[i];
+    }
+    build_tag_table(hierarchy, ids, nb_distinct);
+    free(ids);
+    if (!success)
+        free_tag_hierarchy(hierarchy);
+    return success;
+}
+
+void free_tag_hierarchy(TagHierarchy *hierarchy)
+{
+    assert(hierarchy != NULL);
+    free(hierarchy->strings);
+    free(hierarchy->names);
+    free(hierarchy->ends);
+    free(hierarchy->slots);
+    free(hierarchy->seeds);
+    memset(hierarchy, 0, sizeof(*hierarchy));
+}
+
+int tag_hierarchy_find(const TagHierarchy *hierarchy, const char *name)
+{
+    assert(hierarchy != NULL);
+    assert(name != NULL);
+
+    if (hierarchy->nb_tags == 0)
+        return -1;
+    uint32_t seed = hierarchy->seeds[hash_name(name, 0)
+        % hierarchy->nb_buckets];
+    int32_t id = hierarchy->slots[hash_name(name, seed + 1)
+        & hierarchy->slot_mask];
+    if (id == -1 || strcmp(hierarchy->names[id], name) != 0)
+        return -1;
+    return id;
+}
+
+bool parse_tag_query(
+        const char *args[],
+        int nb_args,
+        const TagHierarchy *hierarchy,
+        TagQuery *query)
+{
+    assert(args != NULL || nb_args == 0);
+    assert(hierarchy != NULL);
+    assert(query != NULL);
+
+    memset(query, 0, sizeof(*query));
+    query->hierarchy = hierarchy;
+    query->root = -1;
+    query->entry = QUERY_ACCEPT;
+    QueryParser parser = { .args = args, .nb_args = nb_args, .query = query };
+    next_token(&parser);
+    if (parser.kind == TOKEN_END)
+        return true;
+
+    size_t node;
+    if (!parse_or(&parser, &node))
+        goto ERROR;
+    if (parser.kind != TOKEN_END) {
+        fprintf(stderr, "Invalid search expression: unexpected %s\n",
+                token_name(&parser));
+        goto ERROR;
+    }
+    number_query_tags(query);
+    query->root = node;
+    query->steps = checked_realloc(NULL,
+            query->nb_nodes * sizeof(*query->steps));
+    query->entry = compile_node(query, node, QUERY_ACCEPT, QUERY_REJECT);
+    return true;
+
+ERROR:
+    free_tag_query(query);
+    return false;
+}
+
+bool tag_query_match(
+        const TagQuery *query,
+        bool (*has_group)(size_t group, void *arg),
+        void *arg)
+{
+    assert(query != NULL);
+    assert(has_group != NULL);
+
+    /* The groups already checked, 0 when unknown, 1 or 2 otherwise.  */
+    uint8_t known[query->nb_groups + 1];
+    memset(known, 0, sizeof(known));
+    int step = query->entry;
+    while (step >= 0) {
+        const QueryStep *current = &query->steps[step];
+        if (known[current->group] == 0)
+            known[current->group] = has_group(current->group, arg) ? 1 : 2;
+        step = known[current->group] == 1
+            ? current->on_match : current->on_mismatch;
+    }
+    return step == QUERY_ACCEPT;
+}
+
+static bool has_no_group(size_t group, void *arg)
+{
+    return false;
+}
+
+bool tag_query_needs_tag(const TagQuery *query)
+{
+    return !tag_query_match(query, has_no_group, NULL);
+}
+
+bool tag_query_may_match(
+        const TagQuery *query,
+        bool (*may_have_group)(size_t group, void *arg),
+        void *arg)
+{
+    assert(query != NULL);
+    assert(may_have_group != NULL);
+
+    if (query->root < 0)
+        return true;
+    bool possible[query->nb_groups + 1];
+    for (size_t group = 0; group < query->nb_groups; group++)
+        possible[group] = may_have_group(group, arg);
+
+    /*
+     * A step only leads to steps compiled before it, so the steps
+     * reachable from the entry are all found by going down the plan
+     * once, both ways at the steps whose group the files may have. No
+     * call is nested, however long the expression is.
+     */
+    bool reached[query->nb_steps];
+    memset(reached, 0, sizeof(reached));
+    reached[query->entry] = true;
+    for (int step = query->entry; step >= 0; step--) {
+        const QueryStep *current = &query->steps[step];
+        if (!reached[step])
+            continue;
+        int targets[2] = { current->on_mismatch, current->on_match };
+        for (int i = 0; i < (possible[current->group] ? 2 : 1); i++) {
+            if (targets[i] == QUERY_ACCEPT)
+                return true;
+            else if (targets[i] >= 0)
+                reached[targets[i]] = true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the number of the tag [name] in [query], or -1 if it is
+ * neither in the config nor in the expression.
+ */
+static int tag_number(const TagQuery *query, const char *name)
+{
+    int number = tag_hierarchy_find(query->hierarchy, name);
+    if (number >= 0)
+        return number;
+    for (size_t i = 0; i < query->nb_extra_tags; i++) {
+        if (strcmp(query->extra_tags[i], name) == 0)
+            return query->hierarchy->nb_tags + i;
+    }
+    return -1;
+}
+
+/**
+ * Returns the span of [query] holding the tag of number [number], or
+ * NULL if no group has this tag.
+ */
+static const QuerySpan *find_span(const TagQuery *query, int number)
+{
+    if (number < 0)
+        return NULL;
+    size_t low = 0;
+    size_t high = query->nb_spans;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (query->spans[middle].first <= (uint32_t) number)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0 || query->spans[low - 1].end <= (uint32_t) number)
+        return NULL;
+    return &query->spans[low - 1];
+}
+
+int tag_query_tag_id(const TagQuery *query, const char *name)
+{
+    assert(query != NULL);
+    assert(name != NULL);
+
+    int number = tag_number(query, name);
+    const QuerySpan *span = find_span(query, number);
+    if (span == NULL)
+        return -1;
+    return span->id + (number - span->first);
+}
+
+const char *tag_query_tag_name(const TagQuery *query, size_t id)
+{
+    assert(query != NULL);
+    assert(id < query->nb_tags);
+
+    size_t low = 0;
+    size_t high = query->nb_spans;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (query->spans[middle].id <= id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    const QuerySpan *span = &query->spans[low - 1];
+    size_t number = span->first + (id - span->id);
+    const TagHierarchy *hierarchy = query->hierarchy;
+    if (number < hierarchy->nb_tags)
+        return hierarchy->names[number];
+    return query->extra_tags[number - hierarchy->nb_tags];
+}
+
+bool tag_query_add_tag(
+        const TagQuery *query,
+        const char *name,
+        uint64_t *groups)
+{
+    int number = tag_number(query, name);
+    if (find_span(query, number) == NULL)
+        return false;
+    for (size_t i = 0; i < query->nb_groups; i++) {
+        const QueryGroup *group = &query->groups[i];
+        if (group->first <= (uint32_t) number
+                && (uint32_t) number < group->end)
+            groups[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+    return true;
+}
+
+bool tag_query_match_groups(const TagQuery *query, const uint64_t *groups)
+{
+    assert(query != NULL);
+
+    int step = query->entry;
+    while (step >= 0) {
+        const QueryStep *current = &query->steps[step];
+        uint64_t bit = UINT64_C(1) << (current->group % 64);
+        step = groups[current->group / 64] & bit
+            ? current->on_match : current->on_mismatch;
+    }
+    return step == QUERY_ACCEPT;
+}
+
+/**
+ * An operand of a chain of conjunctions or disjunctions being planned:
+ * its node [node], its [position] in the expression, the [probability]
+ * that it holds, the [cost] of evaluating it and its [rank], the
+ * operands of lowest rank being evaluated first.
+ */
+typedef struct {
+    size_t node;
+    size_t position;
+    double probability;
+    double cost;
+    double rank;
+} PlannedOperand;
+
+/**
+ * The state of tag_query_plan(): the chains being planned share the
+ * stacks [operands] and [links], holding their operands and the nodes
+ * of their operators, and [pending] holds the nodes left to visit
+ * while a chain is collected. The chains being disjoint, each stack
+ * holds at most one entry per node of [query].
+ */
+typedef struct {
+    TagQuery *query;
+    const QueryGroupStats *stats;
+    PlannedOperand *operands;
+    size_t nb_operands;
+    size_t *links;
+    size_t nb_links;
+    size_t *pending;
+} QueryPlanner;
+
+static int compare_operands(const void *a, const void *b)
+{
+    const PlannedOperand *operand_a = a;
+    const PlannedOperand *operand_b = b;
+    if (operand_a->rank != operand_b->rank)
+        return (operand_a->rank > operand_b->rank)
+            - (operand_a->rank < operand_b->rank);
+    return (operand_a->position > operand_b->position)
+        - (operand_a->position < operand_b->position);
+}
+
+/**
+ * Plans the node [node] with [planner] and writes the probability that
+ * it holds to [*probability] and the expected cost of evaluating it to
+ * [*cost]. The operands of a chain of conjunctions are sorted by their
+ * cost divided by their probability of rejecting the file, which is
+ * the order of least expected cost for independent operands, and those
+ * of a chain of disjunctions by their cost divided by their probability
+ * of accepting it. The chain is then rebuilt with the same operator
+ * nodes, nesting on its left as built by the parser.
+ */
+static void plan_node(
+        QueryPlanner *planner,
+        size_t node,
+        double *probability,
+        double *cost)
+{
+    QueryNode *nodes = planner->query->nodes;
+    QueryOp op = nodes[node].op;
+    if (op == QUERY_TAG) {
+        *probability = planner->stats[nodes[node].group].probability;
+        *cost = planner->stats[nodes[node].group].cost;
+        return;
+    } else if (op == QUERY_NOT) {
+        plan_node(planner, nodes[node].left, probability, cost);
+        *probability = 1 - *probability;
+        return;
+    }
+
+    /* Collect the operands of the chain from left to right.  */
+    size_t first_operand = planner->nb_operands;
+    size_t first_link = planner->nb_links;
+    size_t nb_pending = 0;
+    planner->pending[nb_pending++] = node;
+    while (nb_pending > 0) {
+        size_t current = planner->pending[--nb_pending];
+        if (nodes[current].op == op) {
+            if (current != node)
+                planner->links[planner->nb_links++] = current;
+            planner->pending[nb_pending++] = nodes[current].right;
+            planner->pending[nb_pending++] = nodes[current].left;
+        } else {
+            planner->operands[planner->nb_operands++] =
+                (PlannedOperand) { .node = current };
+        }
+    }
+    /* The parent of the chain still points to its top node.  */
+    planner->links[planner->nb_links++] = node;
+
+    PlannedOperand *operands = &planner->operands[first_operand];
+    size_t nb_operands = planner->nb_operands - first_operand;
+    for (size_t i = 0; i < nb_operands; i++) {
+        PlannedOperand *operand = &operands[i];
+        plan_node(planner, operand->node, &operand->probability,
+                &operand->cost);
+        double decisive = op == QUERY_AND
+            ? 1 - operand->probability : operand->probability;
+        operand->position = i;
+        operand->rank = decisive > 0 ? operand->cost / decisive : DBL_MAX;
+    }
+    qsort(operands, nb_operands, sizeof(*operands), compare_operands);
+
+    const size_t *links = &planner->links[first_link];
+    size_t left = operands[0].node;
+    *probability = operands[0].probability;
+    *cost = operands[0].cost;
+    for (size_t i = 1; i < nb_operands; i++) {
+        QueryNode *link = &nodes[links[i - 1]];
+        link->left = left;
+        link->right = operands[i].node;
+        left = links[i - 1];
+        if (op == QUERY_AND) {
+            *cost += *probability * operands[i].cost;
+            *probability *= operands[i].probability;
+        } else {
+            *cost += (1 - *probability) * operands[i].cost;
+            *probability = 1 - (1 - *probability)
+                * (1 - operands[i].probability);
+        }
+    }
+    planner->nb_operands = first_operand;
+    planner->nb_links = first_link;
+}
+
+double tag_query_plan(TagQuery *query, const QueryGroupStats *stats)
+{
+    assert(query != NULL);
+    assert(stats != NULL || query->nb_groups == 0);
+
+    if (query->root < 0)
+        return 0;
+    size_t nb_nodes = query->nb_nodes;
+    QueryPlanner planner = {
+        .query = query,
+        .stats = stats,
+        .operands = checked_realloc(NULL, nb_nodes * sizeof(PlannedOperand)),
+        .links = checked_realloc(NULL, nb_nodes * sizeof(size_t)),
+        .pending = checked_realloc(NULL, nb_nodes * sizeof(size_t))
+    };
+    double probability, cost;
+    plan_node(&planner, query->root, &probability, &cost);
+    free(planner.pending);
+    free(planner.links);
+    free(planner.operands);
+
+    query->nb_steps = 0;
+    query->entry = compile_node(query, query->root, QUERY_ACCEPT,
+            QUERY_REJECT);
+    return cost;
+}
+
+/**
+ * Returns the name of the tag of the expression of the group [group]
+ * of [query].
+ */
+static const char *group_name(const TagQuery *query, size_t group)
+{
+    return tag_query_tag_name(query, query->groups[group].id);
+}
+
+static void print_node(const TagQuery *query, size_t node, FILE *out);
+
+/**
+ * Prints the operand [node] of an operator to [out], between
+ * parentheses if it is a conjunction or a disjunction.
+ */
+static void print_operand(const TagQuery *query, size_t node, FILE *out)
+{
+    QueryOp op = query->nodes[node].op;
+    if (op == QUERY_AND || op == QUERY_OR) {
+        fputc('(', out);
+        print_node(query, node, out);
+        fputc(')', out);
+    } else {
+        print_node(query, node, out);
+    }
+}
+
+/**
+ * Prints the node [node] of [query] to [out]. The chains of operators,
+ * which nest on their left, are printed without nesting calls.
+ */
+static void print_node(const TagQuery *query, size_t node, FILE *out)
+{
+    const QueryNode *nodes = query->nodes;
+    QueryOp op = nodes[node].op;
+    if (op == QUERY_TAG) {
+        fputs(group_name(query, nodes[node].group), out);
+        return;
+    } else if (op == QUERY_NOT) {
+        fputc('!', out);
+        print_operand(query, nodes[node].left, out);
+        return;
+    }
+
+    size_t nb_links = 0;
+    size_t leaf = node;
+    for (; nodes[leaf].op == op; leaf = nodes[leaf].left)
+        nb_links++;
+    size_t *links = checked_realloc(NULL, nb_links * sizeof(size_t));
+    for (size_t i = nb_links; i > 0; node = nodes[node].left)
+        links[--i] = node;
+    print_operand(query, leaf, out);
+    for (size_t i = 0; i < nb_links; i++) {
+        fputs(op == QUERY_AND ? " & " : " | ", out);
+        print_operand(query, nodes[links[i]].right, out);
+    }
+    free(links);
+}
+
+/**
+ * Prints the step [step] reached by a step of a plan to [out].
+ */
+static void print_step_target(int step, FILE *out)
+{
+    if (step == QUERY_ACCEPT)
+        fputs("accept", out);
+    else if (step == QUERY_REJECT)
+        fputs("reject", out);
+    else
+        fprintf(out, "step %d", step);
+}
+
+void print_tag_query_plan(
+        const TagQuery *query,
+        const QueryGroupStats *stats,
+        FILE *out)
+{
+    assert(query != NULL);
+    assert(stats != NULL || query->nb_groups == 0);
+    assert(out != NULL);
+
+    fputs("Expression: ", out);
+    if (query->root < 0)
+        fputs("(any tag)", out);
+    else
+        print_node(query, query->root, out);
+    fputs("\nEntry: ", out);
+    print_step_target(query->entry, out);
+    fputc('\n', out);
+    for (size_t i = 0; i < query->nb_steps; i++) {
+        const QueryStep *step = &query->steps[i];
+        size_t nb_tags = query->groups[step->group].end
+            - query->groups[step->group].first;
+        fprintf(out, "Step %zu: %s (%zu tag%s, p = %.3f), match: ", i,
+                group_name(query, step->group), nb_tags,
+                nb_tags > 1 ? "s" : "", stats[step->group].probability);
+        print_step_target(step->on_match, out);
+        fputs(", mismatch: ", out);
+        print_step_target(step->on_mismatch, out);
+        fputc('\n', out);
+    }
+}
@@ -0,0 +1,242 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "tag.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The steps of a plan lead to another step, or to one of these
+ * results.
+ */
+#define QUERY_ACCEPT -1
+#define QUERY_REJECT -2
+
+typedef enum {
+    QUERY_TAG = 1,
+    QUERY_NOT = 2,
+    QUERY_AND = 3,
+    QUERY_OR = 4
+} QueryOp;
+
+/**
+ * A node of the syntax tree of a search expression: a test of the
+ * tag group [group] for QUERY_TAG, otherwise an operator applied to
+ * the nodes [left] and, except for QUERY_NOT, [right].
+ */
+typedef struct {
+    QueryOp op;
+    size_t group;
+    size_t left;
+    size_t right;
+} QueryNode;
+
+/**
+ * A step of the plan evaluating a search expression for a file: the
+ * file is checked for one of the tags of the group [group], and the
+ * evaluation continues with the step [on_match] or [on_mismatch].
+ */
+typedef struct {
+    size_t group;
+    int on_match;
+    int on_mismatch;
+} QueryStep;
+
+/**
+ * The tags of the config numbered once in depth-first order: the tag
+ * of number [i] is named [names[i]], a string of the buffer [strings],
+ * and its descendants are the tags of numbers in (i, ends[i]), so that
+ * a tag [j] is [i] or one of its descendants when i <= j < ends[i].
+ * The number of a name is found by tag_hierarchy_find() through a
+ * perfect hash table: the seed [seeds[b]] of the bucket [b] of a name
+ * gives its slot in [slots]. A name given twice in the config is found
+ * at its first place.
+ */
+typedef struct {
+    char *strings;
+    const char **names;
+    uint32_t *ends;
+    size_t nb_tags;
+    int32_t *slots;
+    size_t slot_mask;
+    uint32_t *seeds;
+    size_t nb_buckets;
+} TagHierarchy;
+
+/**
+ * The tags of a group of a search expression: the numbers in [first,
+ * end) of the tag of the expression and of its descendants, whose
+ * identifiers in the query start at [id].
+ */
+typedef struct {
+    uint32_t first;
+    uint32_t end;
+    uint32_t id;
+} QueryGroup;
+
+/**
+ * A largest range of numbers [first, end) covered by the groups of a
+ * query, whose tags have the identifiers starting at [id].
+ */
+typedef struct {
+    uint32_t first;
+    uint32_t end;
+    uint32_t id;
+} QuerySpan;
+
+/**
+ * A search expression such as "+tag1 (+tag2 | _tag3)". Each tag of the
+ * expression makes a group made of the tag and of its descendants,
+ * since a file tagged with one of them has the tag.
+ *
+ * The tags are numbered by [hierarchy], the tags of the expression
+ * missing from the config being numbered after its tags: the tag of
+ * number [hierarchy->nb_tags + i] is named [extra_tags[i]]. Since the
+ * groups of the [nb_groups] groups [groups] are ranges of numbers,
+ * the size of the query does not depend on the number of descendants
+ * of its tags. The groups which overlap are nested, and the largest
+ * ones make the [nb_spans] spans [spans], sorted by number, which
+ * give the [nb_tags] distinct tags of the groups the identifiers 0 to
+ * [nb_tags - 1]. A set of groups takes [nb_words] words.
+ *
+ * The expression is kept as the syntax tree [nodes] of root [root],
+ * or -1 if it is empty, and compiled into the [nb_steps] steps
+ * [steps], starting with [entry], so that the tags of a file are
+ * only checked until the result is known.
+ */
+typedef struct {
+    const TagHierarchy *hierarchy;
+    char **extra_tags;
+    size_t nb_extra_tags;
+    QueryGroup *groups;
+    size_t nb_groups;
+    QuerySpan *spans;
+    size_t nb_spans;
+    size_t nb_tags;
+    size_t nb_words;
+    QueryNode *nodes;
+    size_t nb_nodes;
+    int root;
+    QueryStep *steps;
+    size_t nb_steps;
+    int entry;
+} TagQuery;
+
+/**
+ * What the planner knows about a tag group: the estimated probability
+ * [probability] that a file has one of its tags, and the [cost] of
+ * checking it for a file.
+ */
+typedef struct {
+    double probability;
+    double cost;
+} QueryGroupStats;
+
+/**
+ * Numbers the tags of the config tree [root] into [hierarchy].
+ * Returns [false] and prints an error message if the config is
+ * invalid.
+ */
+bool build_tag_hierarchy(const TagsTree *root, TagHierarchy *hierarchy);
+
+void free_tag_hierarchy(TagHierarchy *hierarchy);
+
+/**
+ * Returns the number of the tag [name] in [hierarchy], or -1 if the
+ * config does not have this tag.
+ */
+int tag_hierarchy_find(const TagHierarchy *hierarchy, const char *name);
+
+/**
+ * Parses the search expression made of the [nb_args] arguments [args]
+ * and writes it to [query], the descendants of its tags being taken
+ * from [hierarchy], which must outlive [query].
+ * If the expression is invalid, an error message is printed and
+ * [false] is returned.
+ */
+bool parse_tag_query(
+        const char *args[],
+        int nb_args,
+        const TagHierarchy *hierarchy,
+        TagQuery *query);
+
+void free_tag_query(TagQuery *query);
+
+/**
+ * Evaluates [query] for a file which, according to [has_group], has
+ * one of the tags of a group or not. [has_group] is only called for
+ * the groups needed to know the result, at most once per group.
+ */
+bool tag_query_match(
+        const TagQuery *query,
+        bool (*has_group)(size_t group, void *arg),
+        void *arg);
+
+/**
+ * Returns [false] if no file can match [query] when the files have
+ * none of the groups for which [may_have_group] returns [false], and
+ * may have the others, [true] otherwise. [may_have_group] is called
+ * once for each group.
+ */
+bool tag_query_may_match(
+        const TagQuery *query,
+        bool (*may_have_group)(size_t group, void *arg),
+        void *arg);
+
+/**
+ * Returns the identifier of the tag [name] in [query], or -1 if no
+ * group of [query] has this tag.
+ */
+int tag_query_tag_id(const TagQuery *query, const char *name);
+
+/**
+ * Returns the name of the tag of identifier [id] in [query].
+ */
+const char *tag_query_tag_name(const TagQuery *query, size_t id);
+
+/**
+ * Adds the groups of [query] having the tag [name] to the set of
+ * groups [groups] of [query->nb_words] words, a group having the tag
+ * when its range holds the number of the tag.
+ * Returns [false] if no group has this tag, [true] otherwise.
+ */
+bool tag_query_add_tag(
+        const TagQuery *query,
+        const char *name,
+        uint64_t *groups);
+
+/**
+ * Same as tag_query_match() for a file having the tags of the set of
+ * groups [groups], filled by tag_query_add_tag().
+ */
+bool tag_query_match_groups(const TagQuery *query, const uint64_t *groups);
+
+/**
+ * Returns [true] if [query] rejects the files having none of the tags
+ * of its groups, so that the files which match it are tagged.
+ */
+bool tag_query_needs_tag(const TagQuery *query);
+
+/**
+ * Reorders the operands of the conjunctions and disjunctions of [query]
+ * according to the statistics [stats] of its groups, so that the
+ * operands most likely to decide the result for the least cost come
+ * first, and compiles its plan again. The files matching [query] do
+ * not change.
+ * Returns the expected cost of evaluating [query] for a file.
+ */
+double tag_query_plan(TagQuery *query, const QueryGroupStats *stats);
+
+/**
+ * Prints to [out] the expression of [query] in the order in which it
+ * is evaluated, then the steps of its plan with the statistics [stats]
+ * of their groups.
+ */
+void print_tag_query_plan(
+        const TagQuery *query,
+        const QueryGroupStats *stats,
+        FILE *out);
+
+#endif
@@ -1,5 +1,8 @@
 #include "../lib/cJSON.h"
 #include "tag.h"
+#include "journal.h"
+#include "commands.h"
+#include "tagsysd.h"
 #include <fcntl.h>
 #include <linux/xattr.h>
 #include <stdbool.h>
@@ -12,7 +15,7 @@
 #include <unistd.h>
 #include <errno.h>
 
-bool remove_tag(int fd, const char *tag)
+static bool remove_tag(int fd, const char *tag)
 {
     size_t tag_len = strlen(tag) + XATTR_PROG_DOMAIN_LEN;
     char attr_name[tag_len + 1];
@@ -29,7 +32,23 @@ static void print_rm_tag_error(const char *tag, int error_num)
     fprintf(stderr, "Error removing tag '%s': %s\n", tag, strerror(error_num));
 }
 
-bool clear_tags(int fd)
+/**
+ * Records in [journal] the removal of the tag [tag] from the file
+ * [filename] open as [fd].
+ */
+static void journal_removal(
+        Journal *journal,
+        int fd,
+        const char *filename,
+        const char *tag)
+{
+    if (!journal_add_file_change(journal, JOURNAL_REMOVE_TAG, fd,
+                filename, tag))
+        fprintf(stderr, "Could not journal the removal of '%s': %s\n",
+                tag, strerror(errno));
+}
+
+static bool clear_tags(int fd, const char *filename, Journal *journal)
 {
     ssize_t buflen = flistxattr(fd, NULL, 0);
     if (buflen == -1)
@@ -51,24 +70,18 @@ bool clear_tags(int fd)
         return false;
     }
 
-    char *key = buf;
+    XattrTagScanner scanner;
     const char *tag;
-    size_t keylen;
-
-    while (buflen > 0) {
-        keylen = strlen(key) + 1; // +1 for null byte
-
-        if (keylen - 1 > XATTR_PROG_DOMAIN_LEN
-                && strncmp(key, XATTR_PROG_DOMAIN, XATTR_PROG_DOMAIN_LEN) == 0) {
-            if (fremovexattr(fd, key) != 0) {
-                tag = key + XATTR_PROG_DOMAIN_LEN;
-                print_rm_tag_error(tag, errno);
-                errno = 0;
-            }
+    size_t tag_len;
+    scan_xattr_tags(&scanner, buf, buflen);
+    while (next_xattr_tag(&scanner, &tag, &tag_len)) {
+        /* The attribute is the prefix followed by the tag.  */
+        if (fremovexattr(fd, tag - XATTR_PROG_DOMAIN_LEN) != 0) {
+            print_rm_tag_error(tag, errno);
+            errno = 0;
+        } else {
+            journal_removal(journal, fd, filename, tag);
         }
-
-        buflen -= keylen;
-        key += keylen;
     }
     free(buf);
     return true;
@@ -86,11 +99,11 @@ static void print_help(const char *prog_name)
             prog_name,prog_name,prog_name);
 }
 
-int main(int argc, char const *argv[])
+int rm_tag_command(int argc, const char *argv[])
 {
     if(argc < 2) {
         print_help(argv[0]);
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
 
     bool clear_tags_opt = false;
@@ -100,16 +113,16 @@ int main(int argc, char const *argv[])
     if (optlen == strlen("-c") && strncmp(argv[1], "-c", optlen) == 0) {
         if (argc != 3) {
             print_help(argv[0]);
-            exit(EXIT_FAILURE);
+            return EXIT_FAILURE;
         }
         clear_tags_opt = true;
         filename = argv[2];
     } else if (optlen == strlen("-h") && strncmp(argv[1], "-h", optlen) == 0) {
         print_help(argv[0]);
-        exit(EXIT_SUCCESS);
+        return EXIT_SUCCESS;
     } else if (argc < 3) {
         print_help(argv[0]);
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     } else {
         filename = argv[1];
         first_tag_pos = 2;
@@ -119,13 +132,14 @@ int main(int argc, char const *argv[])
     if(fd < 0) {
         fprintf(stderr, "Could not open target file '%s': %s\n",
                 filename, strerror(errno));
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
 
     load_config();
 
+    Journal journal = {0};
     if (clear_tags_opt) {
-        if (!clear_tags(fd)) {
+        if (!clear_tags(fd, filename, &journal)) {
             fprintf(stderr, "Could not clear tags: %s\n", strerror(errno));
             goto FREE_RESSOURCES_ON_ERROR;
         }
@@ -136,6 +150,8 @@ int main(int argc, char const *argv[])
                 error_occured = true;
                 print_rm_tag_error(argv[i], errno);
                 errno = 0;
+            } else {
+                journal_removal(&journal, fd, filename, argv[i]);
             }
         }
         if (error_occured)
@@ -143,9 +159,21 @@ int main(int argc, char const *argv[])
     }
 
     close(fd);
-    exit(EXIT_SUCCESS);
+    return journal_close(&journal) ? EXIT_SUCCESS : EXIT_FAILURE;
 
 FREE_RESSOURCES_ON_ERROR:
+    /* Some tags may have been removed before the error.  */
+    journal_close(&journal);
     close(fd);
-    exit(EXIT_FAILURE);
+    return EXIT_FAILURE;
+}
+
+#ifndef TAGSYSD
+int main(int argc, char const *argv[])
+{
+    int status;
+    if (forward_to_daemon("rm-tag", argc, argv, &status))
+        return status;
+    return rm_tag_command(argc, argv);
 }
+#endif
@@ -1,344 +1,1429 @@
+#define _GNU_SOURCE
 #include "tag.h"
+#include "commands.h"
+#include "index.h"
+#include "inodeset.h"
+#include "output.h"
+#include "query.h"
+#include "summary.h"
+#include "tagsysd.h"
+#include "uring.h"
+#include "walk.h"
 #include <assert.h>
 #include <dirent.h>
 #include <linux/xattr.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
 
+/*
+ * Beyond this number of attributes to probe per file, listing the
+ * attributes is cheaper than probing them all at once through
+ * io_uring.
+ */
+#define MAX_PROBES 32
+
+/*
+ * The files are checked with getxattr(2) rather than listxattr(2) when
+ * rejecting a file having none of the tags of the search takes at most
+ * this number of calls, since most files are rejected that way, and
+ * when the tagged files are expected to take at most as many.
+ */
+#define MAX_PROBED_GROUP_SIZE 2
+
+
+/**
+ * The phases of a search timed by --stats.
+ */
+typedef enum {
+    PHASE_CONFIG = 0,
+    PHASE_PLAN,
+    PHASE_SEARCH,
+    PHASE_OUTPUT,
+    NB_PHASES
+} SearchPhase;
+
+static const char *const phase_names[NB_PHASES] = {
+    [PHASE_CONFIG] = "config",
+    [PHASE_PLAN] = "plan",
+    [PHASE_SEARCH] = "search",
+    [PHASE_OUTPUT] = "output"
+};
+
+/**
+ * The key by which the files are ranked with --top.
+ */
+typedef enum {
+    SORT_MTIME = 0,
+    SORT_SIZE = 1
+} SortKey;
+
+/**
+ * What a walk needs to know about the search: the search expression
+ * [query] and, when the search can be answered by probing specific
+ * attributes with getxattr(2) rather than listing them all, the full
+ * names of the attributes to probe, [probes[i]] for the tag [i] of
+ * [query], or [nb_probes] is 0. [probe_mode] tells whether
+ * print_if_correct() probes attributes. The matching files go to
+ * [output], ranked by [sort] if it keeps the top files. When the
+ * directories are skipped according to their summary, [summary_keys[i]]
+ * is the key of the tag [i] of [query] in the summaries. [reported],
+ * if not NULL, holds the files already output, so that a file having
+ * several links is output once.
+ */
+typedef struct {
+    const TagQuery *query;
+    char **probes;
+    size_t nb_probes;
+    bool probe_mode;
+    ResultOutput *output;
+    SortKey sort;
+    SummaryKey *summary_keys;
+    InodeSet *reported;
+} SearchContext;
+
+/**
+ * The summary [summary] of a directory checked for the query of the
+ * search [context].
+ */
+typedef struct {
+    const SearchContext *context;
+    TagSummary summary;
+} SummaryCheck;
+
+/**
+ * How a search is planned: the statistics [stats] of the groups of its
+ * query, taken from the index if [indexed_stats] is [true], and the
+ * number of probes [expected_probes] the plan of the query is expected
+ * to take for a tagged file.
+ */
+typedef struct {
+    QueryGroupStats *stats;
+    bool indexed_stats;
+    double expected_probes;
+} SearchPlan;
 
 /**
- * The parameters used to find files
- * given wanted_tags (must have) and
- * unwanted_tags (must, not have).
+ * A file whose attributes are probed by probe_result(), and the error
+ * [error] which occured while probing them, if any. The probes are
+ * counted in [stats], if not NULL.
  */
 typedef struct {
-    RedimRedimStringArray wanted_tags;
-    RedimRedimStringArray unwanted_tags;
-} TagSearchParams;
+    const WalkEntry *entry;
+    const SearchContext *context;
+    WalkStats *stats;
+    int error;
+} ProbedFile;
+
+/**
+ * Writes the list of extended file attributes xattr of the file
+ * [entry] to [buffer], see read_xattr_list(). The calls are counted
+ * in [stats], if not NULL.
+ * Returns [true] if the operation succeeded, [false] otherwise.
+ */
+static bool get_xattr_list(
+        const WalkEntry *entry,
+        PascalBuffer *buffer,
+        WalkStats *stats)
+{
+    assert(entry != NULL);
+    assert(buffer != NULL);
+
+    unsigned int nb_calls = 0;
+    uint64_t start = walk_stats_start(stats);
+    ssize_t buflen = read_xattr_list(entry->dirfd, entry->name, buffer,
+            &nb_calls);
+    walk_stats_count(stats, WALK_SYSCALL_LISTXATTR, nb_calls);
+    if (buflen == -1)
+        return false;
+    walk_stats_end(stats, start);
+    if (stats != NULL)
+        stats->xattr_name_bytes += buflen;
+    return true;
+}
 
 /**
- * Frees the memory used by a RedimRedimStringArray object.
+ * Returns [true] if the ProbedFile given as [arg] has one of the tags
+ * of the group [group], which are probed with getxattr(2) until one
+ * is found.
  */
-static void free_redim_redim_array(RedimRedimStringArray *array)
+static bool probe_has_group(size_t group, void *arg)
 {
-    assert(array != NULL);
-    RedimStringArray *str_array;
-    for (int i = 0; i < array->nb_elt; i++) {
-        str_array = &array->array[i];
-        if (str_array)
-            free(str_array->array);
+    ProbedFile *file = arg;
+    const SearchContext *context = file->context;
+    const QueryGroup *tags = &context->query->groups[group];
+    size_t end = tags->id + (tags->end - tags->first);
+    for (size_t i = tags->id; i < end && file->error == 0; i++) {
+        uint64_t start = walk_stats_start(file->stats);
+        walk_stats_count(file->stats, WALK_SYSCALL_GETXATTR, 1);
+        ssize_t size = getxattr_at(file->entry->dirfd, file->entry->name,
+                context->probes[i], NULL, 0);
+        walk_stats_end(file->stats, start);
+        if (size != -1)
+            return true;
+        else if (errno != ENODATA)
+            file->error = errno;
     }
-    free(array->array);
+    return false;
 }
 
 /**
- * Frees the memory used by a TagSearchParams object.
+ * Determines whether the file [entry] matches the SearchContext
+ * [context] by probing its attributes with getxattr(2) instead of
+ * listing them, see set_probes(). Only the groups the plan of the
+ * query reaches are probed, so that most files are rejected after
+ * one call. Writes the result to [*match], the probes being counted
+ * in [stats] if not NULL. Returns [false] if an error occured, [true]
+ * otherwise.
  */
-static void free_tag_search_params(TagSearchParams *params)
+static bool probe_result(
+        const WalkEntry *entry,
+        const SearchContext *context,
+        WalkStats *stats,
+        bool *match)
 {
-    assert(params != NULL);
-    free_redim_redim_array(&params->wanted_tags);
-    free_redim_redim_array(&params->unwanted_tags);
+    assert(entry != NULL);
+    assert(context != NULL);
+    assert(match != NULL);
+
+    ProbedFile file = { .entry = entry, .context = context, .stats = stats };
+    *match = tag_query_match(context->query, probe_has_group, &file);
+    if (file.error != 0) {
+        errno = file.error;
+        return false;
+    }
+    return true;
 }
 
+/**
+ * Returns [true] if [query] is a single tag, whose group is enough to
+ * know whether a file matches.
+ */
+static bool is_single_group(const TagQuery *query)
+{
+    return query->root >= 0 && query->nodes[query->root].op == QUERY_TAG;
+}
 
 /**
- * Appends the filename [fname] of [len] chars to the path [path].
+ * Returns [true] if the list of xattr in [xattr_buf] is tagged by the
+ * current user and matches the TagQuery [query], [false] otherwise.
+ * Each tag of the list is looked up once in the hash table of the
+ * query, which gives the groups having it. The list is only read until
+ * the result is known when the query is empty or a single tag.
  */
-static void append_to_path(PascalBuffer *path, const char *fname, size_t len)
+static bool valid_result(PascalBuffer *xattr_buf, const TagQuery *query)
 {
-    assert(path != NULL);
-    append_str_to_buffer(path, "/", 1);
-    append_str_to_buffer(path, fname, len);
+    assert(xattr_buf != NULL);
+    assert(query != NULL);
+
+    uint64_t groups[query->nb_words + 1];
+    memset(groups, 0, sizeof(groups));
+    bool is_tagged = false;
+    bool any_tag = query->root < 0;
+    bool single_group = is_single_group(query);
+    bool match = false;
+    XattrTagScanner scanner;
+    const char *tag;
+    size_t tag_len;
+    scan_xattr_tags(&scanner, xattr_buf->str, xattr_buf->str_length);
+    while (!match && next_xattr_tag(&scanner, &tag, &tag_len)) {
+        is_tagged = true;
+        if (any_tag)
+            match = true;
+        else if (single_group)
+            match = tag_query_tag_id(query, tag) != -1;
+        else
+            tag_query_add_tag(query, tag, groups);
+    }
+    xattr_buf->str_length = 0;
+    if (any_tag || single_group)
+        return match;
+    return is_tagged && tag_query_match_groups(query, groups);
 }
 
+
 /**
- * Writes the list of extended file attributes xattr to [buffer].
- * Returns [true] if the operation succeeded, [false] otherwise.
+ * Outputs the path [path] of a matching file, the file [name] of the
+ * directory [dirfd], to the output of [context], unless it was already
+ * output through another link. When the output keeps the top files or
+ * the reported files are tracked, the file is read with fstatat(2).
+ * The match is counted in [stats], if not NULL.
+ * Returns [false] if an error occurs, [true] otherwise.
  */
-static bool get_xattr_list(const char *fname, PascalBuffer *buffer)
+static bool output_match(
+        const SearchContext *context,
+        int dirfd,
+        const char *name,
+        const char *path,
+        WalkStats *stats)
 {
-    assert(fname != NULL);
-    assert(buffer != NULL);
+    int64_t key = 0;
+    if (context->output->options.top > 0 || context->reported != NULL) {
+        struct stat st;
+        walk_stats_count(stats, WALK_SYSCALL_FSTATAT, 1);
+        if (fstatat(dirfd, name, &st, 0) == -1) {
+            fprintf(stderr, "Could not stat '%s': %s\n", path,
+                    strerror(errno));
+            return false;
+        }
+        if (context->reported != NULL
+                && !inode_set_add(context->reported, st.st_dev, st.st_ino))
+            return true;
+        key = context->sort == SORT_SIZE ? (int64_t) st.st_size
+            : (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    if (stats != NULL)
+        stats->nb_matches++;
+    return output_path(context->output, path, key);
+}
 
-    ssize_t buflen = listxattr(fname, NULL, 0);
-    if (buflen == -1)
+/**
+ * Determines whether the extended attributes of [entry] match the
+ * SearchContext [context], either by probing them or by listing them
+ * into [xattr_buf], and writes the result to [*match]. The calls are
+ * counted in [stats], if not NULL.
+ * Returns [false] and sets errno if the attributes could not be read,
+ * [true] otherwise.
+ */
+static bool file_matches(
+        const WalkEntry *entry,
+        const SearchContext *context,
+        PascalBuffer *xattr_buf,
+        WalkStats *stats,
+        bool *match)
+{
+    if (context->probe_mode)
+        return probe_result(entry, context, stats, match);
+    if (!get_xattr_list(entry, xattr_buf, stats))
         return false;
-    else if (buflen == 0)
+    *match = valid_result(xattr_buf, context->query);
+    return true;
+}
+
+/**
+ * Outputs the path of [entry] if its extended attributes match
+ * the SearchContext given as [arg]. The buffer of the
+ * worker [worker] is used to store the attributes of the file
+ * and to avoid allocating memory too often.
+ */
+static bool print_if_correct(
+        WalkWorker *worker,
+        const WalkEntry *entry,
+        void *arg)
+{
+    assert(worker != NULL);
+    assert(entry != NULL);
+    assert(arg != NULL);
+
+    const SearchContext *context = arg;
+    bool match = false;
+    if (!file_matches(entry, context, &worker->xattr_buf, worker->stats,
+                &match))
+        goto ERROR;
+    if (!match)
         return true;
+    bool success = output_match(context, entry->dirfd, entry->name,
+            walk_entry_path(worker, entry), worker->stats);
+    if (output_done(context->output))
+        walk_stop(worker);
+    return success;
 
-    if (buffer->str_capacity <= buflen)
-        extends_buffer(buffer, buflen * 2);
-    buffer->str_length = listxattr(fname, buffer->str, buffer->str_capacity);
-    return buffer->str_length != -1;
+ERROR:;
+    int errno_save = errno;
+    fprintf(stderr, "Could not get tags for '%s': %s\n",
+            walk_entry_path(worker, entry), strerror(errno_save));
+    return false;
 }
 
 /**
- * Returns [true] if the list of xattr in [xattr_buf] matches the
- * TagSearchParams [params], [false] otherwise.
+ * Same as print_if_correct() for the [nb_entries] entries [entries],
+ * using the io_uring instance of [worker] to probe all the attributes
+ * of the SearchContext given as [arg] at once. Falls back to
+ * print_if_correct() when the worker has no io_uring instance or
+ * when the search cannot be answered by probing attributes.
  */
-static bool valid_result(
-        PascalBuffer *xattr_buf,
-        const TagSearchParams *params)
+static bool print_correct_batch(
+        WalkWorker *worker,
+        const WalkEntry *entries,
+        size_t nb_entries,
+        void *arg)
 {
-    assert(xattr_buf != NULL);
-    assert(params != NULL);
+    assert(worker != NULL);
+    assert(entries != NULL);
+    assert(arg != NULL);
 
-    char *key = xattr_buf->str;
-    char *tag;
-    size_t keylen;
-    int count_wanted = 0;
-    int nb_wanted = params->wanted_tags.nb_elt;
-    bool is_tagged = false;
-    RedimStringArray *str_array;
-    bool has_tag[params->wanted_tags.nb_elt];
-    memset(has_tag, false, params->wanted_tags.nb_elt);
-    while (xattr_buf->str_length > 0) {
-        keylen = strlen(key) + 1;
-
-        if (keylen - 1 > XATTR_PROG_DOMAIN_LEN
-                && strncmp(
-                    key, XATTR_PROG_DOMAIN, XATTR_PROG_DOMAIN_LEN) == 0) {
-
-            is_tagged = true;
-            tag = key + XATTR_PROG_DOMAIN_LEN;
-            for (int i = 0; i < nb_wanted && count_wanted < nb_wanted; i++) {
-                str_array = &params->wanted_tags.array[i];
-                for (int j = 0; j < str_array->nb_elt && !has_tag[i]; j++) {
-                    if (strcmp(tag, str_array->array[j]) == 0 && !has_tag[i]) {
-                        ++count_wanted;
-                        has_tag[i] = true;
-                    }
-                }
-            }
-            for (int i = 0; i < params->unwanted_tags.nb_elt; i++) {
-                str_array = &params->unwanted_tags.array[i];
-                for (int j = 0; j < str_array->nb_elt; j++)
-                    if (strcmp(tag, str_array->array[j]) == 0)
-                        return false;
+    const SearchContext *context = arg;
+    bool success = true;
+    if (worker->ring == NULL || context->nb_probes == 0
+            || context->nb_probes > MAX_PROBES) {
+        for (size_t i = 0; i < nb_entries; i++)
+            success = print_if_correct(worker, &entries[i], arg) && success;
+        return success;
+    }
+
+    /* Files are reached through /proc as the requests take paths.  */
+    size_t nb_probes = context->nb_probes;
+    char paths[nb_entries][PROC_FD_PATH_SIZE];
+    size_t nb_ops = nb_entries * nb_probes;
+    IoRingOp *ops = calloc(nb_ops, sizeof(*ops));
+    if (ops == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nb_entries; i++) {
+        snprintf(paths[i], PROC_FD_PATH_SIZE, "/proc/self/fd/%d/%s",
+                entries[i].dirfd, entries[i].name);
+        for (size_t j = 0; j < nb_probes; j++) {
+            ops[i * nb_probes + j] = (IoRingOp) {
+                .kind = IO_RING_GETXATTR, .path = paths[i],
+                .attr = context->probes[j]
+            };
+        }
+    }
+    if (!io_ring_run(worker->ring, ops, nb_ops)) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Rebuild the list of the attributes found for valid_result().  */
+    PascalBuffer *xattr_buf = &worker->xattr_buf;
+    for (size_t i = 0; i < nb_entries; i++) {
+        int error = 0;
+        xattr_buf->str_length = 0;
+        for (size_t j = 0; j < nb_probes && error == 0; j++) {
+            int result = ops[i * nb_probes + j].result;
+            if (result >= 0) {
+                const char *attr = context->probes[j];
+                append_str_to_buffer(xattr_buf, attr, strlen(attr) + 1);
+            } else if (result != -ENODATA) {
+                error = -result;
             }
-            if (nb_wanted == count_wanted && params->unwanted_tags.nb_elt == 0)
+        }
+        if (error != 0) {
+            fprintf(stderr, "Could not get tags for '%s': %s\n",
+                    walk_entry_path(worker, &entries[i]), strerror(error));
+            success = false;
+        } else if (valid_result(xattr_buf, context->query)) {
+            success = output_match(context, entries[i].dirfd,
+                    entries[i].name, walk_entry_path(worker, &entries[i]),
+                    worker->stats) && success;
+            if (output_done(context->output)) {
+                walk_stop(worker);
                 break;
+            }
         }
-
-        /* Forward to next attribute key.  */
-        xattr_buf->str_length -= keylen;
-        key += keylen;
     }
     xattr_buf->str_length = 0;
-    return count_wanted == nb_wanted && is_tagged;
+    free(ops);
+    return success;
 }
 
+/**
+ * The number of probes [nb_probes] needed to reject a file having none
+ * of the tags of [query].
+ */
+typedef struct {
+    const TagQuery *query;
+    size_t nb_probes;
+} RejectionCost;
 
 /**
- * List the files in the directory [path] matching
- * the TagSearchParams [params]. The PascalBuffer [xattr_buf]
- * is used to store the attributes of the files and to avoid
- * allocating memory too often.
+ * Adds the number of tags of the group [group] to the number of probes
+ * of the RejectionCost given as [arg], see set_probes().
  */
-static bool list_correct_files(
-        const TagSearchParams *params,
-        PascalBuffer *path,
-        PascalBuffer *xattr_buf)
+static bool count_group_probes(size_t group, void *arg)
 {
-    assert(params != NULL);
-    assert(path != NULL);
-    assert(xattr_buf != NULL);
+    RejectionCost *cost = arg;
+    const QueryGroup *tags = &cost->query->groups[group];
+    cost->nb_probes += tags->end - tags->first;
+    return false;
+}
 
-    DIR *dir = opendir(path->str);
-    if (dir == NULL) {
-        fprintf(stderr, "Could not open '%s' directory: %s\n",
-                path->str, strerror(errno));
-        return false;
+/**
+ * Fills the attributes to probe of [context] with the full names of
+ * all the tags of its query, unless probing cannot answer the search:
+ * when the query accepts the files having none of its tags, a file
+ * must be tagged at all to match, which only listing its attributes
+ * tells. The probe mode is then enabled when probing is expected to be
+ * cheaper than listing according to [plan], that is when the files
+ * having none of the tags are rejected after a few probes and, if the
+ * index tells how the tags are spread, when the tagged files are
+ * expected to take a few probes too. The attributes are not filled
+ * when neither the probe mode nor io_uring could use them.
+ */
+static void set_probes(SearchContext *context, const SearchPlan *plan)
+{
+    const TagQuery *query = context->query;
+    if (!tag_query_needs_tag(query))
+        return;
+    RejectionCost cost = { .query = query };
+    tag_query_match(query, count_group_probes, &cost);
+    context->probe_mode = cost.nb_probes <= MAX_PROBED_GROUP_SIZE
+        && (plan->indexed_stats
+            ? plan->expected_probes <= MAX_PROBED_GROUP_SIZE
+            : query->nb_tags <= MAX_PROBES);
+    if (!context->probe_mode && query->nb_tags > MAX_PROBES)
+        return;
+
+    context->probes = malloc(query->nb_tags * sizeof(char *));
+    if (context->probes == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
-    bool success = true;
-    struct dirent *cur;
-    while ((cur = readdir(dir))) {
-        if (strncmp(cur->d_name, "..", 3) != 0 && strncmp(cur->d_name, ".", 2) != 0) {
-            struct stat s = {0};
-            size_t len = strlen(cur->d_name);
-            append_to_path(path, cur->d_name, len);
-
-            stat(path->str, &s);
-            if (S_ISDIR(s.st_mode)) {
-                success = success && list_correct_files(params, path, xattr_buf);
-            } else {
-                if (!get_xattr_list(path->str, xattr_buf)) {
-                    fprintf(stderr, "Could not get tags for '%s': %s\n",
-                            path->str, strerror(errno));
-                    success = false;
-                } else if (valid_result(xattr_buf, params)) {
-                    printf("%s\n", path->str);
-                    xattr_buf->str_length = 0;
-                }
-            }
-            path->str_length -= len + 1;
+    for (size_t i = 0; i < query->nb_tags; i++) {
+        const char *tag = tag_query_tag_name(query, i);
+        size_t len = XATTR_PROG_DOMAIN_LEN + strlen(tag);
+        char *attr = malloc(len + 1);
+        if (attr == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
+        snprintf(attr, len + 1, "%s%s", XATTR_PROG_DOMAIN, tag);
+        context->probes[context->nb_probes++] = attr;
     }
-    closedir(dir);
-    return success;
+}
+
+static void free_probes(SearchContext *context)
+{
+    for (size_t i = 0; i < context->nb_probes; i++)
+        free(context->probes[i]);
+    free(context->probes);
 }
 
 /**
- * Prints the name of the files, in the directory [directory], that
- * match the tag search parameters [params].
- * Returns [false] if an error occurs], [true] otherwise.
+ * Returns [true] if a file of the directory summarized by the
+ * SummaryCheck [arg] may have one of the tags of the group [group].
  */
-static bool display_files(const char *directory, const TagSearchParams *params)
+static bool summary_has_group(size_t group, void *arg)
 {
-    assert(directory != NULL);
-    assert(params != NULL);
+    SummaryCheck *check = arg;
+    const QueryGroup *tags = &check->context->query->groups[group];
+    size_t end = tags->id + (tags->end - tags->first);
+    for (size_t i = tags->id; i < end; i++) {
+        if (summary_has_key(&check->summary,
+                    &check->context->summary_keys[i]))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Returns [false] if the summary of the directory [name] of [dirfd]
+ * shows that none of its files matches the query of the SearchContext
+ * [arg], [true] if it has no summary or a file may match.
+ */
+static bool may_hold_matches(
+        WalkWorker *worker,
+        int dirfd,
+        const char *name,
+        void *arg)
+{
+    SummaryCheck check = { .context = arg };
+    walk_stats_count(worker != NULL ? worker->stats : NULL,
+            WALK_SYSCALL_GETXATTR, 1);
+    if (!summary_read_at(dirfd, name, &check.summary))
+        return true;
+    /* The files having no tag never match.  */
+    if (summary_is_empty(&check.summary))
+        return false;
+    return tag_query_may_match(check.context->query, summary_has_group,
+            &check);
+}
 
-    size_t dirname_len = strlen(directory);
-    size_t path_len = (dirname_len + 2) * 2;
-    char *path = malloc(path_len);
-    if (path == NULL) {
+/**
+ * Computes the keys of the tags of the query of [context] in the
+ * summaries, so that the walk skips the directories which cannot hold
+ * a matching file.
+ */
+static void set_summary_keys(SearchContext *context)
+{
+    const TagQuery *query = context->query;
+    context->summary_keys = malloc((query->nb_tags + 1) * sizeof(SummaryKey));
+    if (context->summary_keys == NULL) {
         perror("malloc");
         exit(EXIT_FAILURE);
     }
-    int rc = snprintf(path, path_len, "%s", directory);
-    if (rc < 0) {
-        perror("snprintf");
-        exit(EXIT_FAILURE);
+    for (size_t i = 0; i < query->nb_tags; i++) {
+        const char *tag = tag_query_tag_name(query, i);
+        summary_key(tag, strlen(tag), &context->summary_keys[i]);
     }
-    PascalBuffer path_buf = {
-        .str = path, .str_length = rc, .str_capacity = path_len
+}
+
+/**
+ * Writes to [output] the name of the files, in the [nb_dirs]
+ * directories [dirs], that match the search expression [query] planned
+ * as [plan], ranked by [sort] if the output keeps the top files. The
+ * directories are walked with the threads and the pruning of
+ * [walk_options], and the attributes are read through io_uring if
+ * [use_uring] is [true]. If [use_summary] is [true], the directories
+ * whose summary shows that they hold no matching file are skipped.
+ * The files already in [reported], if not NULL, are not output again.
+ * The walk stops as soon as the output takes no more files.
+ * Returns [false] if an error occurs], [true] otherwise.
+ */
+static bool display_files(
+        const char *dirs[],
+        int nb_dirs,
+        const TagQuery *query,
+        const SearchPlan *plan,
+        ResultOutput *output,
+        SortKey sort,
+        const WalkOptions *walk_options,
+        bool use_uring,
+        bool use_summary,
+        InodeSet *reported)
+{
+    assert(dirs != NULL);
+    assert(query != NULL);
+    assert(output != NULL);
+    assert(walk_options != NULL);
+
+    SearchContext context = {
+        .query = query, .output = output, .sort = sort, .reported = reported
     };
+    WalkOptions options = *walk_options;
+    options.on_file = print_if_correct;
+    options.arg = &context;
+    if (use_summary) {
+        set_summary_keys(&context);
+        options.filter_dir = may_hold_matches;
+    }
+    /* The roots are checked against their summary like the others.  */
+    const char *roots[nb_dirs + 1];
+    int nb_roots = 0;
+    for (int i = 0; i < nb_dirs; i++) {
+        if (use_summary) {
+            walk_stats_count(options.stats, WALK_SYSCALL_GETXATTR, 1);
+            if (!may_hold_matches(NULL, AT_FDCWD, dirs[i], &context))
+                continue;
+        }
+        roots[nb_roots++] = dirs[i];
+    }
+    if (nb_roots == 0) {
+        free(context.summary_keys);
+        return true;
+    }
+    set_probes(&context, plan);
+    if (use_uring) {
+        options.on_batch = print_correct_batch;
+        options.use_uring = true;
+    }
+    bool success = walk_trees(roots, nb_roots, &options);
+    free_probes(&context);
+    free(context.summary_keys);
+    return success;
+}
+
+/**
+ * Writes to [output] the paths read from the standard input, ended by
+ * [delimiter], of the files matching the search expression [query],
+ * in the order in which they are read. The empty paths are skipped.
+ * The reading stops as soon as the output takes no more files.
+ * The files already in [reported], if not NULL, are not output again.
+ * The files read are counted in [stats], if not NULL.
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool filter_paths(
+        int delimiter,
+        const TagQuery *query,
+        const SearchPlan *plan,
+        ResultOutput *output,
+        SortKey sort,
+        InodeSet *reported,
+        WalkStats *stats)
+{
+    assert(query != NULL);
+    assert(output != NULL);
+
+    SearchContext context = {
+        .query = query, .output = output, .sort = sort, .reported = reported
+    };
+    set_probes(&context, plan);
     PascalBuffer xattr_buf = {0};
-    bool success = list_correct_files(params, &path_buf, &xattr_buf);
-    free(path_buf.str);
+    extends_buffer(&xattr_buf, INITIAL_XATTR_LIST_SIZE);
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    bool success = true;
+    while (!output_done(output) && (len = getdelim(&line, &line_capacity,
+                    delimiter, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == delimiter)
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        /* As in a walk, the directories are not checked.  */
+        struct statx stx;
+        walk_stats_count(stats, WALK_SYSCALL_STATX, 1);
+        if (statx(AT_FDCWD, line, 0, STATX_TYPE, &stx) == -1) {
+            fprintf(stderr, "Could not stat '%s': %s\n", line,
+                    strerror(errno));
+            success = false;
+            continue;
+        }
+        if (S_ISDIR(stx.stx_mode))
+            continue;
+        if (stats != NULL)
+            stats->nb_files++;
+        WalkEntry entry = {
+            AT_FDCWD, line, len, IFTODT(stx.stx_mode), NULL
+        };
+        bool match = false;
+        if (!file_matches(&entry, &context, &xattr_buf, stats, &match)) {
+            fprintf(stderr, "Could not get tags for '%s': %s\n", line,
+                    strerror(errno));
+            success = false;
+        } else if (match) {
+            success = output_match(&context, AT_FDCWD, line, line, stats)
+                && success;
+        }
+    }
+    if (ferror(stdin)) {
+        perror("Could not read the standard input");
+        success = false;
+    }
+    free(line);
     free(xattr_buf.str);
+    free_probes(&context);
     return success;
 }
 
 
 /**
- * Adds the names offf all the children tags of the TagsTree
- * root [root] to the Resizable string array [array].
+ * The tagged files found while building the index, collected by all
+ * the workers of the walk.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    TagIndex found;
+} IndexBuilder;
+
+/**
+ * Adds the file [entry] to the IndexBuilder given as [arg] if it is
+ * tagged by the current user.
+ */
+static bool add_to_index(WalkWorker *worker, const WalkEntry *entry, void *arg)
+{
+    assert(worker != NULL);
+    assert(entry != NULL);
+    assert(arg != NULL);
+
+    IndexBuilder *builder = arg;
+    PascalBuffer *xattr_buf = &worker->xattr_buf;
+    if (!get_xattr_list(entry, xattr_buf, worker->stats)) {
+        int errno_save = errno;
+        fprintf(stderr, "Could not get tags for '%s': %s\n",
+                walk_entry_path(worker, entry), strerror(errno_save));
+        return false;
+    }
+
+    const char *tags[xattr_buf->str_length / 2 + 1];
+    size_t nb_tags = 0;
+    XattrTagScanner scanner;
+    const char *tag;
+    size_t tag_len;
+    scan_xattr_tags(&scanner, xattr_buf->str, xattr_buf->str_length);
+    while (next_xattr_tag(&scanner, &tag, &tag_len))
+        tags[nb_tags++] = tag;
+    if (nb_tags == 0)
+        return true;
+
+    struct stat st;
+    const char *path = walk_entry_path(worker, entry);
+    char *real_path = NULL;
+    walk_stats_count(worker->stats, WALK_SYSCALL_FSTATAT, 1);
+    if (fstatat(entry->dirfd, entry->name, &st, 0) == -1
+            || (real_path = realpath(path, NULL)) == NULL) {
+        fprintf(stderr, "Could not index '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    pthread_mutex_lock(&builder->lock);
+    IndexedFile *file = index_add_file(&builder->found, real_path);
+    if (worker->stats != NULL)
+        worker->stats->nb_matches++;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    index_set_tags(file, tags, nb_tags);
+    pthread_mutex_unlock(&builder->lock);
+    free(real_path);
+    return true;
+}
+
+/**
+ * Returns [true] if the absolute path [path] is the directory [dir] or
+ * is located under it.
+ */
+static bool is_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    if (len == 1)
+        return true;
+    return strncmp(path, dir, len) == 0
+        && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * Writes to [real_dirs] the real paths of the [*nb_dirs] directories
+ * [dirs], to be freed by the caller. The directories located under
+ * another one, or given twice, are removed from both arrays, since
+ * the walk of the other one covers them, and [*nb_dirs] is updated.
+ * Returns [false] and prints an error message if a path could not be
+ * resolved, in which case nothing is left to free.
+ */
+static bool resolve_dirs(const char *dirs[], char *real_dirs[], int *nb_dirs)
+{
+    for (int i = 0; i < *nb_dirs; i++) {
+        real_dirs[i] = realpath(dirs[i], NULL);
+        if (real_dirs[i] == NULL) {
+            fprintf(stderr, "Could not resolve '%s': %s\n", dirs[i],
+                    strerror(errno));
+            for (int j = 0; j < i; j++)
+                free(real_dirs[j]);
+            return false;
+        }
+    }
+    bool dropped[*nb_dirs + 1];
+    for (int i = 0; i < *nb_dirs; i++) {
+        dropped[i] = false;
+        for (int j = 0; j < *nb_dirs && !dropped[i]; j++) {
+            /* Of two equal paths, the first one is kept.  */
+            if (j != i && is_under(real_dirs[i], real_dirs[j])
+                    && (strcmp(real_dirs[i], real_dirs[j]) != 0 || j < i))
+                dropped[i] = true;
+        }
+    }
+    int nb_kept = 0;
+    for (int i = 0; i < *nb_dirs; i++) {
+        if (dropped[i]) {
+            free(real_dirs[i]);
+            continue;
+        }
+        dirs[nb_kept] = dirs[i];
+        real_dirs[nb_kept++] = real_dirs[i];
+    }
+    *nb_dirs = nb_kept;
+    return true;
+}
+
+/**
+ * Frees the [nb_dirs] paths [real_dirs] written by resolve_dirs().
+ */
+static void free_dirs(char *real_dirs[], int nb_dirs)
+{
+    for (int i = 0; i < nb_dirs; i++)
+        free(real_dirs[i]);
+}
+
+/**
+ * Walks the [nb_dirs] directories [dirs], whose real paths are
+ * [real_dirs], with the threads and the pruning of [walk_options] and
+ * replaces the entries of the index located under them by the tagged
+ * files found, so that the files of the pruned directories leave the
+ * index. The index is created if it does not exist.
  * Returns [false] if an error occurs, [true] otherwise.
  */
-static bool add_all_children(const TagsTree *root, RedimStringArray *array)
+static bool build_index(
+        const char *dirs[],
+        char *real_dirs[],
+        int nb_dirs,
+        const WalkOptions *walk_options)
 {
-    assert(root != NULL);
-    assert(array != NULL);
+    assert(dirs != NULL);
+    assert(real_dirs != NULL);
+    assert(walk_options != NULL);
 
-    // add all children
-    TagsTree children_array = {0};
-    if (get_children_array(root, &children_array) != NO_ERROR) {
+    /* The changes made during the walk are replayed afterwards.  */
+    JournalCursor start;
+    TagError error = journal_end(&start);
+    if (error != NO_ERROR) {
+        print_tag_error(error);
         return false;
     }
+    IndexBuilder builder = { .found = {0} };
+    pthread_mutex_init(&builder.lock, NULL);
+    WalkOptions options = *walk_options;
+    options.on_file = add_to_index;
+    options.arg = &builder;
+    bool success = walk_trees(dirs, nb_dirs, &options);
+
+    error = index_merge(&builder.found, (const char **) real_dirs, nb_dirs,
+            &start);
+    if (error == JOURNAL_CURSOR_LOST) {
+        print_tag_error(error);
+        fprintf(stderr, "The files indexed outside of the given "
+                "directories may be out of date\n");
+    } else if (error != NO_ERROR) {
+        print_tag_error(error);
+        success = false;
+    }
+
+    free_index(&builder.found);
+    pthread_mutex_destroy(&builder.lock);
+    return success;
+}
+
+/**
+ * Writes to [set] the identifiers of the files of [reader] having
+ * one of the tags of the group [group] of [query].
+ */
+static void tags_files(
+        const IndexReader *reader,
+        const TagQuery *query,
+        size_t group,
+        Bitmap *set)
+{
+    Bitmap files;
+    memset(set, 0, sizeof(*set));
+    const QueryGroup *tags = &query->groups[group];
+    size_t end = tags->id + (tags->end - tags->first);
+    for (size_t i = tags->id; i < end; i++) {
+        const char *tag = tag_query_tag_name(query, i);
+        if (index_tag_files(reader, tag, &files)) {
+            bitmap_or(set, &files);
+            bitmap_free(&files);
+        }
+    }
+}
 
+/**
+ * Writes to [set] the identifiers of the files of [reader] in
+ * [first, end) matching the node [node] of [query]. The chains of
+ * operators built by the parser, which nest on their left, are
+ * evaluated from their left end without nesting calls.
+ */
+static void query_files(
+        const IndexReader *reader,
+        const TagQuery *query,
+        size_t node,
+        uint32_t first,
+        uint32_t end,
+        Bitmap *set)
+{
+    const QueryNode *nodes = query->nodes;
+    size_t nb_chained = 0;
+    size_t leaf = node;
+    for (; nodes[leaf].op == QUERY_AND || nodes[leaf].op == QUERY_OR;
+            leaf = nodes[leaf].left)
+        nb_chained++;
+    size_t *chain = malloc(nb_chained * sizeof(size_t));
+    if (chain == NULL && nb_chained > 0) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = nb_chained; i > 0; node = nodes[node].left)
+        chain[--i] = node;
+
+    Bitmap operand;
+    if (nodes[leaf].op == QUERY_TAG) {
+        tags_files(reader, query, nodes[leaf].group, set);
+        bitmap_keep_range(set, first, end);
+    } else {
+        query_files(reader, query, nodes[leaf].left, first, end, &operand);
+        memset(set, 0, sizeof(*set));
+        bitmap_set_range(set, first, end);
+        bitmap_andnot(set, &operand);
+        bitmap_free(&operand);
+    }
+    for (size_t i = 0; i < nb_chained; i++) {
+        const QueryNode *op = &nodes[chain[i]];
+        const QueryNode *right = &nodes[op->right];
+        if (op->op == QUERY_AND && right->op == QUERY_NOT) {
+            /* No need to complement the operand.  */
+            query_files(reader, query, right->left, first, end, &operand);
+            bitmap_andnot(set, &operand);
+        } else {
+            query_files(reader, query, op->right, first, end, &operand);
+            if (op->op == QUERY_AND)
+                bitmap_and(set, &operand);
+            else
+                bitmap_or(set, &operand);
+        }
+        bitmap_free(&operand);
+    }
+    free(chain);
+}
+
+/**
+ * Returns [true] if the file [path] still matches [query],
+ * using [xattr_buf] to read its attributes, the reads being counted
+ * in [stats] if not NULL.
+ */
+static bool verify_file(
+        const char *path,
+        const TagQuery *query,
+        PascalBuffer *xattr_buf,
+        WalkStats *stats)
+{
+    unsigned int nb_calls = 0;
+    uint64_t start = walk_stats_start(stats);
+    ssize_t buflen = read_xattr_list(AT_FDCWD, path, xattr_buf, &nb_calls);
+    walk_stats_count(stats, WALK_SYSCALL_LISTXATTR, nb_calls);
+    if (buflen == -1)
+        return false;
+    walk_stats_end(stats, start);
+    if (stats != NULL)
+        stats->xattr_name_bytes += buflen;
+    return valid_result(xattr_buf, query);
+}
+
+/**
+ * Outputs the files of [reader], in the directory [directory] whose
+ * real path is [real_dir], that match the query of [context]. If
+ * [verify] is [true], the attributes of the matching files are read
+ * again into [xattr_buf] to skip the files which no longer match. The
+ * files read are counted in [stats], if not NULL.
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool display_indexed_dir(
+        const IndexReader *reader,
+        const char *directory,
+        const char *real_dir,
+        const SearchContext *context,
+        bool verify,
+        PascalBuffer *xattr_buf,
+        WalkStats *stats)
+{
+    const TagQuery *query = context->query;
+    /* The index only holds tagged files.  */
+    uint32_t first, end;
+    index_dir_range(reader, real_dir, &first, &end);
+    Bitmap result = {0};
+    if (query->root < 0)
+        bitmap_set_range(&result, first, end);
+    else
+        query_files(reader, query, query->root, first, end, &result);
+    uint32_t *ids = malloc(bitmap_cardinality(&result) * sizeof(uint32_t));
+    if (ids == NULL && bitmap_cardinality(&result) > 0) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t nb_ids = bitmap_to_array(&result, ids);
+    bitmap_free(&result);
+
+    size_t real_dir_len = strlen(real_dir);
+    if (real_dir_len == 1)
+        real_dir_len = 0;
+    PascalBuffer found = {0};
     bool success = true;
-    TagsTree child_tag = {0};
-    cJSON *child = NULL;
-    TagError error;
-    const char *tag_name = NULL;
-    cJSON_ArrayForEach(child, children_array.json_tree) {
-        child_tag.json_tree = child;
-        if ((error = get_name(&child_tag, &tag_name)) != NO_ERROR) {
-            print_tag_error(error);
-            success = false;
+    for (size_t i = 0; i < nb_ids && !output_done(context->output); i++) {
+        const char *path = index_file_path(reader, ids[i]);
+        if (stats != NULL)
+            stats->nb_files++;
+        if (verify && !verify_file(path, query, xattr_buf, stats))
             continue;
-        }
-        add_to_str_array(array, tag_name);
-        success = success && add_all_children(&child_tag, array);
+        /* Output the paths relatively to the given directory.  */
+        found.str_length = 0;
+        append_str_to_buffer(&found, directory, strlen(directory));
+        append_str_to_buffer(&found, path + real_dir_len,
+                strlen(path + real_dir_len));
+        success = output_match(context, AT_FDCWD, path, found.str, stats)
+            && success;
     }
+    free(found.str);
+    free(ids);
     return success;
 }
 
 /**
- * Adds the children tags of the tag [tag] to the
- * Resizable string array [array].
+ * Writes to [output] the name of the files, in the [nb_dirs]
+ * directories [dirs] whose real paths are [real_dirs], that match the
+ * search expression [query] according to the index, without walking
+ * the directories, ranked by [sort] if the output keeps the top files.
+ * If [verify] is [true], the attributes of the matching files are read
+ * again to skip the files which no longer match. The files already in
+ * [reported], if not NULL, are not output again. The files read are
+ * counted in [stats], if not NULL.
  * Returns [false] if an error occurs, [true] otherwise.
  */
-static bool add_tag_children(
-        const TagsTree *root,
-        const char *tag,
-        RedimStringArray *array)
+static bool display_indexed_files(
+        const char *dirs[],
+        char *real_dirs[],
+        int nb_dirs,
+        const TagQuery *query,
+        ResultOutput *output,
+        SortKey sort,
+        bool verify,
+        InodeSet *reported,
+        WalkStats *stats)
 {
-    assert(root != NULL);
-    assert(tag != NULL);
-    assert(array != NULL);
+    assert(dirs != NULL);
+    assert(real_dirs != NULL);
+    assert(query != NULL);
+    assert(output != NULL);
 
-    TagsTree tag_tree;
-    TagError tag_error;
-    if (!get_tag(root, tag, &tag_tree, &tag_error) && tag_error != NO_ERROR) {
-        print_tag_error(tag_error);
+    TagError error = update_index();
+    if (error != NO_ERROR) {
+        print_tag_error(error);
+        fprintf(stderr, "The index may be out of date, rebuild it with "
+                "--build-index\n");
+    }
+    const IndexReader *reader;
+    error = get_index_reader(&reader);
+    if (error != NO_ERROR) {
+        print_tag_error(error);
         return false;
     }
-    return add_all_children(&tag_tree, array);
+
+    PascalBuffer xattr_buf = {0};
+    extends_buffer(&xattr_buf, INITIAL_XATTR_LIST_SIZE);
+    SearchContext context = {
+        .query = query, .output = output, .sort = sort, .reported = reported
+    };
+    bool success = true;
+    for (int i = 0; i < nb_dirs && !output_done(output); i++)
+        success = display_indexed_dir(reader, dirs[i], real_dirs[i],
+                &context, verify, &xattr_buf, stats) && success;
+    free(xattr_buf.str);
+    return success;
 }
 
+
 /**
- * Parses the [tag_search] list of [nb_members] elements
- * and writes the result to [*params].
- * If the [tag_search] list contains invalid search members,
- * an error message is printed and the function returns [false],
- * [true] is returned otherwise.
+ * Plans [query] with the statistics of its groups and writes them to
+ * [plan], whose [stats] must hold one entry per group. The cost of a
+ * group is its number of tags, and the probability that a tagged file
+ * has one of them is estimated from the number of files having each
+ * tag in the index, or taken as 1/2 when the user has no index.
  */
-bool get_tag_search_params(
-        const char *tags_search[],
-        int nb_members,
-        TagSearchParams *params,
-        const TagsTree *root)
+static void plan_search(TagQuery *query, SearchPlan *plan)
 {
-    assert(tags_search != NULL);
-    assert(params != NULL);
+    assert(query != NULL);
+    assert(plan != NULL);
 
-    memset(params, 0, sizeof(*params));
-    const char *tag;
-    for (int i = 0; i < nb_members; i++) {
-        tag = tags_search[i];
-        if (tag[0] != '+' && tag[0] != '_') {
-            fprintf(stderr, "Invalid tag search member '%s': "
-                    "char '%c' is not a valid modifier\n", tag, tag[0]);
-            goto ERROR;
-        }
-        RedimStringArray str_array = {0};
-        if (!add_tag_children(root, tag + 1, &str_array))
-            goto ERROR;
-        add_to_str_array(&str_array, tag + 1);
-        switch (tag[0]) {
-            case '_': add_to_redim_array(&params->unwanted_tags, &str_array);
-                      break;
-            case '+': add_to_redim_array(&params->wanted_tags, &str_array);
-                      break;
-            default:
-                      assert(0);
-        }
+    /* Searching without an index is fine, only the estimates suffer.  */
+    const IndexReader *reader;
+    if (get_index_reader(&reader) != NO_ERROR || index_nb_files(reader) == 0)
+        reader = NULL;
+    for (size_t group = 0; group < query->nb_groups; group++) {
+        size_t first = query->groups[group].id;
+        size_t end = first + (query->groups[group].end
+                - query->groups[group].first);
+        plan->stats[group] = (QueryGroupStats) {
+            .probability = 0.5, .cost = end - first
+        };
+        if (reader == NULL)
+            continue;
+        /* A file having several tags of the group is counted for each.  */
+        double nb_files = 0;
+        for (size_t i = first; i < end; i++)
+            nb_files += index_tag_nb_files(reader,
+                    tag_query_tag_name(query, i));
+        plan->stats[group].probability = nb_files < index_nb_files(reader)
+            ? nb_files / index_nb_files(reader) : 1;
     }
-    return true;
+    plan->indexed_stats = reader != NULL;
+    plan->expected_probes = tag_query_plan(query, plan->stats);
+}
 
-ERROR:
-    free_tag_search_params(params);
-    memset(params, 0, sizeof(*params));
-    return false;
+/**
+ * Prints how the search of [query] planned as [plan] would be
+ * answered: where the statistics of its groups come from, whether the
+ * attributes of the files would be listed or probed, through io_uring
+ * if [use_uring] is [true], or not read at all if [use_index] is
+ * [true], and the plan of the query.
+ */
+static void explain_search(
+        const TagQuery *query,
+        const SearchPlan *plan,
+        bool use_index,
+        bool use_uring)
+{
+    if (plan->indexed_stats) {
+        const IndexReader *reader;
+        get_index_reader(&reader);
+        printf("Statistics: tag index of %" PRIu32 " files\n",
+                index_nb_files(reader));
+    } else {
+        printf("Statistics: none, no tag index\n");
+    }
+
+    SearchContext context = { .query = query };
+    set_probes(&context, plan);
+    if (use_index)
+        printf("Mode: tag index\n");
+    else if (use_uring && context.nb_probes > 0
+            && context.nb_probes <= MAX_PROBES)
+        printf("Mode: probe all the tags through io_uring\n");
+    else if (context.probe_mode)
+        printf("Mode: probe the tags with getxattr(2)\n");
+    else
+        printf("Mode: list the tags with listxattr(2)\n");
+    free_probes(&context);
+
+    if (query->root < 0)
+        printf("Evaluator: any tag\n");
+    else if (is_single_group(query))
+        printf("Evaluator: single tag\n");
+    else
+        printf("Evaluator: plan of %zu steps, %.2f probes expected per "
+                "tagged file\n", query->nb_steps, plan->expected_probes);
+    print_tag_query_plan(query, plan->stats, stdout);
+}
+
+/*
+ * The tags of the config numbered for the search expressions, if
+ * [has_hierarchy], and the generation of the config they come from.
+ */
+static TagHierarchy hierarchy;
+static unsigned int hierarchy_generation;
+static bool has_hierarchy = false;
+
+/**
+ * Numbers the tags of the config tree [root] of generation
+ * [generation] into [hierarchy], unless they already are.
+ * Returns [false] if the tree is invalid.
+ */
+static bool update_hierarchy(const TagsTree *root, unsigned int generation)
+{
+    if (has_hierarchy && hierarchy_generation == generation)
+        return true;
+    if (has_hierarchy)
+        free_tag_hierarchy(&hierarchy);
+    has_hierarchy = build_tag_hierarchy(root, &hierarchy);
+    hierarchy_generation = generation;
+    return has_hierarchy;
+}
+
+void search_tag_file_refresh(void)
+{
+    const TagsTree *root;
+    unsigned int generation;
+    if (get_config_tree(&root, &generation) == NO_ERROR)
+        update_hierarchy(root, generation);
+}
+
+/**
+ * Returns the time in nanoseconds of the monotonic clock.
+ */
+static uint64_t clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Adds the time elapsed since [*start] to the phase [phase] of
+ * [phases], and starts the next phase.
+ */
+static void end_phase(uint64_t phases[], SearchPhase phase, uint64_t *start)
+{
+    uint64_t now = clock_ns();
+    phases[phase] += now - *start;
+    *start = now;
+}
+
+/**
+ * Prints to stderr the counters [stats] of a search, the durations
+ * [phases] of its phases and the peak memory of the process.
+ */
+static void print_search_stats(const WalkStats *stats, const uint64_t phases[])
+{
+    walk_stats_print(stats, stderr);
+    fprintf(stderr, "Phases:\n");
+    for (int i = 0; i < NB_PHASES; i++)
+        fprintf(stderr, "  %-16s%.3f ms\n", phase_names[i], phases[i] / 1e6);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stderr, "Peak RSS: %ld KiB\n", usage.ru_maxrss);
 }
 
 static void print_help(const char *prog_name)
 {
     fprintf(stderr,
-            "Usage: %s <dir> [<expression>]\n"
+            "Usage: %s [OPTION]... <dir> [<expression>]\n"
+            "   or: %s [OPTION]... <dir>... -- [<expression>]\n"
+            "   or: %s [OPTION]... --stdin [<expression>]\n"
             "   or: %s -h\n\n"
-            "Search recursively for files matching the given expression.\n\n"
-            "<expression> is an expression consisting of tags and modifiers:\n"
-            "\t_tag1 means that the file MUST NOT be tagged with tag1\n"
-            "\t+tag2 means that the file MUST be tagged with tag2\n"
-            "A <tag_search_expr> is then a list of tags preceded by '_' or '+'\n"
+            "Search recursively for files matching the given expression.\n"
+            "Several directories are searched at once, the ones located\n"
+            "under another being searched once, when \"--\" ends them.\n\n"
+            "<expression> is a boolean expression of tags, a file having a\n"
+            "tag when it is tagged with it or with one of its descendants:\n"
+            "\ttag1 or +tag1\tthe file MUST be tagged with tag1\n"
+            "\t!tag1 or _tag1\tthe file MUST NOT be tagged with tag1\n"
+            "\ta & b or a b\tboth a and b hold\n"
+            "\ta | b\t\teither a or b holds\n"
+            "\t( a )\t\tgroups a, '!' and '_' also apply to groups\n"
+            "'!' binds tighter than '&', which binds tighter than '|'.\n"
+            "Quote the operators so that the shell does not read them.\n"
             "If no expression is provided, all the files tagged by the current\n"
-            "user and accessible from <dir> will be listed.\n"
-            "The '-h' option prints this help message\n\n",
-            prog_name, prog_name);
+            "user and accessible from <dir> will be listed.\n\n"
+            "Options:\n"
+            "\t--stdin\t\tCheck the files whose paths are read from the\n"
+            "\t\t\t standard input, one per line, instead of\n"
+            "\t\t\t walking directories\n"
+            "\t-z\t\tWith --stdin, read paths ended by a null byte,\n"
+            "\t\t\t like the output of find -print0\n"
+            WALK_OPTIONS_HELP
+            "\t--uring\t\tRead the attributes of the files by batches\n"
+            "\t\t\t through io_uring when the kernel supports it\n"
+            "\t--index\t\tAnswer from the tag index instead of walking <dir>\n"
+            "\t--verify\tWith --index, check that the files still match\n"
+            "\t--build-index\tWalk <dir> and store its tagged files in the\n"
+            "\t\t\t tag index, replacing its previous entries\n"
+            "\t--summary\tSkip the directories whose tag summary shows\n"
+            "\t\t\t that they hold no matching file\n"
+            "\t--build-summary\tWrite the tag summary of every directory\n"
+            "\t\t\t under <dir>, kept up to date by assign-tag\n"
+            "\t--explain\tPrint how the expression would be evaluated\n"
+            "\t\t\t instead of searching\n"
+            "\t--stats\t\tPrint to stderr what the search did: files,\n"
+            "\t\t\t system calls, time per phase, peak memory\n"
+            "\t\t\t and latency of the attribute reads\n"
+            "\t-0, --print0\tEnd the paths with a null byte instead of a\n"
+            "\t\t\t newline, for xargs -0\n"
+            "\t--exec <cmd> [<arg>]... {} +\n"
+            "\t\t\tRun <cmd> with the matching files as its last\n"
+            "\t\t\t arguments, as many at once as possible\n"
+            "\t--limit <n>\tStop after <n> matching files\n"
+            "\t--top <n>\tOnly output the <n> matching files of highest\n"
+            "\t\t\t key, by decreasing key\n"
+            "\t--sort <key>\tWith --top, rank the files by 'mtime' (the\n"
+            "\t\t\t default, most recent first) or 'size'\n"
+            "\t--unique\tOutput a file having several hard links once\n"
+            "\t-h\t\tPrint this help message\n\n",
+            prog_name, prog_name, prog_name, prog_name);
 }
 
-int main(int argc, const char *argv[])
+/**
+ * The command line options of search-tag-file. [walk] holds the number
+ * of threads and the pruning of the walks.
+ */
+typedef struct {
+    WalkOptions walk;
+    bool use_uring;
+    bool use_index;
+    bool verify;
+    bool build_index;
+    bool use_summary;
+    bool build_summary;
+    bool unique;
+    bool explain;
+    bool stats;
+    bool from_stdin;
+    int delimiter;
+    OutputOptions output;
+    SortKey sort;
+    bool sorted;
+} SearchOptions;
+
+/**
+ * Parses the argument [arg] of the option [opt], a positive number of
+ * files, and writes it to [*count].
+ * Returns [false] and prints an error message if it is invalid.
+ */
+static bool parse_count(const char *opt, const char *arg, size_t *count)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *arg == '-' || *end != '\0' || errno != 0
+            || value == 0 || value > SIZE_MAX / sizeof(RankedPath)) {
+        fprintf(stderr, "Invalid number of files '%s' for '%s'\n", arg, opt);
+        return false;
+    }
+    *count = value;
+    return true;
+}
+
+/**
+ * Parses the options at the beginning of [argv] and writes them to
+ * [options]. Returns the index of the first non option argument,
+ * which may be "--", or -1 if an option is invalid.
+ */
+static int parse_options(int argc, const char *argv[], SearchOptions *options)
+{
+    assert(options != NULL);
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--") != 0;
+            i++) {
+        const char *opt = argv[i];
+        int walk_option = walk_parse_option(argc, argv, &i, &options->walk);
+        if (walk_option < 0) {
+            return -1;
+        } else if (walk_option > 0) {
+            continue;
+        } else if (strcmp(opt, "--unique") == 0) {
+            options->unique = true;
+        } else if (strcmp(opt, "--uring") == 0) {
+            options->use_uring = true;
+        } else if (strcmp(opt, "--index") == 0) {
+            options->use_index = true;
+        } else if (strcmp(opt, "--verify") == 0) {
+            options->verify = true;
+        } else if (strcmp(opt, "--build-index") == 0) {
+            options->build_index = true;
+        } else if (strcmp(opt, "--summary") == 0) {
+            options->use_summary = true;
+        } else if (strcmp(opt, "--build-summary") == 0) {
+            options->build_summary = true;
+        } else if (strcmp(opt, "--explain") == 0) {
+            options->explain = true;
+        } else if (strcmp(opt, "--stats") == 0) {
+            options->stats = true;
+        } else if (strcmp(opt, "--stdin") == 0) {
+            options->from_stdin = true;
+        } else if (strcmp(opt, "-z") == 0) {
+            options->delimiter = '\0';
+        } else if (strcmp(opt, "-0") == 0 || strcmp(opt, "--print0") == 0) {
+            options->output.separator = '\0';
+        } else if (strcmp(opt, "--limit") == 0 || strcmp(opt, "--top") == 0
+                || strcmp(opt, "--sort") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option '%s' requires an argument\n", opt);
+                return -1;
+            }
+            const char *arg = argv[++i];
+            if (strcmp(opt, "--sort") == 0) {
+                if (strcmp(arg, "mtime") == 0) {
+                    options->sort = SORT_MTIME;
+                } else if (strcmp(arg, "size") == 0) {
+                    options->sort = SORT_SIZE;
+                } else {
+                    fprintf(stderr, "Invalid sort key '%s'\n", arg);
+                    return -1;
+                }
+                options->sorted = true;
+            } else if (!parse_count(opt, arg, strcmp(opt, "--limit") == 0
+                        ? &options->output.limit : &options->output.top)) {
+                return -1;
+            }
+        } else if (strcmp(opt, "--exec") == 0) {
+            /* The command ends with "{} +", like for find(1).  */
+            int end = i + 1;
+            while (end + 1 < argc && (strcmp(argv[end], "{}") != 0
+                        || strcmp(argv[end + 1], "+") != 0))
+                end++;
+            if (end + 1 >= argc || end == i + 1) {
+                fprintf(stderr, "Option '%s' requires a command ending "
+                        "with '{} +'\n", opt);
+                return -1;
+            }
+            options->output.exec_args = argv + i + 1;
+            options->output.nb_exec_args = end - i - 1;
+            i = end + 1;
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", opt);
+            return -1;
+        }
+    }
+    return i;
+}
+
+int search_tag_file_command(int argc, const char *argv[])
 {
     if (argc < 2) {
         print_help(argv[0]);
@@ -348,37 +1433,163 @@ int main(int argc, const char *argv[])
         return EXIT_SUCCESS;
     }
 
-    const char *dirpath = argv[1];
-    struct stat stats = {0};
-    stat(dirpath, &stats);
-    if (!S_ISDIR(stats.st_mode)) {
-        fprintf(stderr, "Directory '%s' does not exist\n", dirpath);
+    const char *excludes[argc];
+    SearchOptions options = {
+        .walk = {
+            .nb_threads = 1, .excludes = excludes
+        },
+        .output = { .separator = '\n' },
+        .delimiter = '\n'
+    };
+    int first_arg = parse_options(argc, argv, &options);
+    if (first_arg < 0 || (first_arg >= argc && !options.from_stdin)) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    } else if (options.sorted && options.output.top == 0) {
+        /* Sorting all the files would keep them all in memory.  */
+        fprintf(stderr, "--sort requires --top\n");
         return EXIT_FAILURE;
     }
 
+    /* Several directories end at "--", a single one needs not.  */
+    const char **dirs = argv + first_arg;
+    int nb_dirs = 0;
+    int expr_arg = first_arg;
+    if (!options.from_stdin) {
+        while (expr_arg < argc && strcmp(argv[expr_arg], "--") != 0)
+            expr_arg++;
+        if (expr_arg < argc) {
+            nb_dirs = expr_arg++ - first_arg;
+        } else {
+            nb_dirs = 1;
+            expr_arg = first_arg + 1;
+        }
+        if (nb_dirs == 0) {
+            print_help(argv[0]);
+            return EXIT_FAILURE;
+        }
+    } else if (expr_arg < argc && strcmp(argv[expr_arg], "--") == 0) {
+        expr_arg++;
+    }
+
+    if (options.from_stdin && (options.use_index || options.build_index
+                || options.build_summary)) {
+        fprintf(stderr, "--stdin cannot be used with --index, --build-index "
+                "or --build-summary\n");
+        return EXIT_FAILURE;
+    } else if (options.delimiter == '\0' && !options.from_stdin) {
+        fprintf(stderr, "-z requires --stdin\n");
+        return EXIT_FAILURE;
+    }
+
+    WalkStats stats = {0};
+    uint64_t phases[NB_PHASES] = {0};
+    uint64_t phase_start = clock_ns();
+    if (options.stats)
+        options.walk.stats = &stats;
+
+    for (int i = 0; i < nb_dirs; i++) {
+        struct stat st = {0};
+        if (stat(dirs[i], &st) == -1) {
+            fprintf(stderr, "Could not stat '%s': %s\n",
+                    dirs[i], strerror(errno));
+            return EXIT_FAILURE;
+        } else if (!S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "'%s' is not a directory\n", dirs[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
     load_config();
 
-    TagsTree root;
+    char *real_dirs[nb_dirs + 1];
+    if (options.build_index || options.build_summary) {
+        if (expr_arg != argc) {
+            fprintf(stderr, "%s does not take an expression\n",
+                    options.build_index ? "--build-index" : "--build-summary");
+            return EXIT_FAILURE;
+        }
+        if (!resolve_dirs(dirs, real_dirs, &nb_dirs))
+            return EXIT_FAILURE;
+        end_phase(phases, PHASE_CONFIG, &phase_start);
+        bool success = true;
+        if (options.build_index) {
+            success = build_index(dirs, real_dirs, nb_dirs, &options.walk);
+        } else {
+            for (int i = 0; i < nb_dirs; i++)
+                success = summary_build(real_dirs[i]) && success;
+        }
+        end_phase(phases, PHASE_SEARCH, &phase_start);
+        free_dirs(real_dirs, nb_dirs);
+        if (options.stats && options.build_index)
+            print_search_stats(&stats, phases);
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    const TagsTree *root;
+    unsigned int generation;
     TagError error;
-    if ((error = parse_config_file(JSON_CONFIG_FILE, &root)) != NO_ERROR) {
+    if ((error = get_config_tree(&root, &generation)) != NO_ERROR) {
         print_tag_error(error);
         return EXIT_FAILURE;
     }
 
-    TagSearchParams params = {0};
-    if (!get_tag_search_params(argv + 2, argc - 2, &params, &root))
-        goto FREE_RESOURCES_ON_ERROR;
-    if (!display_files(argv[1], &params))
-        goto FREE_RESOURCES_ON_ERROR;
+    TagQuery query;
+    if (!update_hierarchy(root, generation) || !parse_tag_query(
+                argv + expr_arg, argc - expr_arg, &hierarchy, &query))
+        return EXIT_FAILURE;
+    end_phase(phases, PHASE_CONFIG, &phase_start);
+    /* The statistics change with the index, so plan again each time.  */
+    QueryGroupStats group_stats[query.nb_groups + 1];
+    SearchPlan plan = { .stats = group_stats };
+    plan_search(&query, &plan);
+    end_phase(phases, PHASE_PLAN, &phase_start);
+    if (options.explain) {
+        explain_search(&query, &plan, options.use_index, options.use_uring);
+        free_tag_query(&query);
+        return EXIT_SUCCESS;
+    }
+    if (!resolve_dirs(dirs, real_dirs, &nb_dirs)) {
+        free_tag_query(&query);
+        return EXIT_FAILURE;
+    }
 
-    free_redim_redim_array(&params.wanted_tags);
-    free_redim_redim_array(&params.unwanted_tags);
-    cJSON_Delete(root.json_tree);
-    return EXIT_SUCCESS;
+    ResultOutput output;
+    InodeSet reported;
+    output_open(&output, &options.output);
+    if (options.unique)
+        inode_set_init(&reported);
+    bool success;
+    if (options.from_stdin)
+        success = filter_paths(options.delimiter, &query, &plan, &output,
+                options.sort, options.unique ? &reported : NULL,
+                options.walk.stats);
+    else if (options.use_index)
+        success = display_indexed_files(dirs, real_dirs, nb_dirs, &query,
+                &output, options.sort, options.verify,
+                options.unique ? &reported : NULL, options.walk.stats);
+    else
+        success = display_files(dirs, nb_dirs, &query, &plan, &output,
+                options.sort, &options.walk, options.use_uring,
+                options.use_summary, options.unique ? &reported : NULL);
+    end_phase(phases, PHASE_SEARCH, &phase_start);
+    success = output_close(&output) && success;
+    end_phase(phases, PHASE_OUTPUT, &phase_start);
+    free_dirs(real_dirs, nb_dirs);
+    free_tag_query(&query);
+    if (options.unique)
+        inode_set_free(&reported);
+    if (options.stats)
+        print_search_stats(&stats, phases);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-FREE_RESOURCES_ON_ERROR:
-    free_redim_redim_array(&params.wanted_tags);
-    free_redim_redim_array(&params.unwanted_tags);
-    cJSON_Delete(root.json_tree);
-    return EXIT_FAILURE;
+#ifndef TAGSYSD
+int main(int argc, const char *argv[])
+{
+    int status;
+    if (forward_to_daemon("search-tag-file", argc, argv, &status))
+        return status;
+    return search_tag_file_command(argc, argv);
 }
+#endif
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+#include "summary.h"
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The size of the attribute: the magic, the version and the bits.  */
+#define SUMMARY_MAGIC_LEN (sizeof(SUMMARY_MAGIC) - 1)
+#define SUMMARY_SIZE (SUMMARY_MAGIC_LEN + 1 + SUMMARY_BITS / 8)
+
+/* The size of the name of the attribute, with the digits of the uid.  */
+#define SUMMARY_ATTR_SIZE (sizeof(SUMMARY_XATTR_PREFIX) + 3 * sizeof(uid_t))
+
+/* How long a command waits for the lock of the summaries, and the
+ * delay between two attempts.  */
+#define SUMMARY_LOCK_TIMEOUT_MS 2000
+#define SUMMARY_LOCK_RETRY_MS 10
+
+void summary_key(const char *tag, size_t len, SummaryKey *key)
+{
+    assert(tag != NULL);
+    assert(key != NULL);
+
+    /* FNV-1a, mixed so that the high bits depend on all the chars.  */
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) tag[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+
+    /* The bits are h1 + i * h2, h2 being odd to reach every bit.  */
+    uint32_t h1 = hash;
+    uint32_t h2 = (hash >> 32) | 1;
+    for (int i = 0; i < SUMMARY_HASHES; i++)
+        key->bits[i] = (h1 + i * h2) % SUMMARY_BITS;
+}
+
+void summary_add_key(TagSummary *summary, const SummaryKey *key)
+{
+    assert(summary != NULL);
+    assert(key != NULL);
+
+    for (int i = 0; i < SUMMARY_HASHES; i++)
+        summary->bits[key->bits[i] / 8] |= 1 << (key->bits[i] % 8);
+}
+
+bool summary_has_key(const TagSummary *summary, const SummaryKey *key)
+{
+    assert(summary != NULL);
+    assert(key != NULL);
+
+    for (int i = 0; i < SUMMARY_HASHES; i++) {
+        if (!(summary->bits[key->bits[i] / 8] & (1 << (key->bits[i] % 8))))
+            return false;
+    }
+    return true;
+}
+
+bool summary_is_empty(const TagSummary *summary)
+{
+    assert(summary != NULL);
+
+    for (size_t i = 0; i < sizeof(summary->bits); i++) {
+        if (summary->bits[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Writes to [attr] the name of the attribute holding the summaries of
+ * the current user, [attr] having room for SUMMARY_ATTR_SIZE chars.
+ */
+static void summary_attribute(char *attr)
+{
+    snprintf(attr, SUMMARY_ATTR_SIZE, SUMMARY_XATTR_PREFIX "%u",
+            (unsigned int) getuid());
+}
+
+/**
+ * Reads the [size] bytes attribute [value] to [summary].
+ * Returns [false] if it is not a summary of this version.
+ */
+static bool decode_summary(
+        const uint8_t *value,
+        ssize_t size,
+        TagSummary *summary)
+{
+    if (size != SUMMARY_SIZE
+            || memcmp(value, SUMMARY_MAGIC, SUMMARY_MAGIC_LEN) != 0
+            || value[SUMMARY_MAGIC_LEN] != SUMMARY_VERSION)
+        return false;
+    memcpy(summary->bits, value + SUMMARY_MAGIC_LEN + 1,
+            sizeof(summary->bits));
+    return true;
+}
+
+/**
+ * Writes [summary] to the SUMMARY_SIZE bytes [value] of its attribute.
+ */
+static void encode_summary(const TagSummary *summary, uint8_t *value)
+{
+    memcpy(value, SUMMARY_MAGIC, SUMMARY_MAGIC_LEN);
+    value[SUMMARY_MAGIC_LEN] = SUMMARY_VERSION;
+    memcpy(value + SUMMARY_MAGIC_LEN + 1, summary->bits,
+            sizeof(summary->bits));
+}
+
+bool summary_read_at(int dirfd, const char *name, TagSummary *summary)
+{
+    assert(name != NULL);
+    assert(summary != NULL);
+
+    char attr[SUMMARY_ATTR_SIZE];
+    summary_attribute(attr);
+    uint8_t value[SUMMARY_SIZE];
+    ssize_t size = dirfd == AT_FDCWD
+        ? getxattr(name, attr, value, sizeof(value))
+        : getxattr_at(dirfd, name, attr, value, sizeof(value));
+    return decode_summary(value, size, summary);
+}
+
+/**
+ * Opens SUMMARY_LOCK_FILE and takes a lock of kind [operation],
+ * LOCK_SH or LOCK_EX, on it, retrying for at most [timeout_ms]
+ * milliseconds while another command holds it. The lock file is the
+ * user's, so that no other user can delay the summaries.
+ * Returns the file descriptor of the lock file, or -1 with [errno] set
+ * if it could not be locked.
+ */
+static int lock_summaries(int operation, int timeout_ms)
+{
+    int fd = open(SUMMARY_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+    int waited_ms = 0;
+    while (flock(fd, operation | LOCK_NB) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EWOULDBLOCK || waited_ms >= timeout_ms) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        struct timespec delay = {
+            .tv_sec = 0,
+            .tv_nsec = SUMMARY_LOCK_RETRY_MS * 1000000L
+        };
+        nanosleep(&delay, NULL);
+        waited_ms += SUMMARY_LOCK_RETRY_MS;
+    }
+    return fd;
+}
+
+/**
+ * Reads to [summary] the summary of the directory [path] from its
+ * attribute [attr].
+ * Returns [false] if the directory has no valid summary or it could
+ * not be read, [true] otherwise.
+ */
+static bool read_summary(
+        const char *path,
+        const char *attr,
+        TagSummary *summary)
+{
+    uint8_t value[SUMMARY_SIZE];
+    ssize_t size = getxattr(path, attr, value, sizeof(value));
+    return decode_summary(value, size, summary);
+}
+
+/**
+ * Adds the tags of [added] to [summary].
+ * Returns [true] if [summary] already had them, [false] otherwise.
+ */
+static bool merge_summary(TagSummary *summary, const TagSummary *added)
+{
+    bool covered = true;
+    for (size_t i = 0; i < sizeof(summary->bits); i++) {
+        if ((summary->bits[i] | added->bits[i]) != summary->bits[i]) {
+            covered = false;
+            summary->bits[i] |= added->bits[i];
+        }
+    }
+    return covered;
+}
+
+/**
+ * Replaces [path], an absolute path, by the path of its parent
+ * directory.
+ * Returns [false] if [path] is the root, [true] otherwise.
+ */
+static bool to_parent(char *path)
+{
+    char *slash = strrchr(path, '/');
+    if (slash == NULL || path[1] == '\0')
+        return false;
+    /* The root keeps its slash.  */
+    slash[slash == path] = '\0';
+    return true;
+}
+
+/**
+ * Writes [summary] to the attribute [attr] of the directory [path] if
+ * [locked] is set. Otherwise, or if it cannot be written, removes the
+ * attribute, since a summary missing tags would hide their files.
+ * Returns [false] and prints an error message if the summary was not
+ * written, [true] otherwise.
+ */
+static bool write_summary(
+        const char *path,
+        const char *attr,
+        const TagSummary *summary,
+        bool locked)
+{
+    uint8_t value[SUMMARY_SIZE];
+    encode_summary(summary, value);
+    if (locked && setxattr(path, attr, value, sizeof(value), 0) == 0)
+        return true;
+    if (locked) {
+        fprintf(stderr, "Could not update the tag summary of '%s': %s\n",
+                path, strerror(errno));
+        if (removexattr(path, attr) == -1)
+            fprintf(stderr, "Rebuild it with search-tag-file "
+                    "--build-summary\n");
+    } else {
+        /* A summary_build() holding the lock may still write it.  */
+        removexattr(path, attr);
+        fprintf(stderr, "Could not lock the tag summaries to update the "
+                "one of '%s', rebuild it with search-tag-file "
+                "--build-summary\n", path);
+    }
+    return false;
+}
+
+/**
+ * Adds the tags of [added] to the summaries of the directories
+ * containing [path], an absolute path without symbolic links, up to
+ * the first summary already having them.
+ * The summaries are first read without lock, since most directories
+ * have none and most tags are already in them. The lock is taken to
+ * rewrite a summary, or, if none must be, tried once to make sure that
+ * no summary_build() running would write summaries missing the tags.
+ * Returns [false] if a summary could not be updated, [true] otherwise.
+ */
+static bool add_to_ancestors(const char *path, const TagSummary *added)
+{
+    char attr[SUMMARY_ATTR_SIZE];
+    summary_attribute(attr);
+    char *dir = strdup(path);
+    if (dir == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    bool stale = false;
+    TagSummary summary;
+    while (!stale && to_parent(dir)) {
+        if (!read_summary(dir, attr, &summary))
+            continue;
+        if (merge_summary(&summary, added))
+            break;
+        stale = true;
+    }
+    int lock_fd = -1;
+    if (!stale) {
+        lock_fd = lock_summaries(LOCK_SH, 0);
+        if (lock_fd != -1) {
+            close(lock_fd);
+            free(dir);
+            return true;
+        }
+    }
+
+    lock_fd = lock_summaries(LOCK_EX, SUMMARY_LOCK_TIMEOUT_MS);
+    bool success = true;
+    strcpy(dir, path);
+    while (to_parent(dir)) {
+        if (!read_summary(dir, attr, &summary))
+            continue;
+        if (merge_summary(&summary, added))
+            break;
+        success = write_summary(dir, attr, &summary, lock_fd != -1)
+            && success;
+    }
+    if (lock_fd != -1)
+        close(lock_fd);
+    free(dir);
+    return success;
+}
+
+bool summary_add_tags(const char *filename, const char *tags[], int nb_tags)
+{
+    assert(filename != NULL);
+    assert(tags != NULL);
+
+    TagSummary added = { .bits = {0} };
+    for (int i = 0; i < nb_tags; i++) {
+        SummaryKey key;
+        summary_key(tags[i], strlen(tags[i]), &key);
+        summary_add_key(&added, &key);
+    }
+    char *path = realpath(filename, NULL);
+    if (path == NULL) {
+        fprintf(stderr, "Could not resolve '%s': %s\n",
+                filename, strerror(errno));
+        return false;
+    }
+    bool success = add_to_ancestors(path, &added);
+    free(path);
+    return success;
+}
+
+/**
+ * The state of summary_build(): the path [path] of the directory being
+ * read, for the error messages, the buffer [xattr_buf] of the
+ * attributes of its files, and the name [attr] of the attribute of the
+ * summaries.
+ */
+typedef struct {
+    PascalBuffer path;
+    PascalBuffer xattr_buf;
+    const char *attr;
+} SummaryBuilder;
+
+/**
+ * Adds the tags of the file [name] of the directory [dirfd] to
+ * [summary]. The path of the file is [builder->path].
+ * Returns [false] and prints an error message on failure.
+ */
+static bool add_file_tags(
+        SummaryBuilder *builder,
+        int dirfd,
+        const char *name,
+        TagSummary *summary)
+{
+    PascalBuffer *buffer = &builder->xattr_buf;
+    ssize_t buflen = read_xattr_list(dirfd, name, buffer, NULL);
+    if (buflen == -1) {
+        if (errno == ENOTSUP)
+            return true;
+        fprintf(stderr, "Could not list the tags of '%s': %s\n",
+                builder->path.str, strerror(errno));
+        return false;
+    }
+
+    XattrTagScanner scanner;
+    const char *tag;
+    size_t len;
+    scan_xattr_tags(&scanner, buffer->str, buflen);
+    while (next_xattr_tag(&scanner, &tag, &len)) {
+        SummaryKey key;
+        summary_key(tag, len, &key);
+        summary_add_key(summary, &key);
+    }
+    return true;
+}
+
+/**
+ * Writes to [summary] the summary of the directory [name] of the
+ * directory [dirfd], whose path is [builder->path], and stores it in
+ * the attribute of the directory, after the ones of its
+ * subdirectories. The symbolic links are not followed, but since the
+ * searches do, a directory holding one gets a summary having every tag,
+ * and so does a directory that could not be read entirely.
+ * Returns [false] and prints an error message if an error occurs.
+ */
+static bool build_dir_summary(
+        SummaryBuilder *builder,
+        int dirfd,
+        const char *name,
+        TagSummary *summary)
+{
+    memset(summary->bits, 0, sizeof(summary->bits));
+    /* Only the directory given by the user may be a link.  */
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (dirfd != AT_FDCWD)
+        flags |= O_NOFOLLOW;
+    int fd = openat(dirfd, name, flags);
+    DIR *stream = NULL;
+    if (fd == -1 || (stream = fdopendir(fd)) == NULL) {
+        fprintf(stderr, "Could not open '%s' directory: %s\n",
+                builder->path.str, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        memset(summary->bits, 0xff, sizeof(summary->bits));
+        return false;
+    }
+
+    bool success = true;
+    size_t path_len = builder->path.str_length;
+    struct dirent *cur;
+    while ((cur = readdir(stream)) != NULL) {
+        if (strncmp(cur->d_name, "..", 3) == 0
+                || strncmp(cur->d_name, ".", 2) == 0)
+            continue;
+        builder->path.str_length = path_len;
+        append_str_to_buffer(&builder->path, "/", 1);
+        append_str_to_buffer(&builder->path, cur->d_name,
+                strlen(cur->d_name));
+
+        unsigned char type = cur->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(fd, cur->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                fprintf(stderr, "Could not stat '%s': %s\n",
+                        builder->path.str, strerror(errno));
+                memset(summary->bits, 0xff, sizeof(summary->bits));
+                success = false;
+                continue;
+            }
+            type = IFTODT(st.st_mode);
+        }
+        if (type == DT_DIR) {
+            TagSummary subdir;
+            success = build_dir_summary(builder, fd, cur->d_name, &subdir)
+                && success;
+            for (size_t i = 0; i < sizeof(summary->bits); i++)
+                summary->bits[i] |= subdir.bits[i];
+        } else if (type == DT_LNK) {
+            memset(summary->bits, 0xff, sizeof(summary->bits));
+        } else if (!add_file_tags(builder, fd, cur->d_name, summary)) {
+            memset(summary->bits, 0xff, sizeof(summary->bits));
+            success = false;
+        }
+    }
+    builder->path.str_length = path_len;
+    builder->path.str[path_len] = '\0';
+
+    uint8_t value[SUMMARY_SIZE];
+    encode_summary(summary, value);
+    if (fsetxattr(fd, builder->attr, value, sizeof(value), 0) == -1) {
+        fprintf(stderr, "Could not write the tag summary of '%s': %s\n",
+                builder->path.str, strerror(errno));
+        success = false;
+    }
+    closedir(stream);
+    return success;
+}
+
+bool summary_build(const char *directory)
+{
+    assert(directory != NULL);
+
+    char attr[SUMMARY_ATTR_SIZE];
+    summary_attribute(attr);
+    int lock_fd = lock_summaries(LOCK_EX, SUMMARY_LOCK_TIMEOUT_MS);
+    if (lock_fd == -1) {
+        fprintf(stderr, "Could not lock the tag summaries: %s\n",
+                strerror(errno));
+        return false;
+    }
+    SummaryBuilder builder = { .path = {0}, .xattr_buf = {0}, .attr = attr };
+    append_str_to_buffer(&builder.path, directory, strlen(directory));
+    extends_buffer(&builder.xattr_buf, INITIAL_XATTR_LIST_SIZE);
+    TagSummary summary;
+    bool success = build_dir_summary(&builder, AT_FDCWD, directory,
+            &summary);
+    free(builder.path.str);
+    free(builder.xattr_buf.str);
+    close(lock_fd);
+
+    /* The ancestors must hold the tags found, as if they were added.  */
+    char *path = realpath(directory, NULL);
+    if (path == NULL) {
+        fprintf(stderr, "Could not resolve '%s': %s\n",
+                directory, strerror(errno));
+        return false;
+    }
+    success = add_to_ancestors(path, &summary) && success;
+    free(path);
+    return success;
+}
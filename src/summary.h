@@ -0,0 +1,103 @@
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include "tag.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The size in bits of the Bloom filter of a summary, and the number
+ * of its bits set for each tag. With 3 bits out of 2048, a directory
+ * holding 100 distinct tags answers "maybe" for about 0.2% of the
+ * tags it does not hold.
+ */
+#define SUMMARY_BITS 2048
+#define SUMMARY_HASHES 3
+
+/*
+ * The prefix of the attribute of the summaries, outside of
+ * XATTR_PROG_DOMAIN so that no tag has its name.
+ */
+#define SUMMARY_XATTR_PREFIX "user.tagsys6s."
+
+/*
+ * The version of the summaries, stored after SUMMARY_MAGIC in the
+ * attribute, so that the summaries written by another version are
+ * ignored.
+ */
+#define SUMMARY_MAGIC "TS6S"
+#define SUMMARY_VERSION 1
+
+/**
+ * The tags of the files found under a directory, the directory itself
+ * excepted, as a Bloom filter of SUMMARY_BITS bits [bits]: a tag whose
+ * SUMMARY_HASHES bits are not all set is held by none of the files.
+ * The summary of a directory is kept in its attribute named
+ * SUMMARY_XATTR_PREFIX followed by the uid of the user.
+ */
+typedef struct {
+    uint8_t bits[SUMMARY_BITS / 8];
+} TagSummary;
+
+/**
+ * The bits [bits] of a tag in the summaries, computed once per tag by
+ * summary_key().
+ */
+typedef struct {
+    uint16_t bits[SUMMARY_HASHES];
+} SummaryKey;
+
+/**
+ * Writes to [key] the bits of the tag [tag] of [len] chars.
+ */
+void summary_key(const char *tag, size_t len, SummaryKey *key);
+
+/**
+ * Adds the tag of key [key] to [summary].
+ */
+void summary_add_key(TagSummary *summary, const SummaryKey *key);
+
+/**
+ * Returns [false] if no file summarized by [summary] has the tag of
+ * key [key], [true] if one may have it.
+ */
+bool summary_has_key(const TagSummary *summary, const SummaryKey *key);
+
+/**
+ * Returns [true] if no file summarized by [summary] has a tag.
+ */
+bool summary_is_empty(const TagSummary *summary);
+
+/**
+ * Reads to [summary] the summary of the directory [name] relative to
+ * the directory file descriptor [dirfd], which may be AT_FDCWD.
+ * Returns [false] if the directory has no valid summary or it could
+ * not be read, [true] otherwise.
+ */
+bool summary_read_at(int dirfd, const char *name, TagSummary *summary);
+
+/**
+ * Adds the [nb_tags] tags [tags] given to the file [filename] to the
+ * summaries of the directories containing it, up to the root. The
+ * directories without a summary are left as they are, and the walk up
+ * stops at the first summary already having the tags. The summaries
+ * are rewritten under the lock of SUMMARY_LOCK_FILE, waited for a
+ * bounded time, after which the summaries that lack the tags are
+ * removed.
+ * Returns [false] and prints an error message if a summary could not
+ * be updated, [true] otherwise.
+ */
+bool summary_add_tags(const char *filename, const char *tags[], int nb_tags);
+
+/**
+ * Writes the summary of every directory under [directory], included,
+ * from the tags of their files, then adds the tags of [directory] to
+ * the summaries of its ancestors. The lock of SUMMARY_LOCK_FILE is
+ * held while the subtree is read, so that summary_add_tags() waits for
+ * the summaries to be written rather than see its tags overwritten.
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+bool summary_build(const char *directory);
+
+#endif
@@ -0,0 +1,682 @@
+#define _GNU_SOURCE
+#include "tag.h"
+#include "index.h"
+#include "journal.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The events are gathered until none arrives during QUIET_DELAY_MS,
+ * or until the first one is MAX_DELAY_MS old, and then applied to
+ * the index at once.
+ */
+#define QUIET_DELAY_MS 200
+#define MAX_DELAY_MS 2000
+
+#define EVENT_BUF_SIZE 65536
+#define NFTW_MAX_FDS 64
+
+#define INOTIFY_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+        | IN_MOVED_TO | IN_ONLYDIR)
+#define FANOTIFY_MASK (FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM \
+        | FAN_MOVED_TO | FAN_ONDIR)
+
+/**
+ * A filesystem watched with fanotify: its identifier, as reported in
+ * the events, and a descriptor of one of its directories to decode
+ * the file handles of the events.
+ */
+typedef struct {
+    dev_t dev;
+    fsid_t fsid;
+    int fd;
+} WatchedFs;
+
+/**
+ * The state of the indexer: the watched directories and the changes
+ * seen since the index was last updated.
+ */
+typedef struct {
+    char **roots;
+    size_t nb_roots;
+    int fanotify_fd;
+    WatchedFs *filesystems;
+    size_t nb_filesystems;
+    int inotify_fd;
+    /* The path of the directory of each inotify watch descriptor.  */
+    char **watches;
+    size_t nb_watches;
+    bool watch_limit_reported;
+    /* The files to read again, sorted by path.  */
+    TagIndex changed;
+    RedimStringArray new_dirs;
+    RedimStringArray removed_dirs;
+    bool rescan;
+} Indexer;
+
+typedef enum {
+    ENTRY_CHANGED,
+    ENTRY_ADDED,
+    ENTRY_REMOVED
+} EntryEvent;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/* nftw(3) does not pass an argument to its callback.  */
+static Indexer *scanning_indexer = NULL;
+static TagIndex *scanned_files = NULL;
+
+static void request_stop(int signum)
+{
+    stop_requested = 1;
+}
+
+static char *checked_strdup(const char *str)
+{
+    char *copy = strdup(str);
+    if (copy == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+/**
+ * Frees the strings of [array] and empties it.
+ */
+static void clear_str_array(RedimStringArray *array)
+{
+    for (size_t i = 0; i < array->nb_elt; i++)
+        free((char *) array->array[i]);
+    array->nb_elt = 0;
+}
+
+/**
+ * Returns [true] if [path] is [dir] or is located under it.
+ */
+static bool is_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    if (len == 1)
+        return true;
+    return strncmp(path, dir, len) == 0
+        && (path[len] == '/' || path[len] == '\0');
+}
+
+/**
+ * Returns [true] if [path] is one of the files written by the tag
+ * system itself, whose changes must not trigger an update of the
+ * index.
+ */
+static bool is_state_file(const char *path)
+{
+    return strncmp(path, INDEX_FILE, strlen(INDEX_FILE)) == 0
+        || strncmp(path, JOURNAL_FILE, strlen(JOURNAL_FILE)) == 0;
+}
+
+/**
+ * Watches with fanotify the filesystem of the directory [path] of
+ * device [dev], unless it is already watched.
+ * Returns [false] and sets errno on failure.
+ */
+static bool watch_filesystem(Indexer *indexer, const char *path, dev_t dev)
+{
+    for (size_t i = 0; i < indexer->nb_filesystems; i++)
+        if (indexer->filesystems[i].dev == dev)
+            return true;
+
+    struct statfs st;
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    if (fstatfs(fd, &st) == -1
+            || fanotify_mark(indexer->fanotify_fd,
+                FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK,
+                fd, NULL) == -1) {
+        int errno_save = errno;
+        close(fd);
+        errno = errno_save;
+        return false;
+    }
+    void *rc = realloc(indexer->filesystems,
+            (indexer->nb_filesystems + 1) * sizeof(WatchedFs));
+    if (rc == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    indexer->filesystems = rc;
+    indexer->filesystems[indexer->nb_filesystems++] =
+        (WatchedFs) { .dev = dev, .fsid = st.f_fsid, .fd = fd };
+    return true;
+}
+
+/**
+ * Watches the directory [path] with inotify.
+ */
+static void watch_directory(Indexer *indexer, const char *path)
+{
+    int wd = inotify_add_watch(indexer->inotify_fd, path, INOTIFY_MASK);
+    if (wd == -1) {
+        if (errno != ENOSPC)
+            fprintf(stderr, "Could not watch '%s': %s\n",
+                    path, strerror(errno));
+        else if (!indexer->watch_limit_reported)
+            fprintf(stderr, "Could not watch '%s': too many directories, "
+                    "see fs.inotify.max_user_watches\n", path);
+        indexer->watch_limit_reported |= errno == ENOSPC;
+        return;
+    }
+    if (wd >= indexer->nb_watches) {
+        size_t new_nb_watches = (wd + 1) * 2;
+        void *rc = realloc(indexer->watches, new_nb_watches * sizeof(char *));
+        if (rc == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        indexer->watches = rc;
+        memset(indexer->watches + indexer->nb_watches, 0,
+                (new_nb_watches - indexer->nb_watches) * sizeof(char *));
+        indexer->nb_watches = new_nb_watches;
+    }
+    free(indexer->watches[wd]);
+    indexer->watches[wd] = checked_strdup(path);
+}
+
+/**
+ * Stops watching with inotify the directories located under [dir],
+ * which no longer exist at their recorded path.
+ */
+static void unwatch_directories(Indexer *indexer, const char *dir)
+{
+    for (size_t wd = 0; wd < indexer->nb_watches; wd++) {
+        if (indexer->watches[wd] != NULL
+                && (dir == NULL || is_under(indexer->watches[wd], dir))) {
+            inotify_rm_watch(indexer->inotify_fd, wd);
+            free(indexer->watches[wd]);
+            indexer->watches[wd] = NULL;
+        }
+    }
+}
+
+/**
+ * The nftw(3) callback of scan_directory().
+ */
+static int scan_entry(
+        const char *path,
+        const struct stat *st,
+        int type,
+        struct FTW *ftw)
+{
+    Indexer *indexer = scanning_indexer;
+    if (type == FTW_DNR || type == FTW_NS) {
+        fprintf(stderr, "Could not scan '%s': %s\n", path, strerror(errno));
+        return 0;
+    } else if (type == FTW_D) {
+        if (indexer->fanotify_fd != -1
+                && !watch_filesystem(indexer, path, st->st_dev))
+            fprintf(stderr, "Could not watch the filesystem of '%s': %s\n",
+                    path, strerror(errno));
+        if (indexer->inotify_fd != -1)
+            watch_directory(indexer, path);
+        return 0;
+    }
+
+    /* Like search-tag-file, index the targets of the links.  */
+    char *real_path = NULL;
+    if (type == FTW_SL && (real_path = realpath(path, NULL)) == NULL)
+        return 0;
+    IndexedFile file = {
+        .path = real_path != NULL ? real_path : (char *) path
+    };
+    struct stat target;
+    if (type == FTW_SL && (stat(file.path, &target) == -1
+                || S_ISDIR(target.st_mode))) {
+        free(real_path);
+        return 0;
+    }
+    if (index_read_tags(&file) && file.nb_tags > 0) {
+        IndexedFile *added = index_add_file(scanned_files, file.path);
+        added->dev = file.dev;
+        added->ino = file.ino;
+        index_set_tags(added, (const char **) file.tags, file.nb_tags);
+    }
+    for (size_t i = 0; i < file.nb_tags; i++)
+        free(file.tags[i]);
+    free(file.tags);
+    free(real_path);
+    return 0;
+}
+
+/**
+ * Adds the tagged files located under [dir] to [files], and watches
+ * its directories.
+ */
+static void scan_directory(Indexer *indexer, const char *dir, TagIndex *files)
+{
+    scanning_indexer = indexer;
+    scanned_files = files;
+    if (nftw(dir, scan_entry, NFTW_MAX_FDS, FTW_PHYS) == -1
+            && errno != ENOENT)
+        fprintf(stderr, "Could not scan '%s': %s\n", dir, strerror(errno));
+}
+
+/**
+ * Records the [event] of the entry [path] to update the index.
+ */
+static void queue_event(
+        Indexer *indexer,
+        const char *path,
+        bool is_dir,
+        EntryEvent event)
+{
+    bool watched = false;
+    for (size_t i = 0; !watched && i < indexer->nb_roots; i++)
+        watched = is_under(path, indexer->roots[i]);
+    if (!watched || is_state_file(path))
+        return;
+
+    if (!is_dir) {
+        index_get_file(&indexer->changed, path, true);
+    } else if (event == ENTRY_ADDED) {
+        add_to_str_array(&indexer->new_dirs, checked_strdup(path));
+    } else if (event == ENTRY_REMOVED) {
+        add_to_str_array(&indexer->removed_dirs, checked_strdup(path));
+        if (indexer->inotify_fd != -1)
+            unwatch_directories(indexer, path);
+    }
+}
+
+/**
+ * Reads the pending inotify events.
+ */
+static void read_inotify_events(Indexer *indexer)
+{
+    char buf[EVENT_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(indexer->inotify_fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event *event;
+        for (char *ptr = buf; ptr < buf + len;
+                ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                indexer->rescan = true;
+                continue;
+            } else if (event->wd < 0 || event->wd >= indexer->nb_watches
+                    || indexer->watches[event->wd] == NULL) {
+                continue;
+            } else if (event->mask & IN_IGNORED) {
+                free(indexer->watches[event->wd]);
+                indexer->watches[event->wd] = NULL;
+                continue;
+            } else if (event->len == 0) {
+                continue;
+            }
+
+            const char *dir = indexer->watches[event->wd];
+            size_t path_len = strlen(dir) + strlen(event->name) + 2;
+            char path[path_len];
+            snprintf(path, path_len, "%s/%s", dir, event->name);
+            bool is_dir = event->mask & IN_ISDIR;
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                queue_event(indexer, path, is_dir, ENTRY_REMOVED);
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                queue_event(indexer, path, is_dir, ENTRY_ADDED);
+            if (event->mask & IN_ATTRIB)
+                queue_event(indexer, path, is_dir, ENTRY_CHANGED);
+        }
+    }
+    if (len == -1 && errno != EAGAIN && errno != EINTR)
+        perror("read");
+}
+
+/**
+ * Writes to [path] the path of the directory identified by [handle]
+ * on the filesystem [fsid]. Returns [false] if it no longer exists.
+ */
+static bool resolve_handle(
+        Indexer *indexer,
+        const __kernel_fsid_t *fsid,
+        struct file_handle *handle,
+        char *path,
+        size_t size)
+{
+    int mount_fd = -1;
+    for (size_t i = 0; mount_fd == -1 && i < indexer->nb_filesystems; i++)
+        if (memcmp(&indexer->filesystems[i].fsid, fsid, sizeof(*fsid)) == 0)
+            mount_fd = indexer->filesystems[i].fd;
+    if (mount_fd == -1)
+        return false;
+    int fd = open_by_handle_at(mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    char proc_path[PROC_FD_PATH_SIZE];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(proc_path, path, size - 1);
+    close(fd);
+    if (len == -1)
+        return false;
+    path[len] = '\0';
+    return true;
+}
+
+/**
+ * Reads the pending fanotify events.
+ */
+static void read_fanotify_events(Indexer *indexer)
+{
+    char buf[EVENT_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t len;
+    while ((len = read(indexer->fanotify_fd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *meta =
+            (struct fanotify_event_metadata *) buf;
+        for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                indexer->rescan = true;
+                continue;
+            }
+            char *info_ptr = (char *) (meta + 1);
+            char *end = (char *) meta + meta->event_len;
+            struct fanotify_event_info_fid *info = NULL;
+            for (; info_ptr < end; info_ptr += info->hdr.len) {
+                info = (struct fanotify_event_info_fid *) info_ptr;
+                if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
+                        || info->hdr.len == 0)
+                    break;
+            }
+            if (info_ptr >= end || info->hdr.len == 0)
+                continue;
+
+            struct file_handle *handle = (struct file_handle *) info->handle;
+            const char *name = (const char *) handle->f_handle
+                + handle->handle_bytes;
+            char path[PATH_MAX];
+            if (!resolve_handle(indexer, &info->fsid, handle, path,
+                        sizeof(path) - NAME_MAX - 1))
+                continue;
+            strcat(path, "/");
+            strcat(path, name);
+            bool is_dir = meta->mask & FAN_ONDIR;
+            if (meta->mask & (FAN_DELETE | FAN_MOVED_FROM))
+                queue_event(indexer, path, is_dir, ENTRY_REMOVED);
+            if (meta->mask & (FAN_CREATE | FAN_MOVED_TO))
+                queue_event(indexer, path, is_dir, ENTRY_ADDED);
+            if (meta->mask & FAN_ATTRIB)
+                queue_event(indexer, path, is_dir, ENTRY_CHANGED);
+        }
+    }
+    if (len == -1 && errno != EAGAIN && errno != EINTR)
+        perror("read");
+}
+
+static bool has_pending_changes(const Indexer *indexer)
+{
+    return indexer->rescan || indexer->changed.nb_files > 0
+        || indexer->new_dirs.nb_elt > 0 || indexer->removed_dirs.nb_elt > 0;
+}
+
+/**
+ * Applies the changes seen since the last update to the index: the
+ * changed files are read again and the new directories are scanned.
+ * When events were lost, all the watched directories are scanned.
+ */
+static void update(Indexer *indexer)
+{
+    TagIndex files = {0};
+    RedimStringArray dirs = {0};
+    JournalCursor since;
+    bool replay = false;
+
+    if (indexer->rescan) {
+        TagError error = journal_end(&since);
+        if (error != NO_ERROR)
+            print_tag_error(error);
+        replay = error == NO_ERROR;
+        if (indexer->inotify_fd != -1)
+            unwatch_directories(indexer, NULL);
+        for (size_t i = 0; i < indexer->nb_roots; i++) {
+            scan_directory(indexer, indexer->roots[i], &files);
+            add_to_str_array(&dirs, indexer->roots[i]);
+        }
+    } else {
+        for (size_t i = 0; i < indexer->new_dirs.nb_elt; i++)
+            scan_directory(indexer, indexer->new_dirs.array[i], &files);
+        for (size_t i = 0; i < indexer->changed.nb_files; i++) {
+            IndexedFile *file =
+                index_add_file(&files, indexer->changed.files[i].path);
+            if (!index_read_tags(file) && errno != ENOENT && errno != ENOTDIR)
+                fprintf(stderr, "Could not read the tags of '%s': %s\n",
+                        file->path, strerror(errno));
+        }
+        for (size_t i = 0; i < indexer->removed_dirs.nb_elt; i++)
+            add_to_str_array(&dirs, indexer->removed_dirs.array[i]);
+        for (size_t i = 0; i < indexer->new_dirs.nb_elt; i++)
+            add_to_str_array(&dirs, indexer->new_dirs.array[i]);
+    }
+
+    TagError error = index_merge(&files, dirs.array, dirs.nb_elt,
+            replay ? &since : NULL);
+    if (error != NO_ERROR)
+        print_tag_error(error);
+
+    free(dirs.array);
+    free_index(&files);
+    free_index(&indexer->changed);
+    clear_str_array(&indexer->new_dirs);
+    clear_str_array(&indexer->removed_dirs);
+    indexer->rescan = false;
+}
+
+/**
+ * Returns the time elapsed since [start] in milliseconds.
+ */
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * Waits for the events until a stop is requested, updating the index
+ * once the changes seen settle.
+ */
+static void watch(Indexer *indexer)
+{
+    struct pollfd pfd = {
+        .fd = indexer->fanotify_fd != -1
+            ? indexer->fanotify_fd : indexer->inotify_fd,
+        .events = POLLIN
+    };
+    struct timespec first_event;
+    bool pending = false;
+
+    while (!stop_requested) {
+        int timeout = -1;
+        if (pending) {
+            long remaining = MAX_DELAY_MS - elapsed_ms(&first_event);
+            timeout = remaining < QUIET_DELAY_MS ? remaining : QUIET_DELAY_MS;
+            if (timeout < 0)
+                timeout = 0;
+        }
+        int rc = poll(&pfd, 1, timeout);
+        if (rc == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        } else if (rc > 0) {
+            if (indexer->fanotify_fd != -1)
+                read_fanotify_events(indexer);
+            else
+                read_inotify_events(indexer);
+            if (!pending && has_pending_changes(indexer)) {
+                pending = true;
+                clock_gettime(CLOCK_MONOTONIC, &first_event);
+            }
+        }
+        if (pending && (rc == 0 || elapsed_ms(&first_event) >= MAX_DELAY_MS)) {
+            update(indexer);
+            pending = false;
+        }
+    }
+    if (has_pending_changes(indexer))
+        update(indexer);
+}
+
+/**
+ * Sets up the watches of [indexer] with fanotify if it is allowed and
+ * [use_fanotify] is [true], or with inotify otherwise.
+ * Returns [false] on failure.
+ */
+static bool init_watches(Indexer *indexer, bool use_fanotify)
+{
+    indexer->fanotify_fd = indexer->inotify_fd = -1;
+    if (use_fanotify) {
+        indexer->fanotify_fd = fanotify_init(
+                FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC
+                | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+        struct stat st;
+        for (size_t i = 0; indexer->fanotify_fd != -1
+                && i < indexer->nb_roots; i++) {
+            if (stat(indexer->roots[i], &st) == -1
+                    || !watch_filesystem(indexer, indexer->roots[i],
+                        st.st_dev)) {
+                /* Not privileged enough, or unsupported filesystem.  */
+                for (size_t j = 0; j < indexer->nb_filesystems; j++)
+                    close(indexer->filesystems[j].fd);
+                indexer->nb_filesystems = 0;
+                close(indexer->fanotify_fd);
+                indexer->fanotify_fd = -1;
+            }
+        }
+        if (indexer->fanotify_fd != -1)
+            return true;
+    }
+
+    indexer->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (indexer->inotify_fd == -1) {
+        perror("inotify_init1");
+        return false;
+    }
+    return true;
+}
+
+static void free_indexer(Indexer *indexer)
+{
+    for (size_t i = 0; i < indexer->nb_roots; i++)
+        free(indexer->roots[i]);
+    free(indexer->roots);
+    for (size_t i = 0; i < indexer->nb_filesystems; i++)
+        close(indexer->filesystems[i].fd);
+    free(indexer->filesystems);
+    for (size_t i = 0; i < indexer->nb_watches; i++)
+        free(indexer->watches[i]);
+    free(indexer->watches);
+    if (indexer->fanotify_fd != -1)
+        close(indexer->fanotify_fd);
+    if (indexer->inotify_fd != -1)
+        close(indexer->inotify_fd);
+    free_index(&indexer->changed);
+    clear_str_array(&indexer->new_dirs);
+    free(indexer->new_dirs.array);
+    clear_str_array(&indexer->removed_dirs);
+    free(indexer->removed_dirs.array);
+}
+
+static void print_help(const char *prog_name)
+{
+    fprintf(stderr,
+            "Usage: %s [OPTION]... <dir> [<dir>...]\n"
+            "   or: %s -h\n\n"
+            "Keep the tag index of the files under the given directories\n"
+            "up to date, until interrupted. The directories are scanned\n"
+            "once, then only the files whose attributes change are read.\n\n"
+            "Options:\n"
+            "\t--inotify\tWatch the directories with inotify even if\n"
+            "\t\t\t fanotify is available\n"
+            "\t-h\t\tPrint this help message\n\n",
+            prog_name, prog_name);
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    } else if (strncmp(argv[1], "-h", 3) == 0) {
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+    }
+
+    bool use_fanotify = true;
+    int first_dir = 1;
+    if (strcmp(argv[1], "--inotify") == 0) {
+        use_fanotify = false;
+        first_dir++;
+    }
+    if (first_dir >= argc) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    load_config();
+
+    Indexer indexer = {0};
+    indexer.fanotify_fd = indexer.inotify_fd = -1;
+    indexer.roots = calloc(argc - first_dir, sizeof(char *));
+    if (indexer.roots == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    for (int i = first_dir; i < argc; i++) {
+        char *root = realpath(argv[i], NULL);
+        if (root == NULL || stat(root, &st) == -1) {
+            fprintf(stderr, "Could not stat '%s': %s\n",
+                    argv[i], strerror(errno));
+            free(root);
+            goto FREE_RESOURCES_ON_ERROR;
+        } else if (!S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "'%s' is not a directory\n", argv[i]);
+            free(root);
+            goto FREE_RESOURCES_ON_ERROR;
+        }
+        indexer.roots[indexer.nb_roots++] = root;
+    }
+    if (!init_watches(&indexer, use_fanotify))
+        goto FREE_RESOURCES_ON_ERROR;
+
+    struct sigaction action = { .sa_handler = request_stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    /* The changes made while no indexer was running are unknown.  */
+    indexer.rescan = true;
+    update(&indexer);
+    watch(&indexer);
+
+    free_indexer(&indexer);
+    return EXIT_SUCCESS;
+
+FREE_RESOURCES_ON_ERROR:
+    free_indexer(&indexer);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,807 @@
+#define _GNU_SOURCE
+#include "../lib/cJSON.h"
+#include "tag.h"
+#include "walk.h"
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define INITIAL_TABLE_CAPACITY 64
+
+/* The number of spaces a tag is indented by per level of the tree.  */
+#define INDENT_WIDTH 2
+
+/**
+ * A set of tag names: an open addressing hash table of [capacity]
+ * slots [slots], a power of 2, holding 1 + the index in [names] of
+ * the names, or 0 when free.
+ */
+typedef struct {
+    char **names;
+    size_t nb_names;
+    size_t names_capacity;
+    uint32_t *slots;
+    size_t capacity;
+} NameTable;
+
+/**
+ * The number of files [count] having both the tags [tags] (the
+ * first one being the smallest identifier), 0 for a free slot of a
+ * PairTable.
+ */
+typedef struct {
+    uint32_t tags[2];
+    uint64_t count;
+} PairCount;
+
+/**
+ * The numbers of files having two given tags: an open addressing hash
+ * table of [capacity] slots [slots], a power of 2, holding [size]
+ * pairs.
+ */
+typedef struct {
+    PairCount *slots;
+    size_t capacity;
+    size_t size;
+} PairTable;
+
+/**
+ * What a worker of the walk counted: the files [nb_files] seen, the
+ * ones [nb_tagged] having a tag, and for each tag identifier below
+ * [capacity], the files [counts] having it. [rolled_up] counts, for
+ * each tag of the config, the files having it or one of its
+ * descendants, [stamps] holding the number of the last file counted
+ * so that a file having several descendants of a tag counts once.
+ * [file_tags] holds the identifiers of the tags of the current file.
+ */
+typedef struct {
+    uint64_t nb_files;
+    uint64_t nb_tagged;
+    uint64_t *counts;
+    size_t capacity;
+    uint64_t *rolled_up;
+    uint64_t *stamps;
+    uint32_t *file_tags;
+    size_t file_tags_capacity;
+    PairTable pairs;
+} TagCounts;
+
+/**
+ * The state shared by the workers. The tags of the config, in the
+ * order of the tree, are [known], the parent of the tag [i] being
+ * [parents[i]] and its depth [depths[i]], or -1 and 0 for the top
+ * level ones. [known] is not modified during the walk. The tags found
+ * on the files but missing from the config are added to [unknown]
+ * under [lock], their identifiers following the ones of [known].
+ * Each worker counts in its own [counts].
+ */
+typedef struct {
+    NameTable known;
+    int *parents;
+    int *depths;
+    pthread_mutex_t lock;
+    NameTable unknown;
+    TagCounts *counts;
+    int nb_counts;
+} TagStats;
+
+/**
+ * Returns the FNV-1a hash of the [len] bytes [name], whose bits are
+ * mixed so that its low bits can index a table.
+ */
+static uint64_t hash_name(const char *name, size_t len)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Returns the slot of [table] holding the name [name] of [len] bytes,
+ * or the free slot where it goes if [table] does not hold it.
+ */
+static uint32_t *find_name_slot(
+        const NameTable *table,
+        const char *name,
+        size_t len)
+{
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash_name(name, len) & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &table->slots[i];
+        if (*slot == 0)
+            return slot;
+        const char *other = table->names[*slot - 1];
+        if (strncmp(other, name, len) == 0 && other[len] == '\0')
+            return slot;
+    }
+}
+
+/**
+ * Returns the index of the name [name] of [len] bytes in [table], or
+ * -1 if [table] does not hold it.
+ */
+static int find_name(const NameTable *table, const char *name, size_t len)
+{
+    if (table->capacity == 0)
+        return -1;
+    return (int) *find_name_slot(table, name, len) - 1;
+}
+
+/**
+ * Adds a copy of the name [name] of [len] bytes, which [table] does
+ * not hold, to [table]. Returns its index.
+ */
+static int add_name(NameTable *table, const char *name, size_t len)
+{
+    if (table->nb_names * 2 >= table->capacity) {
+        uint32_t *old_slots = table->slots;
+        size_t old_capacity = table->capacity;
+        table->capacity = old_capacity > 0
+            ? old_capacity * 2 : INITIAL_TABLE_CAPACITY;
+        table->slots = calloc(table->capacity, sizeof(uint32_t));
+        if (table->slots == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_slots[i] == 0)
+                continue;
+            const char *other = table->names[old_slots[i] - 1];
+            *find_name_slot(table, other, strlen(other)) = old_slots[i];
+        }
+        free(old_slots);
+    }
+    if (table->nb_names == table->names_capacity) {
+        table->names_capacity = table->names_capacity > 0
+            ? table->names_capacity * 2 : INITIAL_TABLE_CAPACITY;
+        table->names = realloc(table->names,
+                table->names_capacity * sizeof(char *));
+        if (table->names == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *copy = strndup(name, len);
+    if (copy == NULL) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    table->names[table->nb_names] = copy;
+    *find_name_slot(table, name, len) = ++table->nb_names;
+    return table->nb_names - 1;
+}
+
+static void free_name_table(NameTable *table)
+{
+    for (size_t i = 0; i < table->nb_names; i++)
+        free(table->names[i]);
+    free(table->names);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Adds the children of the tag [tag] of the config, of index
+ * [parent] in [stats] and at depth [depth], and their descendants to
+ * the tags of the config of [stats], [tag] being the root of the
+ * config if [parent] is -1.
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool add_config_tags(
+        TagStats *stats,
+        const TagsTree *tag,
+        int parent,
+        int depth)
+{
+    TagsTree children = *tag;
+    TagError error;
+    if (parent >= 0 && (error = get_children_array(tag, &children))
+            != NO_ERROR) {
+        print_tag_error(error);
+        return false;
+    }
+    bool success = true;
+    cJSON *child = NULL;
+    cJSON_ArrayForEach(child, children.json_tree) {
+        TagsTree child_tag = { .json_tree = child };
+        const char *name;
+        if ((error = get_name(&child_tag, &name)) != NO_ERROR) {
+            print_tag_error(error);
+            success = false;
+            continue;
+        }
+        /* A name given twice keeps its first place in the tree.  */
+        if (find_name(&stats->known, name, strlen(name)) >= 0)
+            continue;
+        int index = add_name(&stats->known, name, strlen(name));
+        stats->parents = realloc(stats->parents,
+                stats->known.names_capacity * sizeof(int));
+        stats->depths = realloc(stats->depths,
+                stats->known.names_capacity * sizeof(int));
+        if (stats->parents == NULL || stats->depths == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        stats->parents[index] = parent;
+        stats->depths[index] = depth;
+        success = add_config_tags(stats, &child_tag, index, depth + 1)
+            && success;
+    }
+    return success;
+}
+
+/**
+ * Returns the identifier of the tag [name] of [len] bytes in [stats],
+ * adding it to the tags missing from the config if needed.
+ */
+static uint32_t get_tag_id(TagStats *stats, const char *name, size_t len)
+{
+    int index = find_name(&stats->known, name, len);
+    if (index >= 0)
+        return index;
+    pthread_mutex_lock(&stats->lock);
+    index = find_name(&stats->unknown, name, len);
+    if (index < 0)
+        index = add_name(&stats->unknown, name, len);
+    pthread_mutex_unlock(&stats->lock);
+    return stats->known.nb_names + index;
+}
+
+/**
+ * Returns the slot of [pairs] holding the pair of tags [a] and [b],
+ * [a] being smaller than [b], or the free slot where it goes.
+ */
+static PairCount *find_pair_slot(const PairTable *pairs, uint32_t a, uint32_t b)
+{
+    uint64_t hash = ((uint64_t) a << 32 | b) * UINT64_C(0x9e3779b97f4a7c15);
+    hash ^= hash >> 29;
+    size_t mask = pairs->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        PairCount *slot = &pairs->slots[i];
+        if (slot->count == 0 || (slot->tags[0] == a && slot->tags[1] == b))
+            return slot;
+    }
+}
+
+/**
+ * Adds [count] files having both the tags [a] and [b], [a] being
+ * smaller than [b], to [pairs].
+ */
+static void add_pair(PairTable *pairs, uint32_t a, uint32_t b, uint64_t count)
+{
+    if (pairs->size * 2 >= pairs->capacity) {
+        PairCount *old_slots = pairs->slots;
+        size_t old_capacity = pairs->capacity;
+        pairs->capacity = old_capacity > 0
+            ? old_capacity * 2 : INITIAL_TABLE_CAPACITY;
+        pairs->slots = calloc(pairs->capacity, sizeof(PairCount));
+        if (pairs->slots == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            const PairCount *pair = &old_slots[i];
+            if (pair->count > 0)
+                *find_pair_slot(pairs, pair->tags[0], pair->tags[1]) = *pair;
+        }
+        free(old_slots);
+    }
+    PairCount *slot = find_pair_slot(pairs, a, b);
+    if (slot->count == 0) {
+        slot->tags[0] = a;
+        slot->tags[1] = b;
+        pairs->size++;
+    }
+    slot->count += count;
+}
+
+/**
+ * Makes room in [counts] for the tag identifier [id].
+ */
+static void reserve_tag(TagCounts *counts, uint32_t id)
+{
+    if (id < counts->capacity)
+        return;
+    size_t old_capacity = counts->capacity;
+    while (counts->capacity <= id)
+        counts->capacity = counts->capacity > 0
+            ? counts->capacity * 2 : INITIAL_TABLE_CAPACITY;
+    counts->counts = realloc(counts->counts,
+            counts->capacity * sizeof(uint64_t));
+    if (counts->counts == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(counts->counts + old_capacity, 0,
+            (counts->capacity - old_capacity) * sizeof(uint64_t));
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    uint32_t id_a = *(const uint32_t *) a;
+    uint32_t id_b = *(const uint32_t *) b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * Counts the tags of the file [entry] in the TagCounts of [worker] of
+ * the TagStats given as [arg].
+ */
+static bool count_file_tags(
+        WalkWorker *worker,
+        const WalkEntry *entry,
+        void *arg)
+{
+    assert(worker != NULL);
+    assert(entry != NULL);
+    assert(arg != NULL);
+
+    TagStats *stats = arg;
+    TagCounts *counts = &stats->counts[worker->id];
+    PascalBuffer *buffer = &worker->xattr_buf;
+    counts->nb_files++;
+
+    unsigned int nb_calls = 0;
+    ssize_t buflen = read_xattr_list(entry->dirfd, entry->name, buffer,
+            &nb_calls);
+    walk_stats_count(worker->stats, WALK_SYSCALL_LISTXATTR, nb_calls);
+    if (buflen == -1)
+        goto ERROR;
+
+    size_t nb_tags = 0;
+    XattrTagScanner scanner;
+    const char *tag;
+    size_t len;
+    scan_xattr_tags(&scanner, buffer->str, buflen);
+    while (next_xattr_tag(&scanner, &tag, &len)) {
+        if (nb_tags == counts->file_tags_capacity) {
+            counts->file_tags_capacity = nb_tags > 0 ? nb_tags * 2 : 16;
+            counts->file_tags = realloc(counts->file_tags,
+                    counts->file_tags_capacity * sizeof(uint32_t));
+            if (counts->file_tags == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        counts->file_tags[nb_tags++] = get_tag_id(stats, tag, len);
+    }
+    if (nb_tags == 0)
+        return true;
+    counts->nb_tagged++;
+    if (worker->stats != NULL)
+        worker->stats->nb_matches++;
+
+    uint32_t *ids = counts->file_tags;
+    qsort(ids, nb_tags, sizeof(uint32_t), compare_ids);
+    reserve_tag(counts, ids[nb_tags - 1]);
+    for (size_t i = 0; i < nb_tags; i++) {
+        counts->counts[ids[i]]++;
+        for (size_t j = i + 1; j < nb_tags; j++)
+            add_pair(&counts->pairs, ids[i], ids[j], 1);
+        /* The files count for the tag and each of its ancestors.  */
+        for (int id = ids[i] < stats->known.nb_names ? (int) ids[i] : -1;
+                id >= 0 && counts->stamps[id] != counts->nb_files;
+                id = stats->parents[id]) {
+            counts->stamps[id] = counts->nb_files;
+            counts->rolled_up[id]++;
+        }
+    }
+    return true;
+
+ERROR:;
+    int errno_save = errno;
+    fprintf(stderr, "Could not get tags for '%s': %s\n",
+            walk_entry_path(worker, entry), strerror(errno_save));
+    return false;
+}
+
+/**
+ * Adds the counts of all the workers of [stats] to the ones of the
+ * first worker, reserving room for every tag.
+ */
+static void merge_counts(TagStats *stats)
+{
+    TagCounts *total = &stats->counts[0];
+    size_t nb_tags = stats->known.nb_names + stats->unknown.nb_names;
+    if (nb_tags > 0)
+        reserve_tag(total, nb_tags - 1);
+    for (int i = 1; i < stats->nb_counts; i++) {
+        const TagCounts *counts = &stats->counts[i];
+        total->nb_files += counts->nb_files;
+        total->nb_tagged += counts->nb_tagged;
+        for (size_t id = 0; id < counts->capacity; id++)
+            total->counts[id] += counts->counts[id];
+        for (size_t id = 0; id < stats->known.nb_names; id++)
+            total->rolled_up[id] += counts->rolled_up[id];
+        for (size_t j = 0; j < counts->pairs.capacity; j++) {
+            const PairCount *pair = &counts->pairs.slots[j];
+            if (pair->count > 0)
+                add_pair(&total->pairs, pair->tags[0], pair->tags[1],
+                        pair->count);
+        }
+    }
+}
+
+/**
+ * Returns the name of the tag of identifier [id] in [stats].
+ */
+static const char *tag_name(const TagStats *stats, uint32_t id)
+{
+    if (id < stats->known.nb_names)
+        return stats->known.names[id];
+    return stats->unknown.names[id - stats->known.nb_names];
+}
+
+/**
+ * Orders the tags missing from the config, of the TagStats [arg], by
+ * decreasing number of files, then by name.
+ */
+static int compare_unknown(const void *a, const void *b, void *arg)
+{
+    const TagStats *stats = arg;
+    uint32_t id_a = *(const uint32_t *) a;
+    uint32_t id_b = *(const uint32_t *) b;
+    uint64_t count_a = stats->counts[0].counts[id_a];
+    uint64_t count_b = stats->counts[0].counts[id_b];
+    if (count_a != count_b)
+        return count_a < count_b ? 1 : -1;
+    return strcmp(tag_name(stats, id_a), tag_name(stats, id_b));
+}
+
+/**
+ * Orders the pairs of tags of the TagStats [arg] by decreasing number
+ * of files, then by names.
+ */
+static int compare_pairs(const void *a, const void *b, void *arg)
+{
+    const TagStats *stats = arg;
+    const PairCount *pair_a = a;
+    const PairCount *pair_b = b;
+    if (pair_a->count != pair_b->count)
+        return pair_a->count < pair_b->count ? 1 : -1;
+    for (int i = 0; i < 2; i++) {
+        int cmp = strcmp(tag_name(stats, pair_a->tags[i]),
+                tag_name(stats, pair_b->tags[i]));
+        if (cmp != 0)
+            return cmp;
+    }
+    return 0;
+}
+
+/**
+ * The sorted results of a TagStats: the identifiers [unknown] of the
+ * tags missing from the config and the [nb_pairs] pairs of tags
+ * [pairs] found together on files.
+ */
+typedef struct {
+    uint32_t *unknown;
+    PairCount *pairs;
+    size_t nb_pairs;
+} TagReport;
+
+/**
+ * Sorts the merged counts of [stats] into [report].
+ */
+static void sort_report(const TagStats *stats, TagReport *report)
+{
+    const TagCounts *total = &stats->counts[0];
+    size_t nb_unknown = stats->unknown.nb_names;
+    report->unknown = malloc((nb_unknown + 1) * sizeof(uint32_t));
+    report->pairs = malloc((total->pairs.size + 1) * sizeof(PairCount));
+    if (report->unknown == NULL || report->pairs == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nb_unknown; i++)
+        report->unknown[i] = stats->known.nb_names + i;
+    report->nb_pairs = 0;
+    for (size_t i = 0; i < total->pairs.capacity; i++) {
+        if (total->pairs.slots[i].count > 0)
+            report->pairs[report->nb_pairs++] = total->pairs.slots[i];
+    }
+    qsort_r(report->unknown, nb_unknown, sizeof(uint32_t), compare_unknown,
+            (void *) stats);
+    qsort_r(report->pairs, report->nb_pairs, sizeof(PairCount),
+            compare_pairs, (void *) stats);
+}
+
+/**
+ * Returns the percentage that [part] makes of [whole].
+ */
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+/**
+ * Prints the counts of [stats], sorted in [report], as text to
+ * [out].
+ */
+static void print_text_report(
+        const TagStats *stats,
+        const TagReport *report,
+        FILE *out)
+{
+    const TagCounts *total = &stats->counts[0];
+    uint64_t nb_untagged = total->nb_files - total->nb_tagged;
+    fprintf(out, "Files: %" PRIu64 "\n", total->nb_files);
+    fprintf(out, "Tagged files: %" PRIu64 " (%.1f%%)\n", total->nb_tagged,
+            percent(total->nb_tagged, total->nb_files));
+    fprintf(out, "Untagged files: %" PRIu64 " (%.1f%%)\n", nb_untagged,
+            percent(nb_untagged, total->nb_files));
+
+    int width = strlen("Tag");
+    for (size_t id = 0; id < stats->known.nb_names; id++) {
+        int tag_width = stats->depths[id] * INDENT_WIDTH
+            + strlen(stats->known.names[id]);
+        if (tag_width > width)
+            width = tag_width;
+    }
+    if (stats->known.nb_names > 0) {
+        fprintf(out, "\n%-*s  %10s  %16s\n", width, "Tag", "Files",
+                "With descendants");
+        for (size_t id = 0; id < stats->known.nb_names; id++) {
+            int indent = stats->depths[id] * INDENT_WIDTH;
+            fprintf(out, "%*s%-*s  %10" PRIu64 "  %16" PRIu64 "\n",
+                    indent, "", width - indent, stats->known.names[id],
+                    total->counts[id], total->rolled_up[id]);
+        }
+    }
+    if (stats->unknown.nb_names > 0) {
+        fprintf(out, "\nTags missing from the config:\n");
+        for (size_t i = 0; i < stats->unknown.nb_names; i++)
+            fprintf(out, "  %s: %" PRIu64 "\n",
+                    tag_name(stats, report->unknown[i]),
+                    total->counts[report->unknown[i]]);
+    }
+    if (report->nb_pairs > 0) {
+        fprintf(out, "\nTags found together:\n");
+        for (size_t i = 0; i < report->nb_pairs; i++) {
+            const PairCount *pair = &report->pairs[i];
+            fprintf(out, "  %s & %s: %" PRIu64 "\n",
+                    tag_name(stats, pair->tags[0]),
+                    tag_name(stats, pair->tags[1]), pair->count);
+        }
+    }
+}
+
+/**
+ * Returns a new cJSON object, exiting if it cannot be allocated.
+ */
+static cJSON *new_object(void)
+{
+    cJSON *object = cJSON_CreateObject();
+    if (object == NULL) {
+        perror("cJSON_CreateObject");
+        exit(EXIT_FAILURE);
+    }
+    return object;
+}
+
+/**
+ * Prints the counts of [stats], sorted in [report], as a JSON object
+ * to [out].
+ * Returns [false] if an error occurs, [true] otherwise.
+ */
+static bool print_json_report(
+        const TagStats *stats,
+        const TagReport *report,
+        FILE *out)
+{
+    const TagCounts *total = &stats->counts[0];
+    cJSON *json = new_object();
+    cJSON_AddNumberToObject(json, "files", total->nb_files);
+    cJSON_AddNumberToObject(json, "tagged", total->nb_tagged);
+    cJSON_AddNumberToObject(json, "untagged_ratio", total->nb_files > 0
+            ? (double) (total->nb_files - total->nb_tagged)
+            / total->nb_files : 0.0);
+
+    cJSON *tags = cJSON_AddArrayToObject(json, "tags");
+    for (size_t id = 0; tags != NULL && id < stats->known.nb_names; id++) {
+        cJSON *tag = new_object();
+        cJSON_AddStringToObject(tag, "name", stats->known.names[id]);
+        if (stats->parents[id] >= 0)
+            cJSON_AddStringToObject(tag, "parent",
+                    stats->known.names[stats->parents[id]]);
+        else
+            cJSON_AddNullToObject(tag, "parent");
+        cJSON_AddNumberToObject(tag, "files", total->counts[id]);
+        cJSON_AddNumberToObject(tag, "rolled_up", total->rolled_up[id]);
+        cJSON_AddItemToArray(tags, tag);
+    }
+    cJSON *unknown = cJSON_AddArrayToObject(json, "missing_from_config");
+    for (size_t i = 0; unknown != NULL && i < stats->unknown.nb_names; i++) {
+        cJSON *tag = new_object();
+        cJSON_AddStringToObject(tag, "name",
+                tag_name(stats, report->unknown[i]));
+        cJSON_AddNumberToObject(tag, "files",
+                total->counts[report->unknown[i]]);
+        cJSON_AddItemToArray(unknown, tag);
+    }
+    cJSON *pairs = cJSON_AddArrayToObject(json, "cooccurrences");
+    for (size_t i = 0; pairs != NULL && i < report->nb_pairs; i++) {
+        const PairCount *pair = &report->pairs[i];
+        const char *names[2] = {
+            tag_name(stats, pair->tags[0]), tag_name(stats, pair->tags[1])
+        };
+        cJSON *entry = new_object();
+        cJSON_AddItemToObject(entry, "tags", cJSON_CreateStringArray(names, 2));
+        cJSON_AddNumberToObject(entry, "files", pair->count);
+        cJSON_AddItemToArray(pairs, entry);
+    }
+
+    char *text = cJSON_Print(json);
+    cJSON_Delete(json);
+    if (tags == NULL || unknown == NULL || pairs == NULL || text == NULL) {
+        free(text);
+        fprintf(stderr, "Could not build the JSON report\n");
+        return false;
+    }
+    fprintf(out, "%s\n", text);
+    free(text);
+    return true;
+}
+
+static void free_tag_stats(TagStats *stats)
+{
+    for (int i = 0; i < stats->nb_counts; i++) {
+        TagCounts *counts = &stats->counts[i];
+        free(counts->counts);
+        free(counts->rolled_up);
+        free(counts->stamps);
+        free(counts->file_tags);
+        free(counts->pairs.slots);
+    }
+    free(stats->counts);
+    free(stats->parents);
+    free(stats->depths);
+    free_name_table(&stats->known);
+    free_name_table(&stats->unknown);
+    pthread_mutex_destroy(&stats->lock);
+}
+
+static void print_help(const char *prog_name)
+{
+    fprintf(stderr,
+            "Usage: %s [OPTION]... <dir>\n"
+            "   or: %s -h\n\n"
+            "Count, in a single walk of <dir>, the files having each tag of\n"
+            "the current user, with and without its descendants, the\n"
+            "untagged files, the tags missing from the config and the\n"
+            "tags found together on the same files.\n\n"
+            "Options:\n"
+            "\t--json\t\tPrint the report as a JSON object\n"
+            "\t--stats\t\tPrint to stderr the system calls made\n"
+            WALK_OPTIONS_HELP
+            "\t-h\t\tPrint this help message\n\n",
+            prog_name, prog_name);
+}
+
+/**
+ * Parses the options at the beginning of [argv] and writes them to
+ * [options], [json] and [print_stats]. Returns the index of the first
+ * non option argument, or -1 if an option is invalid.
+ */
+static int parse_options(
+        int argc,
+        const char *argv[],
+        WalkOptions *options,
+        bool *json,
+        bool *print_stats)
+{
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        const char *opt = argv[i];
+        int walk_option = walk_parse_option(argc, argv, &i, options);
+        if (walk_option < 0) {
+            return -1;
+        } else if (walk_option > 0) {
+            continue;
+        } else if (strcmp(opt, "--json") == 0) {
+            *json = true;
+        } else if (strcmp(opt, "--stats") == 0) {
+            *print_stats = true;
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", opt);
+            return -1;
+        }
+    }
+    return i;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    } else if (strncmp(argv[1], "-h", 3) == 0) {
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+    }
+
+    const char *excludes[argc];
+    WalkOptions options = {
+        .nb_threads = 1, .excludes = excludes
+    };
+    bool json = false;
+    bool print_stats = false;
+    int first_arg = parse_options(argc, argv, &options, &json, &print_stats);
+    if (first_arg < 0 || first_arg + 1 != argc) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *dirpath = argv[first_arg];
+    struct stat st;
+    if (stat(dirpath, &st) == -1) {
+        fprintf(stderr, "Could not stat '%s': %s\n",
+                dirpath, strerror(errno));
+        return EXIT_FAILURE;
+    } else if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "'%s' is not a directory\n", dirpath);
+        return EXIT_FAILURE;
+    }
+
+    load_config();
+    const TagsTree *root;
+    unsigned int generation;
+    TagError error;
+    if ((error = get_config_tree(&root, &generation)) != NO_ERROR) {
+        print_tag_error(error);
+        return EXIT_FAILURE;
+    }
+
+    TagStats stats = {0};
+    pthread_mutex_init(&stats.lock, NULL);
+    bool success = add_config_tags(&stats, root, -1, 0);
+    stats.nb_counts = options.nb_threads;
+    stats.counts = calloc(stats.nb_counts, sizeof(TagCounts));
+    if (stats.counts == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t nb_known = stats.known.nb_names;
+    for (int i = 0; i < stats.nb_counts; i++) {
+        stats.counts[i].rolled_up = calloc(nb_known + 1, sizeof(uint64_t));
+        stats.counts[i].stamps = calloc(nb_known + 1, sizeof(uint64_t));
+        if (stats.counts[i].rolled_up == NULL
+                || stats.counts[i].stamps == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    WalkStats walk_stats = {0};
+    if (print_stats)
+        options.stats = &walk_stats;
+    options.on_file = count_file_tags;
+    options.arg = &stats;
+    success = walk_tree(dirpath, &options) && success;
+
+    merge_counts(&stats);
+    TagReport report;
+    sort_report(&stats, &report);
+    if (json)
+        success = print_json_report(&stats, &report, stdout) && success;
+    else
+        print_text_report(&stats, &report, stdout);
+    if (print_stats)
+        walk_stats_print(&walk_stats, stderr);
+    free(report.unknown);
+    free(report.pairs);
+    free_tag_stats(&stats);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,54 +1,159 @@
+#define _GNU_SOURCE
 #include "tag.h"
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <pwd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define XATTR_ROOT_NAMESPACE "user.tagsys6."
+#define LOCK_FILE_SUFFIX ".lock"
 #define CONFIG_FILE_LOCATION ".tagsys6.json"
+#define INDEX_FILE_LOCATION ".tagsys6.index"
+#define JOURNAL_FILE_LOCATION ".tagsys6.journal"
+#define SOCKET_FILE_LOCATION ".tagsys6.sock"
+#define SUMMARY_LOCK_FILE_LOCATION ".tagsys6.summary.lock"
+
+/* The size of the blocks of attributes read by next_xattr_tag().  */
+#define XATTR_SCAN_BLOCK_SIZE 32
+
+/*
+ * The *xattrat syscalls appeared in Linux 6.13 and have the same
+ * number on every architecture using the generic syscall table.
+ */
+#if !defined(SYS_getxattrat) && (defined(__x86_64__) || defined(__aarch64__))
+#define SYS_getxattrat 464
+#endif
+#if !defined(SYS_listxattrat) && (defined(__x86_64__) || defined(__aarch64__))
+#define SYS_listxattrat 465
+#endif
+
+/**
+ * The argument of getxattrat(2), see struct xattr_args in linux/xattr.h.
+ */
+struct xattrat_args {
+    uint64_t value;
+    uint32_t size;
+    uint32_t flags;
+};
 
 static const char *parsing_error = NULL;
 static char user_config_file[1000] = {0};
 static bool user_config_file_set = false;
 static size_t user_config_file_len = 0;
+static char user_index_file[1000] = {0};
+static bool user_index_file_set = false;
+static char user_journal_file[1000] = {0};
+static bool user_journal_file_set = false;
+static char user_socket_file[1000] = {0};
+static bool user_socket_file_set = false;
+static char user_summary_lock_file[1000] = {0};
+static bool user_summary_lock_file_set = false;
 static char xattr_user_namespace[200] = {0};
 static bool xattr_user_namespace_set = false;
 static size_t xattr_user_namespace_len = 0;
+static atomic_bool has_xattrat_syscalls = true;
+
+/* The config tree returned by get_config_tree() and the file it was
+ * parsed from.  */
+static TagsTree config_tree = {0};
+static unsigned int config_tree_generation = 0;
+static struct stat config_tree_stat;
 
 const void load_config()
 {
     config_file();
+    index_file();
+    journal_file();
+    socket_file();
+    summary_lock_file();
     xattr_namespace();
 }
 
+/**
+ * Returns the home directory of the current user.
+ */
+static const char * home_directory()
+{
+    char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        struct passwd *pw = getpwuid(getuid());
+        if (pw == NULL) {
+            fprintf(stderr,
+                    "Could not determine home directory: %s\n",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        home_dir = pw->pw_dir;
+    }
+    return home_dir;
+}
+
 const char * config_file()
 {
     if (!user_config_file_set) {
-        char *home_dir = getenv("HOME");
-        if (home_dir != NULL) {
-            snprintf(user_config_file, 1000, "%s",
-                    home_dir);
-        } else {
-            struct passwd *pw = getpwuid(getuid());
-            if (pw == NULL) {
-                fprintf(stderr,
-                        "Could not determine home directory: %s\n",
-                        strerror(errno));
-                exit(EXIT_FAILURE);
-            }
-            home_dir = pw->pw_dir;
-        }
         user_config_file_set = true;
-        user_config_file_len = snprintf(
-                user_config_file, 1000, "%s/"CONFIG_FILE_LOCATION, home_dir);
+        user_config_file_len = snprintf(user_config_file, 1000,
+                "%s/"CONFIG_FILE_LOCATION, home_directory());
     }
     return user_config_file;
 }
 
+const char * index_file()
+{
+    if (!user_index_file_set) {
+        user_index_file_set = true;
+        snprintf(user_index_file, 1000,
+                "%s/"INDEX_FILE_LOCATION, home_directory());
+    }
+    return user_index_file;
+}
+
+const char * journal_file()
+{
+    if (!user_journal_file_set) {
+        user_journal_file_set = true;
+        snprintf(user_journal_file, 1000,
+                "%s/"JOURNAL_FILE_LOCATION, home_directory());
+    }
+    return user_journal_file;
+}
+
+const char * socket_file()
+{
+    if (!user_socket_file_set) {
+        user_socket_file_set = true;
+        snprintf(user_socket_file, 1000,
+                "%s/"SOCKET_FILE_LOCATION, home_directory());
+    }
+    return user_socket_file;
+}
+
+const char * summary_lock_file()
+{
+    if (!user_summary_lock_file_set) {
+        user_summary_lock_file_set = true;
+        snprintf(user_summary_lock_file, 1000,
+                "%s/"SUMMARY_LOCK_FILE_LOCATION, home_directory());
+    }
+    return user_summary_lock_file;
+}
+
 const size_t config_file_len()
 {
     return user_config_file_len;
@@ -70,6 +175,109 @@ const size_t xattr_namespace_len()
     return xattr_user_namespace_len;
 }
 
+/**
+ * Writes "/proc/self/fd/[dirfd]/[name]" to [buf], the path through
+ * which the file [name] of the directory [dirfd] can be reached
+ * without resolving the path of the directory again.
+ * Returns [false] if the path does not fit in [buf].
+ */
+static bool proc_fd_path(int dirfd, const char *name, char *buf, size_t size)
+{
+    int rc = snprintf(buf, size, "/proc/self/fd/%d/%s", dirfd, name);
+    if (rc < 0 || rc >= size) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+ssize_t listxattr_at(int dirfd, const char *name, char *list, size_t size)
+{
+    assert(name != NULL);
+
+#ifdef SYS_listxattrat
+    if (atomic_load_explicit(&has_xattrat_syscalls, memory_order_relaxed)) {
+        ssize_t rc = syscall(SYS_listxattrat, dirfd, name, 0, list, size);
+        if (rc != -1 || errno != ENOSYS)
+            return rc;
+        atomic_store_explicit(
+                &has_xattrat_syscalls, false, memory_order_relaxed);
+    }
+#endif
+    if (dirfd == AT_FDCWD || name[0] == '/')
+        return listxattr(name, list, size);
+    char path[PROC_FD_PATH_SIZE];
+    if (!proc_fd_path(dirfd, name, path, sizeof(path)))
+        return -1;
+    return listxattr(path, list, size);
+}
+
+ssize_t getxattr_at(
+        int dirfd,
+        const char *name,
+        const char *attr,
+        void *value,
+        size_t size)
+{
+    assert(name != NULL);
+    assert(attr != NULL);
+
+#ifdef SYS_getxattrat
+    if (atomic_load_explicit(&has_xattrat_syscalls, memory_order_relaxed)) {
+        struct xattrat_args args = {
+            .value = (uintptr_t) value, .size = size, .flags = 0
+        };
+        ssize_t rc = syscall(SYS_getxattrat, dirfd, name, 0, attr,
+                &args, sizeof(args));
+        if (rc != -1 || errno != ENOSYS)
+            return rc;
+        atomic_store_explicit(
+                &has_xattrat_syscalls, false, memory_order_relaxed);
+    }
+#endif
+    if (dirfd == AT_FDCWD || name[0] == '/')
+        return getxattr(name, attr, value, size);
+    char path[PROC_FD_PATH_SIZE];
+    if (!proc_fd_path(dirfd, name, path, sizeof(path)))
+        return -1;
+    return getxattr(path, attr, value, size);
+}
+
+ssize_t read_xattr_list(
+        int dirfd,
+        const char *name,
+        PascalBuffer *buffer,
+        unsigned int *nb_calls)
+{
+    assert(name != NULL);
+    assert(buffer != NULL);
+
+    if (buffer->str_capacity == 0)
+        extends_buffer(buffer, INITIAL_XATTR_LIST_SIZE);
+    ssize_t buflen;
+    unsigned int calls = 1;
+    while ((buflen = listxattr_at(dirfd, name, buffer->str,
+                    buffer->str_capacity)) == -1) {
+        if (errno != ERANGE)
+            break;
+        /* The list grew since it was last read, ask for its size.  */
+        calls += 2;
+        ssize_t size = listxattr_at(dirfd, name, NULL, 0);
+        if (size == -1) {
+            buflen = -1;
+            break;
+        }
+        /* The list may have shrunk or grown again in the meantime: the
+         * buffer grows anyway, so that the loop ends.  */
+        size_t capacity = buffer->str_capacity;
+        extends_buffer(buffer,
+                2 * ((size_t) size > capacity ? (size_t) size : capacity));
+    }
+    if (nb_calls != NULL)
+        *nb_calls += calls;
+    buffer->str_length = buflen == -1 ? 0 : buflen;
+    return buflen;
+}
 
 void print_tag_error(TagError error)
 {
@@ -91,6 +299,34 @@ void print_tag_error(TagError error)
             fprintf(stderr, "Error, invalid config file '%s'\n",
                     JSON_CONFIG_FILE);
             break;
+        case LOAD_INDEX_ERROR:
+            fprintf(stderr, "Error loading index file '%s': %s\n",
+                    INDEX_FILE, strerror(errno));
+            break;
+        case WRITE_INDEX_ERROR:
+            fprintf(stderr, "Error writing index file '%s': %s\n",
+                    INDEX_FILE, strerror(errno));
+            break;
+        case INVALID_INDEX_FILE:
+            fprintf(stderr, "Error, invalid index file '%s'\n",
+                    INDEX_FILE);
+            break;
+        case LOAD_JOURNAL_ERROR:
+            fprintf(stderr, "Error loading journal file '%s': %s\n",
+                    JOURNAL_FILE, strerror(errno));
+            break;
+        case WRITE_JOURNAL_ERROR:
+            fprintf(stderr, "Error writing journal file '%s': %s\n",
+                    JOURNAL_FILE, strerror(errno));
+            break;
+        case INVALID_JOURNAL_FILE:
+            fprintf(stderr, "Error, invalid journal file '%s'\n",
+                    JOURNAL_FILE);
+            break;
+        case JOURNAL_CURSOR_LOST:
+            fprintf(stderr, "Error, the changes to read were removed from "
+                    "the journal '%s'\n", JOURNAL_FILE);
+            break;
         case NO_ERROR:
             break;
         default:
@@ -100,15 +336,134 @@ void print_tag_error(TagError error)
 }
 
 
+int lock_file(const char *filename)
+{
+    assert(filename != NULL);
+
+    size_t len = strlen(filename) + sizeof(LOCK_FILE_SUFFIX);
+    char lock_filename[len];
+    snprintf(lock_filename, len, "%s"LOCK_FILE_SUFFIX, filename);
+    int fd = open(lock_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+    if (flock(fd, LOCK_EX) == -1) {
+        int errno_save = errno;
+        close(fd);
+        errno = errno_save;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Returns the mask of the null bytes of the XATTR_SCAN_BLOCK_SIZE bytes
+ * [block], bit [i] standing for the byte [i].
+ */
+static inline uint32_t null_bytes_mask(const char *block)
+{
+#if defined(__AVX2__)
+    __m256i bytes = _mm256_loadu_si256((const __m256i *) block);
+    return _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, _mm256_setzero_si256()));
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_loadu_si128((const __m128i *) block);
+    __m128i high = _mm_loadu_si128((const __m128i *) (block + 16));
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(low, zero))
+        | (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(high, zero)) << 16;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < XATTR_SCAN_BLOCK_SIZE; i++)
+        mask |= (uint32_t) (block[i] == '\0') << i;
+    return mask;
+#endif
+}
+
+void scan_xattr_tags(XattrTagScanner *scanner, const char *list, size_t size)
+{
+    assert(scanner != NULL);
+    assert(list != NULL || size == 0);
+
+    scanner->pos = list;
+    scanner->end = list + size;
+    scanner->prefix = xattr_namespace();
+    scanner->prefix_len = xattr_namespace_len();
+    assert(scanner->prefix_len >= sizeof(uint64_t));
+    memcpy(&scanner->prefix_head, scanner->prefix, sizeof(uint64_t));
+    if (size >= XATTR_SCAN_BLOCK_SIZE) {
+        scanner->block = list;
+        scanner->nul_mask = null_bytes_mask(list);
+    } else {
+        scanner->block = NULL;
+        scanner->nul_mask = 0;
+    }
+}
+
+/**
+ * Returns the null byte ending the attribute starting at the position
+ * of [scanner], or NULL if the list ends first. The null bytes are
+ * taken from the mask of the current block, the next blocks being
+ * read as needed, until less than a block remains.
+ */
+static const char *next_key_end(XattrTagScanner *scanner)
+{
+    while (scanner->nul_mask == 0 && scanner->block != NULL) {
+        const char *next = scanner->block + XATTR_SCAN_BLOCK_SIZE;
+        if (scanner->end - next < XATTR_SCAN_BLOCK_SIZE) {
+            scanner->block = NULL;
+        } else {
+            scanner->block = next;
+            scanner->nul_mask = null_bytes_mask(next);
+        }
+    }
+    if (scanner->block == NULL)
+        return memchr(scanner->pos, '\0', scanner->end - scanner->pos);
+    const char *nul = scanner->block + __builtin_ctz(scanner->nul_mask);
+    scanner->nul_mask &= scanner->nul_mask - 1;
+    return nul;
+}
+
+bool next_xattr_tag(XattrTagScanner *scanner, const char **tag, size_t *len)
+{
+    assert(scanner != NULL);
+    assert(tag != NULL);
+    assert(len != NULL);
+
+    while (scanner->pos < scanner->end) {
+        const char *key = scanner->pos;
+        const char *key_end = next_key_end(scanner);
+        /* A key cut by the end of the list is not terminated.  */
+        if (key_end == NULL) {
+            scanner->pos = scanner->end;
+            return false;
+        }
+        scanner->pos = key_end + 1;
+
+        /* Most foreign keys already differ in their first 8 bytes.  */
+        size_t keylen = key_end - key;
+        uint64_t head;
+        if (keylen <= scanner->prefix_len)
+            continue;
+        memcpy(&head, key, sizeof(head));
+        if (head == scanner->prefix_head
+                && memcmp(key + sizeof(head), scanner->prefix + sizeof(head),
+                    scanner->prefix_len - sizeof(head)) == 0) {
+            *tag = key + scanner->prefix_len;
+            *len = keylen - scanner->prefix_len;
+            return true;
+        }
+    }
+    return false;
+}
+
 void add_to_str_array(RedimStringArray *array, const char *str)
 {
     assert(array != NULL);
     assert(str != NULL);
 
     if (array->nb_elt + 1 >= array->capacity) {
-        int new_capacity = ((array->capacity + 1) * 2) * sizeof(char*);
-        assert(new_capacity > 0);
-        void *rc = realloc(array->array, new_capacity);
+        size_t new_capacity = (array->capacity + 1) * 2;
+        void *rc = realloc(array->array, new_capacity * sizeof(char*));
         if (rc == NULL) {
             free(array->array);
             perror("realloc");
@@ -128,10 +483,9 @@ void add_to_redim_array(
     assert(str_array != NULL);
 
     if (redim_array->nb_elt + 1 >= redim_array->capacity) {
-        int new_capacity =
-            ((redim_array->capacity + 1) * 2) * sizeof(*str_array);
-        assert(new_capacity > 0);
-        void *rc = realloc(redim_array->array, new_capacity);
+        size_t new_capacity = (redim_array->capacity + 1) * 2;
+        void *rc = realloc(
+                redim_array->array, new_capacity * sizeof(*str_array));
         if (rc == NULL) {
             free(redim_array->array);
             perror("realloc");
@@ -261,13 +615,41 @@ TagError write_config_file(const char *filename, TagsTree *src)
     cJSON_Minify(str);
     size_t len = strlen(str);
     size_t rc = fwrite(str, 1, len,  f);
-    fclose(f);
+    /* A full disk may only be reported when the buffer is flushed.  */
+    bool closed = fclose(f) == 0;
     free(str);
-    if (rc != len)
+    if (rc != len || !closed)
         return INCOMPLETE_WRITE_CONFIG_ERROR;
     return NO_ERROR;
 }
 
+TagError get_config_tree(const TagsTree **tree, unsigned int *generation)
+{
+    assert(tree != NULL);
+
+    struct stat st;
+    if (stat(JSON_CONFIG_FILE, &st) == -1)
+        return LOAD_CONFIG_ERROR;
+    if (config_tree.json_tree == NULL
+            || st.st_ino != config_tree_stat.st_ino
+            || st.st_size != config_tree_stat.st_size
+            || st.st_mtim.tv_sec != config_tree_stat.st_mtim.tv_sec
+            || st.st_mtim.tv_nsec != config_tree_stat.st_mtim.tv_nsec) {
+        TagsTree parsed;
+        TagError error = parse_config_file(JSON_CONFIG_FILE, &parsed);
+        if (error != NO_ERROR)
+            return error;
+        free_tags_tree(&config_tree);
+        config_tree = parsed;
+        config_tree_stat = st;
+        config_tree_generation++;
+    }
+    *tree = &config_tree;
+    if (generation != NULL)
+        *generation = config_tree_generation;
+    return NO_ERROR;
+}
+
 void free_tags_tree(TagsTree *tree)
 {
     if (tree != NULL)
@@ -2,16 +2,29 @@
 #define TAG_H
 
 #include "../lib/cJSON.h"
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define XATTR_PROG_DOMAIN xattr_namespace()
 #define XATTR_PROG_DOMAIN_LEN xattr_namespace_len()
 #define JSON_CONFIG_FILE config_file()
+#define INDEX_FILE index_file()
+#define JOURNAL_FILE journal_file()
+#define SOCKET_FILE socket_file()
+#define SUMMARY_LOCK_FILE summary_lock_file()
 
 #define NAME_ATTRIBUTE "name"
 #define ASSIGNABLE_ATTRIBUTE "assignable"
 #define CHILDREN_ATTRIBUTE "children"
 
+/* The size of a /proc/self/fd/<dirfd>/<name> path, see listxattr_at().  */
+#define PROC_FD_PATH_SIZE (32 + NAME_MAX)
+
+/* The size of the first buffer allocated by read_xattr_list().  */
+#define INITIAL_XATTR_LIST_SIZE 1024
+
 
 /**
  * Represents the errors that migth occur while
@@ -22,7 +35,14 @@ typedef enum {
     LOAD_CONFIG_ERROR = 1,
     PARSE_CONFIG_ERROR = 2,
     INCOMPLETE_WRITE_CONFIG_ERROR = 3,
-    INVALID_CONFIG_FILE = 4
+    INVALID_CONFIG_FILE = 4,
+    LOAD_INDEX_ERROR = 5,
+    WRITE_INDEX_ERROR = 6,
+    INVALID_INDEX_FILE = 7,
+    LOAD_JOURNAL_ERROR = 8,
+    WRITE_JOURNAL_ERROR = 9,
+    INVALID_JOURNAL_FILE = 10,
+    JOURNAL_CURSOR_LOST = 11
 } TagError;
 
 /**
@@ -80,6 +100,34 @@ const char * config_file();
  */
 const size_t config_file_len();
 
+/**
+ * Returns the path to the index file
+ * of the tags of the current user, located
+ * next to the config file.
+ */
+const char * index_file();
+
+/**
+ * Returns the path to the journal of the
+ * changes made to the tags of the current
+ * user, located next to the config file.
+ */
+const char * journal_file();
+
+/**
+ * Returns the path to the Unix socket on
+ * which the tagsysd daemon of the current
+ * user listens, located next to the config file.
+ */
+const char * socket_file();
+
+/**
+ * Returns the path to the file locked while
+ * the directory summaries of the current user
+ * are written, located next to the config file.
+ */
+const char * summary_lock_file();
+
 /**
  * Returns the string representing the
  * xattr namespace for the current user.
@@ -92,6 +140,75 @@ const char * xattr_namespace();
  */
 const size_t xattr_namespace_len();
 
+/**
+ * Same as listxattr(2) for the file [name] relative to the directory
+ * file descriptor [dirfd], so that the kernel does not resolve the
+ * whole path again, [dirfd] being possibly AT_FDCWD. Uses
+ * listxattrat(2) when the kernel provides it and falls back to the
+ * /proc/self/fd/[dirfd]/[name] path otherwise.
+ */
+ssize_t listxattr_at(int dirfd, const char *name, char *list, size_t size);
+
+/**
+ * Same as getxattr(2) for the file [name] relative to the directory
+ * file descriptor [dirfd]. See listxattr_at().
+ */
+ssize_t getxattr_at(
+        int dirfd,
+        const char *name,
+        const char *attr,
+        void *value,
+        size_t size);
+
+/**
+ * Reads into [buffer] the list of extended attributes of the file
+ * [name] relative to [dirfd], as listxattr_at() does, and sets its
+ * [str_length]. The list is read with a single call as long as
+ * [buffer] is large enough, [buffer] being grown until the list fits
+ * otherwise, even if the list changes in the meantime. The number of
+ * listxattr calls made is added to [*nb_calls], if not NULL.
+ * Returns the size of the list, or -1 and sets errno on error.
+ */
+ssize_t read_xattr_list(
+        int dirfd,
+        const char *name,
+        PascalBuffer *buffer,
+        unsigned int *nb_calls);
+
+/**
+ * An iteration over the tags of the current user in a list of extended
+ * attributes returned by listxattr(2), see scan_xattr_tags(). The null
+ * bytes of the block [block] of the list following [pos] are the bits
+ * of [nul_mask], or [block] is NULL near the end of the list.
+ */
+typedef struct {
+    const char *pos;
+    const char *end;
+    const char *block;
+    uint32_t nul_mask;
+    const char *prefix;
+    size_t prefix_len;
+    uint64_t prefix_head;
+} XattrTagScanner;
+
+/**
+ * Starts iterating with [scanner] over the tags of the current user
+ * in the [size] bytes list of extended attributes [list].
+ */
+void scan_xattr_tags(XattrTagScanner *scanner, const char *list, size_t size);
+
+/**
+ * Writes to [*tag] the name of the next tag of [scanner], that is the
+ * part following XATTR_PROG_DOMAIN of the next attribute having this
+ * prefix, and its length to [*len]. The name is terminated by the null
+ * byte of the attribute, which starts [XATTR_PROG_DOMAIN_LEN] bytes
+ * before it. The ends of the attributes are found 32 bytes at a time,
+ * with SSE2 or AVX2 when the compiler targets them, and most foreign
+ * attributes are told apart by their first 8 bytes.
+ * Returns [false] when there are no more tags.
+ */
+bool next_xattr_tag(XattrTagScanner *scanner, const char **tag, size_t *len);
+
 /**
  * Adds the string [str] to the RedimStringArray array [array].
  * If [array] does not have enough memory to hold str, it is
@@ -120,11 +237,27 @@ void append_str_to_buffer(PascalBuffer *pb, const char *str, size_t len);
  */
 void print_tag_error(TagError error);
 
+/**
+ * Takes an exclusive lock on the file [filename].lock, created if
+ * needed, to serialize the modifications of [filename].
+ * Returns the descriptor to close to release the lock, or -1 on error.
+ */
+int lock_file(const char *filename);
+
 /**
  * Returns an int code on error.
  */
 TagError parse_config_file(const char *filename, TagsTree *res);
 
+/**
+ * Writes to [*tree] the content of the config file, parsed on the
+ * first call and parsed again only when the file has changed since.
+ * The generation written to [*generation], if it is not NULL, changes
+ * each time the file is parsed, so that the data computed from the
+ * tree can be invalidated. The tree must not be freed.
+ */
+TagError get_config_tree(const TagsTree **tree, unsigned int *generation);
+
 /**
  * Writes the config file.
  */
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include "tag.h"
+#include "tagsysd.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * The daemon has this many seconds to take a request, after which the
+ * command runs by itself. The connection and the sending of the
+ * request only wait for it while it is busy with other requests.
+ */
+#define SEND_TIMEOUT_S 1
+
+/**
+ * Connects to the socket of the daemon. Returns the descriptor of the
+ * connection, or -1 if the daemon is not running or does not accept
+ * the connection within SEND_TIMEOUT_S seconds.
+ */
+static int connect_to_daemon()
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char *path = SOCKET_FILE;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    /* connect(2) waits as long as the backlog of the daemon is full.  */
+    struct timeval timeout = { .tv_sec = SEND_TIMEOUT_S };
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                sizeof(timeout)) == -1
+            || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends the header [request] of a request along with the descriptors
+ * [fds] and then its arguments [payload] through [sock].
+ */
+static bool send_request(
+        int sock,
+        const TagsysdRequest *request,
+        const int fds[TAGSYSD_NB_FDS],
+        const char *payload)
+{
+    union {
+        char buf[CMSG_SPACE(TAGSYSD_NB_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = (void *) request, .iov_len = sizeof(*request)
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(TAGSYSD_NB_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, TAGSYSD_NB_FDS * sizeof(int));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(*request))
+        return false;
+
+    size_t sent = 0;
+    while (sent < request->size) {
+        ssize_t rc = send(sock, payload + sent, request->size - sent,
+                MSG_NOSIGNAL);
+        if (rc == -1 && errno != EINTR)
+            return false;
+        else if (rc > 0)
+            sent += rc;
+    }
+    return true;
+}
+
+/**
+ * Reads the exit status of the command from [sock] to [*status].
+ */
+static bool receive_status(int sock, int *status)
+{
+    int32_t reply;
+    size_t received = 0;
+    while (received < sizeof(reply)) {
+        ssize_t rc = recv(sock, (char *) &reply + received,
+                sizeof(reply) - received, 0);
+        if (rc == 0 || (rc == -1 && errno != EINTR))
+            return false;
+        else if (rc > 0)
+            received += rc;
+    }
+    *status = reply;
+    return true;
+}
+
+bool forward_to_daemon(
+        const char *command,
+        int argc,
+        const char *argv[],
+        int *status)
+{
+    assert(command != NULL);
+    assert(status != NULL);
+
+    if (getenv(TAGSYSD_DISABLE_VARIABLE) != NULL)
+        return false;
+    int sock = connect_to_daemon();
+    if (sock == -1)
+        return false;
+
+    PascalBuffer payload = {0};
+    append_str_to_buffer(&payload, command, strlen(command) + 1);
+    for (int i = 0; i < argc; i++)
+        append_str_to_buffer(&payload, argv[i], strlen(argv[i]) + 1);
+    TagsysdRequest request = {
+        .magic = TAGSYSD_MAGIC,
+        .version = TAGSYSD_VERSION,
+        .argc = argc,
+        .size = payload.str_length
+    };
+
+    bool forwarded = false;
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int fds[TAGSYSD_NB_FDS] = { cwd, STDIN_FILENO, STDOUT_FILENO,
+        STDERR_FILENO };
+    /* The daemon only runs a request once it has received all of it.  */
+    if (cwd != -1 && payload.str_length <= TAGSYSD_MAX_REQUEST_SIZE
+            && send_request(sock, &request, fds, payload.str)) {
+        forwarded = true;
+        if (!receive_status(sock, status)) {
+            fprintf(stderr, "Lost the connection to tagsysd while running "
+                    "%s\n", command);
+            *status = EXIT_FAILURE;
+        }
+    }
+    if (cwd != -1)
+        close(cwd);
+    free(payload.str);
+    close(sock);
+    return forwarded;
+}
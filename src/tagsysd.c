@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+#include "tag.h"
+#include "commands.h"
+#include "index.h"
+#include "tagsysd.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A client has this many seconds to send its request.  */
+#define REQUEST_TIMEOUT_S 1
+
+/*
+ * The number of requests served at once. The clients connecting while
+ * that many are running wait in the backlog of the socket, and run
+ * their command themselves if they wait too long.
+ */
+#define MAX_CLIENTS 64
+
+#define NB_LATENCY_BUCKETS 6
+
+/**
+ * The upper bounds, in seconds, of the buckets of the histogram of
+ * the request durations.
+ */
+static const double latency_buckets[NB_LATENCY_BUCKETS] = {
+    1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1
+};
+
+/**
+ * The requests served for a command since the daemon started:
+ * [nb_requests] in total, [nb_errors] of which failed, and how many
+ * of them took at most each duration of latency_buckets. The counters
+ * are updated by the processes serving the requests, see SharedStats.
+ */
+typedef struct {
+    atomic_uint_least64_t nb_requests;
+    atomic_uint_least64_t nb_errors;
+    atomic_uint_least64_t buckets[NB_LATENCY_BUCKETS];
+    atomic_uint_least64_t total_ns;
+} CommandStats;
+
+/**
+ * A command that can be requested to the daemon.
+ */
+typedef struct {
+    const char *name;
+    int (*run)(int argc, const char *argv[]);
+} Command;
+
+/**
+ * A client being served by the process [pid], connected to [sock].
+ * [hung_up] is set once the client is gone and the process was asked
+ * to stop.
+ */
+typedef struct {
+    pid_t pid;
+    int sock;
+    bool hung_up;
+} Client;
+
+/**
+ * A request received from a client: the command [command] to run
+ * with the [argc] arguments [argv], and the descriptors of the
+ * current directory and the standard streams of the client.
+ */
+typedef struct {
+    const char *command;
+    int argc;
+    const char **argv;
+    char *payload;
+    int fds[TAGSYSD_NB_FDS];
+} Request;
+
+static int metrics_command(int argc, const char *argv[]);
+
+static Command commands[] = {
+    { .name = "assign-tag", .run = assign_tag_command },
+    { .name = "display-file-tag", .run = display_file_tag_command },
+    { .name = "rm-tag", .run = rm_tag_command },
+    { .name = "search-tag-file", .run = search_tag_file_command },
+    { .name = "metrics", .run = metrics_command }
+};
+
+#define NB_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/**
+ * The statistics of the requests, in a shared mapping so that the
+ * processes forked to serve the requests update the ones of the
+ * daemon: [commands] holds those of the command of the same index of
+ * commands, and [nb_rejected_requests] counts the others.
+ */
+typedef struct {
+    CommandStats commands[NB_COMMANDS];
+    atomic_uint_least64_t nb_rejected_requests;
+} SharedStats;
+
+static SharedStats *shared_stats;
+
+/* The clients being served.  */
+static Client clients[MAX_CLIENTS];
+static size_t nb_clients = 0;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * Asks the daemon to stop once the requests being served are done.
+ */
+static void request_stop(int signum)
+{
+    stop_requested = 1;
+}
+
+/**
+ * Interrupts the wait of the daemon so that it reaps its children.
+ */
+static void child_exited(int signum)
+{
+}
+
+/**
+ * Prints the metrics of the daemon in the text format of Prometheus.
+ */
+static int metrics_command(int argc, const char *argv[])
+{
+    printf("# HELP tagsysd_requests_total Requests served by command.\n"
+            "# TYPE tagsysd_requests_total counter\n");
+    for (size_t i = 0; i < NB_COMMANDS; i++)
+        printf("tagsysd_requests_total{command=\"%s\"} %"PRIu64"\n",
+                commands[i].name,
+                (uint64_t) shared_stats->commands[i].nb_requests);
+    printf("# HELP tagsysd_request_errors_total Requests which exited "
+            "with a failure status.\n"
+            "# TYPE tagsysd_request_errors_total counter\n");
+    for (size_t i = 0; i < NB_COMMANDS; i++)
+        printf("tagsysd_request_errors_total{command=\"%s\"} %"PRIu64"\n",
+                commands[i].name,
+                (uint64_t) shared_stats->commands[i].nb_errors);
+    printf("# HELP tagsysd_rejected_requests_total Malformed or "
+            "unauthorized requests.\n"
+            "# TYPE tagsysd_rejected_requests_total counter\n"
+            "tagsysd_rejected_requests_total %"PRIu64"\n",
+            (uint64_t) shared_stats->nb_rejected_requests);
+    printf("# HELP tagsysd_request_duration_seconds Time spent running "
+            "the requests.\n"
+            "# TYPE tagsysd_request_duration_seconds histogram\n");
+    for (size_t i = 0; i < NB_COMMANDS; i++) {
+        const CommandStats *stats = &shared_stats->commands[i];
+        uint64_t count = 0;
+        for (size_t j = 0; j < NB_LATENCY_BUCKETS; j++) {
+            count += stats->buckets[j];
+            printf("tagsysd_request_duration_seconds_bucket"
+                    "{command=\"%s\",le=\"%g\"} %"PRIu64"\n",
+                    commands[i].name, latency_buckets[j], count);
+        }
+        uint64_t nb_requests = stats->nb_requests;
+        printf("tagsysd_request_duration_seconds_bucket"
+                "{command=\"%s\",le=\"+Inf\"} %"PRIu64"\n"
+                "tagsysd_request_duration_seconds_sum{command=\"%s\"} %.9f\n"
+                "tagsysd_request_duration_seconds_count{command=\"%s\"} "
+                "%"PRIu64"\n",
+                commands[i].name, nb_requests,
+                commands[i].name, stats->total_ns / 1e9,
+                commands[i].name, nb_requests);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Adds a request of the command [command] which took [ns] nanoseconds
+ * and exited with [status] to its statistics.
+ */
+static void record_request(const Command *command, uint64_t ns, int status)
+{
+    CommandStats *stats = &shared_stats->commands[command - commands];
+    stats->nb_requests++;
+    if (status != EXIT_SUCCESS)
+        stats->nb_errors++;
+    stats->total_ns += ns;
+    for (size_t i = 0; i < NB_LATENCY_BUCKETS; i++) {
+        if (ns <= latency_buckets[i] * 1e9) {
+            stats->buckets[i]++;
+            break;
+        }
+    }
+}
+
+static void free_request(Request *request)
+{
+    for (int i = 0; i < TAGSYSD_NB_FDS; i++)
+        if (request->fds[i] != -1)
+            close(request->fds[i]);
+    free(request->argv);
+    free(request->payload);
+}
+
+/**
+ * Reads exactly [size] bytes from [sock] to [buf].
+ */
+static bool receive_all(int sock, void *buf, size_t size)
+{
+    size_t received = 0;
+    while (received < size) {
+        ssize_t rc = recv(sock, (char *) buf + received, size - received, 0);
+        if (rc == 0 || (rc == -1 && errno != EINTR))
+            return false;
+        else if (rc > 0)
+            received += rc;
+    }
+    return true;
+}
+
+/**
+ * Reads the request of the client connected to [sock] and writes it
+ * to [request]. Returns [false] if the request is invalid.
+ */
+static bool receive_request(int sock, Request *request)
+{
+    memset(request, 0, sizeof(*request));
+    for (int i = 0; i < TAGSYSD_NB_FDS; i++)
+        request->fds[i] = -1;
+
+    TagsysdRequest header;
+    union {
+        char buf[CMSG_SPACE(TAGSYSD_NB_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t rc;
+    do {
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+    if (rc <= 0)
+        return false;
+
+    size_t nb_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        nb_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nb_fds > TAGSYSD_NB_FDS)
+            nb_fds = TAGSYSD_NB_FDS;
+        memcpy(request->fds, CMSG_DATA(cmsg), nb_fds * sizeof(int));
+    }
+    if (nb_fds != TAGSYSD_NB_FDS || (msg.msg_flags & MSG_CTRUNC)
+            || !receive_all(sock, (char *) &header + rc,
+                sizeof(header) - rc)
+            || header.magic != TAGSYSD_MAGIC
+            || header.version != TAGSYSD_VERSION
+            || header.size == 0 || header.size > TAGSYSD_MAX_REQUEST_SIZE
+            || header.argc == 0 || header.argc > header.size)
+        return false;
+
+    request->payload = malloc(header.size);
+    request->argv = malloc((header.argc + 1) * sizeof(char *));
+    if (request->payload == NULL || request->argv == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (!receive_all(sock, request->payload, header.size)
+            || request->payload[header.size - 1] != '\0')
+        return false;
+
+    /* The payload holds the command and then its arguments.  */
+    const char *str = request->payload;
+    const char *end = request->payload + header.size;
+    request->command = str;
+    str += strlen(str) + 1;
+    for (; str < end && request->argc < header.argc; str += strlen(str) + 1)
+        request->argv[request->argc++] = str;
+    request->argv[request->argc] = NULL;
+    return str == end && request->argc == header.argc;
+}
+
+/**
+ * Runs [request] with the standard streams and the current directory
+ * of the client, and returns the exit status of its command. The
+ * process serving the request exits afterwards, so that nothing is
+ * restored.
+ */
+static int run_request(Request *request)
+{
+    const Command *command = NULL;
+    for (size_t i = 0; i < NB_COMMANDS && command == NULL; i++)
+        if (strcmp(commands[i].name, request->command) == 0)
+            command = &commands[i];
+    if (command == NULL) {
+        dprintf(request->fds[3], "tagsysd: unknown command '%s'\n",
+                request->command);
+        shared_stats->nb_rejected_requests++;
+        return EXIT_FAILURE;
+    }
+    if (fchdir(request->fds[0]) == -1) {
+        dprintf(request->fds[3], "tagsysd: could not enter the current "
+                "directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (dup2(request->fds[i + 1], i) == -1) {
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = command->run(request->argc, request->argv);
+    fflush(stdout);
+    fflush(stderr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    record_request(command, (end.tv_sec - start.tv_sec) * 1000000000ULL
+            + end.tv_nsec - start.tv_nsec, status);
+    return status;
+}
+
+/**
+ * Serves the client connected to [sock], if it belongs to the current
+ * user. Runs in a process forked for the client, which the daemon
+ * kills if the client hangs up.
+ */
+static void serve_client(int sock)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1
+            || cred.uid != getuid()) {
+        shared_stats->nb_rejected_requests++;
+        return;
+    }
+    struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_S };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    Request request;
+    if (!receive_request(sock, &request)) {
+        shared_stats->nb_rejected_requests++;
+        free_request(&request);
+        return;
+    }
+    int32_t status = run_request(&request);
+
+    /* The client may be gone, its status is lost then.  */
+    send(sock, &status, sizeof(status), MSG_NOSIGNAL);
+    free_request(&request);
+}
+
+/**
+ * Creates the socket of the daemon. Returns its descriptor, or -1 if
+ * it could not be created or if a daemon is already running.
+ */
+static int create_socket()
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(SOCKET_FILE) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "The socket path '%s' is too long\n", SOCKET_FILE);
+        return -1;
+    }
+    strcpy(addr.sun_path, SOCKET_FILE);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+    /* A socket file nobody listens to is left by a daemon killed.  */
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "tagsysd is already running\n");
+        close(sock);
+        return -1;
+    }
+    if (unlink(SOCKET_FILE) == -1 && errno != ENOENT) {
+        fprintf(stderr, "Could not remove '%s': %s\n",
+                SOCKET_FILE, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1
+            || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(sock, SOMAXCONN) == -1) {
+        fprintf(stderr, "Could not listen on '%s': %s\n",
+                SOCKET_FILE, strerror(errno));
+        if (sock != -1)
+            close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Forks a process to serve the client connected to [sock], the signals
+ * [signals] being blocked in the daemon.
+ * Returns [false] if the process could not be created.
+ */
+static bool start_client(int listen_sock, int sock, const sigset_t *signals)
+{
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return false;
+    } else if (pid == 0) {
+        /* The daemon alone stops on SIGINT, once the request is done.  */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, signals, NULL);
+        close(listen_sock);
+        for (size_t i = 0; i < nb_clients; i++)
+            close(clients[i].sock);
+        serve_client(sock);
+        exit(EXIT_SUCCESS);
+    }
+    clients[nb_clients++] = (Client) { .pid = pid, .sock = sock };
+    return true;
+}
+
+/**
+ * Loads the config, the index and the numbering of the tags, or loads
+ * them again if their files changed, so that the processes forked to
+ * serve the requests inherit them.
+ */
+static void load_shared_state()
+{
+    const TagsTree *tree;
+    const IndexReader *reader;
+    get_config_tree(&tree, NULL);
+    get_index_reader(&reader);
+    search_tag_file_refresh();
+}
+
+/**
+ * Reaps the processes of the clients which were served, and loads
+ * again the state the next ones inherit, see load_shared_state().
+ */
+static void reap_clients()
+{
+    bool reaped = false;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (size_t i = 0; i < nb_clients; i++) {
+            if (clients[i].pid == pid) {
+                close(clients[i].sock);
+                clients[i] = clients[--nb_clients];
+                reaped = true;
+                break;
+            }
+        }
+    }
+    if (reaped)
+        load_shared_state();
+}
+
+/**
+ * Accepts the clients on [sock] and serves each one in a process of
+ * its own until a stop is requested, [signals] being blocked except
+ * while waiting. A process whose client hangs up, for instance because
+ * the command was interrupted, is killed with SIGTERM, which stops its
+ * walk and releases the terminal of the client.
+ */
+static bool serve(int sock, const sigset_t *signals)
+{
+    sigset_t wait_mask;
+    sigprocmask(SIG_BLOCK, NULL, &wait_mask);
+    for (int signum = 1; signum < NSIG; signum++)
+        if (sigismember(signals, signum) == 1)
+            sigdelset(&wait_mask, signum);
+
+    bool success = true;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while (!stop_requested || nb_clients > 0) {
+        bool accepting = !stop_requested && nb_clients < MAX_CLIENTS;
+        fds[0] = (struct pollfd) {
+            .fd = accepting ? sock : -1, .events = POLLIN
+        };
+        /* POLLHUP is reported even though no event is requested.  */
+        for (size_t i = 0; i < nb_clients; i++)
+            fds[i + 1] = (struct pollfd) {
+                .fd = clients[i].hung_up ? -1 : clients[i].sock
+            };
+        int nb_ready = ppoll(fds, nb_clients + 1, NULL, &wait_mask);
+        if (nb_ready == -1 && errno != EINTR) {
+            perror("ppoll");
+            success = false;
+            break;
+        }
+
+        for (size_t i = 0; i < nb_clients && nb_ready > 0; i++) {
+            if (fds[i + 1].revents & (POLLHUP | POLLERR)) {
+                kill(clients[i].pid, SIGTERM);
+                clients[i].hung_up = true;
+            }
+        }
+        if (nb_ready > 0 && (fds[0].revents & POLLIN)) {
+            int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+            if (client != -1) {
+                if (!start_client(sock, client, signals))
+                    close(client);
+            } else if (errno != EINTR && errno != ECONNABORTED
+                    && errno != EAGAIN) {
+                perror("accept");
+                success = false;
+                break;
+            }
+        }
+        reap_clients();
+    }
+
+    /* Wait for the requests being served when an error occurred.  */
+    while (nb_clients > 0 && waitpid(clients[0].pid, NULL, 0) != -1) {
+        close(clients[0].sock);
+        clients[0] = clients[--nb_clients];
+    }
+    return success;
+}
+
+static void print_help(const char *prog_name)
+{
+    fprintf(stderr,
+            "Usage: %s\n"
+            "   or: %s --metrics\n"
+            "   or: %s -h\n\n"
+            "Serve the requests of assign-tag, display-file-tag, rm-tag\n"
+            "and search-tag-file until interrupted, keeping the config\n"
+            "file, the numbering of the tags and the tag index in memory.\n"
+            "The commands forward their requests to the daemon when it\n"
+            "runs, unless the variable "TAGSYSD_DISABLE_VARIABLE" is set.\n\n"
+            "Options:\n"
+            "\t--metrics\tPrint the metrics of the running daemon\n"
+            "\t-h\t\tPrint this help message\n\n",
+            prog_name, prog_name, prog_name);
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--metrics") != 0
+                && strncmp(argv[1], "-h", 3) != 0)) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    } else if (argc == 2 && strncmp(argv[1], "-h", 3) == 0) {
+        print_help(argv[0]);
+        return EXIT_SUCCESS;
+    }
+
+    load_config();
+
+    if (argc == 2) {
+        int status;
+        if (forward_to_daemon("metrics", argc, argv, &status))
+            return status;
+        fprintf(stderr, "tagsysd is not running\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The state files created by the commands are private.  */
+    umask(077);
+    shared_stats = mmap(NULL, sizeof(SharedStats), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_stats == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    int sock = create_socket();
+    if (sock == -1)
+        return EXIT_FAILURE;
+    if (chdir("/") == -1)
+        perror("chdir");
+
+    /* The signals are only handled while the daemon waits.  */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    struct sigaction action = { .sa_handler = request_stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = child_exited;
+    sigaction(SIGCHLD, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    load_shared_state();
+    bool success = serve(sock, &signals);
+    close(sock);
+    unlink(SOCKET_FILE);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
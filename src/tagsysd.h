@@ -0,0 +1,49 @@
+#ifndef TAGSYSD_H
+#define TAGSYSD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TAGSYSD_MAGIC 0x64737974 /* "tysd" */
+#define TAGSYSD_VERSION 1
+
+/* The size limit of the arguments of a request.  */
+#define TAGSYSD_MAX_REQUEST_SIZE (1 << 20)
+
+/*
+ * The file descriptors sent along with a request: the current
+ * directory of the client, then its standard input, output and error.
+ */
+#define TAGSYSD_NB_FDS 4
+
+/* When this variable is set, the commands never contact the daemon.  */
+#define TAGSYSD_DISABLE_VARIABLE "TAGSYS6_NO_DAEMON"
+
+/**
+ * The header of a request sent to tagsysd, followed by [size] bytes
+ * holding the name of the command and its [argc] arguments, each one
+ * terminated by a null byte. The daemon replies with the exit status
+ * of the command as an int32_t once it is done.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t argc;
+    uint32_t size;
+} TagsysdRequest;
+
+/**
+ * Runs the command [command] with the arguments [argv] in the tagsysd
+ * daemon of the current user, the command reading and writing the
+ * standard streams and resolving the paths of the calling process.
+ * Returns [false] if the daemon is not running, in which case the
+ * command must be run by the caller, and otherwise writes its exit
+ * status to [*status].
+ */
+bool forward_to_daemon(
+        const char *command,
+        int argc,
+        const char *argv[],
+        int *status);
+
+#endif
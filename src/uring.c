@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define PROBE_NB_OPS 256
+
+/**
+ * The memory shared with the kernel, see io_uring_setup(2).
+ */
+struct IoRing {
+    int fd;
+    unsigned long nb_enters;
+    unsigned long nb_ops;
+    unsigned int sq_entries;
+    unsigned int cq_entries;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/**
+ * Returns [true] if the kernel of [ring] supports the operations
+ * needed by io_ring_run().
+ */
+static bool has_required_ops(IoRing *ring)
+{
+    size_t size = sizeof(struct io_uring_probe)
+        + PROBE_NB_OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL)
+        return false;
+    bool supported = false;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                probe, PROBE_NB_OPS) == 0) {
+        supported = probe->last_op >= IORING_OP_GETXATTR
+            && (probe->ops[IORING_OP_GETXATTR].flags & IO_URING_OP_SUPPORTED)
+            && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+IoRing *io_ring_new(unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    IoRing *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+    ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        goto ERROR;
+
+    ring->sq_entries = params.sq_entries;
+    ring->cq_entries = params.cq_entries;
+    ring->sq_size = params.sq_off.array
+        + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_size > ring->sq_size)
+        ring->sq_size = ring->cq_size;
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto ERROR;
+    if (single_mmap) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto ERROR;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto ERROR;
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if (!has_required_ops(ring)) {
+        io_ring_free(ring);
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    return ring;
+
+ERROR:;
+    int errno_save = errno;
+    io_ring_free(ring);
+    errno = errno_save;
+    return NULL;
+}
+
+void io_ring_free(IoRing *ring)
+{
+    if (ring == NULL)
+        return;
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Fills the submission queue entry [sqe] for the request [op].
+ */
+static void prepare_sqe(struct io_uring_sqe *sqe, const IoRingOp *op)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    switch (op->kind) {
+        case IO_RING_GETXATTR:
+            sqe->opcode = IORING_OP_GETXATTR;
+            sqe->addr = (uintptr_t) op->attr;
+            sqe->addr2 = (uintptr_t) op->value;
+            sqe->addr3 = (uintptr_t) op->path;
+            sqe->len = op->size;
+            break;
+        case IO_RING_STATX:
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = op->dirfd;
+            sqe->addr = (uintptr_t) op->path;
+            sqe->addr2 = (uintptr_t) op->stx;
+            sqe->len = op->mask;
+            sqe->statx_flags = op->flags;
+            break;
+    }
+}
+
+bool io_ring_run(IoRing *ring, IoRingOp *ops, size_t nb_ops)
+{
+    size_t next = 0;
+    size_t done = 0;
+    unsigned int in_flight = 0;
+
+    while (done < nb_ops) {
+        /* Queue as many requests as the rings can hold.  */
+        unsigned int tail = *ring->sq_tail;
+        unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        while (next < nb_ops && tail - head < ring->sq_entries
+                && in_flight < ring->cq_entries) {
+            unsigned int index = tail & *ring->sq_mask;
+            prepare_sqe(&ring->sqes[index], &ops[next]);
+            ring->sqes[index].user_data = next;
+            ring->sq_array[index] = index;
+            tail++;
+            next++;
+            in_flight++;
+            ring->nb_ops++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        ring->nb_enters++;
+        if (syscall(__NR_io_uring_enter, ring->fd, tail - head, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == -1
+                && errno != EINTR)
+            return false;
+
+        unsigned int cq_head = *ring->cq_head;
+        unsigned int cq_tail =
+            __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; cq_head != cq_tail; cq_head++) {
+            struct io_uring_cqe *cqe =
+                &ring->cqes[cq_head & *ring->cq_mask];
+            ops[cqe->user_data].result = cqe->res;
+            done++;
+            in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+void io_ring_counts(const IoRing *ring, unsigned long *nb_enters,
+        unsigned long *nb_ops)
+{
+    *nb_enters = ring->nb_enters;
+    *nb_ops = ring->nb_ops;
+}
+
+#else
+
+IoRing *io_ring_new(unsigned int entries)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void io_ring_free(IoRing *ring)
+{
+}
+
+bool io_ring_run(IoRing *ring, IoRingOp *ops, size_t nb_ops)
+{
+    errno = ENOSYS;
+    return false;
+}
+
+void io_ring_counts(const IoRing *ring, unsigned long *nb_enters,
+        unsigned long *nb_ops)
+{
+    *nb_enters = 0;
+    *nb_ops = 0;
+}
+
+#endif
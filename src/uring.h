@@ -0,0 +1,65 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct statx;
+
+/**
+ * An io_uring instance used to issue many metadata requests at once.
+ */
+typedef struct IoRing IoRing;
+
+typedef enum {
+    IO_RING_GETXATTR,
+    IO_RING_STATX
+} IoRingOpKind;
+
+/**
+ * A request executed by io_ring_run().
+ * For IO_RING_GETXATTR, the attribute [attr] of the file [path] is
+ * read into [value] of [size] bytes. For IO_RING_STATX, the [mask]
+ * fields of the file [path] relative to [dirfd] are written to [stx],
+ * [flags] being the AT_* flags of statx(2).
+ * [result] receives the return value of the operation, or a negative
+ * errno value if it failed.
+ */
+typedef struct {
+    IoRingOpKind kind;
+    int dirfd;
+    const char *path;
+    const char *attr;
+    void *value;
+    size_t size;
+    int flags;
+    unsigned int mask;
+    struct statx *stx;
+    int result;
+} IoRingOp;
+
+/**
+ * Creates an io_uring instance of [entries] submission slots.
+ * Returns NULL and sets errno if io_uring is not available or does
+ * not support the operations of IoRingOpKind.
+ */
+IoRing *io_ring_new(unsigned int entries);
+
+void io_ring_free(IoRing *ring);
+
+/**
+ * Executes the [nb_ops] requests [ops], keeping as many of them in
+ * flight as the ring allows, and waits for all of them to complete.
+ * Returns [false] and sets errno if the ring itself failed.
+ */
+bool io_ring_run(IoRing *ring, IoRingOp *ops, size_t nb_ops);
+
+/**
+ * Writes to [*nb_enters] the number of io_uring_enter(2) calls made by
+ * io_ring_run() on [ring], and to [*nb_ops] the number of requests it
+ * submitted.
+ */
+void io_ring_counts(const IoRing *ring, unsigned long *nb_enters,
+        unsigned long *nb_ops);
+
+#endif
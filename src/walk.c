@@ -0,0 +1,1274 @@
+#define _GNU_SOURCE
+#include "walk.h"
+#include "inodeset.h"
+#include "uring.h"
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_RETAINED_DIRS 8
+#define WALK_RING_ENTRIES 256
+
+/*
+ * The size of the buffers into which the entries of the directories
+ * are read by getdents64(2), and the size of the smallest entry, so
+ * that a buffer holds at most WALK_DENTS_SIZE / MIN_DIRENT_SIZE of
+ * them.
+ */
+#define WALK_DENTS_SIZE (64 * 1024)
+#define MIN_DIRENT_SIZE 24
+
+/*
+ * The patterns of the exclude option and of the ignore files are
+ * stored one after the other, each one preceded by one of these.
+ */
+#define PATTERN_ANY 'a'
+#define PATTERN_DIR 'd'
+
+/**
+ * A directory of the walked tree. The nodes form a chain up to the
+ * root so that the full path of an entry can be rebuilt on demand.
+ * [refcount] keeps a node alive while some of its subdirectories
+ * still reference it. When [retained] is [true], the descriptor [fd]
+ * of the directory stays open until all its subdirectories have been
+ * opened relatively to it, [fd_users] counting the pending openings.
+ * [fd] is -1 when the directory is not open.
+ * [depth] is the number of levels below the root. [ignores] holds the
+ * patterns of the ignore file of the directory, and [ignore_dir] is
+ * the nearest directory having some, either itself or an ancestor.
+ * [dev] and [ino] identify the directory once it is open, and
+ * [root_dev] is the device of the root it was reached from.
+ */
+struct WalkDir {
+    WalkDir *parent;
+    atomic_int refcount;
+    atomic_int fd_users;
+    int fd;
+    bool retained;
+    int depth;
+    PascalBuffer ignores;
+    const WalkDir *ignore_dir;
+    dev_t dev;
+    ino_t ino;
+    dev_t root_dev;
+    size_t name_len;
+    char name[];
+};
+
+/**
+ * A buffer [buf] of WALK_DENTS_SIZE bytes filled by getdents64(2), and
+ * the entries [entries] read into it, in the order they are handled.
+ */
+struct WalkDents {
+    char *buf;
+    struct dirent64 **entries;
+};
+
+/**
+ * A double ended queue of directory paths waiting to be walked.
+ * The owner pushes and pops at the bottom, thieves steal at the top,
+ * so that the owner walks depth first while thieves take the largest
+ * subtrees.
+ */
+struct WalkDeque {
+    pthread_mutex_t lock;
+    WalkDir **items;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+};
+
+/**
+ * The state shared by all the workers of a walk.
+ * [pending] counts the directories pushed but not walked yet,
+ * [queued] the ones still sitting in a deque. [retained_dirs] counts
+ * the directories kept open for their subdirectories, at most
+ * [max_retained_dirs] so that the walk does not run out of file
+ * descriptors. [stopped] is set by walk_stop(). [excludes] holds the
+ * exclude patterns of the options. [visited] holds the directories
+ * already opened, so that the ones reached again through a symbolic
+ * link, a bind mount or another root are walked once.
+ */
+struct Walk {
+    const WalkOptions *options;
+    WalkWorker *workers;
+    int nb_workers;
+    atomic_long pending;
+    atomic_long queued;
+    atomic_int idle;
+    atomic_bool success;
+    atomic_bool stopped;
+    atomic_long retained_dirs;
+    long max_retained_dirs;
+    PascalBuffer excludes;
+    InodeSet visited;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+static void deque_init(struct WalkDeque *deque)
+{
+    memset(deque, 0, sizeof(*deque));
+    pthread_mutex_init(&deque->lock, NULL);
+}
+
+static void deque_destroy(struct WalkDeque *deque)
+{
+    assert(deque->top == deque->bottom);
+    free(deque->items);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+static void deque_push(struct WalkDeque *deque, WalkDir *dir)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            /* Reclaim the slots freed by thieves before growing.  */
+            memmove(deque->items, deque->items + deque->top,
+                    (deque->bottom - deque->top) * sizeof(WalkDir *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if (deque->bottom == deque->capacity) {
+            size_t new_capacity = (deque->capacity + 1) * 2;
+            void *rc = realloc(deque->items, new_capacity * sizeof(WalkDir *));
+            if (rc == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            deque->items = rc;
+            deque->capacity = new_capacity;
+        }
+    }
+    deque->items[deque->bottom++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static WalkDir *deque_pop(struct WalkDeque *deque)
+{
+    WalkDir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+        dir = deque->items[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+static WalkDir *deque_steal(struct WalkDeque *deque)
+{
+    WalkDir *dir = NULL;
+    if (pthread_mutex_trylock(&deque->lock) != 0)
+        return NULL;
+    if (deque->bottom > deque->top)
+        dir = deque->items[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+/**
+ * Creates the node of the directory [name] of [len] chars found
+ * in the directory [parent].
+ */
+static WalkDir *new_dir(WalkDir *parent, const char *name, size_t len)
+{
+    WalkDir *dir = malloc(sizeof(*dir) + len + 1);
+    if (dir == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    dir->parent = parent;
+    atomic_init(&dir->refcount, 1);
+    atomic_init(&dir->fd_users, 0);
+    dir->fd = -1;
+    dir->retained = false;
+    dir->depth = parent != NULL ? parent->depth + 1 : 0;
+    memset(&dir->ignores, 0, sizeof(dir->ignores));
+    dir->ignore_dir = parent != NULL ? parent->ignore_dir : NULL;
+    dir->dev = 0;
+    dir->ino = 0;
+    dir->root_dev = parent != NULL ? parent->root_dev : 0;
+    dir->name_len = len;
+    memcpy(dir->name, name, len);
+    dir->name[len] = '\0';
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->refcount, 1);
+        if (parent->retained)
+            atomic_fetch_add(&parent->fd_users, 1);
+    }
+    return dir;
+}
+
+/**
+ * Drops a reference to [dir], freeing it and its ancestors when they
+ * are no longer referenced.
+ */
+static void release_dir(WalkDir *dir)
+{
+    WalkDir *parent;
+    while (dir != NULL && atomic_fetch_sub(&dir->refcount, 1) == 1) {
+        parent = dir->parent;
+        assert(dir->fd == -1);
+        free(dir->ignores.str);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/**
+ * Drops a user of the descriptor of [dir], closing it once the
+ * directory has been read and all its subdirectories have been opened.
+ */
+static void release_fd(struct Walk *walk, WalkDir *dir)
+{
+    if (atomic_fetch_sub(&dir->fd_users, 1) == 1) {
+        close(dir->fd);
+        dir->fd = -1;
+        if (dir->retained && walk->nb_workers > 1)
+            atomic_fetch_sub(&walk->retained_dirs, 1);
+    }
+}
+
+/**
+ * Writes the full path of the directory [dir] to [path].
+ */
+static void build_dir_path(PascalBuffer *path, const WalkDir *dir)
+{
+    if (dir->parent != NULL) {
+        build_dir_path(path, dir->parent);
+        append_str_to_buffer(path, "/", 1);
+    }
+    append_str_to_buffer(path, dir->name, dir->name_len);
+}
+
+void walk_stop(WalkWorker *worker)
+{
+    assert(worker != NULL);
+    atomic_store(&worker->walk->stopped, true);
+}
+
+const char *walk_entry_path(WalkWorker *worker, const WalkEntry *entry)
+{
+    assert(worker != NULL);
+    assert(entry != NULL);
+
+    worker->path.str_length = 0;
+    build_dir_path(&worker->path, entry->dir);
+    append_str_to_buffer(&worker->path, "/", 1);
+    append_str_to_buffer(&worker->path, entry->name, entry->name_len);
+    return worker->path.str;
+}
+
+static const char *const syscall_names[WALK_NB_SYSCALLS] = {
+    [WALK_SYSCALL_OPEN] = "open",
+    [WALK_SYSCALL_GETDENTS] = "getdents64",
+    [WALK_SYSCALL_FSTAT] = "fstat",
+    [WALK_SYSCALL_STATX] = "statx",
+    [WALK_SYSCALL_READ] = "read",
+    [WALK_SYSCALL_LISTXATTR] = "listxattr",
+    [WALK_SYSCALL_GETXATTR] = "getxattr",
+    [WALK_SYSCALL_FSTATAT] = "fstatat",
+    [WALK_SYSCALL_IO_URING] = "io_uring_enter"
+};
+
+void walk_stats_count(WalkStats *stats, WalkSyscall syscall, uint64_t count)
+{
+    if (stats != NULL)
+        stats->syscalls[syscall] += count;
+}
+
+uint64_t walk_stats_start(const WalkStats *stats)
+{
+    if (stats == NULL)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void walk_stats_end(WalkStats *stats, uint64_t start)
+{
+    if (stats == NULL)
+        return;
+    uint64_t micros = (walk_stats_start(stats) - start) / 1000;
+    int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+    if (bucket >= WALK_LATENCY_BUCKETS)
+        bucket = WALK_LATENCY_BUCKETS - 1;
+    stats->xattr_latency[bucket]++;
+}
+
+void walk_stats_merge(WalkStats *dst, const WalkStats *src)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+
+    dst->nb_dirs += src->nb_dirs;
+    dst->nb_files += src->nb_files;
+    dst->nb_matches += src->nb_matches;
+    for (int i = 0; i < WALK_NB_SYSCALLS; i++)
+        dst->syscalls[i] += src->syscalls[i];
+    dst->nb_ring_ops += src->nb_ring_ops;
+    dst->xattr_name_bytes += src->xattr_name_bytes;
+    for (int i = 0; i < WALK_LATENCY_BUCKETS; i++)
+        dst->xattr_latency[i] += src->xattr_latency[i];
+}
+
+void walk_stats_print(const WalkStats *stats, FILE *out)
+{
+    assert(stats != NULL);
+    assert(out != NULL);
+
+    uint64_t nb_syscalls = 0;
+    for (int i = 0; i < WALK_NB_SYSCALLS; i++)
+        nb_syscalls += stats->syscalls[i];
+    fprintf(out, "Directories: %" PRIu64 "\n", stats->nb_dirs);
+    fprintf(out, "Files: %" PRIu64 "\n", stats->nb_files);
+    fprintf(out, "Matches: %" PRIu64 "\n", stats->nb_matches);
+    fprintf(out, "System calls: %" PRIu64, nb_syscalls);
+    if (stats->nb_files > 0)
+        fprintf(out, " (%.2f per file)",
+                (double) nb_syscalls / stats->nb_files);
+    fputc('\n', out);
+    for (int i = 0; i < WALK_NB_SYSCALLS; i++) {
+        if (stats->syscalls[i] > 0)
+            fprintf(out, "  %-16s%" PRIu64 "\n", syscall_names[i],
+                    stats->syscalls[i]);
+    }
+    if (stats->nb_ring_ops > 0)
+        fprintf(out, "io_uring requests: %" PRIu64 "\n", stats->nb_ring_ops);
+    fprintf(out, "Attribute names read: %" PRIu64 " bytes\n",
+            stats->xattr_name_bytes);
+
+    int last = WALK_LATENCY_BUCKETS - 1;
+    while (last >= 0 && stats->xattr_latency[last] == 0)
+        last--;
+    if (last < 0)
+        return;
+    fprintf(out, "Attribute read latency:\n");
+    for (int i = 0; i <= last; i++) {
+        if (i < WALK_LATENCY_BUCKETS - 1)
+            fprintf(out, "  < %8" PRIu64 " us  ", UINT64_C(1) << i);
+        else
+            fprintf(out, "  >= %7" PRIu64 " us  ", UINT64_C(1) << (i - 1));
+        fprintf(out, "%" PRIu64 "\n", stats->xattr_latency[i]);
+    }
+}
+
+/**
+ * Adds the glob pattern [pattern] of [len] chars to [patterns]. A
+ * trailing '/' is removed, the pattern then only matching directories.
+ */
+static void add_pattern(PascalBuffer *patterns, const char *pattern,
+        size_t len)
+{
+    char kind = PATTERN_ANY;
+    if (len > 1 && pattern[len - 1] == '/') {
+        kind = PATTERN_DIR;
+        len--;
+    }
+    append_str_to_buffer(patterns, &kind, 1);
+    append_str_to_buffer(patterns, pattern, len);
+    /* Keep the null byte ending the pattern.  */
+    patterns->str_length++;
+}
+
+/**
+ * Returns [true] if [name] matches one of [patterns], only the
+ * patterns ending with '/' being tried if [dir_patterns] is [true],
+ * only the others otherwise.
+ */
+static bool match_patterns(
+        const PascalBuffer *patterns,
+        const char *name,
+        bool dir_patterns)
+{
+    char kind = dir_patterns ? PATTERN_DIR : PATTERN_ANY;
+    const char *pattern = patterns->str;
+    const char *end = patterns->str + patterns->str_length;
+    for (; pattern < end; pattern += strlen(pattern) + 1) {
+        if (pattern[0] == kind && fnmatch(pattern + 1, name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Returns [true] if the entry [name] of the directory [dir] is
+ * excluded by the exclude patterns of [walk] or by the ignore files of
+ * [dir] and its ancestors, see match_patterns() for [dir_patterns].
+ */
+static bool is_excluded(
+        const struct Walk *walk,
+        const WalkDir *dir,
+        const char *name,
+        bool dir_patterns)
+{
+    if (match_patterns(&walk->excludes, name, dir_patterns))
+        return true;
+    for (const WalkDir *ignore_dir = dir->ignore_dir; ignore_dir != NULL;
+            ignore_dir = ignore_dir->parent != NULL
+                ? ignore_dir->parent->ignore_dir : NULL) {
+        if (match_patterns(&ignore_dir->ignores, name, dir_patterns))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Reads the patterns of the ignore file of the directory [dir], if it
+ * has one: one glob pattern per line, the empty lines and the lines
+ * starting with '#' being skipped. The patterns then apply to the
+ * entries of [dir] and of its subdirectories.
+ */
+static void load_ignore_file(WalkWorker *worker, WalkDir *dir)
+{
+    const char *ignore_file = worker->walk->options->ignore_file;
+    int fd = openat(dir->fd, ignore_file, O_RDONLY | O_CLOEXEC);
+    walk_stats_count(worker->stats, WALK_SYSCALL_OPEN, 1);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            int errno_save = errno;
+            worker->path.str_length = 0;
+            build_dir_path(&worker->path, dir);
+            fprintf(stderr, "Could not read '%s/%s': %s\n",
+                    worker->path.str, ignore_file, strerror(errno_save));
+        }
+        return;
+    }
+
+    PascalBuffer content = {0};
+    char chunk[4096];
+    ssize_t nb_read;
+    while ((nb_read = read(fd, chunk, sizeof(chunk))) > 0
+            || (nb_read == -1 && errno == EINTR)) {
+        walk_stats_count(worker->stats, WALK_SYSCALL_READ, 1);
+        if (nb_read > 0)
+            append_str_to_buffer(&content, chunk, nb_read);
+    }
+    if (nb_read == -1) {
+        /* A file read in part is ignored as a whole.  */
+        int errno_save = errno;
+        close(fd);
+        free(content.str);
+        worker->path.str_length = 0;
+        build_dir_path(&worker->path, dir);
+        fprintf(stderr, "Could not read '%s/%s': %s\n",
+                worker->path.str, ignore_file, strerror(errno_save));
+        return;
+    }
+    close(fd);
+
+    const char *line = content.str;
+    const char *end = content.str + content.str_length;
+    while (line < end) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            line_end = end;
+        size_t len = line_end - line;
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'
+                    || line[len - 1] == '\r'))
+            len--;
+        if (len > 0 && line[0] != '#')
+            add_pattern(&dir->ignores, line, len);
+        line = line_end + 1;
+    }
+    free(content.str);
+    if (dir->ignores.str_length > 0)
+        dir->ignore_dir = dir;
+}
+
+/**
+ * Prints an error message for the directory [dir], which is the same
+ * as one of its ancestors, if any, so that walking it would not end.
+ */
+static void report_loop(WalkWorker *worker, const WalkDir *dir)
+{
+    const WalkDir *ancestor = dir->parent;
+    while (ancestor != NULL
+            && (ancestor->dev != dir->dev || ancestor->ino != dir->ino))
+        ancestor = ancestor->parent;
+    if (ancestor == NULL)
+        return;
+    worker->path.str_length = 0;
+    build_dir_path(&worker->path, dir);
+    fprintf(stderr, "File system loop detected: '%s' is '", worker->path.str);
+    worker->path.str_length = 0;
+    build_dir_path(&worker->path, ancestor);
+    fprintf(stderr, "%s'\n", worker->path.str);
+}
+
+/**
+ * Opens the directory [dir], relatively to its parent when the parent
+ * is still open. Its descriptor is left -1 if the directory was
+ * already visited.
+ * Returns [false] and prints an error message if it fails.
+ */
+static bool open_dir(WalkWorker *worker, WalkDir *dir)
+{
+    struct Walk *walk = worker->walk;
+    WalkDir *parent = dir->parent;
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    int fd;
+
+    if (parent != NULL && parent->retained) {
+        fd = openat(parent->fd, dir->name, flags);
+        int errno_save = errno;
+        release_fd(walk, parent);
+        errno = errno_save;
+    } else {
+        worker->path.str_length = 0;
+        build_dir_path(&worker->path, dir);
+        fd = open(worker->path.str, flags);
+    }
+    walk_stats_count(worker->stats, WALK_SYSCALL_OPEN, 1);
+    if (fd == -1) {
+        int errno_save = errno;
+        worker->path.str_length = 0;
+        build_dir_path(&worker->path, dir);
+        fprintf(stderr, "Could not open '%s' directory: %s\n",
+                worker->path.str, strerror(errno_save));
+        return false;
+    }
+    dir->fd = fd;
+    struct stat st;
+    walk_stats_count(worker->stats, WALK_SYSCALL_FSTAT, 1);
+    if (fstat(fd, &st) == 0) {
+        dir->dev = st.st_dev;
+        dir->ino = st.st_ino;
+        if (parent == NULL)
+            dir->root_dev = st.st_dev;
+        if (!inode_set_add(&walk->visited, st.st_dev, st.st_ino)) {
+            report_loop(worker, dir);
+            close(fd);
+            dir->fd = -1;
+            return true;
+        }
+    }
+    if (worker->stats != NULL)
+        worker->stats->nb_dirs++;
+    if (walk->options->ignore_file != NULL)
+        load_ignore_file(worker, dir);
+
+    if (walk->nb_workers == 1) {
+        /* Sequential walks keep the whole chain of parents open.  */
+        dir->retained = true;
+    } else if (atomic_fetch_add(&walk->retained_dirs, 1)
+            < walk->max_retained_dirs) {
+        dir->retained = true;
+    } else {
+        atomic_fetch_sub(&walk->retained_dirs, 1);
+    }
+    atomic_store(&dir->fd_users, 1);
+    return true;
+}
+
+/**
+ * Makes the directory [dir] available to the workers of [walk].
+ */
+static void schedule_directory(WalkWorker *worker, WalkDir *dir)
+{
+    struct Walk *walk = worker->walk;
+    atomic_fetch_add(&walk->pending, 1);
+    deque_push(worker->deque, dir);
+    atomic_fetch_add(&walk->queued, 1);
+    if (atomic_load(&walk->idle) > 0) {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_signal(&walk->idle_cond);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+}
+
+/**
+ * Marks a directory taken from a deque as fully walked.
+ */
+static void finish_directory(struct Walk *walk)
+{
+    if (atomic_fetch_sub(&walk->pending, 1) == 1) {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_broadcast(&walk->idle_cond);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+}
+
+static bool walk_directory(WalkWorker *worker, WalkDir *dir);
+
+/**
+ * Prints an error message for the entry [name] of [len] chars of the
+ * directory [dir] for which the type could not be determined.
+ */
+static void report_stat_error(
+        WalkWorker *worker,
+        const WalkDir *dir,
+        const char *name,
+        size_t len,
+        int errnum)
+{
+    WalkEntry entry = {
+        .dirfd = dir->fd, .name = name, .name_len = len,
+        .type = DT_UNKNOWN, .dir = dir
+    };
+    fprintf(stderr, "Could not stat '%s': %s\n",
+            walk_entry_path(worker, &entry), strerror(errnum));
+}
+
+/**
+ * Returns [true] if the type [type] reported by getdents64(2) has to be
+ * checked with statx(2) during the walk [walk]: either it is unknown,
+ * or it is a symbolic link which is followed like stat(2) would.
+ */
+static bool needs_statx(const struct Walk *walk, unsigned char type)
+{
+    return type == DT_UNKNOWN
+        || (type == DT_LNK && !walk->options->no_follow);
+}
+
+/**
+ * Returns the flags of statx(2) for the entries of the walk [walk].
+ */
+static int statx_flags(const struct Walk *walk)
+{
+    return walk->options->no_follow ? AT_SYMLINK_NOFOLLOW : 0;
+}
+
+/**
+ * Determines the type of the entry [name] of [len] chars of the
+ * directory [dir], as [*type] is reported by getdents64(2). Only the
+ * type is requested from statx(2), and only when needs_statx().
+ * Returns [false] and prints an error message on failure.
+ */
+static bool resolve_type(
+        WalkWorker *worker,
+        const WalkDir *dir,
+        const char *name,
+        size_t len,
+        unsigned char *type)
+{
+    if (!needs_statx(worker->walk, *type))
+        return true;
+
+    struct statx stx;
+    walk_stats_count(worker->stats, WALK_SYSCALL_STATX, 1);
+    if (statx(dir->fd, name, statx_flags(worker->walk),
+                STATX_TYPE, &stx) == -1) {
+        report_stat_error(worker, dir, name, len, errno);
+        return false;
+    }
+    *type = IFTODT(stx.stx_mode);
+    return true;
+}
+
+/**
+ * Returns [true] if the walk of [worker] skips the subdirectory [name]
+ * of [len] chars of [dir], because of the maximum depth, of the
+ * patterns ending with '/', of its file system or of the filter_dir
+ * callback.
+ */
+static bool is_pruned(
+        WalkWorker *worker,
+        const WalkDir *dir,
+        const char *name,
+        size_t len)
+{
+    struct Walk *walk = worker->walk;
+    const WalkOptions *options = walk->options;
+    /* The entries of the subdirectory are two levels below [dir].  */
+    if (options->max_depth > 0 && dir->depth + 2 > options->max_depth)
+        return true;
+    if (is_excluded(walk, dir, name, true))
+        return true;
+
+    struct statx stx;
+    /* A failed statx is reported when the directory is opened.  */
+    if (options->same_device)
+        walk_stats_count(worker->stats, WALK_SYSCALL_STATX, 1);
+    if (options->same_device
+            && statx(dir->fd, name, AT_NO_AUTOMOUNT, STATX_TYPE,
+                &stx) == 0
+            && makedev(stx.stx_dev_major, stx.stx_dev_minor)
+                != dir->root_dev)
+        return true;
+    return options->filter_dir != NULL && !options->filter_dir(
+            worker, dir->fd, name, options->arg);
+}
+
+/**
+ * Handles the subdirectory [name] of [len] chars of [dir], either by
+ * walking it right away when the walk is sequential, or by pushing
+ * it to the deque of the worker, unless it is_pruned().
+ */
+static bool walk_subdirectory(
+        WalkWorker *worker,
+        WalkDir *dir,
+        const char *name,
+        size_t len)
+{
+    if (is_pruned(worker, dir, name, len))
+        return true;
+    WalkDir *subdir = new_dir(dir, name, len);
+    if (worker->walk->nb_workers > 1) {
+        schedule_directory(worker, subdir);
+        return true;
+    }
+    bool success = walk_directory(worker, subdir);
+    release_dir(subdir);
+    return success;
+}
+
+/**
+ * The entries of a directory waiting to be given to the on_batch
+ * callback. The names are stored in [names], [offsets] giving the
+ * position of each of them.
+ */
+typedef struct {
+    WalkEntry entries[WALK_BATCH_SIZE];
+    size_t offsets[WALK_BATCH_SIZE];
+    size_t nb_entries;
+    PascalBuffer names;
+} WalkBatch;
+
+/**
+ * Adds the entry [name] of [len] chars and of type [type] to [batch].
+ */
+static void add_to_batch(
+        WalkBatch *batch,
+        const char *name,
+        size_t len,
+        unsigned char type)
+{
+    assert(batch->nb_entries < WALK_BATCH_SIZE);
+    WalkEntry *entry = &batch->entries[batch->nb_entries];
+    entry->name_len = len;
+    entry->type = type;
+    batch->offsets[batch->nb_entries++] = batch->names.str_length;
+    append_str_to_buffer(&batch->names, name, len + 1);
+}
+
+/**
+ * Resolves the types of the entries of [batch] which needs_statx(),
+ * with a single submission when the worker has an io_uring instance.
+ * The entries that could not be resolved get the DT_UNKNOWN type.
+ */
+static bool resolve_batch_types(
+        WalkWorker *worker,
+        WalkDir *dir,
+        WalkBatch *batch)
+{
+    bool success = true;
+    WalkEntry *entry;
+    if (worker->ring == NULL) {
+        for (size_t i = 0; i < batch->nb_entries; i++) {
+            entry = &batch->entries[i];
+            if (!resolve_type(worker, dir, entry->name, entry->name_len,
+                        &entry->type)) {
+                entry->type = DT_UNKNOWN;
+                success = false;
+            }
+        }
+        return success;
+    }
+
+    IoRingOp ops[WALK_BATCH_SIZE];
+    struct statx stx[WALK_BATCH_SIZE];
+    size_t index[WALK_BATCH_SIZE];
+    size_t nb_ops = 0;
+    for (size_t i = 0; i < batch->nb_entries; i++) {
+        entry = &batch->entries[i];
+        if (!needs_statx(worker->walk, entry->type))
+            continue;
+        ops[nb_ops] = (IoRingOp) {
+            .kind = IO_RING_STATX, .dirfd = entry->dirfd,
+            .path = entry->name, .flags = statx_flags(worker->walk),
+            .mask = STATX_TYPE, .stx = &stx[nb_ops]
+        };
+        index[nb_ops++] = i;
+    }
+    if (nb_ops > 0 && !io_ring_run(worker->ring, ops, nb_ops)) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < nb_ops; i++) {
+        entry = &batch->entries[index[i]];
+        if (ops[i].result < 0) {
+            report_stat_error(worker, dir, entry->name, entry->name_len,
+                    -ops[i].result);
+            entry->type = DT_UNKNOWN;
+            success = false;
+        } else {
+            entry->type = IFTODT(stx[i].stx_mode);
+        }
+    }
+    return success;
+}
+
+/**
+ * Gives the entries of [batch] to the on_batch callback once their
+ * types are known, the subdirectories among them being walked.
+ */
+static bool flush_batch(WalkWorker *worker, WalkDir *dir, WalkBatch *batch)
+{
+    struct Walk *walk = worker->walk;
+    WalkEntry *entry;
+    for (size_t i = 0; i < batch->nb_entries; i++) {
+        entry = &batch->entries[i];
+        entry->dirfd = dir->fd;
+        entry->name = batch->names.str + batch->offsets[i];
+        entry->dir = dir;
+    }
+
+    bool success = resolve_batch_types(worker, dir, batch);
+    size_t nb_files = 0;
+    for (size_t i = 0; i < batch->nb_entries; i++) {
+        entry = &batch->entries[i];
+        if (entry->type == DT_DIR)
+            success = walk_subdirectory(
+                    worker, dir, entry->name, entry->name_len) && success;
+        else if (entry->type != DT_UNKNOWN && entry->type != DT_LNK)
+            batch->entries[nb_files++] = *entry;
+    }
+    if (nb_files > 0 && !atomic_load(&walk->stopped)) {
+        if (worker->stats != NULL)
+            worker->stats->nb_files += nb_files;
+        success = walk->options->on_batch(worker, batch->entries, nb_files,
+                walk->options->arg) && success;
+    }
+
+    batch->nb_entries = 0;
+    batch->names.str_length = 0;
+    return success;
+}
+
+/**
+ * Returns the buffer of [worker] for the directories read at the
+ * recursion level [level], allocating it on first use. A sequential
+ * walk reads the subdirectories while the entries of their parent are
+ * still in its buffer, so that each level needs its own.
+ */
+static struct WalkDents *get_dents(WalkWorker *worker, int level)
+{
+    if (level >= worker->nb_dents) {
+        void *rc = realloc(worker->dents,
+                (level + 1) * sizeof(struct WalkDents));
+        if (rc == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        worker->dents = rc;
+        for (; worker->nb_dents <= level; worker->nb_dents++) {
+            struct WalkDents *dents = &worker->dents[worker->nb_dents];
+            dents->buf = malloc(WALK_DENTS_SIZE);
+            dents->entries = malloc(WALK_DENTS_SIZE / MIN_DIRENT_SIZE
+                    * sizeof(struct dirent64 *));
+            if (dents->buf == NULL || dents->entries == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return &worker->dents[level];
+}
+
+static int compare_inodes(const void *a, const void *b)
+{
+    const struct dirent64 *entry_a = *(const struct dirent64 * const *) a;
+    const struct dirent64 *entry_b = *(const struct dirent64 * const *) b;
+    return (entry_a->d_ino > entry_b->d_ino)
+        - (entry_a->d_ino < entry_b->d_ino);
+}
+
+/**
+ * Reads the next entries of the directory [dir] into [dents], sorted
+ * by inode if the walk of [worker] asks for it.
+ * Returns the number of entries read, 0 at the end of the directory,
+ * or -1 if an error occured.
+ */
+static ssize_t read_dents(
+        WalkWorker *worker,
+        const WalkDir *dir,
+        struct WalkDents *dents)
+{
+    walk_stats_count(worker->stats, WALK_SYSCALL_GETDENTS, 1);
+    ssize_t nb_bytes = syscall(SYS_getdents64, dir->fd, dents->buf,
+            WALK_DENTS_SIZE);
+    if (nb_bytes <= 0)
+        return nb_bytes;
+    ssize_t nb_entries = 0;
+    for (ssize_t offset = 0; offset < nb_bytes; nb_entries++) {
+        dents->entries[nb_entries] =
+            (struct dirent64 *) (dents->buf + offset);
+        offset += dents->entries[nb_entries]->d_reclen;
+    }
+    /* The inode tables are then read in order, with fewer seeks.  */
+    if (worker->walk->options->sort_inode)
+        qsort(dents->entries, nb_entries, sizeof(struct dirent64 *),
+                compare_inodes);
+    return nb_entries;
+}
+
+/**
+ * Walks the directory [dir]. Subdirectories are either walked right
+ * away when the walk is sequential, or pushed to the deque of the
+ * worker. With an on_batch callback, the other entries are gathered
+ * in batches of at most WALK_BATCH_SIZE entries. The entries are read
+ * with getdents64(2) by WALK_DENTS_SIZE bytes at once.
+ */
+static bool walk_directory(WalkWorker *worker, WalkDir *dir)
+{
+    struct Walk *walk = worker->walk;
+
+    if (atomic_load(&walk->stopped)) {
+        /* The directory is dropped, but its parent counts on it.  */
+        if (dir->parent != NULL && dir->parent->retained)
+            release_fd(walk, dir->parent);
+        return true;
+    }
+    if (!open_dir(worker, dir))
+        return false;
+    if (dir->fd == -1)
+        return true;
+
+    int fd = dir->fd;
+    bool success = true;
+    bool batched = walk->options->on_batch != NULL;
+    WalkBatch batch;
+    if (batched) {
+        batch.nb_entries = 0;
+        memset(&batch.names, 0, sizeof(batch.names));
+    }
+    /* A copy, as the array of buffers moves when the recursion grows.  */
+    struct WalkDents dents =
+        *get_dents(worker, walk->nb_workers == 1 ? dir->depth : 0);
+    ssize_t nb_entries = 0;
+    ssize_t next = 0;
+    struct dirent64 *cur;
+    while (!atomic_load(&walk->stopped)) {
+        if (next == nb_entries) {
+            next = 0;
+            if ((nb_entries = read_dents(worker, dir, &dents)) <= 0)
+                break;
+        }
+        cur = dents.entries[next++];
+        if (strncmp(cur->d_name, "..", 3) == 0
+                || strncmp(cur->d_name, ".", 2) == 0)
+            continue;
+
+        if (is_excluded(walk, dir, cur->d_name, false))
+            continue;
+        size_t len = strlen(cur->d_name);
+        unsigned char type = cur->d_type;
+        if (batched && type != DT_DIR) {
+            add_to_batch(&batch, cur->d_name, len, type);
+            if (batch.nb_entries == WALK_BATCH_SIZE)
+                success = flush_batch(worker, dir, &batch) && success;
+            continue;
+        }
+        if (!resolve_type(worker, dir, cur->d_name, len, &type)) {
+            success = false;
+            continue;
+        }
+        /* Only the links that are not followed keep their type.  */
+        if (type == DT_LNK)
+            continue;
+        if (type == DT_DIR) {
+            success = walk_subdirectory(worker, dir, cur->d_name, len)
+                && success;
+        } else {
+            WalkEntry entry = {
+                .dirfd = fd, .name = cur->d_name, .name_len = len,
+                .type = type, .dir = dir
+            };
+            if (worker->stats != NULL)
+                worker->stats->nb_files++;
+            success = walk->options->on_file(
+                    worker, &entry, walk->options->arg) && success;
+        }
+    }
+    if (nb_entries == -1) {
+        int errno_save = errno;
+        worker->path.str_length = 0;
+        build_dir_path(&worker->path, dir);
+        fprintf(stderr, "Could not read '%s' directory: %s\n",
+                worker->path.str, strerror(errno_save));
+        success = false;
+    }
+    if (batched) {
+        if (batch.nb_entries > 0)
+            success = flush_batch(worker, dir, &batch) && success;
+        free(batch.names.str);
+    }
+    release_fd(walk, dir);
+    return success;
+}
+
+/**
+ * Walks the directory [dir] taken from a deque.
+ */
+static void walk_queued_directory(WalkWorker *worker, WalkDir *dir)
+{
+    atomic_fetch_sub(&worker->walk->queued, 1);
+    if (!walk_directory(worker, dir))
+        atomic_store(&worker->walk->success, false);
+    release_dir(dir);
+    finish_directory(worker->walk);
+}
+
+/**
+ * Tries to steal a directory from the deque of another worker.
+ */
+static WalkDir *steal_directory(WalkWorker *worker)
+{
+    struct Walk *walk = worker->walk;
+    WalkDir *dir;
+    for (int i = 1; i < walk->nb_workers; i++) {
+        WalkWorker *victim =
+            &walk->workers[(worker->id + i) % walk->nb_workers];
+        if ((dir = deque_steal(victim->deque)) != NULL)
+            return dir;
+    }
+    return NULL;
+}
+
+/**
+ * Creates the io_uring instance of [worker]. When io_uring is not
+ * available, a warning is printed and the worker keeps using
+ * blocking syscalls.
+ */
+static bool create_ring(WalkWorker *worker)
+{
+    worker->ring = io_ring_new(WALK_RING_ENTRIES);
+    if (worker->ring == NULL) {
+        fprintf(stderr, "io_uring is not available (%s), "
+                "falling back to blocking syscalls\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    WalkWorker *worker = arg;
+    struct Walk *walk = worker->walk;
+    WalkDir *dir;
+
+    while (atomic_load(&walk->pending) > 0) {
+        if ((dir = deque_pop(worker->deque)) != NULL
+                || (dir = steal_directory(worker)) != NULL) {
+            walk_queued_directory(worker, dir);
+            continue;
+        }
+        /* Nothing to steal: sleep until some work is pushed or done.  */
+        pthread_mutex_lock(&walk->idle_lock);
+        atomic_fetch_add(&walk->idle, 1);
+        while (atomic_load(&walk->queued) == 0
+                && atomic_load(&walk->pending) > 0)
+            pthread_cond_wait(&walk->idle_cond, &walk->idle_lock);
+        atomic_fetch_sub(&walk->idle, 1);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Reads the argument following the option [argv[*i]] as a number
+ * between 1 and [max] into [*value], [what] naming it in the error
+ * messages.
+ * Returns [false] and prints an error message if it is missing or
+ * invalid, [true] otherwise.
+ */
+static bool parse_number_argument(
+        int argc,
+        const char *argv[],
+        int *i,
+        long max,
+        const char *what,
+        int *value)
+{
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Option '%s' requires an argument\n", argv[*i]);
+        return false;
+    }
+    const char *arg = argv[++*i];
+    char *end = NULL;
+    long number = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || number < 1 || number > max) {
+        fprintf(stderr, "Invalid %s '%s'\n", what, arg);
+        return false;
+    }
+    *value = number;
+    return true;
+}
+
+int walk_parse_option(int argc, const char *argv[], int *i,
+        WalkOptions *options)
+{
+    assert(i != NULL && *i < argc);
+    assert(options != NULL);
+
+    const char *opt = argv[*i];
+    if (strcmp(opt, "-j") == 0) {
+        if (!parse_number_argument(argc, argv, i, 1024,
+                    "number of threads", &options->nb_threads))
+            return -1;
+    } else if (strcmp(opt, "--max-depth") == 0) {
+        if (!parse_number_argument(argc, argv, i, INT_MAX, "depth",
+                    &options->max_depth))
+            return -1;
+    } else if (strcmp(opt, "--exclude") == 0) {
+        if (*i + 1 >= argc) {
+            fprintf(stderr, "Option '%s' requires an argument\n", opt);
+            return -1;
+        }
+        assert(options->excludes != NULL && options->nb_excludes < argc);
+        options->excludes[options->nb_excludes++] = argv[++*i];
+    } else if (strcmp(opt, "--sort-inode") == 0) {
+        options->sort_inode = true;
+    } else if (strcmp(opt, "--follow") == 0) {
+        options->no_follow = false;
+    } else if (strcmp(opt, "--no-follow") == 0) {
+        options->no_follow = true;
+    } else if (strcmp(opt, "-xdev") == 0) {
+        options->same_device = true;
+    } else if (strcmp(opt, "--ignore") == 0) {
+        options->ignore_file = IGNORE_FILE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+bool walk_tree(const char *root, const WalkOptions *options)
+{
+    assert(root != NULL);
+
+    return walk_trees(&root, 1, options);
+}
+
+bool walk_trees(const char *const roots[], int nb_roots,
+        const WalkOptions *options)
+{
+    assert(roots != NULL);
+    assert(options != NULL);
+    assert(options->on_file != NULL);
+
+    struct Walk walk = {
+        .options = options,
+        .nb_workers = (options->nb_threads > 1) ? options->nb_threads : 1
+    };
+    atomic_init(&walk.pending, 0);
+    atomic_init(&walk.queued, 0);
+    atomic_init(&walk.idle, 0);
+    atomic_init(&walk.success, true);
+    atomic_init(&walk.stopped, false);
+    atomic_init(&walk.retained_dirs, 0);
+    struct rlimit limit;
+    walk.max_retained_dirs = MIN_RETAINED_DIRS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+            && limit.rlim_cur != RLIM_INFINITY
+            && limit.rlim_cur / 2 > MIN_RETAINED_DIRS)
+        walk.max_retained_dirs = limit.rlim_cur / 2;
+    for (int i = 0; i < options->nb_excludes; i++)
+        add_pattern(&walk.excludes, options->excludes[i],
+                strlen(options->excludes[i]));
+    inode_set_init(&walk.visited);
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.idle_cond, NULL);
+
+    walk.workers = calloc(walk.nb_workers, sizeof(*walk.workers));
+    struct WalkDeque *deques = calloc(walk.nb_workers, sizeof(*deques));
+    if (walk.workers == NULL || deques == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < walk.nb_workers; i++) {
+        if (options->use_uring && !create_ring(&walk.workers[i]))
+            break;
+    }
+    for (int i = 0; i < walk.nb_workers; i++) {
+        deque_init(&deques[i]);
+        walk.workers[i].id = i;
+        walk.workers[i].deque = &deques[i];
+        walk.workers[i].walk = &walk;
+        if (options->stats != NULL) {
+            /* Apart from each other, so that no cache line is shared.  */
+            walk.workers[i].stats = calloc(1, sizeof(WalkStats));
+            if (walk.workers[i].stats == NULL) {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    WalkWorker *main_worker = &walk.workers[0];
+    if (walk.nb_workers == 1) {
+        for (int i = 0; i < nb_roots; i++) {
+            WalkDir *root_dir = new_dir(NULL, roots[i], strlen(roots[i]));
+            if (!walk_directory(main_worker, root_dir))
+                atomic_store(&walk.success, false);
+            release_dir(root_dir);
+        }
+    } else {
+        /* The main worker pops the first root first.  */
+        for (int i = nb_roots - 1; i >= 0; i--)
+            schedule_directory(main_worker,
+                    new_dir(NULL, roots[i], strlen(roots[i])));
+
+        pthread_t threads[walk.nb_workers];
+        for (int i = 1; i < walk.nb_workers; i++) {
+            int rc = pthread_create(
+                    &threads[i], NULL, worker_main, &walk.workers[i]);
+            if (rc != 0) {
+                fprintf(stderr, "Could not create worker thread: %s\n",
+                        strerror(rc));
+                exit(EXIT_FAILURE);
+            }
+        }
+        worker_main(main_worker);
+        for (int i = 1; i < walk.nb_workers; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < walk.nb_workers; i++) {
+        WalkStats *stats = walk.workers[i].stats;
+        if (stats != NULL) {
+            if (walk.workers[i].ring != NULL) {
+                unsigned long nb_enters, nb_ops;
+                io_ring_counts(walk.workers[i].ring, &nb_enters, &nb_ops);
+                stats->syscalls[WALK_SYSCALL_IO_URING] += nb_enters;
+                stats->nb_ring_ops += nb_ops;
+            }
+            walk_stats_merge(options->stats, stats);
+            free(stats);
+        }
+        for (int j = 0; j < walk.workers[i].nb_dents; j++) {
+            free(walk.workers[i].dents[j].buf);
+            free(walk.workers[i].dents[j].entries);
+        }
+        free(walk.workers[i].dents);
+        free(walk.workers[i].path.str);
+        free(walk.workers[i].xattr_buf.str);
+        io_ring_free(walk.workers[i].ring);
+        deque_destroy(&deques[i]);
+    }
+    free(deques);
+    free(walk.workers);
+    free(walk.excludes.str);
+    inode_set_free(&walk.visited);
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.idle_cond);
+    return atomic_load(&walk.success);
+}
@@ -0,0 +1,265 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "tag.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define WALK_BATCH_SIZE 64
+
+/*
+ * The name of the files holding, for their directory and its
+ * subdirectories, the patterns of the names that the walks skip when
+ * the --ignore option asks for it, see WalkOptions.
+ */
+#define IGNORE_FILE ".tagsysignore"
+
+/*
+ * The buckets of the latency histogram of WalkStats: the bucket 0
+ * counts the calls shorter than 1 microsecond, the bucket i the ones
+ * shorter than 2^i microseconds, and the last one all the longer ones.
+ */
+#define WALK_LATENCY_BUCKETS 24
+
+/**
+ * The system calls counted by WalkStats. WALK_SYSCALL_IO_URING counts
+ * the io_uring_enter(2) calls, each one submitting many requests.
+ */
+typedef enum {
+    WALK_SYSCALL_OPEN = 0,
+    WALK_SYSCALL_GETDENTS,
+    WALK_SYSCALL_FSTAT,
+    WALK_SYSCALL_STATX,
+    WALK_SYSCALL_READ,
+    WALK_SYSCALL_LISTXATTR,
+    WALK_SYSCALL_GETXATTR,
+    WALK_SYSCALL_FSTATAT,
+    WALK_SYSCALL_IO_URING,
+    WALK_NB_SYSCALLS
+} WalkSyscall;
+
+/**
+ * What a walk did: the directories [nb_dirs] opened, the entries
+ * [nb_files] given to the callbacks, the ones [nb_matches] the
+ * callbacks kept, the system calls [syscalls] made by kind, the
+ * requests [nb_ring_ops] submitted through io_uring, the size
+ * [xattr_name_bytes] of the lists of attributes read, and the
+ * histogram [xattr_latency] of the durations of the blocking reads
+ * of attributes, see WALK_LATENCY_BUCKETS.
+ */
+typedef struct {
+    uint64_t nb_dirs;
+    uint64_t nb_files;
+    uint64_t nb_matches;
+    uint64_t syscalls[WALK_NB_SYSCALLS];
+    uint64_t nb_ring_ops;
+    uint64_t xattr_name_bytes;
+    uint64_t xattr_latency[WALK_LATENCY_BUCKETS];
+} WalkStats;
+
+typedef struct WalkWorker WalkWorker;
+typedef struct WalkDir WalkDir;
+
+/**
+ * A non-directory entry found while walking a tree. The entry is
+ * designated by its [name] relative to the open directory [dirfd]:
+ * its full path is only built when walk_entry_path() is called.
+ * [type] is one of the DT_* constants of dirent.h, symbolic links
+ * being already resolved to the type of their target.
+ */
+typedef struct {
+    int dirfd;
+    const char *name;
+    size_t name_len;
+    unsigned char type;
+    const WalkDir *dir;
+} WalkEntry;
+
+/**
+ * Called for every non-directory entry found under the walked tree.
+ * The callback may be invoked concurrently from several workers when
+ * more than one thread is used.
+ * Returns [false] if an error occured, [true] otherwise.
+ */
+typedef bool (*WalkFileCallback)(WalkWorker *worker, const WalkEntry *entry,
+        void *arg);
+
+/**
+ * Called with [nb_entries] non-directory entries of the same directory
+ * at once, see WalkOptions.
+ */
+typedef bool (*WalkBatchCallback)(WalkWorker *worker,
+        const WalkEntry *entries, size_t nb_entries, void *arg);
+
+/**
+ * Called before the subdirectory [name] of the open directory [dirfd]
+ * is opened.
+ * Returns [false] to skip the subdirectory, [true] to walk it.
+ */
+typedef bool (*WalkDirFilter)(WalkWorker *worker, int dirfd,
+        const char *name, void *arg);
+
+/**
+ * Options of a tree walk.
+ * [nb_threads] is the number of worker threads, 0 or 1 meaning that
+ * the tree is walked in the calling thread in the order of the
+ * directory entries. When [sort_inode] is set, the entries read at
+ * once from a directory are handled by increasing inode number, so
+ * that the inodes are read in the order of the inode table.
+ * When [on_batch] is set, it is called instead of [on_file] with up
+ * to WALK_BATCH_SIZE entries at once.
+ * When [use_uring] is set, each worker gets an io_uring instance used
+ * to resolve the unknown types of the entries of a batch, and which
+ * the callbacks can use as well.
+ * The symbolic links are followed unless [no_follow] is set, in which
+ * case they are skipped. Either way, each directory is walked once,
+ * even if it is reached again through a link or a bind mount.
+ * The walk is pruned before the directories are opened: when
+ * [same_device] is set, the directories of other file systems than
+ * [root] are skipped, like with find -xdev, and when [max_depth] is
+ * not 0, only the entries at most [max_depth] levels below [root] are
+ * seen. The entries whose name matches one of the [nb_excludes] glob
+ * patterns [excludes] are skipped, as well as the ones matching a
+ * pattern of a file named [ignore_file], if not NULL, in their
+ * directory or in one of its ancestors. A pattern ending with '/'
+ * only matches directories. Last, the subdirectories for which
+ * [filter_dir], if set, returns [false] are skipped.
+ * When [stats] is set, each worker counts what it does in its own
+ * WalkStats, added to [stats] once the walk is over.
+ */
+typedef struct {
+    int nb_threads;
+    bool sort_inode;
+    WalkFileCallback on_file;
+    WalkBatchCallback on_batch;
+    bool use_uring;
+    bool no_follow;
+    bool same_device;
+    int max_depth;
+    const char **excludes;
+    int nb_excludes;
+    const char *ignore_file;
+    WalkDirFilter filter_dir;
+    WalkStats *stats;
+    void *arg;
+} WalkOptions;
+
+/*
+ * The help of the options read by walk_parse_option(), for the help
+ * messages of the commands walking trees.
+ */
+#define WALK_OPTIONS_HELP \
+    "\t-j <n>\t\tWalk the directories with <n> threads\n" \
+    "\t--sort-inode\tHandle the entries of the directories by\n" \
+    "\t\t\t inode number, faster on cold caches\n" \
+    "\t--follow\tFollow the symbolic links (the default)\n" \
+    "\t--no-follow\tSkip the symbolic links\n" \
+    "\t-xdev\t\tDo not descend into the directories of other\n" \
+    "\t\t\t file systems than <dir>\n" \
+    "\t--max-depth <n>\tOnly see the files at most <n> levels\n" \
+    "\t\t\t below <dir>\n" \
+    "\t--exclude <glob>\n" \
+    "\t\t\tSkip the files and directories whose name\n" \
+    "\t\t\t matches <glob>, only the directories if it ends\n" \
+    "\t\t\t with '/', may be repeated\n" \
+    "\t--ignore\tAlso skip the names matching the patterns of\n" \
+    "\t\t\t the " IGNORE_FILE " files of the directories\n"
+
+/**
+ * The state owned by a single worker. [xattr_buf] is a buffer that
+ * the callbacks can reuse between files without synchronization.
+ * [ring] is the io_uring instance of the worker, NULL unless it was
+ * requested and is available. [stats] holds the counters of the
+ * worker, which the callbacks update as well, NULL unless the walk
+ * counts them. [dents] holds the [nb_dents] buffers into which the
+ * worker reads the directories, one per level of recursion.
+ */
+struct WalkWorker {
+    int id;
+    PascalBuffer path;
+    PascalBuffer xattr_buf;
+    struct IoRing *ring;
+    WalkStats *stats;
+    struct WalkDents *dents;
+    int nb_dents;
+    struct WalkDeque *deque;
+    struct Walk *walk;
+};
+
+/**
+ * Walks the directory [root] recursively and calls [options->on_file]
+ * (or [options->on_batch]) for every non-directory entry. Directories
+ * are opened relatively to their parent with openat(2), and the type
+ * of the entries is taken from getdents64(2) whenever the file system
+ * reports it, so that no stat(2) call is needed for most of them.
+ * When several threads are requested, directories are spread across
+ * per-worker deques and idle workers steal work from the others.
+ * Returns [false] if an error occured, [true] otherwise.
+ */
+bool walk_tree(const char *root, const WalkOptions *options);
+
+/**
+ * Same as walk_tree() for the [nb_roots] directories [roots], walked
+ * by the same workers. The directories reached from several roots are
+ * walked once, and with [options->same_device], each root keeps to
+ * its own file system.
+ */
+bool walk_trees(const char *const roots[], int nb_roots,
+        const WalkOptions *options);
+
+/**
+ * Reads the option [argv[*i]] if it is one of WALK_OPTIONS_HELP, along
+ * with its argument, into [options], and moves [*i] to its last
+ * argument. [options->excludes] must have room for the [argc]
+ * arguments of [argv].
+ * Returns 1 if the option was read, 0 if it is not a walk option, and
+ * -1 after printing an error message if its argument is invalid.
+ */
+int walk_parse_option(int argc, const char *argv[], int *i,
+        WalkOptions *options);
+
+/**
+ * Stops the walk of [worker]: the entries being handled by the other
+ * workers are finished, but no other entry is given to the callbacks
+ * and the directories left are not read.
+ */
+void walk_stop(WalkWorker *worker);
+
+/**
+ * Builds the full path of [entry] in the path buffer of [worker] and
+ * returns it. The string stays valid until the next call for the
+ * same worker.
+ */
+const char *walk_entry_path(WalkWorker *worker, const WalkEntry *entry);
+
+/**
+ * Counts [count] system calls of kind [syscall] in [stats], unless
+ * [stats] is NULL.
+ */
+void walk_stats_count(WalkStats *stats, WalkSyscall syscall, uint64_t count);
+
+/**
+ * Returns the time in nanoseconds at which a timed call starts, or 0
+ * if [stats] is NULL so that nothing is timed.
+ */
+uint64_t walk_stats_start(const WalkStats *stats);
+
+/**
+ * Adds the read of attributes started at [start], according to
+ * walk_stats_start(), to the latency histogram of [stats], unless
+ * [stats] is NULL.
+ */
+void walk_stats_end(WalkStats *stats, uint64_t start);
+
+/**
+ * Adds the counters of [src] to the ones of [dst].
+ */
+void walk_stats_merge(WalkStats *dst, const WalkStats *src);
+
+/**
+ * Prints the counters of [stats] and their histogram to [out].
+ */
+void walk_stats_print(const WalkStats *stats, FILE *out);
+
+#endif
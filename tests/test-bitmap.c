@@ -0,0 +1,410 @@
+#include "../src/bitmap.h"
+#include "test.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The values of the tests have keys 0 to NB_KEYS - 1.  */
+#define NB_KEYS 4
+#define UNIVERSE (NB_KEYS * 65536)
+
+/**
+ * The contents of a container, chosen to fall on both sides of
+ * BITMAP_MAX_ARRAY_SIZE.
+ */
+typedef enum {
+    PATTERN_EMPTY,
+    PATTERN_SPARSE,
+    PATTERN_ARRAY_FULL,
+    PATTERN_WORDS_MIN,
+    PATTERN_DENSE,
+    PATTERN_RUN,
+    NB_PATTERNS
+} Pattern;
+
+typedef enum {
+    OP_OR,
+    OP_AND,
+    OP_ANDNOT
+} Operation;
+
+static void *checked_calloc(size_t nb, size_t size)
+{
+    void *ptr = calloc(nb, size);
+    if (ptr == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/**
+ * Returns [true] if the container of [pattern] shifted by [shift]
+ * holds [low]. PATTERN_ARRAY_FULL holds exactly BITMAP_MAX_ARRAY_SIZE
+ * values and PATTERN_WORDS_MIN one more.
+ */
+static bool pattern_has(Pattern pattern, unsigned int shift, uint32_t low)
+{
+    switch (pattern) {
+        case PATTERN_EMPTY:
+            return false;
+        case PATTERN_SPARSE:
+            return (low + shift) % 613 == 0;
+        case PATTERN_ARRAY_FULL:
+            return (low + shift) % 16 == 0;
+        case PATTERN_WORDS_MIN:
+            return (low + shift) % 16 == 0
+                || (low < 16 && (low + shift) % 16 == 1);
+        case PATTERN_DENSE:
+            return (low + shift) % 3 != 0;
+        case PATTERN_RUN:
+            return low >= 1000 + 100 * shift && low < 9000 + 100 * shift;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Fills [bitmap] and the UNIVERSE flags [values] with the containers
+ * of the NB_KEYS [patterns], shifted by [shift].
+ */
+static void build(
+        Bitmap *bitmap,
+        bool *values,
+        const Pattern patterns[NB_KEYS],
+        unsigned int shift)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+    for (uint32_t value = 0; value < UNIVERSE; value++) {
+        values[value] = pattern_has(patterns[value >> 16], shift,
+                value & 0xffff);
+        if (values[value])
+            bitmap_append(bitmap, value);
+    }
+}
+
+/**
+ * Checks that the values of [bitmap] are the ones flagged in
+ * [expected], and that its containers are valid.
+ */
+static void check_values(const Bitmap *bitmap, const bool *expected)
+{
+    for (size_t i = 0; i < bitmap->nb_containers; i++) {
+        const BitmapContainer *container = &bitmap->containers[i];
+        CHECK(container->cardinality > 0);
+        CHECK(i == 0 || bitmap->containers[i - 1].key < container->key);
+        CHECK((container->kind == BITMAP_ARRAY)
+                == (container->cardinality <= BITMAP_MAX_ARRAY_SIZE));
+    }
+
+    size_t nb_expected = 0;
+    for (uint32_t value = 0; value < UNIVERSE; value++)
+        nb_expected += expected[value];
+    uint64_t cardinality = bitmap_cardinality(bitmap);
+    CHECK(cardinality == nb_expected);
+    if (cardinality != nb_expected)
+        return;
+    uint32_t *values = checked_calloc(cardinality + 1, sizeof(uint32_t));
+    size_t nb_values = bitmap_to_array(bitmap, values);
+    CHECK(nb_values == nb_expected);
+    bool all_expected = true;
+    for (size_t i = 0; i < nb_values; i++)
+        all_expected = all_expected && values[i] < UNIVERSE
+            && expected[values[i]] && (i == 0 || values[i - 1] < values[i]);
+    CHECK(all_expected);
+    free(values);
+}
+
+/**
+ * Serializes [bitmap] into a new buffer of [*size] bytes aligned on 8
+ * bytes.
+ */
+static uint64_t *serialize(const Bitmap *bitmap, size_t *size)
+{
+    *size = bitmap_serialized_size(bitmap);
+    CHECK(*size % 8 == 0);
+    uint64_t *buf = checked_calloc(*size / 8 + 1, sizeof(uint64_t));
+    bitmap_serialize(bitmap, buf);
+    return buf;
+}
+
+/**
+ * Checks that [bitmap] reads back the same once serialized.
+ */
+static void check_round_trip(const Bitmap *bitmap, const bool *expected)
+{
+    size_t size;
+    uint64_t *buf = serialize(bitmap, &size);
+    Bitmap view;
+    bool valid = bitmap_view(buf, size, &view);
+    CHECK(valid);
+    if (valid) {
+        CHECK(view.borrowed);
+        CHECK(view.nb_containers == bitmap->nb_containers);
+        check_values(&view, expected);
+        bitmap_free(&view);
+    }
+    free(buf);
+}
+
+static void apply(Operation op, Bitmap *dst, const Bitmap *src)
+{
+    switch (op) {
+        case OP_OR: bitmap_or(dst, src); break;
+        case OP_AND: bitmap_and(dst, src); break;
+        case OP_ANDNOT: bitmap_andnot(dst, src); break;
+    }
+}
+
+static bool apply_flag(Operation op, bool a, bool b)
+{
+    switch (op) {
+        case OP_OR: return a || b;
+        case OP_AND: return a && b;
+        case OP_ANDNOT: return a && !b;
+    }
+    return false;
+}
+
+/**
+ * Checks the operations between the bitmaps of the containers
+ * [patterns_a] and [patterns_b], with [src] owned and borrowed.
+ */
+static void check_operations(
+        const Pattern patterns_a[NB_KEYS],
+        unsigned int shift_a,
+        const Pattern patterns_b[NB_KEYS],
+        unsigned int shift_b)
+{
+    bool *values_a = checked_calloc(UNIVERSE, sizeof(bool));
+    bool *values_b = checked_calloc(UNIVERSE, sizeof(bool));
+    bool *expected = checked_calloc(UNIVERSE, sizeof(bool));
+    Bitmap b;
+    build(&b, values_b, patterns_b, shift_b);
+    size_t size;
+    uint64_t *buf = serialize(&b, &size);
+    Bitmap view;
+    CHECK(bitmap_view(buf, size, &view));
+
+    for (Operation op = OP_OR; op <= OP_ANDNOT; op++) {
+        for (uint32_t value = 0; value < UNIVERSE; value++)
+            expected[value] = apply_flag(op, pattern_has(
+                        patterns_a[value >> 16], shift_a, value & 0xffff),
+                    values_b[value]);
+        for (int borrowed = 0; borrowed < 2; borrowed++) {
+            Bitmap a;
+            build(&a, values_a, patterns_a, shift_a);
+            apply(op, &a, borrowed ? &view : &b);
+            check_values(&a, expected);
+            check_round_trip(&a, expected);
+            bitmap_free(&a);
+        }
+    }
+    /* The operands are left as they were.  */
+    check_values(&b, values_b);
+    check_values(&view, values_b);
+
+    bitmap_free(&view);
+    free(buf);
+    bitmap_free(&b);
+    free(values_a);
+    free(values_b);
+    free(expected);
+}
+
+/**
+ * Checks the operations between all the pairs of patterns, in the
+ * same container and next to a container missing from the other
+ * bitmap.
+ */
+static void test_operations(void)
+{
+    for (Pattern pa = 0; pa < NB_PATTERNS; pa++) {
+        for (Pattern pb = 0; pb < NB_PATTERNS; pb++) {
+            const Pattern patterns_a[NB_KEYS] = {
+                pa, pb, PATTERN_EMPTY, PATTERN_SPARSE
+            };
+            const Pattern patterns_b[NB_KEYS] = {
+                pb, pa, PATTERN_DENSE, PATTERN_EMPTY
+            };
+            check_operations(patterns_a, 0, patterns_b, 0);
+            check_operations(patterns_a, 0, patterns_b, 5);
+        }
+    }
+}
+
+/**
+ * Checks the conversions between arrays and words at exactly
+ * BITMAP_MAX_ARRAY_SIZE values.
+ */
+static void test_array_boundary(void)
+{
+    Bitmap full = {0}, extra = {0}, one = {0};
+    for (uint32_t value = 0; value < 2 * BITMAP_MAX_ARRAY_SIZE; value += 2)
+        bitmap_append(&full, value);
+    bitmap_append(&one, 1);
+    CHECK(full.nb_containers == 1);
+    CHECK(full.containers[0].kind == BITMAP_ARRAY);
+    CHECK(bitmap_cardinality(&full) == BITMAP_MAX_ARRAY_SIZE);
+
+    /* The value over the limit makes words, removing it an array.  */
+    bitmap_or(&extra, &full);
+    bitmap_or(&extra, &one);
+    CHECK(extra.containers[0].kind == BITMAP_WORDS);
+    CHECK(bitmap_cardinality(&extra) == BITMAP_MAX_ARRAY_SIZE + 1);
+    bitmap_andnot(&extra, &one);
+    CHECK(extra.containers[0].kind == BITMAP_ARRAY);
+    CHECK(bitmap_cardinality(&extra) == BITMAP_MAX_ARRAY_SIZE);
+
+    /* Appending the value over the limit makes words as well.  */
+    Bitmap appended = {0};
+    for (uint32_t value = 0; value <= BITMAP_MAX_ARRAY_SIZE; value++)
+        bitmap_append(&appended, value);
+    CHECK(appended.containers[0].kind == BITMAP_WORDS);
+    CHECK(bitmap_cardinality(&appended) == BITMAP_MAX_ARRAY_SIZE + 1);
+    bitmap_and(&appended, &full);
+    CHECK(appended.containers[0].kind == BITMAP_ARRAY);
+    CHECK(bitmap_cardinality(&appended) == BITMAP_MAX_ARRAY_SIZE / 2 + 1);
+
+    /* Emptied containers are removed.  */
+    bitmap_andnot(&full, &full);
+    CHECK(full.nb_containers == 0);
+    bitmap_and(&one, &full);
+    CHECK(one.nb_containers == 0);
+
+    bitmap_free(&full);
+    bitmap_free(&extra);
+    bitmap_free(&one);
+    bitmap_free(&appended);
+}
+
+/**
+ * Checks the ranges, whose containers are arrays or words by size.
+ */
+static void test_ranges(void)
+{
+    bool *expected = checked_calloc(UNIVERSE, sizeof(bool));
+    Bitmap bitmap = {0};
+    bitmap_set_range(&bitmap, 60000, 140000);
+    for (uint32_t value = 60000; value < 140000; value++)
+        expected[value] = true;
+    check_values(&bitmap, expected);
+
+    bitmap_keep_range(&bitmap, 65536 - 10, 65536 + BITMAP_MAX_ARRAY_SIZE);
+    memset(expected, 0, UNIVERSE * sizeof(bool));
+    for (uint32_t value = 65536 - 10;
+            value < 65536 + BITMAP_MAX_ARRAY_SIZE; value++)
+        expected[value] = true;
+    check_values(&bitmap, expected);
+    check_round_trip(&bitmap, expected);
+
+    bitmap_set_range(&bitmap, 5, 5);
+    CHECK(bitmap.nb_containers == 0);
+    bitmap_free(&bitmap);
+    free(expected);
+}
+
+/*
+ * The layout written by bitmap_serialize(): a header of 8 bytes whose
+ * first 4 bytes are the number of containers, then a record of 8 bytes
+ * per container (key and kind on 2 bytes, cardinality on 4), then the
+ * data of the containers padded to 8 bytes.
+ */
+#define HEADER_SIZE 8
+#define RECORD_SIZE 8
+#define RECORD_KEY(i) (HEADER_SIZE + (i) * RECORD_SIZE)
+#define RECORD_KIND(i) (RECORD_KEY(i) + 2)
+#define RECORD_CARDINALITY(i) (RECORD_KEY(i) + 4)
+
+/**
+ * Returns [true] if bitmap_view() accepts the serialized [valid]
+ * bitmap of [size] bytes once the [len] bytes [patch] are written at
+ * [offset], and the size reduced by [cut].
+ */
+static bool view_patched(
+        const uint64_t *valid,
+        size_t size,
+        size_t offset,
+        const void *patch,
+        size_t len,
+        size_t cut)
+{
+    uint64_t *buf = checked_calloc(size / 8 + 1, sizeof(uint64_t));
+    memcpy(buf, valid, size);
+    memcpy((char *) buf + offset, patch, len);
+    Bitmap view;
+    bool accepted = bitmap_view(buf, size - cut, &view);
+    if (accepted)
+        bitmap_free(&view);
+    free(buf);
+    return accepted;
+}
+
+/**
+ * Checks that bitmap_view() rejects the malformed bitmaps.
+ */
+static void test_view_malformed(void)
+{
+    Bitmap bitmap = {0};
+    bitmap_append(&bitmap, 3);
+    bitmap_append(&bitmap, 7);
+    for (uint32_t value = 65536; value < 65536 + 3 * 4096; value += 2)
+        bitmap_append(&bitmap, value);
+    CHECK(bitmap.nb_containers == 2);
+    CHECK(bitmap.containers[1].kind == BITMAP_WORDS);
+    size_t size;
+    uint64_t *valid = serialize(&bitmap, &size);
+    uint16_t u16;
+    uint32_t u32;
+
+    CHECK(view_patched(valid, size, 0, &u16, 0, 0));
+    /* Truncated: in the header, the records or the data.  */
+    CHECK(!view_patched(valid, size, 0, &u16, 0, size - 4));
+    CHECK(!view_patched(valid, size, 0, &u16, 0, size - HEADER_SIZE - 4));
+    CHECK(!view_patched(valid, size, 0, &u16, 0, 8));
+    /* More containers than the records the size allows.  */
+    u32 = 0xffffffff;
+    CHECK(!view_patched(valid, size, 0, &u32, sizeof(u32), 0));
+    /* An unknown kind.  */
+    u16 = 3;
+    CHECK(!view_patched(valid, size, RECORD_KIND(0), &u16, sizeof(u16), 0));
+    u16 = 0;
+    CHECK(!view_patched(valid, size, RECORD_KIND(1), &u16, sizeof(u16), 0));
+    /* Arrays that are empty, or too large for an array.  */
+    u32 = 0;
+    CHECK(!view_patched(valid, size, RECORD_CARDINALITY(0), &u32,
+                sizeof(u32), 0));
+    u32 = BITMAP_MAX_ARRAY_SIZE + 1;
+    CHECK(!view_patched(valid, size, RECORD_CARDINALITY(0), &u32,
+                sizeof(u32), 0));
+    /* Keys out of order, or given twice.  */
+    u16 = 1;
+    CHECK(!view_patched(valid, size, RECORD_KEY(0), &u16, sizeof(u16), 0));
+    u16 = 0;
+    CHECK(!view_patched(valid, size, RECORD_KEY(1), &u16, sizeof(u16), 0));
+    /* The cardinality of words is counted, not trusted.  */
+    u32 = 1;
+    CHECK(view_patched(valid, size, RECORD_CARDINALITY(1), &u32,
+                sizeof(u32), 0));
+
+    Bitmap empty = {0};
+    Bitmap view;
+    uint64_t header = 0;
+    CHECK(bitmap_serialized_size(&empty) == HEADER_SIZE);
+    CHECK(bitmap_view(&header, sizeof(header), &view));
+    CHECK(view.nb_containers == 0);
+    bitmap_free(&view);
+
+    free(valid);
+    bitmap_free(&bitmap);
+}
+
+int main(void)
+{
+    test_operations();
+    test_array_boundary();
+    test_ranges();
+    test_view_malformed();
+    return TEST_RESULT("test-bitmap");
+}
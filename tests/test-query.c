@@ -0,0 +1,194 @@
+#include "../src/query.h"
+#include "test.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The config of the tests: "dup" is given twice, first as a child of
+ * "a", and "x" has no tag of the config as a descendant.
+ */
+static const char *CONFIG =
+    "[{\"name\": \"a\", \"assignable\": true, \"children\": ["
+    "    {\"name\": \"a1\", \"assignable\": true, \"children\": []},"
+    "    {\"name\": \"dup\", \"assignable\": true, \"children\": ["
+    "        {\"name\": \"a2\", \"assignable\": true, \"children\": []}]}]},"
+    " {\"name\": \"b\", \"assignable\": true, \"children\": []},"
+    " {\"name\": \"c\", \"assignable\": true, \"children\": []},"
+    " {\"name\": \"dup\", \"assignable\": true, \"children\": []},"
+    " {\"name\": \"x\", \"assignable\": false, \"children\": []}]";
+
+static TagHierarchy hierarchy;
+
+/**
+ * Returns [true] if the set of groups [arg] holds the group [group].
+ */
+static bool has_group(size_t group, void *arg)
+{
+    const uint64_t *groups = arg;
+    return (groups[group / 64] >> (group % 64)) & 1;
+}
+
+/**
+ * Returns [true] if a file having the [nb_tags] tags [tags] matches
+ * the expression [expression], which must be valid, checking that
+ * tag_query_match() and tag_query_match_groups() agree.
+ */
+static bool matches(const char *expression, const char *tags[], int nb_tags)
+{
+    TagQuery query;
+    const char *args[] = { expression };
+    if (!parse_tag_query(args, 1, &hierarchy, &query)) {
+        CHECK(!"invalid expression");
+        return false;
+    }
+    uint64_t *groups = calloc(query.nb_words + 1, sizeof(uint64_t));
+    if (groups == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nb_tags; i++)
+        tag_query_add_tag(&query, tags[i], groups);
+    bool match = tag_query_match_groups(&query, groups);
+
+    /* The plan evaluated group by group gives the same result.  */
+    CHECK(tag_query_match(&query, has_group, groups) == match);
+    free(groups);
+    free_tag_query(&query);
+    return match;
+}
+
+/**
+ * Returns [true] if the [nb_args] arguments [args] make a valid search
+ * expression.
+ */
+static bool is_valid(const char *args[], int nb_args)
+{
+    TagQuery query;
+    if (!parse_tag_query(args, nb_args, &hierarchy, &query))
+        return false;
+    free_tag_query(&query);
+    return true;
+}
+
+#define TAGS(...) (const char *[]) { __VA_ARGS__ }, \
+    sizeof((const char *[]) { __VA_ARGS__ }) / sizeof(const char *)
+#define NO_TAGS NULL, 0
+
+static void test_hierarchy_find(void)
+{
+    CHECK(hierarchy.nb_tags == 8);
+    int a = tag_hierarchy_find(&hierarchy, "a");
+    int a1 = tag_hierarchy_find(&hierarchy, "a1");
+    int a2 = tag_hierarchy_find(&hierarchy, "a2");
+    int dup = tag_hierarchy_find(&hierarchy, "dup");
+    int b = tag_hierarchy_find(&hierarchy, "b");
+    CHECK(a == 0);
+    CHECK(a1 >= 0 && strcmp(hierarchy.names[a1], "a1") == 0);
+    CHECK(b >= 0 && strcmp(hierarchy.names[b], "b") == 0);
+
+    /* A name given twice is found at its first place, under "a".  */
+    CHECK(dup >= 0 && strcmp(hierarchy.names[dup], "dup") == 0);
+    CHECK(dup > a && (uint32_t) dup < hierarchy.ends[a]);
+    CHECK(a2 > dup && (uint32_t) a2 < hierarchy.ends[dup]);
+    int last_dup = -1;
+    for (size_t i = 0; i < hierarchy.nb_tags; i++)
+        if (strcmp(hierarchy.names[i], "dup") == 0)
+            last_dup = i;
+    CHECK(last_dup > dup);
+
+    CHECK(tag_hierarchy_find(&hierarchy, "missing") == -1);
+    CHECK(tag_hierarchy_find(&hierarchy, "") == -1);
+    CHECK(tag_hierarchy_find(&hierarchy, "a3") == -1);
+    CHECK(tag_hierarchy_find(&hierarchy, "du") == -1);
+    CHECK(tag_hierarchy_find(&hierarchy, "dupe") == -1);
+}
+
+static void test_precedence(void)
+{
+    /* '&' binds tighter than '|': a | (b & c).  */
+    CHECK(matches("a | b c", TAGS("a")));
+    CHECK(!matches("a | b c", TAGS("b")));
+    CHECK(matches("a | b c", TAGS("b", "c")));
+    CHECK(matches("b & c | a", TAGS("a")));
+    CHECK(!matches("b & c | a", TAGS("c")));
+    /* '!' binds tighter than '&': (!a) & b.  */
+    CHECK(matches("!a b", TAGS("b")));
+    CHECK(!matches("!a b", TAGS("a", "b")));
+    CHECK(!matches("!a b", NO_TAGS));
+    CHECK(matches("!a | b", NO_TAGS));
+    /* Parentheses group, and '!' applies to groups.  */
+    CHECK(!matches("(a | b) c", TAGS("a")));
+    CHECK(matches("(a | b) c", TAGS("b", "c")));
+    CHECK(matches("!(a | b)", TAGS("c")));
+    CHECK(!matches("!(a | b)", TAGS("b")));
+    CHECK(matches("!!a", TAGS("a")));
+    /* A tag stands for itself and its descendants.  */
+    CHECK(matches("a", TAGS("a2")));
+    CHECK(matches("dup", TAGS("a2")));
+    CHECK(!matches("a1", TAGS("a2")));
+    CHECK(!matches("!a", TAGS("dup")));
+    CHECK(matches("x", TAGS("x")));
+    CHECK(matches("missing", TAGS("missing")));
+}
+
+static void test_legacy_syntax(void)
+{
+    /* "+a _b" is a & !b, '+' and '_' being glued to the tags.  */
+    CHECK(matches("+a _b", TAGS("a")));
+    CHECK(!matches("+a _b", TAGS("a", "b")));
+    CHECK(!matches("+a _b", TAGS("b")));
+    CHECK(matches("+a +b", TAGS("a1", "b")));
+    CHECK(!matches("+a +b", TAGS("a1")));
+    CHECK(matches("_a", TAGS("b")));
+    CHECK(matches("+a _b | c", TAGS("c", "b")));
+    /* The name following a sign may start with one.  */
+    CHECK(matches("+__s", TAGS("__s")));
+    CHECK(!matches("+__s", TAGS("_s")));
+    CHECK(!matches("__s", TAGS("_s")));
+    CHECK(matches("__s", TAGS("__s")));
+    CHECK(matches("+_a", TAGS("_a")));
+    CHECK(!matches("+_a", TAGS("a")));
+    CHECK(matches("_ _a", TAGS("a")));
+
+    /* The expression may span several arguments.  */
+    const char *split[] = { "+a", "_b" };
+    CHECK(is_valid(split, 2));
+    const char *operators[] = { "a", "|", "(", "b", "c", ")" };
+    CHECK(is_valid(operators, 6));
+}
+
+/**
+ * Checks that the invalid expressions are rejected, which prints their
+ * error messages.
+ */
+static void test_invalid(void)
+{
+    const char *invalid[][1] = {
+        { "a |" }, { "| a" }, { "(a" }, { "a)" }, { "()" }, { "a & & b" },
+        { "!" }, { "+" }, { "_" }
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+        CHECK(!is_valid(invalid[i], 1));
+}
+
+int main(void)
+{
+    TagsTree root = { .json_tree = cJSON_Parse(CONFIG) };
+    if (root.json_tree == NULL) {
+        fprintf(stderr, "Invalid test config\n");
+        return EXIT_FAILURE;
+    }
+    if (!build_tag_hierarchy(&root, &hierarchy)) {
+        cJSON_Delete(root.json_tree);
+        return EXIT_FAILURE;
+    }
+    test_hierarchy_find();
+    test_precedence();
+    test_legacy_syntax();
+    test_invalid();
+    free_tag_hierarchy(&hierarchy);
+    cJSON_Delete(root.json_tree);
+    return TEST_RESULT("test-query");
+}
@@ -0,0 +1,30 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * The checks of the test programs: a failed check prints its location
+ * and condition, and the program then goes on with the next ones so
+ * that a single run reports every failure. TEST_RESULT() ends main().
+ */
+
+static int nb_checks = 0;
+static int nb_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        nb_checks++; \
+        if (!(cond)) { \
+            nb_failures++; \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+#define TEST_RESULT(name) \
+    (fprintf(stderr, "%s: %d checks, %d failed\n", (name), nb_checks, \
+             nb_failures), nb_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE)
+
+#endif